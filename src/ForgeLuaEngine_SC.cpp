@@ -17,6 +17,7 @@
 
 #include "Chat.h"
 #include "ForgeEventMgr.h"
+#include "ForgeTemplate.h"
 #include "Log.h"
 #include "LuaEngine.h"
 #include "Pet.h"
@@ -32,7 +33,7 @@ public:
     // Creature
     bool CanCreatureGossipHello(Player* player, Creature* creature) override
     {
-        if (sForge->OnGossipHello(player, creature))
+        if (Forge::GetMapForge(creature->GetMap())->OnGossipHello(player, creature))
             return true;
 
         return false;
@@ -40,7 +41,7 @@ public:
 
     bool CanCreatureGossipSelect(Player* player, Creature* creature, uint32 sender, uint32 action) override
     {
-        if (sForge->OnGossipSelect(player, creature, sender, action))
+        if (Forge::GetMapForge(creature->GetMap())->OnGossipSelect(player, creature, sender, action))
             return true;
 
         return false;
@@ -48,7 +49,7 @@ public:
 
     bool CanCreatureGossipSelectCode(Player* player, Creature* creature, uint32 sender, uint32 action, const char* code) override
     {
-        if (sForge->OnGossipSelectCode(player, creature, sender, action, code))
+        if (Forge::GetMapForge(creature->GetMap())->OnGossipSelectCode(player, creature, sender, action, code))
             return true;
 
         return false;
@@ -56,26 +57,26 @@ public:
 
     void OnCreatureAddWorld(Creature* creature) override
     {
-        sForge->OnAddToWorld(creature);
+        Forge::GetMapForge(creature->GetMap())->OnAddToWorld(creature);
 
         if (creature->IsGuardian() && creature->ToTempSummon() && creature->ToTempSummon()->GetSummonerGUID().IsPlayer())
-            sForge->OnPetAddedToWorld(creature->ToTempSummon()->GetSummonerUnit()->ToPlayer(), creature);
+            Forge::GetMapForge(creature->GetMap())->OnPetAddedToWorld(creature->ToTempSummon()->GetSummonerUnit()->ToPlayer(), creature);
     }
 
     void OnCreatureRemoveWorld(Creature* creature) override
     {
-        sForge->OnRemoveFromWorld(creature);
+        Forge::GetMapForge(creature->GetMap())->OnRemoveFromWorld(creature);
     }
 
     bool CanCreatureQuestAccept(Player* player, Creature* creature, Quest const* quest) override
     {
-        sForge->OnQuestAccept(player, creature, quest);
+        Forge::GetMapForge(creature->GetMap())->OnQuestAccept(player, creature, quest);
         return false;
     }
 
     bool CanCreatureQuestReward(Player* player, Creature* creature, Quest const* quest, uint32 opt) override
     {
-        if (sForge->OnQuestReward(player, creature, quest, opt))
+        if (Forge::GetMapForge(creature->GetMap())->OnQuestReward(player, creature, quest, opt))
         {
             ClearGossipMenuFor(player);
             return true;
@@ -86,7 +87,7 @@ public:
 
     CreatureAI* GetCreatureAI(Creature* creature) const override
     {
-        if (CreatureAI* luaAI = sForge->GetAI(creature))
+        if (CreatureAI* luaAI = Forge::GetMapForge(creature->GetMap())->GetAI(creature))
             return luaAI;
 
         return nullptr;
@@ -100,25 +101,25 @@ public:
 
     void OnGameObjectAddWorld(GameObject* go) override
     {
-        sForge->OnAddToWorld(go);
+        Forge::GetMapForge(go->GetMap())->OnAddToWorld(go);
     }
 
     void OnGameObjectRemoveWorld(GameObject* go) override
     {
-        sForge->OnRemoveFromWorld(go);
+        Forge::GetMapForge(go->GetMap())->OnRemoveFromWorld(go);
     }
 
     void OnGameObjectUpdate(GameObject* go, uint32 diff) override
     {
-        sForge->UpdateAI(go, diff);
+        Forge::GetMapForge(go->GetMap())->UpdateAI(go, diff);
     }
 
     bool CanGameObjectGossipHello(Player* player, GameObject* go) override
     {
-        if (sForge->OnGossipHello(player, go))
+        if (Forge::GetMapForge(go->GetMap())->OnGossipHello(player, go))
             return true;
 
-        if (sForge->OnGameObjectUse(player, go))
+        if (Forge::GetMapForge(go->GetMap())->OnGameObjectUse(player, go))
             return true;
 
         return false;
@@ -126,33 +127,33 @@ public:
 
     void OnGameObjectDamaged(GameObject* go, Player* player) override
     {
-        sForge->OnDamaged(go, player);
+        Forge::GetMapForge(go->GetMap())->OnDamaged(go, player);
     }
 
     void OnGameObjectDestroyed(GameObject* go, Player* player) override
     {
-        sForge->OnDestroyed(go, player);
+        Forge::GetMapForge(go->GetMap())->OnDestroyed(go, player);
     }
 
     void OnGameObjectLootStateChanged(GameObject* go, uint32 state, Unit* /*unit*/) override
     {
-        sForge->OnLootStateChanged(go, state);
+        Forge::GetMapForge(go->GetMap())->OnLootStateChanged(go, state);
     }
 
     void OnGameObjectStateChanged(GameObject* go, uint32 state) override
     {
-        sForge->OnGameObjectStateChanged(go, state);
+        Forge::GetMapForge(go->GetMap())->OnGameObjectStateChanged(go, state);
     }
 
     bool CanGameObjectQuestAccept(Player* player, GameObject* go, Quest const* quest) override
     {
-        sForge->OnQuestAccept(player, go, quest);
+        Forge::GetMapForge(go->GetMap())->OnQuestAccept(player, go, quest);
         return false;
     }
 
     bool CanGameObjectGossipSelect(Player* player, GameObject* go, uint32 sender, uint32 action) override
     {
-        if (sForge->OnGossipSelect(player, go, sender, action))
+        if (Forge::GetMapForge(go->GetMap())->OnGossipSelect(player, go, sender, action))
             return true;
 
         return false;
@@ -160,7 +161,7 @@ public:
 
     bool CanGameObjectGossipSelectCode(Player* player, GameObject* go, uint32 sender, uint32 action, const char* code) override
     {
-        if (sForge->OnGossipSelectCode(player, go, sender, action, code))
+        if (Forge::GetMapForge(go->GetMap())->OnGossipSelectCode(player, go, sender, action, code))
             return true;
 
         return false;
@@ -168,10 +169,10 @@ public:
 
     bool CanGameObjectQuestReward(Player* player, GameObject* go, Quest const* quest, uint32 opt) override
     {
-        if (sForge->OnQuestAccept(player, go, quest))
+        if (Forge::GetMapForge(go->GetMap())->OnQuestAccept(player, go, quest))
             return false;
 
-        if (sForge->OnQuestReward(player, go, quest, opt))
+        if (Forge::GetMapForge(go->GetMap())->OnQuestReward(player, go, quest, opt))
             return false;
 
         return true;
@@ -179,7 +180,7 @@ public:
 
     GameObjectAI* GetGameObjectAI(GameObject* go) const override
     {
-        sForge->OnSpawn(go);
+        Forge::GetMapForge(go->GetMap())->OnSpawn(go);
         return nullptr;
     }
 };
@@ -240,37 +241,39 @@ public:
     void OnBeforeCreateInstanceScript(InstanceMap* instanceMap, InstanceScript** instanceData, bool /*load*/, std::string /*data*/, uint32 /*completedEncounterMask*/) override
     {
         if (instanceData)
-            *instanceData = sForge->GetInstanceData(instanceMap);
+            *instanceData = Forge::GetMapForge(instanceMap)->GetInstanceData(instanceMap);
     }
 
     void OnDestroyInstance(MapInstanced* /*mapInstanced*/, Map* map) override
     {
-        sForge->FreeInstanceId(map->GetInstanceId());
+        Forge::GetMapForge(map)->FreeInstanceId(map->GetInstanceId());
     }
 
     void OnCreateMap(Map* map) override
     {
-        sForge->OnCreate(map);
+        Forge::CreateMapState(map);
+        Forge::GetMapForge(map)->OnCreate(map);
     }
 
     void OnDestroyMap(Map* map) override
     {
-        sForge->OnDestroy(map);
+        Forge::GetMapForge(map)->OnDestroy(map);
+        Forge::DestroyMapState(map);
     }
 
     void OnPlayerEnterAll(Map* map, Player* player) override
     {
-        sForge->OnPlayerEnter(map, player);
+        Forge::GetMapForge(map)->OnPlayerEnter(map, player);
     }
 
     void OnPlayerLeaveAll(Map* map, Player* player) override
     {
-        sForge->OnPlayerLeave(map, player);
+        Forge::GetMapForge(map)->OnPlayerLeave(map, player);
     }
 
     void OnMapUpdate(Map* map, uint32 diff) override
     {
-        sForge->OnUpdate(map, diff);
+        Forge::GetMapForge(map)->OnUpdate(map, diff);
     }
 };
 
@@ -496,9 +499,21 @@ public:
     void GetDialogStatus(Player* player, Object* questgiver) override
     {
         if (questgiver->GetTypeId() == TYPEID_GAMEOBJECT)
-            sForge->GetDialogStatus(player, questgiver->ToGameObject());
+        {
+            GameObject* go = questgiver->ToGameObject();
+            Forge::GetMapForge(go->GetMap())->GetDialogStatus(player, go);
+        }
         else if (questgiver->GetTypeId() == TYPEID_UNIT)
-            sForge->GetDialogStatus(player, questgiver->ToCreature());
+        {
+            Creature* creature = questgiver->ToCreature();
+            Forge::GetMapForge(creature->GetMap())->GetDialogStatus(player, creature);
+        }
+    }
+
+    void OnDestructObject(Object* /*origin*/) override
+    {
+        // No state lock, objects are destroyed on every map thread
+        ForgeObjectCache::OnObjectDestroyed();
     }
 };
 
@@ -843,12 +858,12 @@ public:
 
     void OnDummyEffect(WorldObject* caster, uint32 spellID, SpellEffIndex effIndex, GameObject* gameObjTarget) override
     {
-        sForge->OnDummyEffect(caster, spellID, effIndex, gameObjTarget);
+        Forge::GetMapForge(gameObjTarget->GetMap())->OnDummyEffect(caster, spellID, effIndex, gameObjTarget);
     }
 
     void OnDummyEffect(WorldObject* caster, uint32 spellID, SpellEffIndex effIndex, Creature* creatureTarget) override
     {
-        sForge->OnDummyEffect(caster, spellID, effIndex, creatureTarget);
+        Forge::GetMapForge(creatureTarget->GetMap())->OnDummyEffect(caster, spellID, effIndex, creatureTarget);
     }
 
     void OnDummyEffect(WorldObject* caster, uint32 spellID, SpellEffIndex effIndex, Item* itemTarget) override
@@ -864,7 +879,8 @@ public:
 
     void OnUnitUpdate(Unit* unit, uint32 diff) override
     {
-        unit->forgeEvents->Update(diff);
+        if (unit->forgeEvents)
+            unit->forgeEvents->Update(diff);
     }
 };
 
@@ -915,15 +931,21 @@ public:
         object->forgeEvents = nullptr;
     }
 
-    void OnWorldObjectSetMap(WorldObject* object, Map* /*map*/) override
+    void OnWorldObjectSetMap(WorldObject* object, Map* map) override
     {
-        if (!object->forgeEvents)
-            object->forgeEvents = new ForgeEventProcessor(&Forge::GForge, object);
+        // The processor is created by the first RegisterEvent
+        if (!object->forgeEvents || object->forgeEvents->GetStateRef() == Forge::GetEventStateRef(object, map))
+            return;
+
+        // Timed events belong to one state, they don't follow the object to another map's state
+        delete object->forgeEvents;
+        object->forgeEvents = nullptr;
     }
 
     void OnWorldObjectUpdate(WorldObject* object, uint32 diff) override
     {
-        object->forgeEvents->Update(diff);
+        if (object->forgeEvents)
+            object->forgeEvents->Update(diff);
     }
 };
 
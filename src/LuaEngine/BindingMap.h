@@ -7,6 +7,8 @@
 #ifndef _BINDING_MAP_H
 #define _BINDING_MAP_H
 
+#include <algorithm>
+#include <atomic>
 #include <memory>
 #include "Common.h"
 #include "ForgeUtility.h"
@@ -19,11 +21,44 @@ extern "C"
 };
 
 
+/*
+ * The part of a `BindingMap` that doesn't depend on the key type,
+ *   so a binding can be handled without knowing which map it's in.
+ */
+class BindingMapBase : public ForgeUtil::Lockable
+{
+public:
+    BindingMapBase(const char* name) :
+        ForgeUtil::Lockable(name),
+        name(name)
+    { }
+
+    virtual ~BindingMapBase() { }
+
+    // Name of the event family, used in diagnostics
+    const char* GetName() const { return name; }
+
+    virtual void Remove(uint64 id) = 0;
+    // Whether the binding `id` still exists, it may have been removed or run out of shots
+    virtual bool Contains(uint64 id) = 0;
+
+private:
+    const char* name;
+};
+
 /*
  * A set of bindings from keys of type `K` to Lua references.
+ *
+ * Bindings change rarely while hooks look them up all the time, so the
+ *   bindings live in an immutable snapshot: a flat array sorted by key and
+ *   then by binding ID (which keeps registration order within a key).
+ *
+ * Readers load the current snapshot atomically and walk it without locking.
+ *   Writers take the lock, build a new snapshot and publish it, so a reader
+ *   always sees either the old or the new set of bindings as a whole.
  */
 template<typename K>
-class BindingMap : public ForgeUtil::Lockable
+class BindingMap : public BindingMapBase
 {
 private:
     lua_State* L;
@@ -31,44 +66,194 @@ private:
 
     struct Binding
     {
+        K key;
         uint64 id;
-        lua_State* L;
-        uint32 remainingShots;
         int functionReference;
+        // Whether the binding expires after some amount of shots, see `remainingShots`
+        bool limited;
 
-        Binding(lua_State* L, uint64 id, int functionReference, uint32 remainingShots) :
+        Binding(const K& key, uint64 id, int functionReference, bool limited) :
+            key(key),
             id(id),
-            L(L),
-            remainingShots(remainingShots),
-            functionReference(functionReference)
+            functionReference(functionReference),
+            limited(limited)
         { }
+    };
 
-        ~Binding()
+    struct BindingOrder
+    {
+        bool operator()(Binding const& lhs, Binding const& rhs) const
         {
-            luaL_unref(L, LUA_REGISTRYINDEX, functionReference);
+            if (std::less<K>()(lhs.key, rhs.key))
+                return true;
+            if (std::less<K>()(rhs.key, lhs.key))
+                return false;
+            return lhs.id < rhs.id;
         }
+
+        bool operator()(Binding const& lhs, K const& rhs) const { return std::less<K>()(lhs.key, rhs); }
+        bool operator()(K const& lhs, Binding const& rhs) const { return std::less<K>()(lhs, rhs.key); }
     };
 
-    typedef std::vector< std::unique_ptr<Binding> > BindingList;
+    typedef std::vector<Binding> BindingList;
+    typedef std::shared_ptr<const BindingList> Snapshot;
 
-    std::unordered_map<K, BindingList> bindings;
     /*
-     * This table is for fast removal of bindings by ID.
+     * The published snapshot, only accessed through `Load` and `Publish`.
+     */
+#if defined(__cpp_lib_atomic_shared_ptr)
+    std::atomic<Snapshot> bindings;
+#else
+    Snapshot bindings;
+#endif
+
+    /*
+     * Side tables, only accessed while holding the lock.
      *
-     * Instead of having to look through (potentially) every BindingList to find
-     *   the Binding with the right ID, this allows you to go directly to the
-     *   BindingList that might have the Binding with that ID.
+     * `id_lookup_table` maps binding IDs to their keys for `Remove`, and
+     *   `remainingShots` holds the shots left for bindings that expire.
+     */
+    std::unordered_map<uint64, K> id_lookup_table;
+    std::unordered_map<uint64, uint32> remainingShots;
+
+    /*
+     * Event IDs below this have a bit in `boundEvents`, which covers
+     *   every event type in Hooks.h. Any higher ID always searches the snapshot.
+     */
+    static const uint32 GATED_EVENT_COUNT = 128;
+    static const uint32 GATE_WORD_BITS = 64;
+
+    /*
+     * One bit per event ID that is set while at least one binding for it exists.
+     *
+     * `HasBindingsFor` reads this first, so hooks nobody listens to return
+     *   after a single relaxed load. The bits are only written while holding
+     *   the lock, from `bindingCounts`.
+     */
+    std::atomic<uint64> boundEvents[GATED_EVENT_COUNT / GATE_WORD_BITS];
+    uint32 bindingCounts[GATED_EVENT_COUNT];
+
+    template<typename E>
+    static uint32 EventIndex(E event_id)
+    {
+        return static_cast<uint32>(event_id);
+    }
+
+    // Must be called while holding the lock
+    void AddBindingCount(uint32 event_id, int32 change)
+    {
+        if (event_id >= GATED_EVENT_COUNT)
+            return;
+
+        uint32& count = bindingCounts[event_id];
+        bool wasBound = count != 0;
+        count += change;
+        bool isBound = count != 0;
+        if (wasBound == isBound)
+            return;
+
+        uint64 bit = uint64(1) << (event_id % GATE_WORD_BITS);
+        std::atomic<uint64>& word = boundEvents[event_id / GATE_WORD_BITS];
+        if (isBound)
+            word.fetch_or(bit, std::memory_order_relaxed);
+        else
+            word.fetch_and(~bit, std::memory_order_relaxed);
+    }
+
+    // Must be called while holding the lock
+    void ResetBindingCounts()
+    {
+        for (uint32 i = 0; i < GATED_EVENT_COUNT; ++i)
+            bindingCounts[i] = 0;
+        for (auto& word : boundEvents)
+            word.store(0, std::memory_order_relaxed);
+    }
+
+    Snapshot Load() const
+    {
+#if defined(__cpp_lib_atomic_shared_ptr)
+        return bindings.load(std::memory_order_acquire);
+#else
+        return std::atomic_load_explicit(&bindings, std::memory_order_acquire);
+#endif
+    }
+
+    // Must be called while holding the lock
+    void Publish(BindingList&& list)
+    {
+        Snapshot snapshot;
+        if (!list.empty())
+            snapshot = std::make_shared<const BindingList>(std::move(list));
+#if defined(__cpp_lib_atomic_shared_ptr)
+        bindings.store(std::move(snapshot), std::memory_order_release);
+#else
+        std::atomic_store_explicit(&bindings, std::move(snapshot), std::memory_order_release);
+#endif
+    }
+
+    /*
+     * Removes every binding in the current snapshot matching `predicate`
+     *   and publishes the result.
      *
-     * However, you must be careful not to store pointers to BindingLists
-     *   that no longer exist (see `void Clear(const K& key)` implementation).
+     * Must be called while holding the lock.
      */
-    std::unordered_map<uint64, BindingList*> id_lookup_table;
+    template<typename P>
+    void RemoveIf(P predicate)
+    {
+        Snapshot current = Load();
+        if (!current)
+            return;
+
+        BindingList list;
+        list.reserve(current->size());
+        for (Binding const& binding : *current)
+        {
+            if (!predicate(binding))
+            {
+                list.push_back(binding);
+                continue;
+            }
+
+            id_lookup_table.erase(binding.id);
+            remainingShots.erase(binding.id);
+            AddBindingCount(EventIndex(binding.key.event_id), -1);
+            luaL_unref(L, LUA_REGISTRYINDEX, binding.functionReference);
+        }
+
+        if (list.size() != current->size())
+            Publish(std::move(list));
+    }
 
 public:
-    BindingMap(lua_State* L) :
+    BindingMap(lua_State* L, const char* name) :
+        BindingMapBase(name),
         L(L),
         maxBindingID(0)
-    { }
+    {
+        ResetBindingCounts();
+    }
+
+    ~BindingMap()
+    {
+        Clear();
+    }
+
+    /*
+     * Returns false if there are certainly no bindings for `event_id`,
+     *   without looking at the snapshot.
+     *
+     * A true result only means some key with this event ID may be bound.
+     */
+    template<typename E>
+    bool MayHaveBindingsFor(E event_id) const
+    {
+        uint32 index = EventIndex(event_id);
+        if (index >= GATED_EVENT_COUNT)
+            return true;
+
+        uint64 bit = uint64(1) << (index % GATE_WORD_BITS);
+        return (boundEvents[index / GATE_WORD_BITS].load(std::memory_order_relaxed) & bit) != 0;
+    }
 
     /*
      * Insert a new binding from `key` to `ref`, which lasts for `shots`-many pushes.
@@ -78,12 +263,26 @@ public:
      */
     uint64 Insert(const K& key, int ref, uint32 shots)
     {
-        Guard guard(GetLock());
+        Guard guard(GetLock(), __FUNCTION__);
 
         uint64 id = (++maxBindingID);
-        BindingList& list = bindings[key];
-        list.push_back(std::unique_ptr<Binding>(new Binding(L, id, ref, shots)));
-        id_lookup_table[id] = &list;
+        Binding binding(key, id, ref, shots > 0);
+
+        Snapshot current = Load();
+        BindingList list;
+        if (current)
+        {
+            list.reserve(current->size() + 1);
+            list.assign(current->begin(), current->end());
+        }
+        // IDs only grow, so the new binding goes after all existing bindings for `key`
+        list.insert(std::upper_bound(list.begin(), list.end(), binding, BindingOrder()), binding);
+        Publish(std::move(list));
+
+        id_lookup_table.emplace(id, key);
+        if (shots > 0)
+            remainingShots[id] = shots;
+        AddBindingCount(EventIndex(key.event_id), 1);
         return id;
     }
 
@@ -92,25 +291,10 @@ public:
      */
     void Clear(const K& key)
     {
-        Guard guard(GetLock());
-
-        if (bindings.empty())
-            return;
-
-        auto iter = bindings.find(key);
-        if (iter == bindings.end())
-            return;
-
-        BindingList& list = iter->second;
+        Guard guard(GetLock(), __FUNCTION__);
 
-        // Remove all pointers to `list` from `id_lookup_table`.
-        for (auto i = list.begin(); i != list.end(); ++i)
-        {
-            std::unique_ptr<Binding>& binding = *i;
-            id_lookup_table.erase(binding->id);
-        }
-
-        bindings.erase(key);
+        std::equal_to<K> equal;
+        RemoveIf([&](Binding const& binding) { return equal(binding.key, key); });
     }
 
     /*
@@ -118,13 +302,10 @@ public:
      */
     void Clear()
     {
-        Guard guard(GetLock());
-
-        if (bindings.empty())
-            return;
+        Guard guard(GetLock(), __FUNCTION__);
 
-        id_lookup_table.clear();
-        bindings.clear();
+        RemoveIf([](Binding const&) { return true; });
+        ResetBindingCounts();
     }
 
     /*
@@ -132,83 +313,87 @@ public:
      *
      * If `id` in invalid, nothing is removed.
      */
-    void Remove(uint64 id)
+    void Remove(uint64 id) override
     {
-        Guard guard(GetLock());
+        Guard guard(GetLock(), __FUNCTION__);
 
-        auto iter = id_lookup_table.find(id);
-        if (iter == id_lookup_table.end())
+        if (id_lookup_table.find(id) == id_lookup_table.end())
             return;
 
-        BindingList* list = iter->second;
-        auto i = list->begin();
-
-        for (; i != list->end(); ++i)
-        {
-            std::unique_ptr<Binding>& binding = *i;
-            if (binding->id == id)
-                break;
-        }
+        RemoveIf([id](Binding const& binding) { return binding.id == id; });
+    }
 
-        if (i != list->end())
-            list->erase(i);
+    bool Contains(uint64 id) override
+    {
+        Guard guard(GetLock(), __FUNCTION__);
 
-        // Unconditionally erase the ID in the lookup table because
-        //   it was either already invalid, or it's no longer valid.
-        id_lookup_table.erase(id);
+        return id_lookup_table.find(id) != id_lookup_table.end();
     }
 
     /*
      * Check whether `key` has any bindings.
      */
-    bool HasBindingsFor(const K& key)
+    bool HasBindingsFor(const K& key) const
     {
-        Guard guard(GetLock());
-
-        if (bindings.empty())
+        if (!MayHaveBindingsFor(key.event_id))
             return false;
 
-        auto result = bindings.find(key);
-        if (result == bindings.end())
+        Snapshot snapshot = Load();
+        if (!snapshot)
             return false;
 
-        BindingList& list = result->second;
-        return !list.empty();
+        return std::binary_search(snapshot->begin(), snapshot->end(), key, BindingOrder());
     }
 
     /*
      * Push all Lua references for `key` onto the stack.
+     *
+     * If `ids` is given, the binding ID of each pushed reference is appended to it.
      */
-    void PushRefsFor(const K& key)
+    void PushRefsFor(const K& key, std::vector<uint64>* ids = NULL)
     {
-        Guard guard(GetLock());
-
-        if (bindings.empty())
+        Snapshot snapshot = Load();
+        if (!snapshot)
             return;
 
-        auto result = bindings.find(key);
-        if (result == bindings.end())
+        auto range = std::equal_range(snapshot->begin(), snapshot->end(), key, BindingOrder());
+        bool hasLimited = false;
+        for (auto i = range.first; i != range.second; ++i)
+        {
+            lua_rawgeti(L, LUA_REGISTRYINDEX, i->functionReference);
+            hasLimited = hasLimited || i->limited;
+            if (ids)
+                ids->push_back(i->id);
+        }
+
+        if (!hasLimited)
             return;
 
-        BindingList& list = result->second;
-        for (auto i = list.begin(); i != list.end();)
-        {
-            std::unique_ptr<Binding>& binding = (*i);
-            auto i_prev = (i++);
+        // Count down the shots and drop the bindings that ran out.
+        // The functions are already on the stack, so unreferencing them here is safe.
+        Guard guard(GetLock(), __FUNCTION__);
 
-            lua_rawgeti(L, LUA_REGISTRYINDEX, binding->functionReference);
+        std::vector<uint64> expired;
+        for (auto i = range.first; i != range.second; ++i)
+        {
+            if (!i->limited)
+                continue;
 
-            if (binding->remainingShots > 0)
-            {
-                binding->remainingShots -= 1;
+            auto shots = remainingShots.find(i->id);
+            if (shots == remainingShots.end())
+                continue;
 
-                if (binding->remainingShots == 0)
-                {
-                    id_lookup_table.erase(binding->id);
-                    list.erase(i_prev);
-                }
-            }
+            if (--shots->second == 0)
+                expired.push_back(i->id);
         }
+
+        if (expired.empty())
+            return;
+
+        RemoveIf([&expired](Binding const& binding)
+        {
+            return std::find(expired.begin(), expired.end(), binding.id) != expired.end();
+        });
     }
 };
 
@@ -304,7 +489,7 @@ private:
 
 /*
  * Implementations of various std functions on the above key types,
- *   so that they can be used within an unordered_map.
+ *   so that they can be used within an unordered_map and a sorted BindingMap snapshot.
  */
 namespace std
 {
@@ -338,6 +523,39 @@ namespace std
         }
     };
 
+    template<typename T>
+    struct less < EventKey<T> >
+    {
+        bool operator()(EventKey<T> const& lhs, EventKey<T> const& rhs) const
+        {
+            return lhs.event_id < rhs.event_id;
+        }
+    };
+
+    template<typename T>
+    struct less < EntryKey<T> >
+    {
+        bool operator()(EntryKey<T> const& lhs, EntryKey<T> const& rhs) const
+        {
+            if (lhs.event_id != rhs.event_id)
+                return lhs.event_id < rhs.event_id;
+            return lhs.entry < rhs.entry;
+        }
+    };
+
+    template<typename T>
+    struct less < UniqueObjectKey<T> >
+    {
+        bool operator()(UniqueObjectKey<T> const& lhs, UniqueObjectKey<T> const& rhs) const
+        {
+            if (lhs.event_id != rhs.event_id)
+                return lhs.event_id < rhs.event_id;
+            if (lhs.guid.GetRawValue() != rhs.guid.GetRawValue())
+                return lhs.guid.GetRawValue() < rhs.guid.GetRawValue();
+            return lhs.instance_id < rhs.instance_id;
+        }
+    };
+
     template<typename T>
     struct hash < EventKey<T> >
     {
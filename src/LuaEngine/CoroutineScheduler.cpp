@@ -0,0 +1,194 @@
+/*
+* Copyright (C) 2010 - 2016 Forge Lua Engine <http://emudevs.com/>
+* This program is free software licensed under GPL version 3
+* Please see the included DOCS/LICENSE.md for more information
+*/
+
+#include "CoroutineScheduler.h"
+#include "LuaEngine.h"
+#include <vector>
+
+extern "C"
+{
+#include "lauxlib.h"
+};
+
+#include "ForgeCompat.h"
+
+CoroutineScheduler::CoroutineScheduler(Forge* E) :
+    E(E),
+    now(0),
+    nextWaitId(0),
+    sleepingCount(0)
+{ }
+
+void CoroutineScheduler::Start(lua_State* L, int nargs)
+{
+    // Stack: function, [arguments]
+    int base = lua_gettop(L) - nargs;
+
+    lua_pushcfunction(L, &ResumeThread);
+    lua_State* co = lua_newthread(L);
+    lua_pushvalue(L, -1);
+    Coroutine& coroutine = coroutines[co];
+    coroutine.ref = luaL_ref(L, LUA_REGISTRYINDEX);
+    coroutine.waitId = 0;
+
+    // The caller's values stay where they are, ForgeGlobal::thunk checks its stack
+    for (int i = base; i <= base + nargs; ++i)
+        lua_pushvalue(L, i);
+    // Stack: function, [arguments], ResumeThread, thread, function, [arguments]
+
+    // The first run is part of the caller's call, so it is not watched separately
+    bool suspended = false;
+    if (lua_pcall(L, nargs + 2, 1, 0))
+    {
+        const char* msg = lua_tostring(L, -1);
+        FORGE_LOG_ERROR("{}", msg ? msg : "(error object is not a string)");
+    }
+    else
+        suspended = lua_toboolean(L, -1);
+    lua_pop(L, 1);
+
+    OnResumed(co, suspended);
+}
+
+bool CoroutineScheduler::IsCoroutine(lua_State* L) const
+{
+    return coroutines.find(L) != coroutines.end();
+}
+
+uint64 CoroutineScheduler::Park(lua_State* L)
+{
+    Coroutine& coroutine = coroutines.at(L);
+    coroutine.waitId = ++nextWaitId;
+    waiting[coroutine.waitId] = L;
+    return coroutine.waitId;
+}
+
+void CoroutineScheduler::Unpark(lua_State* L)
+{
+    Coroutine& coroutine = coroutines.at(L);
+    waiting.erase(coroutine.waitId);
+    coroutine.waitId = 0;
+}
+
+void CoroutineScheduler::Sleep(lua_State* L, uint32 ms)
+{
+    uint64 waitId = Park(L);
+    sleeping.insert(std::make_pair(now.load(std::memory_order_relaxed) + ms, waitId));
+    sleepingCount.store(sleeping.size(), std::memory_order_relaxed);
+}
+
+bool CoroutineScheduler::Wake(uint64 waitId, ResumeArgs const& args)
+{
+    auto itr = waiting.find(waitId);
+    if (itr == waiting.end())
+        return false;
+
+    lua_State* co = itr->second;
+    waiting.erase(itr);
+
+    // The coroutine may have ended, or moved on when its yield failed inside a pcall on Lua 5.1
+    auto coroutine = coroutines.find(co);
+    if (coroutine == coroutines.end() || coroutine->second.waitId != waitId || lua_status(co) != LUA_YIELD)
+        return false;
+
+    coroutine->second.waitId = 0;
+    Resume(co, args);
+    return true;
+}
+
+void CoroutineScheduler::Update(uint32 diff)
+{
+    uint64 time = now.fetch_add(diff, std::memory_order_relaxed) + diff;
+    if (!sleepingCount.load(std::memory_order_relaxed))
+        return;
+
+    Forge::Guard guard(E->GetStateLock(), __FUNCTION__);
+
+    // Coroutines resumed here can sleep again, they are woken on a later update at the earliest
+    std::vector<uint64> due;
+    auto end = sleeping.upper_bound(time);
+    for (auto itr = sleeping.begin(); itr != end; ++itr)
+        due.push_back(itr->second);
+    sleeping.erase(sleeping.begin(), end);
+    sleepingCount.store(sleeping.size(), std::memory_order_relaxed);
+
+    for (uint64 waitId : due)
+        Wake(waitId, ResumeArgs());
+}
+
+void CoroutineScheduler::Clear()
+{
+    // The threads go away with the Lua state. Wait IDs keep counting, so
+    //  results still on their way find nothing to wake.
+    coroutines.clear();
+    waiting.clear();
+    sleeping.clear();
+    sleepingCount.store(0, std::memory_order_relaxed);
+}
+
+void CoroutineScheduler::Resume(lua_State* co, ResumeArgs const& args)
+{
+    lua_State* L = E->L;
+
+    lua_pushcfunction(L, &ResumeThread);
+    lua_rawgeti(L, LUA_REGISTRYINDEX, coroutines[co].ref);
+    int nargs = args ? args(L) : 0;
+
+    // Errors are reported like the errors of any other callback
+    E->ExecuteCall(1 + nargs, 1);
+    bool suspended = lua_toboolean(L, -1);
+    lua_pop(L, 1);
+
+    OnResumed(co, suspended);
+}
+
+void CoroutineScheduler::OnResumed(lua_State* co, bool suspended)
+{
+    auto itr = coroutines.find(co);
+    if (itr == coroutines.end())
+        return;
+
+    if (!suspended)
+    {
+        waiting.erase(itr->second.waitId);
+        luaL_unref(E->L, LUA_REGISTRYINDEX, itr->second.ref);
+        coroutines.erase(itr);
+        return;
+    }
+
+    // A plain coroutine.yield waits for the next update
+    if (!itr->second.waitId)
+        Sleep(co, 0);
+}
+
+/*
+ * Resumes the thread at index 1 with the values above it, the function to run
+ *   comes first on the first resume. Returns whether the coroutine can be
+ *   resumed again, and raises its error if it failed.
+ */
+int CoroutineScheduler::ResumeThread(lua_State* L)
+{
+    lua_State* co = lua_tothread(L, 1);
+    int nargs = lua_gettop(L) - 1;
+    if (lua_status(co) == 0 && lua_gettop(co) == 0)
+        --nargs;
+
+    // The watchdog and the profiler see the coroutine as part of the resuming call
+    lua_sethook(co, lua_gethook(L), lua_gethookmask(L), lua_gethookcount(L));
+
+    lua_xmove(L, co, lua_gettop(L) - 1);
+    int status = lua_resume(co, L, nargs);
+    if (status == 0 || status == LUA_YIELD)
+    {
+        // Yielded values have no receiver
+        lua_settop(co, 0);
+        lua_pushboolean(L, status == LUA_YIELD);
+        return 1;
+    }
+
+    lua_xmove(co, L, 1);
+    return lua_error(L);
+}
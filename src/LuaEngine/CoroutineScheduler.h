@@ -0,0 +1,94 @@
+/*
+* Copyright (C) 2010 - 2016 Forge Lua Engine <http://emudevs.com/>
+* This program is free software licensed under GPL version 3
+* Please see the included DOCS/LICENSE.md for more information
+*/
+
+#ifndef _COROUTINE_SCHEDULER_H
+#define _COROUTINE_SCHEDULER_H
+
+#include <atomic>
+#include <functional>
+#include <map>
+#include <unordered_map>
+#include "Common.h"
+
+extern "C"
+{
+#include "lua.h"
+};
+
+class Forge;
+
+/*
+ * Runs the coroutines started with `StartCoroutine` and resumes them once
+ *   what they wait for is done: `Sleep`, `AwaitQuery` or `AwaitHttp`.
+ *
+ * A waiting coroutine is parked under a wait ID that is never reused, so a
+ *   result that arrives after its coroutine ended or the state was reloaded
+ *   is dropped. Sleeps run on a clock that only advances by the update diff.
+ *
+ * Everything but Update must be called with the state lock held.
+ */
+class CoroutineScheduler
+{
+public:
+    // Pushes the values a coroutine is resumed with and returns how many
+    typedef std::function<int(lua_State*)> ResumeArgs;
+
+    explicit CoroutineScheduler(Forge* E);
+
+    // Runs the function and the `nargs` arguments on top of L's stack as a new
+    //  coroutine, until it waits for the first time or ends. Leaves them on the stack.
+    void Start(lua_State* L, int nargs);
+    bool IsCoroutine(lua_State* L) const;
+
+    // Parks the coroutine L until Wake is called with the returned ID, the caller yields right after
+    uint64 Park(lua_State* L);
+    // Undoes Park when what the coroutine would wait for could not be started, it carries on without yielding
+    void Unpark(lua_State* L);
+    // Parks the coroutine L until `ms` milliseconds of updates have passed
+    void Sleep(lua_State* L, uint32 ms);
+    // Resumes the coroutine parked under `waitId` with the values `args` pushes.
+    // Returns false if nothing waits for `waitId` anymore, `args` is not called then.
+    bool Wake(uint64 waitId, ResumeArgs const& args);
+
+    // Advances the clock by `diff` and resumes the coroutines whose sleep is over
+    void Update(uint32 diff);
+    // Forgets all coroutines, called before the Lua state is closed
+    void Clear();
+
+private:
+    CoroutineScheduler(CoroutineScheduler const&) = delete;
+    CoroutineScheduler& operator=(CoroutineScheduler const&) = delete;
+
+    struct Coroutine
+    {
+        // Registry reference that keeps the thread alive
+        int ref;
+        // What the coroutine is parked for, 0 if it is running
+        uint64 waitId;
+    };
+
+    void Resume(lua_State* co, ResumeArgs const& args);
+    // Forgets `co` if it ended, or parks it until the next update if it yielded without waiting
+    void OnResumed(lua_State* co, bool suspended);
+
+    static int ResumeThread(lua_State* L);
+
+    // The state the coroutines run in
+    Forge* E;
+    // Milliseconds of updates since the state was created, Sleep may read it from any map thread
+    std::atomic<uint64> now;
+    uint64 nextWaitId;
+
+    std::unordered_map<lua_State*, Coroutine> coroutines;
+    // Coroutine by wait ID. Waits of coroutines that ended stay until their result arrives.
+    std::unordered_map<uint64, lua_State*> waiting;
+    // Wait ID by wake up time
+    std::multimap<uint64, uint64> sleeping;
+    // Size of `sleeping`, checked without locking by Update
+    std::atomic<uint32> sleepingCount;
+};
+
+#endif // _COROUTINE_SCHEDULER_H
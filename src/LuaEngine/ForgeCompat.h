@@ -26,6 +26,8 @@ extern "C"
         lua_pushinteger(L, u)
     #define lua_load(L, buf_read, dec_buf, str, NULL) \
         lua_load(L, buf_read, dec_buf, str)
+    #define lua_resume(L, from, nargs) \
+        lua_resume(L, nargs)
 
 #endif
 
@@ -35,4 +37,14 @@ extern "C"
     #define lua_pushunsigned(L, u) \
         lua_pushinteger(L, u)
 #endif
+
+#if LUA_VERSION_NUM > 503
+    inline int forge_resume(lua_State* L, lua_State* from, int nargs)
+    {
+        int nresults;
+        return lua_resume(L, from, nargs, &nresults);
+    }
+    #define lua_resume(L, from, nargs) \
+        forge_resume(L, from, nargs)
+#endif
 #endif
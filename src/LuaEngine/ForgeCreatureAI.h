@@ -18,6 +18,8 @@ typedef AggressorAI ScriptedAI;
 
 struct ForgeCreatureAI : ScriptedAI
 {
+    // the state that created this AI, see Forge::GetMapForge
+    Forge* E;
     // used to delay the spawn hook triggering on AI creation
     bool justSpawned;
     // used to delay movementinform hook (WP hook)
@@ -26,7 +28,7 @@ struct ForgeCreatureAI : ScriptedAI
 #define me  m_creature
 #endif
 
-    ForgeCreatureAI(Creature* creature) : ScriptedAI(creature), justSpawned(true)
+    ForgeCreatureAI(Creature* creature, Forge* E) : ScriptedAI(creature), E(E), justSpawned(true)
     {
     }
     ~ForgeCreatureAI() { }
@@ -53,13 +55,13 @@ struct ForgeCreatureAI : ScriptedAI
         {
             for (auto& point : movepoints)
             {
-                if (!sForge->MovementInform(me, point.first, point.second))
+                if (!E->MovementInform(me, point.first, point.second))
                     ScriptedAI::MovementInform(point.first, point.second);
             }
             movepoints.clear();
         }
 
-        if (!sForge->UpdateAI(me, diff))
+        if (!E->UpdateAI(me, diff))
         {
 #if defined TRINITY || AZEROTHCORE
             if (!me->HasFlag(UNIT_FIELD_FLAGS, UNIT_FLAG_IMMUNE_TO_NPC))
@@ -76,7 +78,7 @@ struct ForgeCreatureAI : ScriptedAI
     // Called at creature aggro either by MoveInLOS or Attack Start
     void JustEngagedWith(Unit* target) override
     {
-        if (!sForge->EnterCombat(me, target))
+        if (!E->EnterCombat(me, target))
             ScriptedAI::JustEngagedWith(target);
     }
 #else
@@ -84,7 +86,7 @@ struct ForgeCreatureAI : ScriptedAI
     //Called at creature aggro either by MoveInLOS or Attack Start
     void EnterCombat(Unit* target) override
     {
-        if (!sForge->EnterCombat(me, target))
+        if (!E->EnterCombat(me, target))
             ScriptedAI::EnterCombat(target);
     }
 #endif
@@ -98,7 +100,7 @@ struct ForgeCreatureAI : ScriptedAI
     void DamageTaken(Unit* attacker, uint32& damage) override
 #endif
     {
-        if (!sForge->DamageTaken(me, attacker, damage))
+        if (!E->DamageTaken(me, attacker, damage))
         {
 #if defined AZEROTHCORE
             ScriptedAI::DamageTaken(attacker, damage, damagetype, damageSchoolMask);
@@ -113,28 +115,28 @@ struct ForgeCreatureAI : ScriptedAI
     //Called at creature death
     void JustDied(Unit* killer) override
     {
-        if (!sForge->JustDied(me, killer))
+        if (!E->JustDied(me, killer))
             ScriptedAI::JustDied(killer);
     }
 
     //Called at creature killing another unit
     void KilledUnit(Unit* victim) override
     {
-        if (!sForge->KilledUnit(me, victim))
+        if (!E->KilledUnit(me, victim))
             ScriptedAI::KilledUnit(victim);
     }
 
     // Called when the creature summon successfully other creature
     void JustSummoned(Creature* summon) override
     {
-        if (!sForge->JustSummoned(me, summon))
+        if (!E->JustSummoned(me, summon))
             ScriptedAI::JustSummoned(summon);
     }
 
     // Called when a summoned creature is despawned
     void SummonedCreatureDespawn(Creature* summon) override
     {
-        if (!sForge->SummonedCreatureDespawn(me, summon))
+        if (!E->SummonedCreatureDespawn(me, summon))
             ScriptedAI::SummonedCreatureDespawn(summon);
     }
 
@@ -149,14 +151,14 @@ struct ForgeCreatureAI : ScriptedAI
     // Called before EnterCombat even before the creature is in combat.
     void AttackStart(Unit* target) override
     {
-        if (!sForge->AttackStart(me, target))
+        if (!E->AttackStart(me, target))
             ScriptedAI::AttackStart(target);
     }
 
     // Called for reaction at stopping attack at no attackers or targets
     void EnterEvadeMode(EvadeReason /*why*/) override
     {
-        if (!sForge->EnterEvadeMode(me))
+        if (!E->EnterEvadeMode(me))
             ScriptedAI::EnterEvadeMode();
     }
 
@@ -164,14 +166,14 @@ struct ForgeCreatureAI : ScriptedAI
     // Called when creature appears in the world (spawn, respawn, grid load etc...)
     void JustAppeared() override
     {
-        if (!sForge->JustRespawned(me))
+        if (!E->JustRespawned(me))
             ScriptedAI::JustAppeared();
     }
 #else
     // Called when creature is spawned or respawned (for reseting variables)
     void JustRespawned() override
     {
-        if (!sForge->JustRespawned(me))
+        if (!E->JustRespawned(me))
             ScriptedAI::JustRespawned();
     }
 #endif
@@ -179,21 +181,21 @@ struct ForgeCreatureAI : ScriptedAI
     // Called at reaching home after evade
     void JustReachedHome() override
     {
-        if (!sForge->JustReachedHome(me))
+        if (!E->JustReachedHome(me))
             ScriptedAI::JustReachedHome();
     }
 
     // Called at text emote receive from player
     void ReceiveEmote(Player* player, uint32 emoteId) override
     {
-        if (!sForge->ReceiveEmote(me, player, emoteId))
+        if (!E->ReceiveEmote(me, player, emoteId))
             ScriptedAI::ReceiveEmote(player, emoteId);
     }
 
     // called when the corpse of this creature gets removed
     void CorpseRemoved(uint32& respawnDelay) override
     {
-        if (!sForge->CorpseRemoved(me, respawnDelay))
+        if (!E->CorpseRemoved(me, respawnDelay))
             ScriptedAI::CorpseRemoved(respawnDelay);
     }
 
@@ -207,7 +209,7 @@ struct ForgeCreatureAI : ScriptedAI
 
     void MoveInLineOfSight(Unit* who) override
     {
-        if (!sForge->MoveInLineOfSight(me, who))
+        if (!E->MoveInLineOfSight(me, who))
             ScriptedAI::MoveInLineOfSight(who);
     }
 
@@ -218,7 +220,7 @@ struct ForgeCreatureAI : ScriptedAI
     void SpellHit(Unit* caster, SpellInfo const* spell) override
 #endif
     {
-        if (!sForge->SpellHit(me, caster, spell))
+        if (!E->SpellHit(me, caster, spell))
             ScriptedAI::SpellHit(caster, spell);
     }
 
@@ -229,7 +231,7 @@ struct ForgeCreatureAI : ScriptedAI
     void SpellHitTarget(Unit* target, SpellInfo const* spell) override
 #endif
     {
-        if (!sForge->SpellHitTarget(me, target, spell))
+        if (!E->SpellHitTarget(me, target, spell))
             ScriptedAI::SpellHitTarget(target, spell);
     }
 
@@ -239,35 +241,35 @@ struct ForgeCreatureAI : ScriptedAI
     // Called when the creature is summoned successfully by other creature
     void IsSummonedBy(WorldObject* summoner) override
     {
-        if (!summoner->ToUnit() || !sForge->OnSummoned(me, summoner->ToUnit()))
+        if (!summoner->ToUnit() || !E->OnSummoned(me, summoner->ToUnit()))
             ScriptedAI::IsSummonedBy(summoner);
     }
 #else
     // Called when the creature is summoned successfully by other creature
     void IsSummonedBy(Unit* summoner) override
     {
-        if (!sForge->OnSummoned(me, summoner))
+        if (!E->OnSummoned(me, summoner))
             ScriptedAI::IsSummonedBy(summoner);
     }
 #endif
 
     void SummonedCreatureDies(Creature* summon, Unit* killer) override
     {
-        if (!sForge->SummonedCreatureDies(me, summon, killer))
+        if (!E->SummonedCreatureDies(me, summon, killer))
             ScriptedAI::SummonedCreatureDies(summon, killer);
     }
 
     // Called when owner takes damage
     void OwnerAttackedBy(Unit* attacker) override
     {
-        if (!sForge->OwnerAttackedBy(me, attacker))
+        if (!E->OwnerAttackedBy(me, attacker))
             ScriptedAI::OwnerAttackedBy(attacker);
     }
 
     // Called when owner attacks something
     void OwnerAttacked(Unit* target) override
     {
-        if (!sForge->OwnerAttacked(me, target))
+        if (!E->OwnerAttacked(me, target))
             ScriptedAI::OwnerAttacked(target);
     }
 #endif
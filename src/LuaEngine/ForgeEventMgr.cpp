@@ -5,8 +5,10 @@
 */
 
 #include "ForgeEventMgr.h"
+#include "ForgeMetrics.h"
 #include "LuaEngine.h"
 #include "Object.h"
+#include <atomic>
 
 extern "C"
 {
@@ -14,12 +16,227 @@ extern "C"
 #include "lauxlib.h"
 };
 
-ForgeEventProcessor::ForgeEventProcessor(Forge** _E, WorldObject* _obj) : m_time(0), obj(_obj), E(_E)
+namespace
 {
+    // Freed LuaEvents of this thread, linked through their first bytes
+    thread_local void* freeEvents = NULL;
+    thread_local uint32 freeEventCount = 0;
+    // Set once the thread's free list was released, later frees go to the heap
+    thread_local bool freeEventsRetired = false;
+    // Enough for the events of a busy map, the rest is returned to the heap
+    const uint32 MAX_FREE_EVENTS = 4096;
+
+    // Starts at 1 so that a new processor's `lastTick` never matches
+    std::atomic<uint32> worldTick(1);
+
+    // splitmix64 finalizer, spreads close GUIDs and event IDs over the whole range
+    uint64 MixBits(uint64 value)
+    {
+        value ^= value >> 30;
+        value *= 0xbf58476d1ce4e5b9ULL;
+        value ^= value >> 27;
+        value *= 0x94d049bb133111ebULL;
+        value ^= value >> 31;
+        return value;
+    }
+
+    struct FreeEventsHandle
+    {
+        ~FreeEventsHandle()
+        {
+            while (freeEvents)
+            {
+                void* next = *static_cast<void**>(freeEvents);
+                ::operator delete(freeEvents);
+                freeEvents = next;
+            }
+            freeEventCount = 0;
+            freeEventsRetired = true;
+        }
+    };
+}
+
+void* LuaEvent::operator new(size_t size)
+{
+    if (size != sizeof(LuaEvent) || !freeEvents)
+        return ::operator new(size);
+
+    void* ptr = freeEvents;
+    freeEvents = *static_cast<void**>(ptr);
+    --freeEventCount;
+    return ptr;
+}
+
+void LuaEvent::operator delete(void* ptr)
+{
+    if (!ptr)
+        return;
+
+    if (freeEventsRetired || freeEventCount >= MAX_FREE_EVENTS)
+    {
+        ::operator delete(ptr);
+        return;
+    }
+
+    thread_local FreeEventsHandle handle;
+    *static_cast<void**>(ptr) = freeEvents;
+    freeEvents = ptr;
+    ++freeEventCount;
+}
+
+LuaEventWheel::Level::Level() : occupied(0)
+{
+    for (uint32 i = 0; i < SLOT_COUNT; ++i)
+        slots[i] = NULL;
+}
+
+LuaEventWheel::LuaEventWheel() : time(0), sequence(0), nextSlotTime(NO_SLOT)
+{
+}
+
+void LuaEventWheel::Insert(LuaEvent* luaEvent, uint64 due)
+{
+    luaEvent->due = due < time ? time : due;
+    luaEvent->sequence = sequence++;
+    Place(luaEvent);
+}
+
+void LuaEventWheel::Place(LuaEvent* luaEvent)
+{
+    // The highest SLOT_BITS group where the due time differs from the current time
+    uint32 level = 0;
+    for (uint64 diff = (luaEvent->due ^ time) >> SLOT_BITS; diff; diff >>= SLOT_BITS)
+        ++level;
+
+    if (level >= levels.size())
+        levels.resize(level + 1);
+
+    uint32 shift = level * SLOT_BITS;
+    uint32 slot = (luaEvent->due >> shift) & (SLOT_COUNT - 1);
+    luaEvent->next = levels[level].slots[slot];
+    levels[level].slots[slot] = luaEvent;
+    levels[level].occupied |= 1 << slot;
+
+    uint64 slotTime = (luaEvent->due >> shift) << shift;
+    if (slotTime < nextSlotTime)
+        nextSlotTime = slotTime;
+}
+
+uint64 LuaEventWheel::FindNextSlotTime() const
+{
+    // Events on a level are due after all events on the levels below it,
+    //  so the first slot of the lowest used level is the next one to visit
+    for (uint32 level = 0; level < levels.size(); ++level)
+    {
+        uint32 occupied = levels[level].occupied;
+        if (!occupied)
+            continue;
+
+        uint32 slot = 0;
+        while (!(occupied & (1 << slot)))
+            ++slot;
+
+        uint32 shift = level * SLOT_BITS;
+        return ((time >> (shift + SLOT_BITS)) << (shift + SLOT_BITS)) | (uint64(slot) << shift);
+    }
+    return NO_SLOT;
+}
+
+void LuaEventWheel::Advance(uint64 newTime)
+{
+    uint64 oldTime = time;
+    time = newTime;
+
+    // Every level whose current slot changed, the events in it now belong to lower levels.
+    //  Placing never targets the current slot of a level above the lowest, so any order works.
+    for (uint32 level = 1; level < levels.size(); ++level)
+    {
+        uint32 shift = level * SLOT_BITS;
+        if ((newTime >> shift) == (oldTime >> shift))
+            break;
+
+        uint32 slot = (newTime >> shift) & (SLOT_COUNT - 1);
+        LuaEvent* luaEvent = levels[level].slots[slot];
+        levels[level].slots[slot] = NULL;
+        levels[level].occupied &= ~(1 << slot);
+
+        while (luaEvent)
+        {
+            LuaEvent* next = luaEvent->next;
+            Place(luaEvent);
+            luaEvent = next;
+        }
+    }
+}
+
+LuaEvent* LuaEventWheel::PopNext(uint64 until)
+{
+    while (nextSlotTime <= until)
+    {
+        Advance(nextSlotTime);
+
+        uint32 slot = time & (SLOT_COUNT - 1);
+        LuaEvent* luaEvent = levels[0].slots[slot];
+        if (!luaEvent)
+        {
+            // Entered a slot of a higher level, its events were moved down
+            nextSlotTime = FindNextSlotTime();
+            continue;
+        }
+
+        levels[0].slots[slot] = NULL;
+        levels[0].occupied &= ~(1 << slot);
+        nextSlotTime = FindNextSlotTime();
+
+        // A slot of the lowest level holds events of one due time, sort them by insertion
+        LuaEvent* sorted = NULL;
+        while (luaEvent)
+        {
+            LuaEvent* next = luaEvent->next;
+            LuaEvent** pos = &sorted;
+            while (*pos && (*pos)->sequence < luaEvent->sequence)
+                pos = &(*pos)->next;
+            luaEvent->next = *pos;
+            *pos = luaEvent;
+            luaEvent = next;
+        }
+        return sorted;
+    }
+
+    // No slot with events starts before `until`, so moving there moves no events
+    if (until > time)
+        time = until;
+    return NULL;
+}
+
+LuaEvent* LuaEventWheel::TakeAll()
+{
+    LuaEvent* all = NULL;
+    for (Level& level : levels)
+    {
+        for (uint32 slot = 0; slot < SLOT_COUNT; ++slot)
+        {
+            while (LuaEvent* luaEvent = level.slots[slot])
+            {
+                level.slots[slot] = luaEvent->next;
+                luaEvent->next = all;
+                all = luaEvent;
+            }
+        }
+        level.occupied = 0;
+    }
+    nextSlotTime = NO_SLOT;
+    return all;
+}
+
+ForgeEventProcessor::ForgeEventProcessor(Forge** _E, WorldObject* _obj) : m_time(0), lastTick(0), obj(_obj), E(_E)
+{
+    Forge::RetainStateRef(E);
+
     // can be called from multiple threads
-    if (obj)
+    if (obj && *E)
     {
-        EventMgr::Guard guard((*E)->eventMgr->GetLock());
+        EventMgr::Guard guard((*E)->eventMgr->GetLock(), __FUNCTION__);
         (*E)->eventMgr->processors.insert(this);
     }
 }
@@ -27,54 +244,88 @@ ForgeEventProcessor::ForgeEventProcessor(Forge** _E, WorldObject* _obj) : m_time
 ForgeEventProcessor::~ForgeEventProcessor()
 {
     // can be called from multiple threads
+    // A map state may be gone already, its Lua references went with it
+    // Most processors have run all their events by now and have nothing to unreference
+    if (!eventWheel.IsEmpty() && Forge::IsInitialized() && *E)
     {
-        LOCK_FORGE;
+        Forge::Guard guard((*E)->GetStateLock(), __FUNCTION__);
         RemoveEvents_internal();
     }
+    else
+        RemoveEvents_internal();
 
-    if (obj && Forge::IsInitialized())
+    if (obj && Forge::IsInitialized() && *E)
     {
-        EventMgr::Guard guard((*E)->eventMgr->GetLock());
+        EventMgr::Guard guard((*E)->eventMgr->GetLock(), __FUNCTION__);
         (*E)->eventMgr->processors.erase(this);
     }
+
+    Forge::ReleaseStateRef(E);
 }
 
 void ForgeEventProcessor::Update(uint32 diff)
 {
-    m_time += diff;
-    for (EventList::iterator it = eventList.begin(); it != eventList.end() && it->first <= m_time; it = eventList.begin())
-    {
-        LuaEvent* luaEvent = it->second;
-        eventList.erase(it);
+    if (!*E)
+        return;
 
-        if (luaEvent->state != LUAEVENT_STATE_ERASE)
-            eventMap.erase(luaEvent->funcRef);
+    // Units and game objects reach this from more than one update hook
+    if (obj)
+    {
+        uint32 tick = worldTick.load(std::memory_order_relaxed);
+        if (lastTick == tick)
+            return;
+        lastTick = tick;
+    }
 
-        if (luaEvent->state == LUAEVENT_STATE_RUN)
+    m_time += diff;
+    while (LuaEvent* dueEvents = eventWheel.PopNext(m_time))
+    {
+        while (dueEvents)
         {
-            uint32 delay = luaEvent->delay;
-            bool remove = luaEvent->repeats == 1;
-            if (!remove)
-                AddEvent(luaEvent); // Reschedule before calling incase RemoveEvents used
+            LuaEvent* luaEvent = dueEvents;
+            dueEvents = luaEvent->next;
+            ProcessEvent(luaEvent);
+        }
+    }
+}
 
-            // Call the timed event
-            (*E)->OnTimedEvent(luaEvent->funcRef, delay, luaEvent->repeats ? luaEvent->repeats-- : luaEvent->repeats, obj);
+void ForgeEventProcessor::NextTick()
+{
+    // Never 0, see `lastTick`
+    uint32 tick = worldTick.load(std::memory_order_relaxed) + 1;
+    worldTick.store(tick ? tick : 1, std::memory_order_relaxed);
+}
 
-            if (!remove)
-                continue;
-        }
+void ForgeEventProcessor::ProcessEvent(LuaEvent* luaEvent)
+{
+    if (luaEvent->state == LUAEVENT_STATE_RUN)
+    {
+        uint32 delay = luaEvent->delay;
+        bool remove = luaEvent->repeats == 1;
+        if (remove)
+            UnindexEvent(luaEvent->funcRef);
+        else
+            ScheduleEvent(luaEvent); // Reschedule before calling incase RemoveEvents used
 
-        // Event should be deleted (executed last time or set to be aborted)
-        RemoveEvent(luaEvent);
+        // Call the timed event
+        (*E)->OnTimedEvent(luaEvent->funcRef, delay, luaEvent->repeats ? luaEvent->repeats-- : luaEvent->repeats, obj);
+
+        if (!remove)
+            return;
     }
+    else if (luaEvent->state == LUAEVENT_STATE_ABORT)
+        UnindexEvent(luaEvent->funcRef);
+
+    // Event should be deleted (executed last time or set to be aborted)
+    RemoveEvent(luaEvent);
 }
 
 void ForgeEventProcessor::SetStates(LuaEventState state)
 {
-    for (EventList::iterator it = eventList.begin(); it != eventList.end(); ++it)
+    for (EventMap::iterator it = eventMap.begin(); it != eventMap.end(); ++it)
         it->second->SetState(state);
     if (state == LUAEVENT_STATE_ERASE)
-        eventMap.clear();
+        UnindexEvents();
 }
 
 void ForgeEventProcessor::RemoveEvents_internal()
@@ -86,37 +337,106 @@ void ForgeEventProcessor::RemoveEvents_internal()
     //    return;
     //}
 
-    for (EventList::iterator it = eventList.begin(); it != eventList.end(); ++it)
-        RemoveEvent(it->second);
+    LuaEvent* luaEvent = eventWheel.TakeAll();
+    while (luaEvent)
+    {
+        LuaEvent* next = luaEvent->next;
+        RemoveEvent(luaEvent);
+        luaEvent = next;
+    }
 
-    eventList.clear();
-    eventMap.clear();
+    UnindexEvents();
 }
 
 void ForgeEventProcessor::SetState(int eventId, LuaEventState state)
 {
-    if (eventMap.find(eventId) != eventMap.end())
-        eventMap[eventId]->SetState(state);
+    EventMap::iterator itr = eventMap.find(eventId);
+    if (itr == eventMap.end())
+        return;
+
+    itr->second->SetState(state);
     if (state == LUAEVENT_STATE_ERASE)
-        eventMap.erase(eventId);
+        UnindexEvent(eventId);
 }
 
-void ForgeEventProcessor::AddEvent(LuaEvent* luaEvent)
+void ForgeEventProcessor::ScheduleEvent(LuaEvent* luaEvent)
 {
     luaEvent->GenerateDelay();
-    eventList.insert(std::pair<uint64, LuaEvent*>(m_time + luaEvent->delay, luaEvent));
+    eventWheel.Insert(luaEvent, m_time + luaEvent->delay);
+}
+
+void ForgeEventProcessor::AddEvent(int funcRef, uint32 min, uint32 max, uint32 repeats, bool spread)
+{
+    LuaEvent* luaEvent = new LuaEvent(funcRef, min, max, repeats);
+    if (spread && max)
+    {
+        // The same object and event always get the same phase, the later calls keep the delay
+        uint64 key = MixBits(uint32(funcRef));
+        if (obj)
+            key = MixBits(key ^ obj->GET_GUID().GetRawValue());
+
+        luaEvent->GenerateDelay();
+        uint32 phase = luaEvent->delay ? 1 + uint32(key % luaEvent->delay) : 0;
+        eventWheel.Insert(luaEvent, m_time + phase);
+    }
+    else
+        ScheduleEvent(luaEvent);
+    IndexEvent(luaEvent);
+}
+
+EventMgr* ForgeEventProcessor::GetEventMgr() const
+{
+    return *E ? (*E)->eventMgr : NULL;
+}
+
+void ForgeEventProcessor::IndexEvent(LuaEvent* luaEvent)
+{
     eventMap[luaEvent->funcRef] = luaEvent;
+    if (ForgeMetrics::IsEnabled())
+        ForgeMetrics::AddTimers(1);
+
+    if (EventMgr* mgr = GetEventMgr())
+    {
+        EventMgr::Guard guard(mgr->indexLock, __FUNCTION__);
+        mgr->eventIndex[luaEvent->funcRef] = std::make_pair(this, luaEvent);
+    }
 }
 
-void ForgeEventProcessor::AddEvent(int funcRef, uint32 min, uint32 max, uint32 repeats)
+void ForgeEventProcessor::UnindexEvent(int eventId)
 {
-    AddEvent(new LuaEvent(funcRef, min, max, repeats));
+    if (!eventMap.erase(eventId))
+        return;
+
+    if (ForgeMetrics::IsEnabled())
+        ForgeMetrics::AddTimers(-1);
+
+    if (EventMgr* mgr = GetEventMgr())
+    {
+        EventMgr::Guard guard(mgr->indexLock, __FUNCTION__);
+        mgr->eventIndex.erase(eventId);
+    }
+}
+
+void ForgeEventProcessor::UnindexEvents()
+{
+    if (eventMap.empty())
+        return;
+
+    if (EventMgr* mgr = GetEventMgr())
+    {
+        EventMgr::Guard guard(mgr->indexLock, __FUNCTION__);
+        for (EventMap::const_iterator it = eventMap.begin(); it != eventMap.end(); ++it)
+            mgr->eventIndex.erase(it->first);
+    }
+    if (ForgeMetrics::IsEnabled())
+        ForgeMetrics::AddTimers(-int32(eventMap.size()));
+    eventMap.clear();
 }
 
 void ForgeEventProcessor::RemoveEvent(LuaEvent* luaEvent)
 {
     // Unreference if should and if Forge was not yet uninitialized and if the lua state still exists
-    if (luaEvent->state != LUAEVENT_STATE_ERASE && Forge::IsInitialized() && (*E)->HasLuaState())
+    if (luaEvent->state != LUAEVENT_STATE_ERASE && Forge::IsInitialized() && *E && (*E)->HasLuaState())
     {
         // Free lua function ref
         luaL_unref((*E)->L, LUA_REGISTRYINDEX, luaEvent->funcRef);
@@ -124,14 +444,14 @@ void ForgeEventProcessor::RemoveEvent(LuaEvent* luaEvent)
     delete luaEvent;
 }
 
-EventMgr::EventMgr(Forge** _E) : globalProcessor(new ForgeEventProcessor(_E, NULL)), E(_E)
+EventMgr::EventMgr(Forge** _E) : ForgeUtil::Lockable("EventMgr"), indexLock("EventIndex"), globalProcessor(new ForgeEventProcessor(_E, NULL)), E(_E)
 {
 }
 
 EventMgr::~EventMgr()
 {
     {
-        Guard guard(GetLock());
+        Guard guard(GetLock(), __FUNCTION__);
         if (!processors.empty())
             for (ProcessorSet::const_iterator it = processors.begin(); it != processors.end(); ++it) // loop processors
                 (*it)->RemoveEvents_internal();
@@ -143,7 +463,7 @@ EventMgr::~EventMgr()
 
 void EventMgr::SetStates(LuaEventState state)
 {
-    Guard guard(GetLock());
+    Guard guard(GetLock(), __FUNCTION__);
     if (!processors.empty())
         for (ProcessorSet::const_iterator it = processors.begin(); it != processors.end(); ++it) // loop processors
             (*it)->SetStates(state);
@@ -152,9 +472,15 @@ void EventMgr::SetStates(LuaEventState state)
 
 void EventMgr::SetState(int eventId, LuaEventState state)
 {
-    Guard guard(GetLock());
-    if (!processors.empty())
-        for (ProcessorSet::const_iterator it = processors.begin(); it != processors.end(); ++it) // loop processors
-            (*it)->SetState(eventId, state);
-    globalProcessor->SetState(eventId, state);
+    Guard guard(indexLock, __FUNCTION__);
+    EventIndex::iterator itr = eventIndex.find(eventId);
+    if (itr == eventIndex.end())
+        return;
+
+    itr->second.second->SetState(state);
+    if (state == LUAEVENT_STATE_ERASE)
+    {
+        itr->second.first->eventMap.erase(eventId);
+        eventIndex.erase(itr);
+    }
 }
@@ -14,7 +14,7 @@
 #else
 #include "Util.h"
 #endif
-#include <map>
+#include <vector>
 
 #if defined(TRINITY) || AZEROTHCORE
 #include "Define.h"
@@ -37,10 +37,14 @@ enum LuaEventState
 struct LuaEvent
 {
     LuaEvent(int _funcRef, uint32 _min, uint32 _max, uint32 _repeats) :
-        min(_min), max(_max), delay(0), repeats(_repeats), funcRef(_funcRef), state(LUAEVENT_STATE_RUN)
+        min(_min), max(_max), delay(0), repeats(_repeats), funcRef(_funcRef), state(LUAEVENT_STATE_RUN), due(0), sequence(0), next(NULL)
     {
     }
 
+    // Freed events are kept in a free list per thread and reused
+    static void* operator new(size_t size);
+    static void operator delete(void* ptr);
+
     void SetState(LuaEventState _state)
     {
         if (state != LUAEVENT_STATE_ERASE)
@@ -58,6 +62,63 @@ struct LuaEvent
     uint32 repeats; // Amount of repeats to make, 0 for infinite
     int funcRef;    // Lua function reference ID, also used as event ID
     LuaEventState state;    // State for next call
+
+    // Set by LuaEventWheel
+    uint64 due;         // Time the event is due at
+    uint64 sequence;    // Insertion order, orders the events due at the same time
+    LuaEvent* next;     // Next event in the same wheel slot
+};
+
+/*
+ * A hierarchical timing wheel of LuaEvents keyed by their due time in milliseconds.
+ *
+ * Level N has SLOT_COUNT slots of SLOT_COUNT^N milliseconds. An event is kept
+ *   on the lowest level where its due time is not in the current slot, and
+ *   moves down when the wheel reaches its slot, so an insert is O(1) and an
+ *   event moves at most once per level. Levels are allocated when first used.
+ *
+ * Events due at the same time are returned in insertion order.
+ */
+class LuaEventWheel
+{
+public:
+    LuaEventWheel();
+
+    // Events due before the current time are due at the current time
+    void Insert(LuaEvent* luaEvent, uint64 due);
+    // Removes the earliest events due at or before `until` and returns them linked in
+    //  insertion order, the wheel moves to their due time. Returns NULL and moves the
+    //  wheel to `until` when none are due.
+    LuaEvent* PopNext(uint64 until);
+    // Removes all events and returns them linked in no particular order
+    LuaEvent* TakeAll();
+    bool IsEmpty() const { return nextSlotTime == NO_SLOT; }
+
+private:
+    static const uint32 SLOT_BITS = 4;
+    static const uint32 SLOT_COUNT = 1 << SLOT_BITS;
+    static const uint64 NO_SLOT = ~uint64(0);
+
+    struct Level
+    {
+        Level();
+
+        LuaEvent* slots[SLOT_COUNT];
+        // Bit per non empty slot
+        uint32 occupied;
+    };
+
+    void Place(LuaEvent* luaEvent);
+    // The start time of the first slot with events, NO_SLOT if empty
+    uint64 FindNextSlotTime() const;
+    // Moves to `newTime`, moving down the events of the slots it enters
+    void Advance(uint64 newTime);
+
+    std::vector<Level> levels;
+    uint64 time;
+    uint64 sequence;
+    // The start time of the first slot with events, the wheel has nothing to do before it
+    uint64 nextSlotTime;
 };
 
 class ForgeEventProcessor
@@ -65,26 +126,42 @@ class ForgeEventProcessor
     friend class EventMgr;
 
 public:
-    typedef std::multimap<uint64, LuaEvent*> EventList;
     typedef std::unordered_map<int, LuaEvent*> EventMap;
 
     ForgeEventProcessor(Forge** _E, WorldObject* _obj);
     ~ForgeEventProcessor();
 
+    // Runs the due events, an object's processor only runs once per world tick
+    //  however many of its update hooks call this
     void Update(uint32 diff);
+    // Starts a new world tick, called at the start of the world update
+    static void NextTick();
     // removes all timed events on next tick or at tick end
     void SetStates(LuaEventState state);
     // set the event to be removed when executing
     void SetState(int eventId, LuaEventState state);
-    void AddEvent(int funcRef, uint32 min, uint32 max, uint32 repeats);
+    // With `spread` the first call comes at a point within the first delay picked from the
+    //  event ID and object GUID, so that events registered together don't all run in one tick
+    void AddEvent(int funcRef, uint32 min, uint32 max, uint32 repeats, bool spread = false);
+    // The state the events belong to, see Forge::GetStateRef
+    Forge** GetStateRef() const { return E; }
     EventMap eventMap;
 
 private:
     void RemoveEvents_internal();
-    void AddEvent(LuaEvent* luaEvent);
+    void ProcessEvent(LuaEvent* luaEvent);
+    void ScheduleEvent(LuaEvent* luaEvent);
     void RemoveEvent(LuaEvent* luaEvent);
-    EventList eventList;
+    // Add to and remove from `eventMap` and EventMgr::eventIndex
+    void IndexEvent(LuaEvent* luaEvent);
+    void UnindexEvent(int eventId);
+    void UnindexEvents();
+    // NULL once the state is gone
+    EventMgr* GetEventMgr() const;
+    LuaEventWheel eventWheel;
     uint64 m_time;
+    // The world tick of the last Update, 0 if none
+    uint32 lastTick;
     WorldObject* obj;
     Forge** E;
 };
@@ -93,7 +170,14 @@ class EventMgr : public ForgeUtil::Lockable
 {
 public:
     typedef std::unordered_set<ForgeEventProcessor*> ProcessorSet;
+    typedef std::unordered_map<int, std::pair<ForgeEventProcessor*, LuaEvent*> > EventIndex;
+    // The processors of the objects of this state that got a timed event, objects
+    //  without one have none
     ProcessorSet processors;
+    // The processor and event of every event in a processor's `eventMap` by event ID,
+    //  guarded by `indexLock`. Take it after GetLock(), never before.
+    EventIndex eventIndex;
+    LockType indexLock;
     ForgeEventProcessor* globalProcessor;
     Forge** E;
 
@@ -104,7 +188,7 @@ public:
     // Execute only in safe env
     void SetStates(LuaEventState state);
 
-    // Sets the eventId's state in all processors
+    // Sets the eventId's state in whichever processor has it
     // Execute only in safe env
     void SetState(int eventId, LuaEventState state);
 };
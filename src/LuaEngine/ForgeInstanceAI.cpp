@@ -12,22 +12,22 @@
 #ifndef TRINITY
 void ForgeInstanceAI::Initialize()
 {
-    LOCK_FORGE;
+    Forge::Guard guard(E->GetStateLock(), __FUNCTION__);
 
-    ASSERT(!sForge->HasInstanceData(instance));
+    ASSERT(!E->HasInstanceData(instance));
 
     // Create a new table for instance data.
-    lua_State* L = sForge->L;
+    lua_State* L = E->L;
     lua_newtable(L);
-    sForge->CreateInstanceData(instance);
+    E->CreateInstanceData(instance);
 
-    sForge->OnInitialize(this);
+    E->OnInitialize(this);
 }
 #endif
 
 void ForgeInstanceAI::Load(const char* data)
 {
-    LOCK_FORGE;
+    Forge::Guard guard(E->GetStateLock(), __FUNCTION__);
 
     // If we get passed NULL (i.e. `Reload` was called) then use
     //   the last known save data (or maybe just an empty string).
@@ -42,21 +42,21 @@ void ForgeInstanceAI::Load(const char* data)
 
     if (data[0] == '\0')
     {
-        ASSERT(!sForge->HasInstanceData(instance));
+        ASSERT(!E->HasInstanceData(instance));
 
         // Create a new table for instance data.
-        lua_State* L = sForge->L;
+        lua_State* L = E->L;
         lua_newtable(L);
-        sForge->CreateInstanceData(instance);
+        E->CreateInstanceData(instance);
 
-        sForge->OnLoad(this);
+        E->OnLoad(this);
         // Stack: (empty)
         return;
     }
 
     size_t decodedLength;
     const unsigned char* decodedData = ForgeUtil::DecodeData(data, &decodedLength);
-    lua_State* L = sForge->L;
+    lua_State* L = E->L;
 
     if (decodedData)
     {
@@ -73,9 +73,9 @@ void ForgeInstanceAI::Load(const char* data)
             // Only use the data if it's a table.
             if (lua_istable(L, -1))
             {
-                sForge->CreateInstanceData(instance);
+                E->CreateInstanceData(instance);
                 // Stack: (empty)
-                sForge->OnLoad(this);
+                E->OnLoad(this);
                 // WARNING! lastSaveData might be different after `OnLoad` if the Lua code saved data.
             }
             else
@@ -115,8 +115,8 @@ void ForgeInstanceAI::Load(const char* data)
 
 const char* ForgeInstanceAI::Save() const
 {
-    LOCK_FORGE;
-    lua_State* L = sForge->L;
+    Forge::Guard guard(E->GetStateLock(), __FUNCTION__);
+    lua_State* L = E->L;
     // Stack: (empty)
 
     /*
@@ -129,7 +129,7 @@ const char* ForgeInstanceAI::Save() const
     ForgeInstanceAI* self = const_cast<ForgeInstanceAI*>(this);
 
     lua_pushcfunction(L, mar_encode);
-    sForge->PushInstanceData(L, self, false);
+    E->PushInstanceData(L, self, false);
     // Stack: mar_encode, instance_data
 
     if (lua_pcall(L, 1, 1, 0) != 0)
@@ -153,11 +153,11 @@ const char* ForgeInstanceAI::Save() const
 
 uint32 ForgeInstanceAI::GetData(uint32 key) const
 {
-    LOCK_FORGE;
-    lua_State* L = sForge->L;
+    Forge::Guard guard(E->GetStateLock(), __FUNCTION__);
+    lua_State* L = E->L;
     // Stack: (empty)
 
-    sForge->PushInstanceData(L, const_cast<ForgeInstanceAI*>(this), false);
+    E->PushInstanceData(L, const_cast<ForgeInstanceAI*>(this), false);
     // Stack: instance_data
 
     Forge::Push(L, key);
@@ -175,11 +175,11 @@ uint32 ForgeInstanceAI::GetData(uint32 key) const
 
 void ForgeInstanceAI::SetData(uint32 key, uint32 value)
 {
-    LOCK_FORGE;
-    lua_State* L = sForge->L;
+    Forge::Guard guard(E->GetStateLock(), __FUNCTION__);
+    lua_State* L = E->L;
     // Stack: (empty)
 
-    sForge->PushInstanceData(L, this, false);
+    E->PushInstanceData(L, this, false);
     // Stack: instance_data
 
     Forge::Push(L, key);
@@ -195,11 +195,11 @@ void ForgeInstanceAI::SetData(uint32 key, uint32 value)
 
 uint64 ForgeInstanceAI::GetData64(uint32 key) const
 {
-    LOCK_FORGE;
-    lua_State* L = sForge->L;
+    Forge::Guard guard(E->GetStateLock(), __FUNCTION__);
+    lua_State* L = E->L;
     // Stack: (empty)
 
-    sForge->PushInstanceData(L, const_cast<ForgeInstanceAI*>(this), false);
+    E->PushInstanceData(L, const_cast<ForgeInstanceAI*>(this), false);
     // Stack: instance_data
 
     Forge::Push(L, key);
@@ -217,11 +217,11 @@ uint64 ForgeInstanceAI::GetData64(uint32 key) const
 
 void ForgeInstanceAI::SetData64(uint32 key, uint64 value)
 {
-    LOCK_FORGE;
-    lua_State* L = sForge->L;
+    Forge::Guard guard(E->GetStateLock(), __FUNCTION__);
+    lua_State* L = E->L;
     // Stack: (empty)
 
-    sForge->PushInstanceData(L, this, false);
+    E->PushInstanceData(L, this, false);
     // Stack: instance_data
 
     Forge::Push(L, key);
@@ -62,14 +62,16 @@ private:
     // The last save data to pass through this class,
     //   either through `Load` or `Save`.
     std::string lastSaveData;
+    // The state that created this instance data, see Forge::GetMapForge.
+    Forge* E;
 
 public:
 #ifdef TRINITY
-    ForgeInstanceAI(Map* map) : InstanceData(map->ToInstanceMap())
+    ForgeInstanceAI(Map* map, Forge* E) : InstanceData(map->ToInstanceMap()), E(E)
     {
     }
 #else
-    ForgeInstanceAI(Map* map) : InstanceData(map)
+    ForgeInstanceAI(Map* map, Forge* E) : InstanceData(map), E(E)
     {
     }
 #endif
@@ -123,20 +125,20 @@ public:
         // If Forge is reloaded, it will be missing our instance data.
         // Reload here instead of waiting for the next hook call (possibly never).
         // This avoids having to have an empty Update hook handler just to trigger the reload.
-        if (!sForge->HasInstanceData(instance))
+        if (!E->HasInstanceData(instance))
             Reload();
 
-        sForge->OnUpdateInstance(this, diff);
+        E->OnUpdateInstance(this, diff);
     }
 
     bool IsEncounterInProgress() const override
     {
-        return sForge->OnCheckEncounterInProgress(const_cast<ForgeInstanceAI*>(this));
+        return E->OnCheckEncounterInProgress(const_cast<ForgeInstanceAI*>(this));
     }
 
     void OnPlayerEnter(Player* player) override
     {
-        sForge->OnPlayerEnterInstance(this, player);
+        E->OnPlayerEnterInstance(this, player);
     }
 
 #if defined TRINITY || AZEROTHCORE
@@ -145,12 +147,12 @@ public:
     void OnObjectCreate(GameObject* gameobject) override
 #endif
     {
-        sForge->OnGameObjectCreate(this, gameobject);
+        E->OnGameObjectCreate(this, gameobject);
     }
 
     void OnCreatureCreate(Creature* creature) override
     {
-        sForge->OnCreatureCreate(this, creature);
+        E->OnCreatureCreate(this, creature);
     }
 };
 
@@ -0,0 +1,309 @@
+/*
+* Copyright (C) 2010 - 2016 Forge Lua Engine <http://emudevs.com/>
+* This program is free software licensed under GPL version 3
+* Please see the included DOCS/LICENSE.md for more information
+*/
+
+#include <atomic>
+#include <cstdio>
+#include <cstring>
+#include <thread>
+extern "C"
+{
+#include "lua.h"
+#include "lauxlib.h"
+};
+
+#include "ForgeMetrics.h"
+#include "HookStats.h"
+#include "HttpManager.h"
+#include "LuaEngine.h"
+
+namespace
+{
+    // Upper bounds of the hook latency buckets, the last bucket is +Inf
+    struct LatencyBound
+    {
+        uint32 us;
+        const char* label;
+    };
+    const LatencyBound LATENCY_BOUNDS[] =
+    {
+        { 10, "1e-05" }, { 50, "5e-05" }, { 100, "0.0001" }, { 500, "0.0005" }, { 1000, "0.001" },
+        { 5000, "0.005" }, { 10000, "0.01" }, { 50000, "0.05" }, { 100000, "0.1" }, { 1000000, "1" }
+    };
+    const uint32 LATENCY_BUCKET_COUNT = sizeof(LATENCY_BOUNDS) / sizeof(LATENCY_BOUNDS[0]) + 1;
+    // There are about 20 binding families, later ones are not recorded
+    const uint32 MAX_FAMILIES = 32;
+    const uint32 SERVER_THREADS = 2;
+
+    struct HookFamily
+    {
+        // Claimed once by the first thread recording the family
+        std::atomic<const char*> name;
+        std::atomic<uint64> errors;
+        std::atomic<uint64> ticks;
+        std::atomic<uint64> buckets[LATENCY_BUCKET_COUNT];
+    };
+
+    // Zero initialized as statics
+    HookFamily families[MAX_FAMILIES];
+    uint64 boundTicks[LATENCY_BUCKET_COUNT - 1];
+    double microsecondsPerTick;
+
+    std::atomic<bool> enabled(false);
+    std::atomic<uint64> errors(0);
+    std::atomic<int64> timers(0);
+    std::atomic<uint64> timerCalls(0);
+    std::atomic<int64> luaHeap(0);
+    std::atomic<uint64> gcCycles(0);
+    std::atomic<int64> pendingQueries(0);
+    std::atomic<uint64> queries(0);
+
+    std::unique_ptr<httplib::Server> server;
+    std::thread serverThread;
+
+    // Metatable of the userdata that counts garbage collection cycles
+    const char* GC_SENTINEL = "Forge GC sentinel";
+
+    HookFamily* GetFamily(const char* family)
+    {
+        for (HookFamily& slot : families)
+        {
+            const char* name = slot.name.load(std::memory_order_acquire);
+            if (!name)
+            {
+                if (slot.name.compare_exchange_strong(name, family, std::memory_order_acq_rel))
+                    return &slot;
+                // Someone else claimed the slot, `name` holds their family
+            }
+            if (name == family || !strcmp(name, family))
+                return &slot;
+        }
+        return NULL;
+    }
+
+    void NewSentinel(lua_State* L)
+    {
+        lua_newuserdata(L, 1);
+        luaL_getmetatable(L, GC_SENTINEL);
+        lua_setmetatable(L, -2);
+        lua_pop(L, 1);
+    }
+
+    // Unreferenced from birth, so the sentinel is finalized by the cycle after the one
+    //  that created it. Every finalizer makes the next sentinel.
+    int OnGcCycle(lua_State* L)
+    {
+        gcCycles.fetch_add(1, std::memory_order_relaxed);
+        NewSentinel(L);
+        return 0;
+    }
+
+    void Append(std::string& out, const char* name, const char* type, const char* help)
+    {
+        out += "# HELP ";
+        out += name;
+        out += ' ';
+        out += help;
+        out += "\n# TYPE ";
+        out += name;
+        out += ' ';
+        out += type;
+        out += '\n';
+    }
+
+    template<typename T>
+    void AppendValue(std::string& out, const char* name, const char* labels, T value)
+    {
+        out += name;
+        if (labels)
+            out += labels;
+        out += ' ';
+        out += std::to_string(value);
+        out += '\n';
+    }
+
+    template<typename T>
+    void AppendMetric(std::string& out, const char* name, const char* type, const char* help, T value)
+    {
+        Append(out, name, type, help);
+        AppendValue(out, name, NULL, value);
+    }
+}
+
+bool ForgeMetrics::Start(std::string const& address, uint16 port)
+{
+    // Done once here, the rate is fixed after calibration
+    microsecondsPerTick = HookClock::TicksToMicroseconds(1000000) / 1000000;
+    for (uint32 i = 0; i < LATENCY_BUCKET_COUNT - 1; ++i)
+        boundTicks[i] = uint64(LATENCY_BOUNDS[i].us / microsecondsPerTick);
+
+    server.reset(new httplib::Server());
+    server->new_task_queue = [] { return new httplib::ThreadPool(SERVER_THREADS); };
+#ifndef _WIN32
+    // httplib binds with SO_REUSEPORT, which would let a second worldserver on the
+    //  same port start quietly and answer half of the scrapes
+    server->set_socket_options([](socket_t sock)
+    {
+        int yes = 1;
+        setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, reinterpret_cast<const void*>(&yes), sizeof(yes));
+    });
+#endif
+    server->Get("/metrics", [](const httplib::Request& /*req*/, httplib::Response& res)
+    {
+        res.set_content(Format(), "text/plain; version=0.0.4; charset=utf-8");
+    });
+
+    if (!server->bind_to_port(address, port))
+    {
+        FORGE_LOG_ERROR("[Forge]: Could not serve metrics on {}:{}", address, port);
+        server.reset();
+        return false;
+    }
+
+    httplib::Server* listener = server.get();
+    serverThread = std::thread([listener] { listener->listen_after_bind(); });
+    // Stop does nothing before the server runs
+    server->wait_until_ready();
+    // Publishes the bucket bounds to the recording threads
+    enabled.store(true, std::memory_order_release);
+
+    FORGE_LOG_INFO("[Forge]: Serving metrics on http://{}:{}/metrics", address, port);
+    return true;
+}
+
+void ForgeMetrics::Stop()
+{
+    if (!server)
+        return;
+
+    enabled.store(false, std::memory_order_relaxed);
+    server->stop();
+    serverThread.join();
+    server.reset();
+}
+
+bool ForgeMetrics::IsEnabled()
+{
+    return enabled.load(std::memory_order_acquire);
+}
+
+void ForgeMetrics::RecordHook(const char* family, uint64 ticks)
+{
+    HookFamily* slot = GetFamily(family);
+    if (!slot)
+        return;
+
+    uint32 bucket = 0;
+    while (bucket < LATENCY_BUCKET_COUNT - 1 && ticks > boundTicks[bucket])
+        ++bucket;
+
+    slot->ticks.fetch_add(ticks, std::memory_order_relaxed);
+    slot->buckets[bucket].fetch_add(1, std::memory_order_relaxed);
+}
+
+void ForgeMetrics::RecordError(const char* family)
+{
+    errors.fetch_add(1, std::memory_order_relaxed);
+    if (!family)
+        return;
+
+    if (HookFamily* slot = GetFamily(family))
+        slot->errors.fetch_add(1, std::memory_order_relaxed);
+}
+
+void ForgeMetrics::AddTimers(int32 delta)
+{
+    timers.fetch_add(delta, std::memory_order_relaxed);
+}
+
+void ForgeMetrics::RecordTimerCall()
+{
+    timerCalls.fetch_add(1, std::memory_order_relaxed);
+}
+
+void ForgeMetrics::AddLuaHeap(int64 delta)
+{
+    luaHeap.fetch_add(delta, std::memory_order_relaxed);
+}
+
+void ForgeMetrics::WatchGarbageCollector(lua_State* L)
+{
+    luaL_newmetatable(L, GC_SENTINEL);
+    lua_pushcfunction(L, &OnGcCycle);
+    lua_setfield(L, -2, "__gc");
+    lua_pop(L, 1);
+
+    NewSentinel(L);
+}
+
+std::shared_ptr<void> ForgeMetrics::TrackQuery()
+{
+    queries.fetch_add(1, std::memory_order_relaxed);
+    pendingQueries.fetch_add(1, std::memory_order_relaxed);
+    return std::shared_ptr<void>(nullptr, [](void*) { pendingQueries.fetch_sub(1, std::memory_order_relaxed); });
+}
+
+std::string ForgeMetrics::Format()
+{
+    std::string out;
+    out.reserve(8192);
+
+    // Label sets are built per family, the buffer fits the longest family name with room to spare
+    char labels[128];
+
+    Append(out, "forge_hook_duration_seconds", "histogram", "Time spent in event handlers by binding family.");
+    for (HookFamily& slot : families)
+    {
+        const char* name = slot.name.load(std::memory_order_acquire);
+        if (!name)
+            break;
+
+        uint64 cumulative = 0;
+        for (uint32 i = 0; i < LATENCY_BUCKET_COUNT; ++i)
+        {
+            cumulative += slot.buckets[i].load(std::memory_order_relaxed);
+            snprintf(labels, sizeof(labels), "{family=\"%s\",le=\"%s\"}", name, i < LATENCY_BUCKET_COUNT - 1 ? LATENCY_BOUNDS[i].label : "+Inf");
+            AppendValue(out, "forge_hook_duration_seconds_bucket", labels, cumulative);
+        }
+
+        // Counted from the buckets, so the count always matches the +Inf bucket
+        snprintf(labels, sizeof(labels), "{family=\"%s\"}", name);
+        AppendValue(out, "forge_hook_duration_seconds_sum", labels, slot.ticks.load(std::memory_order_relaxed) * microsecondsPerTick / 1000000);
+        AppendValue(out, "forge_hook_duration_seconds_count", labels, cumulative);
+    }
+
+    Append(out, "forge_hook_errors_total", "counter", "Errors raised by event handlers by binding family.");
+    for (HookFamily& slot : families)
+    {
+        const char* name = slot.name.load(std::memory_order_acquire);
+        if (!name)
+            break;
+
+        snprintf(labels, sizeof(labels), "{family=\"%s\"}", name);
+        AppendValue(out, "forge_hook_errors_total", labels, slot.errors.load(std::memory_order_relaxed));
+    }
+
+    AppendMetric(out, "forge_lua_errors_total", "counter", "Errors raised by Lua code, in event handlers or elsewhere.", errors.load(std::memory_order_relaxed));
+    AppendMetric(out, "forge_timed_events", "gauge", "Timed events currently registered.", timers.load(std::memory_order_relaxed));
+    AppendMetric(out, "forge_timed_event_calls_total", "counter", "Timed event callbacks called.", timerCalls.load(std::memory_order_relaxed));
+    AppendMetric(out, "forge_lua_heap_bytes", "gauge", "Memory used by the Lua states, as of their last update.", luaHeap.load(std::memory_order_relaxed));
+    AppendMetric(out, "forge_lua_gc_cycles_total", "counter", "Garbage collection cycles completed by the Lua states.", gcCycles.load(std::memory_order_relaxed));
+    AppendMetric(out, "forge_db_queries_pending", "gauge", "Asynchronous database queries whose callback has not run yet.", pendingQueries.load(std::memory_order_relaxed));
+    AppendMetric(out, "forge_db_queries_total", "counter", "Asynchronous database queries made.", queries.load(std::memory_order_relaxed));
+
+    HttpStats http = HttpManager::GetStats();
+    AppendMetric(out, "forge_http_requests_pending", "gauge", "HTTP requests accepted and not passed to Lua yet.", http.pending);
+    AppendMetric(out, "forge_http_requests_queued", "gauge", "HTTP requests waiting for a worker.", http.queued);
+    AppendMetric(out, "forge_http_requests_running", "gauge", "HTTP requests being sent by a worker.", http.running);
+    AppendMetric(out, "forge_http_requests_started_total", "counter", "HTTP requests taken by a worker.", http.started);
+    AppendMetric(out, "forge_http_requests_completed_total", "counter", "HTTP responses passed to Lua or dropped.", http.completed);
+    AppendMetric(out, "forge_http_requests_rejected_total", "counter", "HTTP requests rejected by Forge.HttpQueueLimit.", http.rejected);
+    AppendMetric(out, "forge_http_cache_hits_total", "counter", "HTTP requests answered by the cache without sending them.", http.cache_hits);
+    AppendMetric(out, "forge_http_cache_revalidated_total", "counter", "HTTP requests answered by the cache after a 304.", http.cache_revalidated);
+    AppendMetric(out, "forge_http_cache_misses_total", "counter", "Cacheable HTTP requests sent without a usable cache entry.", http.cache_misses);
+    AppendMetric(out, "forge_http_cache_bytes", "gauge", "Size of the HTTP response cache.", http.cache_size);
+
+    return out;
+}
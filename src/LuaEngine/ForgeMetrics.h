@@ -0,0 +1,61 @@
+/*
+* Copyright (C) 2010 - 2016 Forge Lua Engine <http://emudevs.com/>
+* This program is free software licensed under GPL version 3
+* Please see the included DOCS/LICENSE.md for more information
+*/
+
+#ifndef _FORGE_METRICS_H
+#define _FORGE_METRICS_H
+
+#include <memory>
+#include <string>
+#include "Common.h"
+
+extern "C"
+{
+#include "lua.h"
+};
+
+/*
+ * Process wide counters of the scripting internals, served in the Prometheus
+ *   text format by a small HTTP server for monitoring.
+ *
+ * The counters are relaxed atomics summed over all Lua states, so recording
+ *   and scraping take no locks and a scrape never waits for a running script.
+ *   Nothing is recorded until `Start` brought up the server.
+ *
+ * Hooks are counted per binding family, e.g. "PlayerEvent". Family names
+ *   must be string literals, they are kept by pointer.
+ */
+namespace ForgeMetrics
+{
+    // Serves the metrics at http://address:port/metrics until Stop is called.
+    // Returns false and records nothing if the address can't be bound.
+    bool Start(std::string const& address, uint16 port);
+    void Stop();
+
+    bool IsEnabled();
+
+    // A call of an event handler that took `ticks` HookClock ticks
+    void RecordHook(const char* family, uint64 ticks);
+    // A Lua error, `family` is NULL for errors outside of event handlers
+    void RecordError(const char* family);
+
+    // Timed events indexed and unindexed by their processors, so events that finished
+    //  or were removed are no longer counted, even while their memory is pooled
+    void AddTimers(int32 delta);
+    void RecordTimerCall();
+
+    // Lua states publish the change of their heap size since the last call
+    void AddLuaHeap(int64 delta);
+    // Counts the garbage collection cycles of L from now on
+    void WatchGarbageCollector(lua_State* L);
+
+    // Counts a database query as pending until the last copy of the returned handle is gone
+    std::shared_ptr<void> TrackQuery();
+
+    // The metrics in the Prometheus text exposition format
+    std::string Format();
+}
+
+#endif // _FORGE_METRICS_H
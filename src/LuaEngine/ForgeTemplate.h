@@ -17,6 +17,9 @@ extern "C"
 #include "ForgeCompat.h"
 #include "ForgeUtility.h"
 #include "SharedDefines.h"
+#include <atomic>
+#include <new>
+#include <type_traits>
 
 class ForgeGlobal
 {
@@ -26,6 +29,9 @@ public:
         luaL_Reg* l = static_cast<luaL_Reg*>(lua_touserdata(L, lua_upvalueindex(1)));
         int top = lua_gettop(L);
         int expected = l->func(L);
+        // Lua 5.1 lua_yield returns -1, the results are passed by the resume
+        if (expected < 0)
+            return expected;
         int args = lua_gettop(L) - top;
         if (args < 0 || args > expected)
         {
@@ -59,20 +65,20 @@ class ForgeObject
 {
 public:
     template<typename T>
-    ForgeObject(T * obj, bool manageMemory);
+    ForgeObject(Forge* E, T * obj, bool manageMemory);
 
-    ~ForgeObject()
-    {
-    }
+    ~ForgeObject() = default;
 
     // Get wrapped object pointer
     void* GetObj() const { return object; }
     // Returns whether the object is valid or not
-    bool IsValid() const { return !callstackid || callstackid == sForge->GetCallstackId(); }
+    bool IsValid() const { return !callstackid || (E && callstackid == E->GetCallstackId()); }
     // Returns whether the object can be invalidated or not
     bool CanInvalidate() const { return _invalidate; }
     // Returns pointer to the wrapped object's type name
     const char* GetTypeName() const { return type_name; }
+    // Returns the ForgeObjectCache destroy epoch at the time the userdata was created
+    uint32 GetDestroyEpoch() const { return destroyEpoch; }
 
     // Sets the object pointer that is wrapped
     void SetObj(void* obj)
@@ -86,8 +92,8 @@ public:
     {
         ASSERT(!valid || (valid && object));
         if (valid)
-            if (CanInvalidate())
-                callstackid = sForge->GetCallstackId();
+            if (CanInvalidate() && E)
+                callstackid = E->GetCallstackId();
             else
                 callstackid = 0;
         else
@@ -96,7 +102,11 @@ public:
     // Sets whether the pointer will be invalidated at end of calls
     void SetValidation(bool invalidate)
     {
+        // A valid object is kept for good, or again only until the current call stack ends
+        bool valid = IsValid();
         _invalidate = invalidate;
+        if (valid)
+            SetValid(true);
     }
     // Invalidates the pointer if it should be invalidated
     void Invalidate()
@@ -106,12 +116,66 @@ public:
     }
 
 private:
+    // The state the object was pushed to, its call stack decides validity.
+    // NULL for values owned by lua, those are never invalidated.
+    Forge* E;
     uint64 callstackid;
     bool _invalidate;
+    uint32 destroyEpoch;
     void* object;
     const char* type_name;
 };
 
+/*
+ * A weak-valued registry table that maps wrapped object pointers to the
+ *   userdata that was last pushed for them.
+ *
+ * Pushing the same object again during the same call stack returns the cached
+ *   userdata instead of allocating a new one. Entries left over from older call
+ *   stacks fail the validity check in `ForgeTemplate<T>::Push` and are replaced.
+ *
+ * Destroying any object bumps a process wide epoch and entries created before
+ *   it are not reused, so an object created at the same address during the same
+ *   call stack gets new userdata. Objects are destroyed on every map thread, and
+ *   a bump is only an atomic increment where removing the entry would need the
+ *   lock of each state the object was pushed to.
+ */
+class ForgeObjectCache
+{
+public:
+    // Creates the cache table, must be called once after creating the Lua state
+    static void Create(lua_State* L)
+    {
+        lua_pushlightuserdata(L, &key);
+        lua_newtable(L);
+        // Stack: key, cache
+
+        lua_newtable(L);
+        lua_pushstring(L, "v");
+        lua_setfield(L, -2, "__mode");
+        lua_setmetatable(L, -2);
+
+        lua_rawset(L, LUA_REGISTRYINDEX);
+        // Stack: (empty)
+    }
+
+    // Pushes the cache table onto the stack
+    static void Push(lua_State* L)
+    {
+        lua_pushlightuserdata(L, &key);
+        lua_rawget(L, LUA_REGISTRYINDEX);
+    }
+
+    // Called when any object is destroyed, cached userdata created before is not reused
+    static void OnObjectDestroyed() { destroyEpoch.fetch_add(1, std::memory_order_relaxed); }
+    static uint32 GetDestroyEpoch() { return destroyEpoch.load(std::memory_order_relaxed); }
+
+private:
+    // Only the address is used, as the registry key of the cache table
+    static char key;
+    static std::atomic<uint32> destroyEpoch;
+};
+
 template<typename T>
 struct ForgeRegister
 {
@@ -142,8 +206,13 @@ public:
         // pop nil
         lua_pop(E->L, 1);
 
-        tname = name;
-        manageMemory = gc;
+        // Every state registers the same types, map states are only created
+        // after the global state has set these
+        if (!tname)
+        {
+            tname = name;
+            manageMemory = gc;
+        }
 
         // create metatable for userdata of this type
         luaL_newmetatable(E->L, tname);
@@ -153,13 +222,22 @@ public:
         lua_pushvalue(E->L, metatable);
         lua_setglobal(E->L, tname);
 
+        // store the metatable under a per type light userdata key as well,
+        // so pushing objects doesn't need to hash the type name
+        lua_pushlightuserdata(E->L, &tname);
+        lua_pushvalue(E->L, metatable);
+        lua_rawset(E->L, LUA_REGISTRYINDEX);
+
         // tostring
         lua_pushcfunction(E->L, ToString);
         lua_setfield(E->L, metatable, "__tostring");
 
-        // garbage collecting
-        lua_pushcfunction(E->L, CollectGarbage);
-        lua_setfield(E->L, metatable, "__gc");
+        // garbage collecting, inline values pushed with PushValue own nothing to free
+        if (gc || !std::is_arithmetic<T>::value)
+        {
+            lua_pushcfunction(E->L, CollectGarbage);
+            lua_setfield(E->L, metatable, "__gc");
+        }
 
         // make methods accessible through metatable
         lua_pushvalue(E->L, metatable);
@@ -237,8 +315,7 @@ public:
         ASSERT(methodTable);
 
         // get metatable
-        lua_pushstring(E->L, tname);
-        lua_rawget(E->L, LUA_REGISTRYINDEX);
+        PushMetatable(E->L);
         ASSERT(lua_istable(E->L, -1));
 
         for (; methodTable && methodTable->name && methodTable->mfunc; ++methodTable)
@@ -252,6 +329,13 @@ public:
         lua_pop(E->L, 1);
     }
 
+    // Pushes the metatable of this type onto the stack
+    static void PushMetatable(lua_State* L)
+    {
+        lua_pushlightuserdata(L, &tname);
+        lua_rawget(L, LUA_REGISTRYINDEX);
+    }
+
     static int Push(lua_State* L, T const* obj)
     {
         if (!obj)
@@ -260,19 +344,85 @@ public:
             return 1;
         }
 
-        // Create new userdata
-        ForgeObject** ptrHold = static_cast<ForgeObject**>(lua_newuserdata(L, sizeof(ForgeObject*)));
+        int top = lua_gettop(L);
+
+        // Objects owned by lua are never shared, everything else
+        // is reused if it was already pushed during this call stack
+        bool cacheable = !manageMemory;
+        if (cacheable)
+        {
+            ForgeObjectCache::Push(L);
+            lua_pushlightuserdata(L, const_cast<T*>(obj));
+            lua_rawget(L, -2);
+            // Stack: cache, userdata or nil
+
+            if (ForgeObject* forgeObj = static_cast<ForgeObject*>(lua_touserdata(L, -1)))
+            {
+                if (forgeObj->GetTypeName() == tname && forgeObj->CanInvalidate() && forgeObj->IsValid() &&
+                    forgeObj->GetDestroyEpoch() == ForgeObjectCache::GetDestroyEpoch())
+                {
+                    lua_remove(L, -2);
+                    // Stack: userdata
+                    return 1;
+                }
+            }
+            lua_pop(L, 1);
+            // Stack: cache
+        }
+
+        // Create new userdata, the ForgeObject is stored inline in it
+        void* ptrHold = lua_newuserdata(L, sizeof(ForgeObject));
         if (!ptrHold)
         {
             FORGE_LOG_ERROR("{} could not create new userdata", tname);
+            lua_settop(L, top);
             lua_pushnil(L);
             return 1;
         }
-        *ptrHold = new ForgeObject(const_cast<T*>(obj), manageMemory);
+        new (ptrHold) ForgeObject(Forge::GetForge(L), const_cast<T*>(obj), manageMemory);
 
         // Set metatable for it
-        lua_pushstring(L, tname);
-        lua_rawget(L, LUA_REGISTRYINDEX);
+        PushMetatable(L);
+        if (!lua_istable(L, -1))
+        {
+            FORGE_LOG_ERROR("{} missing metatable", tname);
+            lua_settop(L, top);
+            lua_pushnil(L);
+            return 1;
+        }
+        lua_setmetatable(L, -2);
+
+        if (cacheable)
+        {
+            // Stack: cache, userdata
+            lua_pushlightuserdata(L, const_cast<T*>(obj));
+            lua_pushvalue(L, -2);
+            lua_rawset(L, -4);
+            lua_remove(L, -2);
+            // Stack: userdata
+        }
+        return 1;
+    }
+
+    // Pushes a copy of value, stored inline right after the ForgeObject in the same userdata.
+    // The userdata is owned by lua and never invalidated, so nothing is allocated or freed in C++.
+    static int PushValue(lua_State* L, T const& value)
+    {
+        static_assert(std::is_arithmetic<T>::value, "PushValue is meant for plain values");
+        static_assert(std::is_trivially_destructible<ForgeObject>::value, "values pushed with PushValue are not finalized");
+
+        void* ptrHold = lua_newuserdata(L, sizeof(ForgeObject) + sizeof(T));
+        if (!ptrHold)
+        {
+            FORGE_LOG_ERROR("{} could not create new userdata", tname);
+            lua_pushnil(L);
+            return 1;
+        }
+        T* valueHold = new (static_cast<char*>(ptrHold) + sizeof(ForgeObject)) T(value);
+        new (ptrHold) ForgeObject(NULL, valueHold, true);
+
+        // Set metatable for it
+        PushMetatable(L);
         if (!lua_istable(L, -1))
         {
             FORGE_LOG_ERROR("{} missing metatable", tname);
@@ -330,6 +480,8 @@ public:
         ForgeRegister<T>* l = static_cast<ForgeRegister<T>*>(lua_touserdata(L, lua_upvalueindex(1)));
         int top = lua_gettop(L);
         int expected = l->mfunc(L, obj);
+        if (expected < 0)
+            return expected;
         int args = lua_gettop(L) - top;
         if (args < 0 || args > expected)
         {
@@ -347,9 +499,12 @@ public:
     {
         // Get object pointer (and check type, no error)
         ForgeObject* obj = Forge::CHECKOBJ<ForgeObject>(L, 1, false);
-        if (obj && manageMemory)
+        if (!obj)
+            return 0;
+        if (manageMemory)
             delete static_cast<T*>(obj->GetObj());
-        delete obj;
+        // The userdata memory itself is owned by lua
+        obj->~ForgeObject();
         return 0;
     }
 
@@ -378,7 +533,7 @@ public:
 };
 
 template<typename T>
-ForgeObject::ForgeObject(T * obj, bool manageMemory) : callstackid(1), _invalidate(!manageMemory), object(obj), type_name(ForgeTemplate<T>::tname)
+ForgeObject::ForgeObject(Forge* E, T * obj, bool manageMemory) : E(E), callstackid(1), _invalidate(!manageMemory), destroyEpoch(ForgeObjectCache::GetDestroyEpoch()), object(obj), type_name(ForgeTemplate<T>::tname)
 {
     SetValid(true);
 }
@@ -12,6 +12,7 @@
 #include <mutex>
 #include <memory>
 #include "Common.h"
+#include "LockStats.h"
 #include "SharedDefines.h"
 #include "ObjectGuid.h"
 #ifdef TRINITY
@@ -133,15 +134,18 @@ namespace ForgeUtil
     /*
      * Usage:
      * Inherit this class, then when needing lock, use
-     * Guard guard(GetLock());
+     * Guard guard(GetLock(), __FUNCTION__);
      *
-     * The lock is automatically released at end of scope
+     * The lock is automatically released at end of scope.
+     * `lockName` and the call site are used by LockStats.
      */
     class Lockable
     {
     public:
-        typedef std::mutex LockType;
-        typedef std::lock_guard<LockType> Guard;
+        typedef InstrumentedLock<std::mutex> LockType;
+        typedef TaggedGuard<LockType> Guard;
+
+        Lockable(const char* lockName) : _lock(lockName) { }
 
         LockType& GetLock() { return _lock; }
 
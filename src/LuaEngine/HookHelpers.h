@@ -10,6 +10,20 @@
 #include "LuaEngine.h"
 #include "ForgeUtility.h"
 
+/*
+ * Pushes the event handlers bound to `key` and remembers which bindings they
+ *   came from, so `CallOneFunction` can attribute each call to its binding.
+ */
+template<typename K>
+void Forge::PushHookRefs(BindingMap<K>* bindings, const K& key)
+{
+    hookBindingIds.clear();
+    bindings->PushRefsFor(key, &hookBindingIds);
+
+    for (uint64 id : hookBindingIds)
+        hookCalls.push_back(HookCall(bindings, static_cast<uint32>(key.event_id), id));
+}
+
 /*
  * Sets up the stack so that event handlers can be called.
  *
@@ -34,9 +48,10 @@ int Forge::SetupStack(BindingMap<K1>* bindings1, BindingMap<K2>* bindings2, cons
     lua_insert(L, first_argument_index);
     // Stack: event_id, [arguments]
 
-    bindings1->PushRefsFor(key1);
+    hookFrames.push_back(hookCalls.size());
+    PushHookRefs(bindings1, key1);
     if (bindings2)
-        bindings2->PushRefsFor(key2);
+        PushHookRefs(bindings2, key2);
     // Stack: event_id, [arguments], [functions]
 
     int number_of_functions = lua_gettop(L) - arguments_top;
@@ -0,0 +1,443 @@
+/*
+* Copyright (C) 2010 - 2016 Forge Lua Engine <http://emudevs.com/>
+* This program is free software licensed under GPL version 3
+* Please see the included DOCS/LICENSE.md for more information
+*/
+
+#include "HookStats.h"
+#include "BindingMap.h"
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <mutex>
+#include <sstream>
+#include <thread>
+
+#if defined(_MSC_VER) && (defined(_M_X64) || defined(_M_IX86))
+#include <intrin.h>
+#define FORGE_HOOK_CLOCK_TSC
+#elif (defined(__GNUC__) || defined(__clang__)) && (defined(__x86_64__) || defined(__i386__))
+#include <x86intrin.h>
+#define FORGE_HOOK_CLOCK_TSC
+#endif
+
+namespace
+{
+    uint64 SteadyNanoseconds()
+    {
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+    }
+
+    uint64 SteadyMilliseconds()
+    {
+        return std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+    }
+
+    // Measured once by HookClock::Calibrate, read from every thread that reports times
+    std::once_flag calibrated;
+    std::atomic<double> nanosecondsPerTick(0.0);
+
+    // How long Calibrate measures the tick rate for
+    const uint64 CALIBRATION_NANOSECONDS = 10000000;
+
+    uint32 HighestBit(uint64 value)
+    {
+#if defined(__GNUC__) || defined(__clang__)
+        return 63 - __builtin_clzll(value);
+#else
+        uint32 bit = 0;
+        while (value >>= 1)
+            ++bit;
+        return bit;
+#endif
+    }
+}
+
+uint64 HookClock::Now()
+{
+#ifdef FORGE_HOOK_CLOCK_TSC
+    return __rdtsc();
+#else
+    return SteadyNanoseconds();
+#endif
+}
+
+void HookClock::Calibrate()
+{
+    std::call_once(calibrated, []
+    {
+#ifdef FORGE_HOOK_CLOCK_TSC
+        uint64 startTicks = Now();
+        uint64 startNanoseconds = SteadyNanoseconds();
+        std::this_thread::sleep_for(std::chrono::nanoseconds(CALIBRATION_NANOSECONDS));
+
+        // Sleeps can end early on some platforms, the rate needs the full interval
+        uint64 elapsedNanoseconds = SteadyNanoseconds() - startNanoseconds;
+        while (elapsedNanoseconds < CALIBRATION_NANOSECONDS)
+            elapsedNanoseconds = SteadyNanoseconds() - startNanoseconds;
+
+        uint64 elapsedTicks = Now() - startTicks;
+        nanosecondsPerTick.store(double(elapsedNanoseconds) / double(elapsedTicks), std::memory_order_release);
+#else
+        nanosecondsPerTick.store(1.0, std::memory_order_release);
+#endif
+    });
+}
+
+double HookClock::TicksToMicroseconds(uint64 ticks)
+{
+    double rate = nanosecondsPerTick.load(std::memory_order_acquire);
+    if (!rate)
+    {
+        // Only before Forge::Initialize, as in tools that use the clock on their own
+        Calibrate();
+        rate = nanosecondsPerTick.load(std::memory_order_acquire);
+    }
+    return double(ticks) * rate / 1000.0;
+}
+
+LatencyHistogram::LatencyHistogram()
+{
+    Reset();
+}
+
+void LatencyHistogram::Reset()
+{
+    std::fill(buckets, buckets + BUCKET_COUNT, 0);
+    count = 0;
+    total = 0;
+    max = 0;
+}
+
+void LatencyHistogram::Record(uint64 value)
+{
+    ++buckets[GetBucketIndex(value)];
+    ++count;
+    total += value;
+    if (value > max)
+        max = value;
+}
+
+uint32 LatencyHistogram::GetBucketIndex(uint64 value)
+{
+    if (value < SUB_BUCKET_COUNT)
+        return static_cast<uint32>(value);
+
+    uint32 bit = HighestBit(value);
+    if (bit >= MAX_VALUE_BITS)
+        return BUCKET_COUNT - 1;
+
+    // The highest bit picks the group, the bits below it the bucket within the group
+    uint32 shift = bit - SUB_BUCKET_BITS;
+    uint32 group = shift + 1;
+    return group * SUB_BUCKET_COUNT + static_cast<uint32>((value >> shift) & (SUB_BUCKET_COUNT - 1));
+}
+
+uint64 LatencyHistogram::GetBucketUpperBound(uint32 index)
+{
+    if (index < SUB_BUCKET_COUNT)
+        return index;
+
+    uint32 shift = index / SUB_BUCKET_COUNT - 1;
+    uint64 lower = uint64(SUB_BUCKET_COUNT + index % SUB_BUCKET_COUNT) << shift;
+    return lower + (uint64(1) << shift) - 1;
+}
+
+uint64 LatencyHistogram::GetPercentile(double percentile) const
+{
+    if (!count)
+        return 0;
+
+    uint64 wanted = static_cast<uint64>(percentile / 100.0 * double(count) + 0.5);
+    if (wanted < 1)
+        wanted = 1;
+    if (wanted > count)
+        wanted = count;
+
+    uint64 seen = 0;
+    for (uint32 i = 0; i < BUCKET_COUNT; ++i)
+    {
+        seen += buckets[i];
+        if (seen >= wanted)
+            return std::min(GetBucketUpperBound(i), max);
+    }
+    return max;
+}
+
+HookCall::HookCall(BindingMapBase* bindings, uint32 event_id, uint64 binding_id) :
+    bindings(bindings),
+    family(bindings ? bindings->GetName() : ""),
+    event_id(event_id),
+    binding_id(binding_id)
+{ }
+
+std::size_t HookStats::KeyHash::operator()(Key const& key) const
+{
+    std::size_t seed = std::hash<const void*>()(key.family);
+    seed ^= std::hash<uint32>()(key.event_id) + 0x9e3779b9 + (seed << 6) + (seed >> 2);
+    seed ^= std::hash<uint64>()(key.binding_id) + 0x9e3779b9 + (seed << 6) + (seed >> 2);
+    return seed;
+}
+
+HookStats::HookStats() : enabled(false), pruneSize(MIN_PRUNE_SIZE)
+{
+}
+
+HookStats::Entry& HookStats::GetEntry(const HookCall& call)
+{
+    Key key = { call.family, call.event_id, call.binding_id };
+    Entry& entry = entries[key];
+    entry.bindings = call.bindings;
+    return entry;
+}
+
+void HookStats::Prune()
+{
+    if (entries.size() < pruneSize)
+        return;
+
+    for (auto itr = entries.begin(); itr != entries.end();)
+    {
+        if (itr->second.bindings->Contains(itr->first.binding_id))
+            ++itr;
+        else
+            itr = entries.erase(itr);
+    }
+
+    pruneSize = entries.size() * 2 > MIN_PRUNE_SIZE ? entries.size() * 2 : MIN_PRUNE_SIZE;
+}
+
+void HookStats::Reset()
+{
+    for (auto& entry : entries)
+        entry.second.histogram.Reset();
+}
+
+void HookStats::Clear()
+{
+    entries.clear();
+    pruneSize = MIN_PRUNE_SIZE;
+}
+
+std::vector<HookStats::Summary> HookStats::GetTop(size_t count, SortOrder order) const
+{
+    std::vector<Summary> summaries;
+    summaries.reserve(entries.size());
+
+    for (auto const& entry : entries)
+    {
+        LatencyHistogram const& histogram = entry.second.histogram;
+        if (!histogram.GetCount())
+            continue;
+
+        Summary summary;
+        summary.family = entry.first.family;
+        summary.event_id = entry.first.event_id;
+        summary.binding_id = entry.first.binding_id;
+        summary.source = entry.second.source;
+        summary.calls = histogram.GetCount();
+        summary.total_us = HookClock::TicksToMicroseconds(histogram.GetTotal());
+        summary.avg_us = summary.total_us / double(summary.calls);
+        summary.p50_us = HookClock::TicksToMicroseconds(histogram.GetPercentile(50.0));
+        summary.p99_us = HookClock::TicksToMicroseconds(histogram.GetPercentile(99.0));
+        summary.max_us = HookClock::TicksToMicroseconds(histogram.GetMax());
+        summaries.push_back(summary);
+    }
+
+    std::sort(summaries.begin(), summaries.end(), [order](Summary const& lhs, Summary const& rhs)
+    {
+        if (order == SORT_BY_P99)
+            return lhs.p99_us > rhs.p99_us;
+        return lhs.total_us > rhs.total_us;
+    });
+
+    if (summaries.size() > count)
+        summaries.resize(count);
+    return summaries;
+}
+
+std::size_t HookBreaker::KeyHash::operator()(Key const& key) const
+{
+    std::size_t seed = std::hash<const void*>()(key.bindings);
+    seed ^= std::hash<uint64>()(key.binding_id) + 0x9e3779b9 + (seed << 6) + (seed >> 2);
+    return seed;
+}
+
+HookBreaker::HookBreaker() : errorLimit(0), errorWindowMs(0)
+{
+}
+
+void HookBreaker::Configure(uint32 errorLimit, uint32 errorWindowMs)
+{
+    this->errorLimit = errorLimit;
+    this->errorWindowMs = errorWindowMs;
+}
+
+bool HookBreaker::ShouldSkip(const HookCall& call) const
+{
+    if (health.empty())
+        return false;
+
+    Key key = { call.bindings, call.binding_id };
+    auto itr = health.find(key);
+    if (itr == health.end() || !itr->second.backoffUntil)
+        return false;
+
+    return itr->second.backoffUntil > SteadyMilliseconds();
+}
+
+void HookBreaker::OnSuccess(const HookCall& call)
+{
+    if (health.empty())
+        return;
+
+    Key key = { call.bindings, call.binding_id };
+    auto itr = health.find(key);
+    if (itr == health.end())
+        return;
+
+    itr->second.consecutiveErrors = 0;
+    itr->second.backoffUntil = 0;
+}
+
+HookBreaker::ErrorResult HookBreaker::OnError(const HookCall& call)
+{
+    uint64 now = SteadyMilliseconds();
+
+    Key key = { call.bindings, call.binding_id };
+    auto itr = health.find(key);
+    if (itr == health.end())
+    {
+        Health fresh = { now, 0, 0, 0, 0, 0 };
+        itr = health.emplace(key, fresh).first;
+    }
+    Health& h = itr->second;
+
+    if (now - h.windowStart >= errorWindowMs)
+    {
+        h.windowStart = now;
+        h.windowErrors = 0;
+    }
+    ++h.windowErrors;
+    ++h.consecutiveErrors;
+
+    if (h.consecutiveErrors >= 2)
+    {
+        uint32 shift = std::min<uint32>(h.consecutiveErrors - 2, 16);
+        h.backoffUntil = now + std::min<uint64>(uint64(BACKOFF_BASE_MS) << shift, BACKOFF_MAX_MS);
+    }
+
+    ErrorResult result;
+    result.log = now >= h.nextLogTime;
+    result.suppressed = 0;
+    if (result.log)
+    {
+        result.suppressed = h.suppressed;
+        h.suppressed = 0;
+        h.nextLogTime = now + LOG_INTERVAL_MS;
+    }
+    else
+        ++h.suppressed;
+
+    result.windowErrors = h.windowErrors;
+    result.disable = errorLimit && h.windowErrors >= errorLimit;
+    if (result.disable)
+        health.erase(itr);
+    return result;
+}
+
+void HookBreaker::Clear()
+{
+    health.clear();
+}
+
+std::size_t HookWatchdog::KeyHash::operator()(Key const& key) const
+{
+    std::size_t seed = std::hash<const void*>()(key.family);
+    seed ^= std::hash<uint32>()(key.event_id) + 0x9e3779b9 + (seed << 6) + (seed >> 2);
+    return seed;
+}
+
+HookWatchdog::HookWatchdog() : defaultTimeout(0), state({ 0, 0, false })
+{
+}
+
+std::vector<std::string> HookWatchdog::Configure(uint32 defaultTimeoutMs, std::string const& overrides)
+{
+    defaultTimeout = defaultTimeoutMs;
+    overrideTimeouts.clear();
+    timeouts.clear();
+
+    std::string list = overrides;
+    std::replace(list.begin(), list.end(), ',', ' ');
+
+    std::vector<std::string> invalid;
+    std::istringstream entries(list);
+    std::string entry;
+    while (entries >> entry)
+    {
+        size_t separator = entry.find('=');
+        if (separator == 0 || separator == std::string::npos || separator + 1 == entry.size() || entry.size() - separator - 1 > 9 ||
+            entry.find_first_not_of("0123456789", separator + 1) != std::string::npos)
+        {
+            invalid.push_back(entry);
+            continue;
+        }
+
+        overrideTimeouts[entry.substr(0, separator)] = std::stoul(entry.substr(separator + 1));
+    }
+    return invalid;
+}
+
+uint32 HookWatchdog::GetTimeout(const HookCall* call)
+{
+    if (!call || overrideTimeouts.empty())
+        return defaultTimeout;
+
+    Key key = { call->family, call->event_id };
+    auto itr = timeouts.find(key);
+    if (itr != timeouts.end())
+        return itr->second;
+
+    uint32 timeout = defaultTimeout;
+    auto familyItr = overrideTimeouts.find(call->family);
+    if (familyItr != overrideTimeouts.end())
+        timeout = familyItr->second;
+
+    auto eventItr = overrideTimeouts.find(std::string(call->family) + "." + std::to_string(call->event_id));
+    if (eventItr != overrideTimeouts.end())
+        timeout = eventItr->second;
+
+    timeouts.emplace(key, timeout);
+    return timeout;
+}
+
+HookWatchdog::State HookWatchdog::Arm(uint32 timeoutMs)
+{
+    State previous = state;
+    uint64 deadline = SteadyMilliseconds() + timeoutMs;
+    if (!state.deadline || deadline < state.deadline)
+        state = { deadline, timeoutMs, false };
+    return previous;
+}
+
+bool HookWatchdog::OnHook()
+{
+    if (!state.deadline)
+        return false;
+
+    uint64 now = SteadyMilliseconds();
+    if (now < state.deadline)
+        return false;
+
+    // The first error can be caught, the call carries on for the grace time
+    if (!state.raised)
+    {
+        state.raised = true;
+        state.deadline = now + state.grace;
+    }
+    else
+        state.grace = 0;
+    return true;
+}
@@ -0,0 +1,346 @@
+/*
+* Copyright (C) 2010 - 2016 Forge Lua Engine <http://emudevs.com/>
+* This program is free software licensed under GPL version 3
+* Please see the included DOCS/LICENSE.md for more information
+*/
+
+#ifndef _HOOK_STATS_H
+#define _HOOK_STATS_H
+
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include "Common.h"
+
+class BindingMapBase;
+
+/*
+ * A cheap monotonic clock for timing event handlers.
+ *
+ * Uses the CPU timestamp counter where available and falls back to
+ *   std::chrono::steady_clock. Ticks are converted to time only when
+ *   reporting, using a rate measured against steady_clock once at startup.
+ */
+namespace HookClock
+{
+    uint64 Now();
+
+    // Measures the tick rate against steady_clock, sleeping about 10 ms the first time.
+    // Called by Forge::Initialize, later calls return right away.
+    void Calibrate();
+
+    // Never waits once calibrated, safe to call from any thread
+    double TicksToMicroseconds(uint64 ticks);
+}
+
+/*
+ * A log-linear latency histogram in the spirit of HdrHistogram.
+ *
+ * Values are bucketed by their highest set bit and the SUB_BUCKET_BITS bits
+ *   below it, so a value read back from the histogram is at most 1/16 (6.25%)
+ *   larger than the value that was recorded.
+ */
+class LatencyHistogram
+{
+public:
+    static const uint32 SUB_BUCKET_BITS = 4;
+    static const uint32 SUB_BUCKET_COUNT = 1 << SUB_BUCKET_BITS;
+    // Values with more significant bits are recorded in the last bucket
+    static const uint32 MAX_VALUE_BITS = 48;
+    static const uint32 BUCKET_COUNT = (MAX_VALUE_BITS - SUB_BUCKET_BITS + 1) * SUB_BUCKET_COUNT;
+
+    LatencyHistogram();
+
+    void Record(uint64 value);
+    void Reset();
+
+    uint64 GetCount() const { return count; }
+    uint64 GetTotal() const { return total; }
+    uint64 GetMax() const { return max; }
+
+    /*
+     * Returns the smallest bucket bound that `percentile` percent of the
+     *   recorded values are less than or equal to.
+     */
+    uint64 GetPercentile(double percentile) const;
+
+    static uint32 GetBucketIndex(uint64 value);
+    static uint64 GetBucketUpperBound(uint32 index);
+
+private:
+    uint64 buckets[BUCKET_COUNT];
+    uint64 count;
+    uint64 total;
+    uint64 max;
+};
+
+/*
+ * Identifies one event handler call: the binding map it came from (and so
+ *   its family, like "PlayerEvent"), the event ID and the binding ID.
+ */
+struct HookCall
+{
+    BindingMapBase* bindings;
+    const char* family;
+    uint32 event_id;
+    uint64 binding_id;
+
+    HookCall(BindingMapBase* bindings, uint32 event_id, uint64 binding_id);
+};
+
+/*
+ * Latency histograms of every event handler that has been called,
+ *   keyed by `HookCall`.
+ *
+ * Only accessed while holding the lock of the owning state, see Forge::GetStateLock.
+ */
+class HookStats
+{
+public:
+    struct Entry
+    {
+        // "source:line" of the handler function, filled in by the first caller
+        std::string source;
+        LatencyHistogram histogram;
+        // The map of the handler's binding, to find out when it's gone
+        BindingMapBase* bindings;
+    };
+
+    struct Summary
+    {
+        const char* family;
+        uint32 event_id;
+        uint64 binding_id;
+        std::string source;
+        uint64 calls;
+        double total_us;
+        double avg_us;
+        double p50_us;
+        double p99_us;
+        double max_us;
+    };
+
+    enum SortOrder
+    {
+        SORT_BY_TOTAL,
+        SORT_BY_P99
+    };
+
+    HookStats();
+
+    bool IsEnabled() const { return enabled; }
+    void SetEnabled(bool enable) { enabled = enable; }
+
+    /*
+     * Returns the entry for `call`, creating an empty one on first use.
+     *
+     * Entries are only erased by `Prune` and `Clear`, which don't run while a
+     *   handler does, so the reference stays valid while the handler runs,
+     *   even if it triggers other hooks.
+     */
+    Entry& GetEntry(const HookCall& call);
+
+    /*
+     * Erases the entries of handlers whose binding was removed or ran out of
+     *   shots, binding IDs are never reused so they would only pile up.
+     *
+     * Only sweeps once the entries doubled since the last sweep, so it can be
+     *   called after every hook. Only safe when no handler is running.
+     */
+    void Prune();
+
+    // Zeroes all histograms but keeps the entries
+    void Reset();
+
+    // Removes all entries, only safe when no handler is running
+    void Clear();
+
+    std::vector<Summary> GetTop(size_t count, SortOrder order) const;
+
+private:
+    struct Key
+    {
+        const char* family;
+        uint32 event_id;
+        uint64 binding_id;
+
+        bool operator==(Key const& other) const
+        {
+            return family == other.family && event_id == other.event_id && binding_id == other.binding_id;
+        }
+    };
+
+    struct KeyHash
+    {
+        std::size_t operator()(Key const& key) const;
+    };
+
+    static const size_t MIN_PRUNE_SIZE = 256;
+
+    bool enabled;
+    std::unordered_map<Key, Entry, KeyHash> entries;
+    // Prune sweeps once `entries` reaches this size
+    size_t pruneSize;
+};
+
+/*
+ * A circuit breaker for event handlers that keep raising errors.
+ *
+ * After two errors in a row a handler is skipped for a backoff period that
+ *   doubles with every further error, and is reset by a successful call.
+ *   A handler raising `errorLimit` errors within the error window is disabled.
+ *   Error messages of one handler are logged at most once per LOG_INTERVAL_MS,
+ *   with the count of the errors suppressed in between.
+ *
+ * Only accessed while holding the lock of the owning state, see Forge::GetStateLock.
+ */
+class HookBreaker
+{
+public:
+    static const uint32 BACKOFF_BASE_MS = 100;
+    static const uint32 BACKOFF_MAX_MS = 30000;
+    static const uint32 LOG_INTERVAL_MS = 10000;
+
+    struct ErrorResult
+    {
+        // Whether the error message should be logged
+        bool log;
+        // The amount of errors not logged since the last logged one
+        uint32 suppressed;
+        // Whether the handler should be disabled
+        bool disable;
+        // The amount of errors within the current error window
+        uint32 windowErrors;
+    };
+
+    HookBreaker();
+
+    // `errorLimit` of 0 never disables handlers
+    void Configure(uint32 errorLimit, uint32 errorWindowMs);
+
+    uint32 GetErrorLimit() const { return errorLimit; }
+    uint32 GetErrorWindow() const { return errorWindowMs; }
+
+    // Returns true if the handler is backing off and should not be called now
+    bool ShouldSkip(const HookCall& call) const;
+
+    void OnSuccess(const HookCall& call);
+    ErrorResult OnError(const HookCall& call);
+
+    // Removes all state, must be called when the binding maps are destroyed
+    void Clear();
+
+private:
+    struct Key
+    {
+        BindingMapBase* bindings;
+        uint64 binding_id;
+
+        bool operator==(Key const& other) const
+        {
+            return bindings == other.bindings && binding_id == other.binding_id;
+        }
+    };
+
+    struct KeyHash
+    {
+        std::size_t operator()(Key const& key) const;
+    };
+
+    struct Health
+    {
+        uint64 windowStart;
+        uint32 windowErrors;
+        uint32 consecutiveErrors;
+        uint64 backoffUntil;
+        uint64 nextLogTime;
+        uint32 suppressed;
+    };
+
+    uint32 errorLimit;
+    uint32 errorWindowMs;
+    // Only handlers that have raised errors have an entry
+    std::unordered_map<Key, Health, KeyHash> health;
+};
+
+/*
+ * Time limits for Lua calls, so that a runaway handler can't freeze the server.
+ *
+ * While a call is armed Forge installs a count hook, which raises an error
+ *   once the deadline has passed. A handler can catch that error with pcall
+ *   and recover, the call then gets its timeout again as grace. Past the grace
+ *   the error is raised on every instruction until the call returns, so a handler
+ *   can't keep running by catching it in a loop.
+ *   Nested calls never extend the deadline of the call they run in.
+ *
+ * LuaJIT doesn't call hooks from compiled code, so a loop it has compiled
+ *   is not stopped. Loops that call functions it can't compile are.
+ *
+ * Timeouts are configured in milliseconds, with a default for all calls and
+ *   overrides per event family ("ServerEvent") or event ("PlayerEvent.42").
+ *
+ * Only accessed while holding the lock of the owning state, see Forge::GetStateLock.
+ */
+class HookWatchdog
+{
+public:
+    HookWatchdog();
+
+    /*
+     * Parses `overrides`, a list of "Family=ms" and "Family.event=ms" entries separated
+     *   by spaces or commas. Returns the entries that could not be parsed.
+     *   A timeout of 0 disables the watchdog.
+     */
+    std::vector<std::string> Configure(uint32 defaultTimeoutMs, std::string const& overrides);
+
+    // Returns the timeout for a call to the handler `call`, or for any other call if it is NULL
+    uint32 GetTimeout(const HookCall* call);
+
+    // What Arm replaces, to pass to `Restore` when the call returns
+    struct State
+    {
+        // Steady clock milliseconds, 0 if not armed
+        uint64 deadline;
+        // The timeout of the armed call, given again as grace after the first error, 0 once that is over
+        uint32 grace;
+        bool raised;
+    };
+
+    uint64 GetDeadline() const { return state.deadline; }
+    bool IsArmed() const { return state.deadline != 0; }
+
+    // Arms the watchdog, returns the previous state to pass to `Restore` when the call returns
+    State Arm(uint32 timeoutMs);
+    void Restore(State const& previous) { state = previous; }
+
+    // Called from the count hook, returns true if the call has to be stopped with an error
+    bool OnHook();
+    // True once the grace is over, the hook then has to run on every instruction
+    bool IsPastGrace() const { return state.raised && !state.grace; }
+
+private:
+    struct Key
+    {
+        const char* family;
+        uint32 event_id;
+
+        bool operator==(Key const& other) const
+        {
+            return family == other.family && event_id == other.event_id;
+        }
+    };
+
+    struct KeyHash
+    {
+        std::size_t operator()(Key const& key) const;
+    };
+
+    uint32 defaultTimeout;
+    // Keyed by "Family" and "Family.event"
+    std::unordered_map<std::string, uint32> overrideTimeouts;
+    // Resolved timeouts of the events called so far
+    std::unordered_map<Key, uint32, KeyHash> timeouts;
+    State state;
+};
+
+#endif // _HOOK_STATS_H
@@ -16,8 +16,8 @@
  *     if (!WhateverBindings->HasBindingsFor(SOME_EVENT_TYPE))
  *         return;
  *
- *     // Lock out any other threads.
- *     LOCK_FORGE;
+ *     // Lock out any other threads using this state.
+ *     LOCK_FORGE_STATE;
  *
  *     // Push extra arguments, if any.
  *     Push(a);
@@ -34,8 +34,8 @@
  *     if (!WhateverBindings->HasBindingsFor(SOME_EVENT_TYPE))
  *          return;
  *
- *     // Lock out any other threads.
- *     LOCK_FORGE;
+ *     // Lock out any other threads using this state.
+ *     LOCK_FORGE_STATE;
  *
  *     // Push extra arguments, if any.
  *     Push(a);
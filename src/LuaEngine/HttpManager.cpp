@@ -1,3 +1,8 @@
+#include <algorithm>
+#include <cctype>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
 #include <thread>
 extern "C"
 {
@@ -5,271 +10,1161 @@ extern "C"
 #include "lauxlib.h"
 };
 
-#if defined TRINITY || defined AZEROTHCORE
-#define CPPHTTPLIB_OPENSSL_SUPPORT
-#endif
-#include "libs/httplib.h"
 #include "HttpManager.h"
 #include "LuaEngine.h"
 
-HttpWorkItem::HttpWorkItem(int funcRef, const std::string& httpVerb, const std::string& url, const std::string& body, const std::string& contentType, const httplib::Headers& headers)
+HttpWorkItem::HttpWorkItem(int funcRef, const std::string& httpVerb, const std::string& url, const std::string& body, const std::string& contentType, const httplib::Headers& headers, uint64 waitId)
     : funcRef(funcRef),
+    waitId(waitId),
     httpVerb(httpVerb),
     url(url),
     body(body),
     contentType(contentType),
-    headers(headers)
+    headers(headers),
+    connectTimeout(DEFAULT_CONNECT_TIMEOUT),
+    timeout(DEFAULT_TIMEOUT),
+    chunkSize(0),
+    maxBodySize(DEFAULT_MAX_BODY_SIZE),
+    owner(nullptr),
+    generation(0)
 { }
 
-HttpResponse::HttpResponse(int funcRef, int statusCode, const std::string& body, const httplib::Headers& headers)
-    : funcRef(funcRef),
+HttpResponse::HttpResponse(HttpWorkItem const* req, int statusCode, std::string body, const httplib::Headers& headers, bool last)
+    : funcRef(req->funcRef),
+    waitId(req->waitId),
+    generation(req->generation),
+    queuedAt(req->queuedAt),
     statusCode(statusCode),
-    body(body),
-    headers(headers)
+    body(std::move(body)),
+    headers(headers),
+    chunked(req->chunkSize != 0),
+    last(last),
+    download(!req->downloadPath.empty()),
+    bodySize(0)
 { }
 
-HttpManager::HttpManager()
-    : workQueue(16),
-    responseQueue(16),
-    startedWorkerThread(false),
-    cancelationToken(false),
-    condVar(),
-    condVarMutex(),
-    parseUrlRegex("^(([^:/?#]+):)?(//([^/?#]*))?([^?#]*)(\\?([^#]*))?(#(.*))?")
+HttpResponse::HttpResponse(HttpWorkItem const* req, const std::string& error)
+    : funcRef(req->funcRef),
+    waitId(req->waitId),
+    generation(req->generation),
+    queuedAt(req->queuedAt),
+    statusCode(0),
+    error(error),
+    chunked(req->chunkSize != 0),
+    last(true),
+    download(!req->downloadPath.empty()),
+    bodySize(0)
+{ }
+
+namespace
 {
-    StartHttpWorker();
+    // Pushes `status, body, headers`, or `nil, error` for a failed request.
+    // Downloads push the size of the file instead of the body, chunks whether they are the last one after the headers.
+    int PushResponseValues(lua_State* L, HttpResponse const* res)
+    {
+        if (!res->error.empty())
+        {
+            lua_pushnil(L);
+            Forge::Push(L, res->error);
+            return 2;
+        }
+
+        Forge::Push(L, res->statusCode);
+        if (res->download)
+            Forge::Push(L, res->bodySize);
+        else
+            lua_pushlstring(L, res->body.data(), res->body.size());
+        lua_newtable(L);
+        for (const auto& item : res->headers) {
+            Forge::Push(L, item.first);
+            Forge::Push(L, item.second);
+            lua_settable(L, -3);
+        }
+
+        if (!res->chunked)
+            return 3;
+
+        Forge::Push(L, res->last);
+        return 4;
+    }
+
+    int64 SteadyMilliseconds()
+    {
+        return std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+    }
+
+    // The Cache-Control directives of a response HttpCache looks at
+    struct CacheControl
+    {
+        CacheControl() : maxAge(-1), noStore(false), noCache(false) { }
+
+        // In seconds, -1 if not given
+        int64 maxAge;
+        bool noStore;
+        bool noCache;
+    };
+
+    CacheControl ParseCacheControl(httplib::Headers const& headers)
+    {
+        CacheControl control;
+        auto range = headers.equal_range("Cache-Control");
+        for (auto itr = range.first; itr != range.second; ++itr)
+        {
+            std::string const& value = itr->second;
+            std::string::size_type start = 0;
+            while (start < value.size())
+            {
+                std::string::size_type end = value.find(',', start);
+                if (end == std::string::npos)
+                {
+                    end = value.size();
+                }
+
+                std::string directive = value.substr(start, end - start);
+                directive.erase(0, directive.find_first_not_of(" \t"));
+                directive.erase(directive.find_last_not_of(" \t") + 1);
+                std::transform(directive.begin(), directive.end(), directive.begin(), ::tolower);
+
+                if (directive == "no-store")
+                {
+                    control.noStore = true;
+                }
+                else if (directive == "no-cache")
+                {
+                    control.noCache = true;
+                }
+                else if (directive.compare(0, 8, "max-age=") == 0)
+                {
+                    control.maxAge = std::max<int64>(std::strtoll(directive.c_str() + 8, nullptr, 10), 0);
+                }
+                start = end + 1;
+            }
+        }
+        return control;
+    }
+
+    bool IsSuccess(int status)
+    {
+        return status >= 200 && status < 300;
+    }
+
+    // Headers of the body or the connection, which a 304 doesn't update
+    bool IsBodyHeader(std::string name)
+    {
+        std::transform(name.begin(), name.end(), name.begin(), ::tolower);
+        return name == "content-length" || name == "content-type" || name == "transfer-encoding" || name == "connection" || name == "keep-alive";
+    }
+
+    /*
+     * Receives the body of a request as it arrives on a worker. Downloads are
+     *   written to a temporary file that replaces the target once complete,
+     *   chunked bodies are passed on in pieces, other bodies are kept whole.
+     */
+    class ResponseReader
+    {
+    public:
+        ResponseReader(HttpWorkItem* req, uint64 maxBodySize) :
+            req(req),
+            maxBodySize(maxBodySize),
+            status(0),
+            skipped(false),
+            received(0)
+        { }
+
+        ~ResponseReader()
+        {
+            Abort();
+        }
+
+        bool OnResponse(httplib::Response const& res)
+        {
+            if (!req->owner->IsCurrent(req->generation))
+                return Fail("request cancelled");
+
+            // Execute follows the redirect, its body is not wanted
+            skipped = res.status == 301;
+            if (skipped)
+                return true;
+
+            status = res.status;
+            headers = res.headers;
+
+            if (maxBodySize && res.has_header("Content-Length") && std::strtoull(res.get_header_value("Content-Length").c_str(), nullptr, 10) > maxBodySize)
+                return Fail("response body too large");
+
+            // Error pages don't replace the file
+            if (!req->downloadPath.empty() && IsSuccess(status))
+                return OpenFile();
+            return true;
+        }
+
+        bool OnContent(const char* data, size_t length)
+        {
+            // A stream that never ends would otherwise keep the worker and a closing state waiting
+            if (!req->owner->IsCurrent(req->generation))
+                return Fail("request cancelled");
+
+            if (skipped)
+                return true;
+
+            received += length;
+            if (maxBodySize && received > maxBodySize)
+                return Fail("response body too large");
+
+            if (!req->downloadPath.empty())
+            {
+                if (!file.is_open())
+                    return true;
+
+                file.write(data, length);
+                return file.good() || Fail("could not write " + req->downloadPath);
+            }
+
+            body.append(data, length);
+            while (req->chunkSize && body.size() >= req->chunkSize)
+            {
+                req->owner->PushResponse(new HttpResponse(req, status, body.substr(0, req->chunkSize), headers, false));
+                body.erase(0, req->chunkSize);
+            }
+            return true;
+        }
+
+        // Returns the response once the request is done, the remaining body is the last chunk
+        HttpResponse* Finish(httplib::Response const& res)
+        {
+            if (req->downloadPath.empty())
+                return new HttpResponse(req, res.status, std::move(body), res.headers);
+
+            uint64 size = 0;
+            if (IsSuccess(res.status))
+            {
+                // No body, as for 204
+                if (!file.is_open() && !OpenFile())
+                    return new HttpResponse(req, error);
+
+                // The state reloaded or closed after the last read, its file is not replaced
+                if (!req->owner->IsCurrent(req->generation))
+                {
+                    Abort();
+                    return new HttpResponse(req, "request cancelled");
+                }
+
+                file.close();
+                std::string tempPath = GetTempPath();
+                bool written = !file.fail();
+                // Renaming onto an existing file fails on Windows
+                if (written && std::rename(tempPath.c_str(), req->downloadPath.c_str()))
+                {
+                    std::remove(req->downloadPath.c_str());
+                    written = !std::rename(tempPath.c_str(), req->downloadPath.c_str());
+                }
+
+                if (!written)
+                {
+                    std::remove(tempPath.c_str());
+                    return new HttpResponse(req, "could not write " + req->downloadPath);
+                }
+                size = received;
+            }
+
+            HttpResponse* response = new HttpResponse(req, res.status, std::string(), res.headers);
+            response->bodySize = size;
+            return response;
+        }
+
+        // Set when OnResponse or OnContent stopped the request
+        std::string const& GetError() const { return error; }
+
+        // Drops the partial download
+        void Abort()
+        {
+            if (!file.is_open())
+                return;
+
+            file.close();
+            std::remove(GetTempPath().c_str());
+        }
+
+    private:
+        std::string GetTempPath() const
+        {
+            return req->downloadPath + ".part";
+        }
+
+        bool OpenFile()
+        {
+            file.open(GetTempPath(), std::ios::binary | std::ios::trunc);
+            return file.is_open() || Fail("could not open " + GetTempPath());
+        }
+
+        bool Fail(std::string const& message)
+        {
+            error = message;
+            return false;
+        }
+
+        HttpWorkItem* req;
+        const uint64 maxBodySize;
+        int status;
+        httplib::Headers headers;
+        // Content of a redirect that is followed
+        bool skipped;
+        uint64 received;
+        std::string body;
+        std::ofstream file;
+        std::string error;
+    };
+
+    uint64 MicrosecondsSince(std::chrono::steady_clock::time_point start)
+    {
+        return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start).count();
+    }
+
+    void UpdateMax(std::atomic<uint64>& max, uint64 value)
+    {
+        uint64 current = max.load(std::memory_order_relaxed);
+        while (value > current && !max.compare_exchange_weak(current, value, std::memory_order_relaxed))
+            ;
+    }
 }
 
-HttpManager::~HttpManager()
+// Taken by reference by std::chrono
+const uint32 HttpConnectionPool::IDLE_TIMEOUT;
+const uint32 HttpConnectionPool::MAX_IDLE_PER_SERVER;
+
+std::string HttpUrl::GetServerKey() const
 {
-    StopHttpWorker();
+    return (https ? "https://" : "http://") + host + ":" + std::to_string(port);
 }
 
-void HttpManager::PushRequest(HttpWorkItem* item)
+HttpConnectionPool::ClientPtr HttpConnectionPool::Acquire(HttpUrl const& url)
 {
-    std::unique_lock<std::mutex> lock(condVarMutex);
-    workQueue.push(item);
-    condVar.notify_one();
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        auto itr = idle.find(url.GetServerKey());
+        if (itr != idle.end() && !itr->second.empty())
+        {
+            ClientPtr client = std::move(itr->second.back().client);
+            itr->second.pop_back();
+            return client;
+        }
+    }
+
+    ClientPtr client;
+    if (url.https)
+    {
+#ifdef CPPHTTPLIB_OPENSSL_SUPPORT
+        client.reset(new httplib::SSLClient(url.host, url.port));
+#else
+        return client;
+#endif
+    }
+    else
+        client.reset(new httplib::ClientImpl(url.host, url.port));
+
+    client->set_keep_alive(true);
+    // Requests on a kept-alive connection otherwise wait for delayed ACKs
+    client->set_tcp_nodelay(true);
+    return client;
 }
 
-void HttpManager::StartHttpWorker()
+void HttpConnectionPool::Release(HttpUrl const& url, ClientPtr client)
 {
-    ClearQueues();
+    // Closed outside the lock
+    ClientPtr dropped;
 
-    if (!startedWorkerThread)
+    std::lock_guard<std::mutex> guard(lock);
+    std::vector<IdleClient>& clients = idle[url.GetServerKey()];
+    if (clients.size() >= MAX_IDLE_PER_SERVER)
     {
-        cancelationToken.store(false);
-        workerThread = std::thread(&HttpManager::HttpWorkerThread, this);
-        startedWorkerThread = true;
+        dropped = std::move(clients.front().client);
+        clients.erase(clients.begin());
     }
+
+    IdleClient released;
+    released.client = std::move(client);
+    released.releasedAt = std::chrono::steady_clock::now();
+    clients.push_back(std::move(released));
 }
 
-void HttpManager::ClearQueues()
+void HttpConnectionPool::EvictIdle()
 {
-    while (workQueue.front())
+    std::vector<IdleClient> dropped;
+    std::chrono::steady_clock::time_point expiry = std::chrono::steady_clock::now() - std::chrono::milliseconds(IDLE_TIMEOUT);
+
+    std::lock_guard<std::mutex> guard(lock);
+    for (auto itr = idle.begin(); itr != idle.end();)
     {
-        HttpWorkItem* item = *workQueue.front();
-        if (item != nullptr)
-        {
-            delete item;
-        }
-        workQueue.pop();
+        std::vector<IdleClient>& clients = itr->second;
+        auto expired = std::find_if(clients.begin(), clients.end(), [expiry](IdleClient const& client) { return client.releasedAt > expiry; });
+        std::move(clients.begin(), expired, std::back_inserter(dropped));
+        clients.erase(clients.begin(), expired);
+
+        if (clients.empty())
+            itr = idle.erase(itr);
+        else
+            ++itr;
     }
+}
+
+void HttpConnectionPool::Clear()
+{
+    std::lock_guard<std::mutex> guard(lock);
+    idle.clear();
+}
+
+bool HttpCache::Entry::IsFresh() const
+{
+    return SteadyMilliseconds() < expiresAt.load(std::memory_order_relaxed);
+}
+
+HttpCache::HttpCache(uint64 maxSize) :
+    maxSize(maxSize),
+    usedSize(0),
+    entryCount(0),
+    hits(0),
+    revalidated(0),
+    misses(0)
+{ }
+
+bool HttpCache::IsCacheable(HttpWorkItem const* req)
+{
+    // Requests that ask for revalidation themselves get the answer of the server
+    return req->httpVerb == "GET" && !req->chunkSize && req->downloadPath.empty() &&
+        !req->headers.count("Cache-Control") && !req->headers.count("If-None-Match") && !req->headers.count("If-Modified-Since");
+}
 
-    while (responseQueue.front())
+std::string HttpCache::GetKey(HttpWorkItem const* req)
+{
+    std::string key = req->url;
+    for (auto const& header : req->headers)
     {
-        HttpResponse* item = *responseQueue.front();
-        if (item != nullptr)
-        {
+        key += '\n';
+        key += header.first;
+        key += ':';
+        key += header.second;
+    }
+    return key;
+}
+
+HttpCache::EntryPtr HttpCache::Find(std::string const& key)
+{
+    std::lock_guard<std::mutex> guard(lock);
+    auto itr = entries.find(key);
+    if (itr == entries.end())
+        return nullptr;
+
+    recent.splice(recent.begin(), recent, itr->second.itr);
+    return itr->second.entry;
+}
+
+void HttpCache::Store(std::string const& key, std::string const& body, httplib::Headers const& headers)
+{
+    // Not built for responses that are dropped anyway
+    CacheControl control = ParseCacheControl(headers);
+    bool keep = !control.noStore;
+    EntryPtr entry = keep ? NewEntry(key, body, headers, keep) : nullptr;
+
+    std::lock_guard<std::mutex> guard(lock);
+    auto itr = entries.find(key);
+    if (itr != entries.end())
+        Erase(itr);
+
+    if (keep)
+        Insert(key, entry);
+}
+
+HttpCache::EntryPtr HttpCache::Refresh(std::string const& key, EntryPtr const& entry, httplib::Headers const& headers)
+{
+    revalidated.fetch_add(1, std::memory_order_relaxed);
+
+    // The headers of a 304 replace the stored ones of the same name, those of the body excepted
+    httplib::Headers merged = entry->headers;
+    for (auto itr = headers.begin(); itr != headers.end(); itr = headers.upper_bound(itr->first))
+    {
+        if (IsBodyHeader(itr->first))
+            continue;
+
+        auto range = headers.equal_range(itr->first);
+        merged.erase(itr->first);
+        merged.insert(range.first, range.second);
+    }
+
+    if (merged == entry->headers)
+    {
+        // A 304 without Cache-Control keeps the max-age the response came with
+        entry->expiresAt = SteadyMilliseconds() + std::max<int64>(entry->maxAge, 0);
+        return entry;
+    }
+
+    // Entries are shared with the requests that use them, so a changed one is replaced instead of modified.
+    // Later revalidations send the new validators.
+    bool keep;
+    EntryPtr updated = NewEntry(key, entry->body, merged, keep);
+
+    std::lock_guard<std::mutex> guard(lock);
+    auto itr = entries.find(key);
+    // Unless a newer response was stored meanwhile
+    if (itr != entries.end() && itr->second.entry == entry)
+    {
+        Erase(itr);
+        if (keep)
+            Insert(key, updated);
+    }
+    return updated;
+}
+
+HttpCache::EntryPtr HttpCache::NewEntry(std::string const& key, std::string const& body, httplib::Headers const& headers, bool& keep) const
+{
+    CacheControl control = ParseCacheControl(headers);
+    EntryPtr entry = std::make_shared<Entry>();
+    entry->statusCode = 200;
+    entry->body = body;
+    entry->headers = headers;
+    entry->etag = headers.count("ETag") ? headers.find("ETag")->second : std::string();
+    entry->lastModified = headers.count("Last-Modified") ? headers.find("Last-Modified")->second : std::string();
+    entry->maxAge = control.noCache ? 0 : control.maxAge * 1000;
+    entry->expiresAt = SteadyMilliseconds() + std::max<int64>(entry->maxAge, 0);
+    entry->size = key.size() + body.size();
+    for (auto const& header : headers)
+        entry->size += header.first.size() + header.second.size();
+
+    // Without max-age or a validator every request would go to the server anyway
+    keep = !control.noStore && (control.maxAge > 0 || !entry->etag.empty() || !entry->lastModified.empty()) && entry->size <= maxSize;
+    auto vary = headers.find("Vary");
+    if (vary != headers.end() && vary->second.find('*') != std::string::npos)
+        keep = false;
+    return entry;
+}
+
+void HttpCache::Insert(std::string const& key, EntryPtr const& entry)
+{
+    recent.push_front(key);
+    Slot& slot = entries[key];
+    slot.entry = entry;
+    slot.itr = recent.begin();
+    usedSize.fetch_add(entry->size, std::memory_order_relaxed);
+
+    while (usedSize.load(std::memory_order_relaxed) > maxSize)
+        Erase(entries.find(recent.back()));
+
+    entryCount.store(entries.size(), std::memory_order_relaxed);
+}
+
+void HttpCache::CountHit()
+{
+    hits.fetch_add(1, std::memory_order_relaxed);
+}
+
+void HttpCache::CountMiss()
+{
+    misses.fetch_add(1, std::memory_order_relaxed);
+}
+
+void HttpCache::GetStats(HttpStats& stats) const
+{
+    stats.cache_hits = hits.load(std::memory_order_relaxed);
+    stats.cache_revalidated = revalidated.load(std::memory_order_relaxed);
+    stats.cache_misses = misses.load(std::memory_order_relaxed);
+    stats.cache_entries = entryCount.load(std::memory_order_relaxed);
+    stats.cache_size = usedSize.load(std::memory_order_relaxed);
+}
+
+void HttpCache::Erase(std::unordered_map<std::string, Slot>::iterator itr)
+{
+    usedSize.fetch_sub(itr->second.entry->size, std::memory_order_relaxed);
+    recent.erase(itr->second.itr);
+    entries.erase(itr);
+    entryCount.store(entries.size(), std::memory_order_relaxed);
+}
+
+HttpExecutor::HttpExecutor(uint32 workerCount, uint32 maxPerServer, uint32 queueLimit, uint64 maxBodySize, uint64 maxDownloadSize, uint64 cacheSize) :
+    maxPerServer(maxPerServer),
+    queueLimit(queueLimit),
+    maxBodySize(maxBodySize),
+    maxDownloadSize(maxDownloadSize),
+    stopping(false),
+    pendingCount(0),
+    queuedCount(0),
+    runningCount(0),
+    started(0),
+    completed(0),
+    rejected(0),
+    totalWait(0),
+    maxWait(0),
+    totalLatency(0),
+    maxLatency(0),
+    cache(cacheSize)
+{
+    for (uint32 i = 0; i < workerCount; ++i)
+        workers.push_back(std::thread(&HttpExecutor::WorkerThread, this));
+}
+
+HttpExecutor::~HttpExecutor()
+{
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        stopping = true;
+    }
+    workAvailable.notify_all();
+
+    for (std::thread& worker : workers)
+        worker.join();
+
+    for (auto const& server : servers)
+        for (HttpWorkItem* item : server.second.pending)
             delete item;
-        }
-        responseQueue.pop();
+}
+
+bool HttpExecutor::Admit()
+{
+    uint32 pending = pendingCount.fetch_add(1, std::memory_order_relaxed);
+    if (queueLimit && pending >= queueLimit)
+    {
+        pendingCount.fetch_sub(1, std::memory_order_relaxed);
+        rejected.fetch_add(1, std::memory_order_relaxed);
+        return false;
     }
+    return true;
 }
 
-void HttpManager::StopHttpWorker()
+void HttpExecutor::Push(HttpWorkItem* item)
 {
-    if (!startedWorkerThread)
     {
-        return;
+        std::lock_guard<std::mutex> guard(lock);
+        std::string key = item->target.GetServerKey();
+        ServerQueue& queue = servers[key];
+        if (queue.pending.empty())
+            turns.push_back(key);
+        queue.pending.push_back(item);
+        queuedCount.fetch_add(1, std::memory_order_relaxed);
     }
+    workAvailable.notify_one();
+}
 
-    cancelationToken.store(true);
-    condVar.notify_one();
-    workerThread.join();
-    ClearQueues();
-    startedWorkerThread = false;
+void HttpExecutor::Release(HttpResponse const* res)
+{
+    uint64 latency = MicrosecondsSince(res->queuedAt);
+    totalLatency.fetch_add(latency, std::memory_order_relaxed);
+    UpdateMax(maxLatency, latency);
+    completed.fetch_add(1, std::memory_order_relaxed);
+    pendingCount.fetch_sub(1, std::memory_order_relaxed);
 }
 
-void HttpManager::HttpWorkerThread()
+HttpStats HttpExecutor::GetStats() const
 {
-    while (true)
+    HttpStats stats;
+    stats.pending = pendingCount.load(std::memory_order_relaxed);
+    stats.queued = queuedCount.load(std::memory_order_relaxed);
+    stats.running = runningCount.load(std::memory_order_relaxed);
+    stats.limit = queueLimit;
+    stats.started = started.load(std::memory_order_relaxed);
+    stats.completed = completed.load(std::memory_order_relaxed);
+    stats.rejected = rejected.load(std::memory_order_relaxed);
+    stats.total_wait_us = totalWait.load(std::memory_order_relaxed);
+    stats.max_wait_us = maxWait.load(std::memory_order_relaxed);
+    stats.total_latency_us = totalLatency.load(std::memory_order_relaxed);
+    stats.max_latency_us = maxLatency.load(std::memory_order_relaxed);
+    cache.GetStats(stats);
+    return stats;
+}
+
+void HttpExecutor::Cancel(HttpManager* owner, bool wait)
+{
+    std::unique_lock<std::mutex> guard(lock);
+
+    for (auto itr = servers.begin(); itr != servers.end();)
     {
-        {
-            std::unique_lock<std::mutex> lock(condVarMutex);
-            condVar.wait(lock, [&] { return workQueue.front() != nullptr || cancelationToken.load(); });
-        }
+        std::deque<HttpWorkItem*>& pending = itr->second.pending;
+        auto cancelled = std::stable_partition(pending.begin(), pending.end(), [owner](HttpWorkItem* item) { return item->owner != owner; });
+        uint32 count = std::distance(cancelled, pending.end());
+        for (auto it = cancelled; it != pending.end(); ++it)
+            delete *it;
+        pending.erase(cancelled, pending.end());
+        queuedCount.fetch_sub(count, std::memory_order_relaxed);
+        pendingCount.fetch_sub(count, std::memory_order_relaxed);
 
-        if (cancelationToken.load())
-        {
-            break;
-        }
-        if (!workQueue.front())
-        {
-            continue;
-        }
+        if (pending.empty() && !itr->second.running)
+            itr = servers.erase(itr);
+        else
+            ++itr;
+    }
+
+    turns.erase(std::remove_if(turns.begin(), turns.end(), [this](std::string const& key)
+    {
+        auto server = servers.find(key);
+        return server == servers.end() || server->second.pending.empty();
+    }), turns.end());
+
+    // The readers of the running requests stop once the owner is no longer current,
+    //  so this waits for at most one socket read or connect timeout
+    if (wait)
+        requestFinished.wait(guard, [this, owner] { return running.find(owner) == running.end(); });
+}
+
+HttpWorkItem* HttpExecutor::TakeNext()
+{
+    // Every server with queued requests gets one turn, servers at their limit are skipped
+    for (size_t i = turns.size(); i > 0; --i)
+    {
+        std::string key = std::move(turns.front());
+        turns.pop_front();
 
-        HttpWorkItem* req = *workQueue.front();
-        workQueue.pop();
-        if (!req)
+        ServerQueue& queue = servers[key];
+        if (queue.running >= maxPerServer)
         {
+            turns.push_back(std::move(key));
             continue;
         }
 
-        try
-        {
-            std::string host;
-            std::string path;
+        HttpWorkItem* item = queue.pending.front();
+        queue.pending.pop_front();
+        ++queue.running;
+        ++running[item->owner];
 
-            if (!ParseUrl(req->url, host, path)) {
-                FORGE_LOG_ERROR("[Forge]: Could not parse URL {}", req->url);
-                continue;
-            }
+        queuedCount.fetch_sub(1, std::memory_order_relaxed);
+        runningCount.fetch_add(1, std::memory_order_relaxed);
+        uint64 wait = MicrosecondsSince(item->queuedAt);
+        totalWait.fetch_add(wait, std::memory_order_relaxed);
+        UpdateMax(maxWait, wait);
+        started.fetch_add(1, std::memory_order_relaxed);
 
-            httplib::Client cli(host);
-            cli.set_connection_timeout(0, 3000000); // 3 seconds
-            cli.set_read_timeout(5, 0); // 5 seconds
-            cli.set_write_timeout(5, 0); // 5 seconds
+        if (!queue.pending.empty())
+            turns.push_back(std::move(key));
+        return item;
+    }
+    return nullptr;
+}
 
-            httplib::Result res = DoRequest(cli, req, path);
-            httplib::Error err = res.error();
-            if (err != httplib::Error::Success)
-            {
-                FORGE_LOG_ERROR("[Forge]: HTTP request error: {}", httplib::to_string(err));
-                continue;
-            }
+void HttpExecutor::Finish(HttpWorkItem* item)
+{
+    auto server = servers.find(item->target.GetServerKey());
+    if (!--server->second.running && server->second.pending.empty())
+        servers.erase(server);
 
-            if (res->status == 301)
-            {
-                std::string location = res->get_header_value("Location");
-                std::string host;
-                std::string path;
+    auto owner = running.find(item->owner);
+    if (!--owner->second)
+        running.erase(owner);
 
-                if (!ParseUrl(location, host, path))
+    runningCount.fetch_sub(1, std::memory_order_relaxed);
+}
+
+void HttpExecutor::WorkerThread()
+{
+    while (true)
+    {
+        HttpWorkItem* req = nullptr;
+        {
+            std::unique_lock<std::mutex> guard(lock);
+            while (!stopping && !(req = TakeNext()))
+            {
+                if (workAvailable.wait_for(guard, std::chrono::milliseconds(HttpConnectionPool::IDLE_TIMEOUT)) == std::cv_status::timeout)
                 {
-                    FORGE_LOG_ERROR("[Forge]: Could not parse URL after redirect: {}", location);
-                    continue;
+                    guard.unlock();
+                    connections.EvictIdle();
+                    guard.lock();
                 }
-                httplib::Client cli2(host);
-                cli2.set_connection_timeout(0, 3000000); // 3 seconds
-                cli2.set_read_timeout(5, 0); // 5 seconds
-                cli2.set_write_timeout(5, 0); // 5 seconds
-                res = DoRequest(cli2, req, path);
             }
 
-            responseQueue.push(new HttpResponse(req->funcRef, res->status, res->body, res->headers));
+            if (stopping)
+                break;
+        }
+
+        HttpResponse* res;
+        try
+        {
+            res = Execute(req);
         }
         catch (const std::exception& ex)
         {
             FORGE_LOG_ERROR("[Forge]: HTTP request error: {}", ex.what());
+            res = new HttpResponse(req, ex.what());
         }
 
+        // Failed requests are passed on too, a coroutine in AwaitHttp would wait forever otherwise
+        req->owner->PushResponse(res);
+
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            Finish(req);
+        }
+        // The server may take another request now
+        workAvailable.notify_one();
+        requestFinished.notify_all();
         delete req;
+
+        connections.EvictIdle();
     }
 }
 
-httplib::Result HttpManager::DoRequest(httplib::Client& client, HttpWorkItem* req, const std::string& urlPath)
+HttpResponse* HttpExecutor::Execute(HttpWorkItem* req)
 {
-    const char* path = urlPath.c_str();
-    if (req->httpVerb == "GET")
+    uint64 limit = req->maxBodySize;
+    if (limit == HttpWorkItem::DEFAULT_MAX_BODY_SIZE)
+        limit = req->downloadPath.empty() ? maxBodySize : maxDownloadSize;
+    ResponseReader reader(req, limit);
+    httplib::ResponseHandler onResponse = [&reader](httplib::Response const& res) { return reader.OnResponse(res); };
+    httplib::ContentReceiver onContent = [&reader](const char* data, size_t length) { return reader.OnContent(data, length); };
+
+    HttpUrl const& url = req->target;
+    httplib::Result res = Send(req, url, onResponse, onContent);
+    if (res && res->status == 301)
+    {
+        std::string location = res->get_header_value("Location");
+        HttpUrl redirect;
+
+        if (!location.empty() && location[0] == '/')
+        {
+            redirect = url;
+            redirect.path = location;
+        }
+        else if (!HttpManager::ParseUrl(location, redirect))
+        {
+            FORGE_LOG_ERROR("[Forge]: Could not parse URL after redirect: {}", location);
+            return new HttpResponse(req, "could not parse URL after redirect");
+        }
+        res = Send(req, redirect, onResponse, onContent);
+    }
+
+    httplib::Error err = res.error();
+    if (err != httplib::Error::Success)
+    {
+        std::string error = reader.GetError().empty() ? httplib::to_string(err) : reader.GetError();
+        FORGE_LOG_ERROR("[Forge]: HTTP request error: {}", error);
+        return new HttpResponse(req, error);
+    }
+
+    if (req->cacheKey.empty())
+        return reader.Finish(*res);
+
+    if (res->status == 304 && req->cached)
     {
-        return client.Get(path, req->headers);
+        HttpCache::EntryPtr entry = cache.Refresh(req->cacheKey, req->cached, res->headers);
+        return new HttpResponse(req, entry->statusCode, entry->body, entry->headers);
     }
-    if (req->httpVerb == "HEAD")
+
+    cache.CountMiss();
+    HttpResponse* response = reader.Finish(*res);
+    if (response->statusCode == 200)
+        cache.Store(req->cacheKey, response->body, response->headers);
+    return response;
+}
+
+httplib::Result HttpExecutor::Send(HttpWorkItem* req, HttpUrl const& url, httplib::ResponseHandler const& onResponse, httplib::ContentReceiver const& onContent)
+{
+    HttpConnectionPool::ClientPtr client = connections.Acquire(url);
+    // https without SSL support
+    if (!client)
+        return httplib::Result(nullptr, httplib::Error::SSLConnection);
+
+    client->set_connection_timeout(std::chrono::milliseconds(req->connectTimeout));
+    client->set_read_timeout(std::chrono::milliseconds(req->timeout));
+    client->set_write_timeout(std::chrono::milliseconds(req->timeout));
+
+    httplib::Result res = DoRequest(*client, req, url.path, onResponse, onContent);
+    connections.Release(url, std::move(client));
+    return res;
+}
+
+httplib::Result HttpExecutor::DoRequest(httplib::ClientImpl& client, HttpWorkItem* req, const std::string& path, httplib::ResponseHandler const& onResponse, httplib::ContentReceiver const& onContent)
+{
+    httplib::Request request;
+    request.method = req->httpVerb;
+    request.path = path;
+    request.headers = req->headers;
+    if (req->cached)
     {
-        return client.Head(path, req->headers);
+        if (!req->cached->etag.empty())
+        {
+            request.set_header("If-None-Match", req->cached->etag);
+        }
+        if (!req->cached->lastModified.empty())
+        {
+            request.set_header("If-Modified-Since", req->cached->lastModified);
+        }
     }
-    if (req->httpVerb == "POST")
+    // The body goes to the reader instead of the response
+    request.response_handler = onResponse;
+    request.content_receiver = [&onContent](const char* data, size_t length, uint64_t /*offset*/, uint64_t /*total*/) { return onContent(data, length); };
+
+    if (req->httpVerb == "POST" || req->httpVerb == "PUT" || req->httpVerb == "PATCH")
     {
-        return client.Post(path, req->headers, req->body, req->contentType.c_str());
+        if (!req->contentType.empty())
+        {
+            request.set_header("Content-Type", req->contentType);
+        }
+        request.body = req->body;
     }
-    if (req->httpVerb == "PUT")
+    else if (req->httpVerb != "GET" && req->httpVerb != "HEAD" && req->httpVerb != "DELETE" && req->httpVerb != "OPTIONS")
     {
-        return client.Put(path, req->headers, req->body, req->contentType.c_str());
+        FORGE_LOG_ERROR("[Forge]: HTTP request error: invalid HTTP verb {}", req->httpVerb);
+        request.method = "GET";
     }
-    if (req->httpVerb == "PATCH")
+
+    return client.send(request);
+}
+
+HttpExecutor* HttpManager::executor = nullptr;
+
+HttpManager::HttpManager(Forge* E)
+    : E(E),
+    generation(0),
+    responseCount(0)
+{
+}
+
+HttpManager::~HttpManager()
+{
+    // Stops the running requests, see HttpExecutor::Cancel
+    ++generation;
+    if (executor)
+        executor->Cancel(this, true);
+    ClearQueues();
+}
+
+void HttpManager::Initialize(uint32 workerCount, uint32 maxPerServer, uint32 queueLimit, uint64 maxBodySize, uint64 maxDownloadSize, uint64 cacheSize)
+{
+    executor = new HttpExecutor(std::max(workerCount, 1u), std::max(maxPerServer, 1u), queueLimit, maxBodySize, maxDownloadSize, cacheSize);
+}
+
+void HttpManager::Uninitialize()
+{
+    delete executor;
+    executor = nullptr;
+}
+
+HttpStats HttpManager::GetStats()
+{
+    if (!executor)
+        return HttpStats();
+    return executor->GetStats();
+}
+
+bool HttpManager::PushRequest(HttpWorkItem* item)
+{
+    ASSERT(executor);
+
+    if (!executor->Admit())
     {
-        return client.Patch(path, req->headers, req->body, req->contentType.c_str());
+        delete item;
+        return false;
     }
-    if (req->httpVerb == "DELETE")
+
+    item->owner = this;
+    item->generation = generation.load();
+    item->queuedAt = std::chrono::steady_clock::now();
+    if (!ParseUrl(item->url, item->target))
     {
-        return client.Delete(path, req->headers);
+        FORGE_LOG_ERROR("[Forge]: Could not parse URL {}", item->url);
+        PushResponse(new HttpResponse(item, "could not parse URL"));
+        delete item;
+        return true;
     }
-    if (req->httpVerb == "OPTIONS")
+
+    HttpCache& cache = executor->GetCache();
+    if (cache.IsEnabled() && HttpCache::IsCacheable(item))
     {
-        return client.Options(path, req->headers);
+        item->cacheKey = HttpCache::GetKey(item);
+        item->cached = cache.Find(item->cacheKey);
+
+        // Answered without a worker, in the next update like any other response
+        if (item->cached && item->cached->IsFresh())
+        {
+            cache.CountHit();
+            PushResponse(new HttpResponse(item, item->cached->statusCode, item->cached->body, item->cached->headers));
+            delete item;
+            return true;
+        }
     }
 
-    FORGE_LOG_ERROR("[Forge]: HTTP request error: invalid HTTP verb {}", req->httpVerb);
-    return client.Get(path, req->headers);
+    executor->Push(item);
+    return true;
+}
+
+void HttpManager::PushResponse(HttpResponse* res)
+{
+    std::lock_guard<std::mutex> guard(responseLock);
+    responses.push_back(res);
+    responseCount.store(responses.size(), std::memory_order_release);
+}
+
+void HttpManager::Reset()
+{
+    // Responses that are already queued are dropped by HandleHttpResponses,
+    //  it runs on the update thread of the state
+    if (executor)
+        executor->Cancel(this, false);
+    ++generation;
+}
+
+void HttpManager::ClearQueues()
+{
+    std::lock_guard<std::mutex> guard(responseLock);
+    for (HttpResponse* res : responses)
+    {
+        if (executor && res->last)
+            executor->Release(res);
+        delete res;
+    }
+    responses.clear();
+    responseCount.store(0, std::memory_order_release);
 }
 
-bool HttpManager::ParseUrl(const std::string& url, std::string& host, std::string& path)
+bool HttpManager::ParseUrl(const std::string& url, HttpUrl& parsed)
 {
-    std::smatch matches;
+    std::string::size_type schemeEnd = url.find("://");
+    if (schemeEnd == std::string::npos)
+    {
+        return false;
+    }
+
+    std::string scheme = url.substr(0, schemeEnd);
+    std::transform(scheme.begin(), scheme.end(), scheme.begin(), ::tolower);
+    if (scheme == "http")
+    {
+        parsed.https = false;
+    }
+    else if (scheme == "https")
+    {
+        parsed.https = true;
+    }
+    else
+    {
+        return false;
+    }
 
-    if (!std::regex_search(url, matches, parseUrlRegex))
+    std::string::size_type authorityStart = schemeEnd + 3;
+    std::string::size_type authorityEnd = url.find_first_of("/?#", authorityStart);
+    if (authorityEnd == std::string::npos)
+    {
+        authorityEnd = url.size();
+    }
+
+    // User info is dropped, credentials are passed in the headers
+    std::string authority = url.substr(authorityStart, authorityEnd - authorityStart);
+    std::string::size_type userInfoEnd = authority.rfind('@');
+    if (userInfoEnd != std::string::npos)
+    {
+        authority.erase(0, userInfoEnd + 1);
+    }
+
+    std::string::size_type portStart = std::string::npos;
+    if (!authority.empty() && authority[0] == '[')
+    {
+        // IPv6 address
+        std::string::size_type hostEnd = authority.find(']');
+        if (hostEnd == std::string::npos)
+        {
+            return false;
+        }
+        parsed.host = authority.substr(1, hostEnd - 1);
+
+        if (hostEnd + 1 < authority.size())
+        {
+            if (authority[hostEnd + 1] != ':')
+            {
+                return false;
+            }
+            portStart = hostEnd + 2;
+        }
+    }
+    else
+    {
+        std::string::size_type hostEnd = authority.find(':');
+        parsed.host = authority.substr(0, hostEnd);
+        if (hostEnd != std::string::npos)
+        {
+            portStart = hostEnd + 1;
+        }
+    }
+
+    if (parsed.host.empty())
     {
         return false;
     }
+    std::transform(parsed.host.begin(), parsed.host.end(), parsed.host.begin(), ::tolower);
+
+    // An empty port means the default one
+    parsed.port = parsed.https ? 443 : 80;
+    if (portStart != std::string::npos && portStart < authority.size())
+    {
+        int port = 0;
+        for (std::string::size_type i = portStart; i < authority.size(); ++i)
+        {
+            if (!isdigit(static_cast<unsigned char>(authority[i])))
+            {
+                return false;
+            }
+            port = port * 10 + (authority[i] - '0');
+            if (port > 65535)
+            {
+                return false;
+            }
+        }
+        if (!port)
+        {
+            return false;
+        }
+        parsed.port = port;
+    }
 
-    std::string scheme = matches[2];
-    std::string authority = matches[4];
-    std::string query = matches[7];
-    host = scheme + "://" + authority;
-    path = matches[5];
-    if (path.empty())
+    std::string::size_type fragmentStart = url.find('#', authorityEnd);
+    parsed.path = url.substr(authorityEnd, fragmentStart == std::string::npos ? std::string::npos : fragmentStart - authorityEnd);
+    if (parsed.path.empty() || parsed.path[0] != '/')
     {
-        path = "/";
+        parsed.path.insert(0, "/");
     }
-    path += (query.empty() ? "" : "?") + query;
 
     return true;
 }
 
 void HttpManager::HandleHttpResponses()
 {
-    while (!responseQueue.empty())
+    // Called every update by every state, most of the time there is nothing to handle
+    if (!responseCount.load(std::memory_order_acquire))
+        return;
+
+    std::vector<HttpResponse*> ready;
+    {
+        std::lock_guard<std::mutex> guard(responseLock);
+        ready.swap(responses);
+        responseCount.store(0, std::memory_order_release);
+    }
+
+    for (HttpResponse* res : ready)
     {
-        HttpResponse* res = *responseQueue.front();
-        responseQueue.pop();
+        if (res->last)
+            executor->Release(res);
 
-        if (res == nullptr)
+        // Locked per response, so that a long chunked body doesn't hold up the other threads
+        Forge::Guard guard(E->GetStateLock(), __FUNCTION__);
+
+        // Requested by a Lua state that was closed since
+        if (res->generation != generation.load())
         {
+            delete res;
             continue;
         }
 
-        LOCK_FORGE;
-
-        lua_State* L = Forge::GForge->L;
-
-        // Get function
-        lua_rawgeti(L, LUA_REGISTRYINDEX, res->funcRef);
+        lua_State* L = E->L;
 
-        // Push parameters
-        Forge::Push(L, res->statusCode);
-        Forge::Push(L, res->body);
-        lua_newtable(L);
-        for (const auto& item : res->headers) {
-            Forge::Push(L, item.first);
-            Forge::Push(L, item.second);
-            lua_settable(L, -3);
+        if (res->waitId)
+        {
+            E->coroutines.Wake(res->waitId, [res](lua_State* L) { return PushResponseValues(L, res); });
         }
+        // Callbacks of failed requests are not called, the error was logged.
+        // Chunked requests and downloads get the error, they may have to drop what they have.
+        else if (res->error.empty() || res->chunked || res->download)
+        {
+            // Get function
+            lua_rawgeti(L, LUA_REGISTRYINDEX, res->funcRef);
 
-        // Call function
-        Forge::GForge->ExecuteCall(3, 0);
+            // Push parameters and call function
+            E->ExecuteCall(PushResponseValues(L, res), 0);
+        }
 
-        luaL_unref(L, LUA_REGISTRYINDEX, res->funcRef);
+        if (res->last)
+            luaL_unref(L, LUA_REGISTRYINDEX, res->funcRef);
 
         delete res;
     }
@@ -1,61 +1,393 @@
 #ifndef FORGE_HTTP_MANAGER_H
 #define FORGE_HTTP_MANAGER_H
 
-#include <regex>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+#include <vector>
 
+#include "Common.h"
+// Set for every file including httplib, its classes differ with and without it
+#if defined TRINITY || defined AZEROTHCORE
+#define CPPHTTPLIB_OPENSSL_SUPPORT
+#endif
 #include "libs/httplib.h"
-#include "libs/rigtorp/SPSCQueue.h"
+
+class Forge;
+class HttpManager;
+
+// The parts of a URL HttpManager needs to send a request
+struct HttpUrl
+{
+    bool https;
+    std::string host;
+    int port;
+    // Path and query, without the fragment
+    std::string path;
+
+    // Identifies the server, connections are only reused for the same one
+    std::string GetServerKey() const;
+};
+
+struct HttpWorkItem;
+struct HttpStats;
+
+/*
+ * Responses to GET requests shared by all states, so that polling an
+ *   unchanged resource doesn't go to the network every time.
+ *
+ * Responses are kept while their `Cache-Control: max-age` says they are fresh
+ *   and answered right away. Stale responses with an ETag or Last-Modified are
+ *   revalidated, a 304 answers the request with the stored body and updates
+ *   the stored headers and validators with its own. The least recently used
+ *   responses are dropped once the cache grows past its size.
+ */
+class HttpCache
+{
+public:
+    struct Entry
+    {
+        int statusCode;
+        std::string body;
+        httplib::Headers headers;
+        std::string etag;
+        std::string lastModified;
+        // From the response's max-age in milliseconds, -1 if it had none
+        int64 maxAge;
+        // Steady clock milliseconds, revalidation moves it
+        std::atomic<int64> expiresAt;
+        size_t size;
+
+        bool IsFresh() const;
+    };
+    typedef std::shared_ptr<Entry> EntryPtr;
+
+    // `maxSize` in bytes, 0 disables the cache
+    explicit HttpCache(uint64 maxSize);
+
+    bool IsEnabled() const { return maxSize != 0; }
+    // GET requests without their own caching headers, whose whole body goes to Lua
+    static bool IsCacheable(HttpWorkItem const* req);
+    // The URL and the request headers, which may change the response
+    static std::string GetKey(HttpWorkItem const* req);
+
+    // Returns the entry of `key`, fresh or stale, or nullptr
+    EntryPtr Find(std::string const& key);
+    // Keeps a 200 response if its headers allow it, drops the old entry otherwise
+    void Store(std::string const& key, std::string const& body, httplib::Headers const& headers);
+    // Makes `entry` of `key` fresh again after a 304 with `headers` and returns it. If the 304
+    //  changed its headers or validators, returns an updated copy that replaces it instead.
+    EntryPtr Refresh(std::string const& key, EntryPtr const& entry, httplib::Headers const& headers);
+    // Counts a request answered from the cache without sending it
+    void CountHit();
+    // Counts a cacheable request that was sent and not answered with a 304
+    void CountMiss();
+
+    // Lock free, fills the cache fields
+    void GetStats(HttpStats& stats) const;
+
+private:
+    struct Slot
+    {
+        EntryPtr entry;
+        // Position in `recent`
+        std::list<std::string>::iterator itr;
+    };
+
+    // Builds the entry of a 200 response, `keep` is false if it may not be cached
+    EntryPtr NewEntry(std::string const& key, std::string const& body, httplib::Headers const& headers, bool& keep) const;
+    // Adds an entry for a key that has none and drops the least recently used ones
+    //  past `maxSize`, must be called with `lock` held
+    void Insert(std::string const& key, EntryPtr const& entry);
+    void Erase(std::unordered_map<std::string, Slot>::iterator itr);
+
+    const uint64 maxSize;
+
+    std::mutex lock;
+    std::unordered_map<std::string, Slot> entries;
+    // Keys, most recently used first
+    std::list<std::string> recent;
+    // Sum of Entry::size, changed with `lock` held and read without by GetStats
+    std::atomic<uint64> usedSize;
+    // Size of `entries` for GetStats
+    std::atomic<uint32> entryCount;
+
+    std::atomic<uint64> hits;
+    std::atomic<uint64> revalidated;
+    std::atomic<uint64> misses;
+};
 
 struct HttpWorkItem
 {
 public:
-    HttpWorkItem(int funcRef, const std::string& httpVerb, const std::string& url, const std::string& body, const std::string &contentType, const httplib::Headers& headers);
+    static const uint32 DEFAULT_CONNECT_TIMEOUT = 3000;
+    static const uint32 DEFAULT_TIMEOUT = 5000;
+    // `maxBodySize` of requests that use the configured limit
+    static const uint64 DEFAULT_MAX_BODY_SIZE = uint64(-1);
+
+    HttpWorkItem(int funcRef, const std::string& httpVerb, const std::string& url, const std::string& body, const std::string &contentType, const httplib::Headers& headers, uint64 waitId = 0);
 
     int funcRef;
+    // The coroutine waiting in AwaitHttp, 0 for requests with a callback
+    uint64 waitId;
     std::string httpVerb;
     std::string url;
     std::string body;
     std::string contentType;
     httplib::Headers headers;
+    // In milliseconds, the read and write timeouts apply to every socket operation
+    uint32 connectTimeout;
+    uint32 timeout;
+    // The body is passed to the callback in pieces of this many bytes as it arrives, 0 passes it whole
+    uint32 chunkSize;
+    // Requests with a longer body fail, 0 allows any size. DEFAULT_MAX_BODY_SIZE limits
+    //  bodies passed to Lua to Forge.HttpMaxBodySize and downloads to Forge.HttpMaxDownloadSize.
+    uint64 maxBodySize;
+    // Set by HttpDownload, the body is written to this file instead of passed to Lua
+    std::string downloadPath;
+    // Set by HttpManager::PushRequest if the cache may answer the request
+    std::string cacheKey;
+    // The stale entry the request revalidates
+    HttpCache::EntryPtr cached;
+
+    // Set by HttpManager::PushRequest
+    HttpManager* owner;
+    uint32 generation;
+    HttpUrl target;
+    std::chrono::steady_clock::time_point queuedAt;
 };
 
 struct HttpResponse
 {
 public:
-    HttpResponse(int funcRef, int statusCode, const std::string& body, const httplib::Headers& headers);
+    HttpResponse(HttpWorkItem const* req, int statusCode, std::string body, const httplib::Headers& headers, bool last = true);
+    // A request that failed without a response
+    HttpResponse(HttpWorkItem const* req, const std::string& error);
 
     int funcRef;
+    uint64 waitId;
+    uint32 generation;
+    std::chrono::steady_clock::time_point queuedAt;
     int statusCode;
     std::string body;
     httplib::Headers headers;
+    // Empty if the request got a response
+    std::string error;
+
+    bool chunked;
+    // False for the chunks of a chunked response but the last one
+    bool last;
+    bool download;
+    // Bytes written to the file of a download
+    uint64 bodySize;
 };
 
+/*
+ * Kept-alive clients by server, so that requests to the same scheme, host and
+ *   port reuse an open connection instead of paying the TCP and TLS setup again.
+ *
+ * A client is taken out of the pool for the duration of a request and given
+ *   back after it. Clients idle for longer than IDLE_TIMEOUT are closed.
+ */
+class HttpConnectionPool
+{
+public:
+    typedef std::unique_ptr<httplib::ClientImpl> ClientPtr;
 
+    static const uint32 IDLE_TIMEOUT = 30000;
+    // Idle clients kept per server, more are closed when given back
+    static const uint32 MAX_IDLE_PER_SERVER = 4;
+
+    // Returns an idle client of the server of `url`, or a new one
+    ClientPtr Acquire(HttpUrl const& url);
+    void Release(HttpUrl const& url, ClientPtr client);
+    void EvictIdle();
+    void Clear();
+
+private:
+    struct IdleClient
+    {
+        ClientPtr client;
+        std::chrono::steady_clock::time_point releasedAt;
+    };
+
+    std::mutex lock;
+    // Most recently released last
+    std::unordered_map<std::string, std::vector<IdleClient>> idle;
+};
+
+// A snapshot of the HttpExecutor counters, times in microseconds
+struct HttpStats
+{
+    // Requests accepted and not passed to Lua yet, limited by Forge.HttpQueueLimit
+    uint32 pending;
+    // Requests waiting for a worker
+    uint32 queued;
+    uint32 running;
+    uint32 limit;
+    // Requests taken by a worker
+    uint64 started;
+    // Responses passed to Lua or dropped
+    uint64 completed;
+    uint64 rejected;
+    // Summed over the started requests, from the request being made until a worker took it
+    uint64 total_wait_us;
+    uint64 max_wait_us;
+    // Summed over the completed requests, from the request being made until its response was handled
+    uint64 total_latency_us;
+    uint64 max_latency_us;
+    // Requests answered by the cache without sending them, with a 304, and sent without a usable entry
+    uint64 cache_hits;
+    uint64 cache_revalidated;
+    uint64 cache_misses;
+    uint32 cache_entries;
+    uint64 cache_size;
+};
+
+/*
+ * The worker threads that send the HTTP requests of all states.
+ *
+ * Requests are queued per server and the workers take them round robin over
+ *   the servers with queued requests. At most `maxPerServer` requests to one
+ *   server run at a time, so a slow server only holds up its own requests.
+ *   The responses are handed to the HttpManager that queued the request.
+ *   Bodies are received as they arrive, see HttpWorkItem::chunkSize and downloadPath.
+ *
+ * At most `queueLimit` requests are pending at a time, counted from Admit
+ *   until their response is passed to Lua or dropped. Further requests are
+ *   rejected right away instead of piling up behind a slow server.
+ */
+class HttpExecutor
+{
+public:
+    // `queueLimit` 0 accepts any number of requests, `maxBodySize` and `maxDownloadSize` 0 any body size, `cacheSize` 0 disables the cache
+    HttpExecutor(uint32 workerCount, uint32 maxPerServer, uint32 queueLimit, uint64 maxBodySize, uint64 maxDownloadSize, uint64 cacheSize);
+    // Waits for the running requests and drops the rest
+    ~HttpExecutor();
+
+    // Reserves room for one more request, returns false if the limit is reached
+    bool Admit();
+    // Queues an admitted request
+    void Push(HttpWorkItem* item);
+    // Frees the room of an admitted request once its response was handled or dropped
+    void Release(HttpResponse const* res);
+
+    // Lock free, may be called from any thread
+    HttpStats GetStats() const;
+
+    HttpCache& GetCache() { return cache; }
+
+    // Drops the queued requests of `owner`. With `wait` also waits until none
+    //  of its requests are running, so that no response reaches it afterwards.
+    //  Running requests stop at their next socket read once the owner changed its generation.
+    void Cancel(HttpManager* owner, bool wait);
+
+private:
+    HttpExecutor(HttpExecutor const&) = delete;
+    HttpExecutor& operator=(HttpExecutor const&) = delete;
+
+    struct ServerQueue
+    {
+        ServerQueue() : running(0) { }
+
+        std::deque<HttpWorkItem*> pending;
+        uint32 running;
+    };
+
+    // Takes the next request a worker may run, must be called with `lock` held
+    HttpWorkItem* TakeNext();
+    void Finish(HttpWorkItem* item);
+    void WorkerThread();
+
+    HttpResponse* Execute(HttpWorkItem* req);
+    // Sends the request on a pooled connection to the server of `url`
+    httplib::Result Send(HttpWorkItem* req, HttpUrl const& url, httplib::ResponseHandler const& onResponse, httplib::ContentReceiver const& onContent);
+    httplib::Result DoRequest(httplib::ClientImpl& client, HttpWorkItem* req, const std::string& path, httplib::ResponseHandler const& onResponse, httplib::ContentReceiver const& onContent);
+
+    const uint32 maxPerServer;
+    const uint32 queueLimit;
+    // Default limit of bodies passed to Lua
+    const uint64 maxBodySize;
+    // Default limit of downloads
+    const uint64 maxDownloadSize;
+
+    std::mutex lock;
+    // Notified when a request is queued or a server is below its limit again
+    std::condition_variable workAvailable;
+    std::condition_variable requestFinished;
+    // By HttpUrl::GetServerKey
+    std::unordered_map<std::string, ServerQueue> servers;
+    // Servers with queued requests in the order they get their turn
+    std::deque<std::string> turns;
+    // Running requests by owner
+    std::unordered_map<HttpManager*, uint32> running;
+    bool stopping;
+
+    std::atomic<uint32> pendingCount;
+    // Mirror `servers` and `running` for GetStats
+    std::atomic<uint32> queuedCount;
+    std::atomic<uint32> runningCount;
+    std::atomic<uint64> started;
+    std::atomic<uint64> completed;
+    std::atomic<uint64> rejected;
+    std::atomic<uint64> totalWait;
+    std::atomic<uint64> maxWait;
+    std::atomic<uint64> totalLatency;
+    std::atomic<uint64> maxLatency;
+
+    HttpConnectionPool connections;
+    HttpCache cache;
+    std::vector<std::thread> workers;
+};
+
+/*
+ * The HTTP requests of one state. Requests are sent by the shared HttpExecutor,
+ *   the responses are queued here until HandleHttpResponses passes them to Lua.
+ */
 class HttpManager
 {
 public:
-    HttpManager();
+    HttpManager(Forge* E);
     ~HttpManager();
 
-    void StartHttpWorker();
-    void StopHttpWorker();
-    void PushRequest(HttpWorkItem* item);
+    // Creates the executor of all states, called on startup
+    static void Initialize(uint32 workerCount, uint32 maxPerServer, uint32 queueLimit, uint64 maxBodySize, uint64 maxDownloadSize, uint64 cacheSize);
+    static void Uninitialize();
+    static HttpStats GetStats();
+
+    // Takes ownership of `item`. Returns false and deletes it if too many requests are pending.
+    bool PushRequest(HttpWorkItem* item);
+    // Called by the executor from its workers
+    void PushResponse(HttpResponse* res);
+    // False once Reset or the destructor dropped the requests of `generation`, running requests stop then
+    bool IsCurrent(uint32 generation) const { return this->generation.load() == generation; }
     void HandleHttpResponses();
+    // Drops the queued requests and responses, the responses of running requests are ignored.
+    // Called when the Lua state closes.
+    void Reset();
+
+    // Splits an absolute http or https URL, returns false if it is malformed
+    static bool ParseUrl(const std::string& url, HttpUrl& parsed);
 
 private:
     void ClearQueues();
-    void HttpWorkerThread();
-    bool ParseUrl(const std::string& url, std::string& host, std::string& path);
-    httplib::Result DoRequest(httplib::Client& client, HttpWorkItem* req, const std::string& path);
-
-    rigtorp::SPSCQueue<HttpWorkItem*> workQueue;
-    rigtorp::SPSCQueue<HttpResponse*> responseQueue;
-    std::thread workerThread;
-    bool startedWorkerThread;
-    std::atomic_bool cancelationToken;
-    std::condition_variable condVar;
-    std::mutex condVarMutex;
-    std::regex parseUrlRegex;
+
+    static HttpExecutor* executor;
+
+    // The state the callbacks are called in
+    Forge* E;
+    // Changes on Reset, responses of older requests are dropped
+    std::atomic<uint32> generation;
+    std::mutex responseLock;
+    std::vector<HttpResponse*> responses;
+    // Size of `responses`, checked without locking by HandleHttpResponses
+    std::atomic<uint32> responseCount;
 };
 
 #endif // #ifndef FORGE_HTTP_MANAGER_H
@@ -0,0 +1,224 @@
+/*
+* Copyright (C) 2010 - 2016 Forge Lua Engine <http://emudevs.com/>
+* This program is free software licensed under GPL version 3
+* Please see the included DOCS/LICENSE.md for more information
+*/
+
+#include "LockStats.h"
+
+#ifdef FORGE_LOCK_STATS
+
+#include <algorithm>
+#include <atomic>
+#include <functional>
+#include <map>
+#include <utility>
+
+namespace
+{
+    struct Counters
+    {
+        // Set once by the owning thread, `lock` last
+        std::atomic<const char*> lock;
+        std::atomic<const char*> tag;
+        std::atomic<uint64> acquisitions;
+        std::atomic<uint64> waitTicks;
+        std::atomic<uint64> maxWaitTicks;
+        std::atomic<uint64> holdTicks;
+        std::atomic<uint64> maxHoldTicks;
+    };
+
+    /*
+     * The counters of one thread, an open addressing table keyed by lock and tag.
+     *
+     * Only the owning thread writes, other threads only read. A block is
+     *   never freed: when its thread exits the block is handed to the next new
+     *   thread, so that the totals are kept.
+     */
+    struct ThreadCounters
+    {
+        static const uint32 SLOT_COUNT = 256;
+
+        Counters slots[SLOT_COUNT];
+        // Used once all slots are taken
+        Counters overflow;
+        bool inUse;
+    };
+
+    std::mutex registryLock;
+    std::vector<ThreadCounters*> registry;
+
+    ThreadCounters* AcquireThreadCounters()
+    {
+        std::lock_guard<std::mutex> guard(registryLock);
+        for (ThreadCounters* counters : registry)
+        {
+            if (!counters->inUse)
+            {
+                counters->inUse = true;
+                return counters;
+            }
+        }
+
+        ThreadCounters* counters = new ThreadCounters();
+        counters->overflow.lock.store("(overflow)", std::memory_order_relaxed);
+        counters->inUse = true;
+        registry.push_back(counters);
+        return counters;
+    }
+
+    thread_local ThreadCounters* threadCounters = NULL;
+    // Set once the thread's counters were handed back, locks taken later on are not recorded
+    thread_local bool threadRetired = false;
+
+    struct ThreadCountersHandle
+    {
+        ~ThreadCountersHandle()
+        {
+            std::lock_guard<std::mutex> guard(registryLock);
+            threadCounters->inUse = false;
+            threadCounters = NULL;
+            threadRetired = true;
+        }
+    };
+
+    Counters* GetCounters(const char* lock, const char* tag)
+    {
+        if (!threadCounters)
+        {
+            if (threadRetired)
+                return NULL;
+
+            threadCounters = AcquireThreadCounters();
+            thread_local ThreadCountersHandle handle;
+        }
+
+        std::size_t hash = std::hash<const void*>()(lock) ^ (std::hash<const void*>()(tag) * 31);
+        for (uint32 i = 0; i < ThreadCounters::SLOT_COUNT; ++i)
+        {
+            Counters& slot = threadCounters->slots[(hash + i) % ThreadCounters::SLOT_COUNT];
+            const char* slotLock = slot.lock.load(std::memory_order_relaxed);
+            if (!slotLock)
+            {
+                slot.tag.store(tag, std::memory_order_relaxed);
+                slot.lock.store(lock, std::memory_order_release);
+                return &slot;
+            }
+
+            if (slotLock == lock && slot.tag.load(std::memory_order_relaxed) == tag)
+                return &slot;
+        }
+        return &threadCounters->overflow;
+    }
+
+    // Single writer, so a load and a store is enough
+    void Add(std::atomic<uint64>& counter, uint64 value)
+    {
+        counter.store(counter.load(std::memory_order_relaxed) + value, std::memory_order_relaxed);
+    }
+
+    void Max(std::atomic<uint64>& counter, uint64 value)
+    {
+        if (value > counter.load(std::memory_order_relaxed))
+            counter.store(value, std::memory_order_relaxed);
+    }
+}
+
+void LockStats::RecordAcquire(const char* lock, const char* tag, uint64 waitTicks)
+{
+    Counters* counters = GetCounters(lock, tag);
+    if (!counters)
+        return;
+
+    Add(counters->acquisitions, 1);
+    Add(counters->waitTicks, waitTicks);
+    Max(counters->maxWaitTicks, waitTicks);
+}
+
+void LockStats::RecordHold(const char* lock, const char* tag, uint64 holdTicks)
+{
+    Counters* counters = GetCounters(lock, tag);
+    if (!counters)
+        return;
+
+    Add(counters->holdTicks, holdTicks);
+    Max(counters->maxHoldTicks, holdTicks);
+}
+
+std::vector<LockStats::Summary> LockStats::GetTop(size_t count)
+{
+    struct Totals
+    {
+        uint64 acquisitions;
+        uint64 waitTicks;
+        uint64 maxWaitTicks;
+        uint64 holdTicks;
+        uint64 maxHoldTicks;
+    };
+
+    std::map<std::pair<const char*, const char*>, Totals> totals;
+    {
+        std::lock_guard<std::mutex> guard(registryLock);
+        for (ThreadCounters* thread : registry)
+        {
+            for (uint32 i = 0; i <= ThreadCounters::SLOT_COUNT; ++i)
+            {
+                Counters& slot = i < ThreadCounters::SLOT_COUNT ? thread->slots[i] : thread->overflow;
+                const char* lock = slot.lock.load(std::memory_order_acquire);
+                if (!lock)
+                    continue;
+
+                Totals& total = totals[std::make_pair(lock, slot.tag.load(std::memory_order_relaxed))];
+                total.acquisitions += slot.acquisitions.load(std::memory_order_relaxed);
+                total.waitTicks += slot.waitTicks.load(std::memory_order_relaxed);
+                total.maxWaitTicks = std::max(total.maxWaitTicks, slot.maxWaitTicks.load(std::memory_order_relaxed));
+                total.holdTicks += slot.holdTicks.load(std::memory_order_relaxed);
+                total.maxHoldTicks = std::max(total.maxHoldTicks, slot.maxHoldTicks.load(std::memory_order_relaxed));
+            }
+        }
+    }
+
+    std::vector<Summary> summaries;
+    summaries.reserve(totals.size());
+    for (auto const& total : totals)
+    {
+        if (!total.second.acquisitions)
+            continue;
+
+        Summary summary;
+        summary.lock = total.first.first;
+        summary.tag = total.first.second ? total.first.second : "?";
+        summary.acquisitions = total.second.acquisitions;
+        summary.wait_us = HookClock::TicksToMicroseconds(total.second.waitTicks);
+        summary.max_wait_us = HookClock::TicksToMicroseconds(total.second.maxWaitTicks);
+        summary.hold_us = HookClock::TicksToMicroseconds(total.second.holdTicks);
+        summary.max_hold_us = HookClock::TicksToMicroseconds(total.second.maxHoldTicks);
+        summaries.push_back(summary);
+    }
+
+    std::sort(summaries.begin(), summaries.end(), [](Summary const& lhs, Summary const& rhs)
+    {
+        return lhs.wait_us > rhs.wait_us;
+    });
+
+    if (summaries.size() > count)
+        summaries.resize(count);
+    return summaries;
+}
+
+#else
+
+void LockStats::RecordAcquire(const char* /*lock*/, const char* /*tag*/, uint64 /*waitTicks*/)
+{
+}
+
+void LockStats::RecordHold(const char* /*lock*/, const char* /*tag*/, uint64 /*holdTicks*/)
+{
+}
+
+std::vector<LockStats::Summary> LockStats::GetTop(size_t /*count*/)
+{
+    return std::vector<LockStats::Summary>();
+}
+
+#endif // FORGE_LOCK_STATS
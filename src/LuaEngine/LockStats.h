@@ -0,0 +1,145 @@
+/*
+* Copyright (C) 2010 - 2016 Forge Lua Engine <http://emudevs.com/>
+* This program is free software licensed under GPL version 3
+* Please see the included DOCS/LICENSE.md for more information
+*/
+
+#ifndef _LOCK_STATS_H
+#define _LOCK_STATS_H
+
+#include <mutex>
+#include <string>
+#include <vector>
+#include "Common.h"
+#include "HookStats.h"
+
+/*
+ * Contention statistics of the Forge locks.
+ *
+ * Only compiled in when FORGE_LOCK_STATS is defined, otherwise
+ *   `InstrumentedLock` is the plain mutex and `TaggedGuard` a `std::lock_guard`.
+ *
+ * Every acquisition records the time spent waiting for the lock and, once the
+ *   outermost recursive acquisition is released, the time the lock was held.
+ *   The numbers are kept per lock name and call site tag in counters owned by
+ *   the recording thread, so recording takes no locks and does no atomic
+ *   read-modify-write. `GetTop` sums the counters of all threads.
+ */
+namespace LockStats
+{
+    struct Summary
+    {
+        const char* lock;
+        const char* tag;
+        uint64 acquisitions;
+        double wait_us;
+        double max_wait_us;
+        double hold_us;
+        double max_hold_us;
+    };
+
+#ifdef FORGE_LOCK_STATS
+    inline bool IsEnabled() { return true; }
+#else
+    inline bool IsEnabled() { return false; }
+#endif
+
+    // Called by `InstrumentedLock`, `tag` may be NULL
+    void RecordAcquire(const char* lock, const char* tag, uint64 waitTicks);
+    void RecordHold(const char* lock, const char* tag, uint64 holdTicks);
+
+    // The `count` lock and call site pairs with the most total wait time
+    std::vector<Summary> GetTop(size_t count);
+}
+
+#ifdef FORGE_LOCK_STATS
+
+/*
+ * A `Mutex` that records its contention in LockStats under `name`.
+ *
+ * Lock it with `TaggedGuard` to record the call site as well.
+ */
+template<typename Mutex>
+class InstrumentedLock
+{
+public:
+    explicit InstrumentedLock(const char* name) : name(name), depth(0), acquiredAt(0), holdTag(NULL) { }
+
+    void lock() { lock(NULL); }
+
+    void lock(const char* tag)
+    {
+        uint64 start = HookClock::Now();
+        mutex.lock();
+        uint64 acquired = HookClock::Now();
+
+        // Only the owner gets here, so the members need no synchronization
+        if (!depth++)
+        {
+            acquiredAt = acquired;
+            holdTag = tag;
+        }
+        LockStats::RecordAcquire(name, tag, acquired - start);
+    }
+
+    void unlock()
+    {
+        if (--depth)
+        {
+            mutex.unlock();
+            return;
+        }
+
+        uint64 held = HookClock::Now() - acquiredAt;
+        const char* tag = holdTag;
+        mutex.unlock();
+        LockStats::RecordHold(name, tag, held);
+    }
+
+private:
+    InstrumentedLock(InstrumentedLock const&) = delete;
+    InstrumentedLock& operator=(InstrumentedLock const&) = delete;
+
+    Mutex mutex;
+    const char* const name;
+    uint32 depth;
+    uint64 acquiredAt;
+    const char* holdTag;
+};
+
+template<typename Lock>
+class TaggedGuard
+{
+public:
+    explicit TaggedGuard(Lock& lock, const char* tag = NULL) : lock(lock) { lock.lock(tag); }
+    ~TaggedGuard() { lock.unlock(); }
+
+private:
+    TaggedGuard(TaggedGuard const&) = delete;
+    TaggedGuard& operator=(TaggedGuard const&) = delete;
+
+    Lock& lock;
+};
+
+#else
+
+template<typename Mutex>
+class InstrumentedLock : public Mutex
+{
+public:
+    explicit InstrumentedLock(const char* /*name*/) { }
+};
+
+template<typename Lock>
+class TaggedGuard
+{
+public:
+    explicit TaggedGuard(Lock& lock, const char* /*tag*/ = NULL) : guard(lock) { }
+
+private:
+    std::lock_guard<Lock> guard;
+};
+
+#endif // FORGE_LOCK_STATS
+
+#endif // _LOCK_STATS_H
@@ -0,0 +1,241 @@
+/*
+* Copyright (C) 2010 - 2016 Forge Lua Engine <http://emudevs.com/>
+* This program is free software licensed under GPL version 3
+* Please see the included DOCS/LICENSE.md for more information
+*/
+
+#include "LuaAllocator.h"
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include <new>
+
+// Pooled blocks are reused without going through malloc, so AddressSanitizer only
+//  sees their accesses if the pool poisons the free ones itself
+#if defined(__SANITIZE_ADDRESS__)
+#define FORGE_POISON_POOL
+#elif defined(__has_feature)
+#if __has_feature(address_sanitizer)
+#define FORGE_POISON_POOL
+#endif
+#endif
+
+#ifdef FORGE_POISON_POOL
+#include <sanitizer/asan_interface.h>
+#define POISON(ptr, size) ASAN_POISON_MEMORY_REGION(ptr, size)
+#define UNPOISON(ptr, size) ASAN_UNPOISON_MEMORY_REGION(ptr, size)
+#else
+#define POISON(ptr, size) ((void)(ptr), (void)(size))
+#define UNPOISON(ptr, size) ((void)(ptr), (void)(size))
+#endif
+
+LuaAllocator::LuaAllocator()
+{
+    std::memset(classes, 0, sizeof(classes));
+    std::memset(&stats, 0, sizeof(stats));
+}
+
+LuaAllocator::~LuaAllocator()
+{
+    Release();
+}
+
+void LuaAllocator::Release()
+{
+    for (void* slab : slabs)
+        std::free(slab);
+    slabs.clear();
+
+    std::memset(classes, 0, sizeof(classes));
+    std::memset(&stats, 0, sizeof(stats));
+}
+
+/*
+ * Size classes are 16 byte steps up to 128 bytes, 32 byte steps up to 256
+ *   bytes and 64 byte steps up to MAX_POOLED_SIZE, 16 classes in total.
+ *   Every class is a multiple of 16 bytes, so all blocks are 16 byte aligned.
+ */
+size_t LuaAllocator::GetClassIndex(size_t size)
+{
+    if (size <= 128)
+        return (size + 15) / 16 - 1;
+    if (size <= 256)
+        return 8 + (size - 129) / 32;
+    return 12 + (size - 257) / 64;
+}
+
+size_t LuaAllocator::GetClassSize(size_t index)
+{
+    if (index < 8)
+        return (index + 1) * 16;
+    if (index < 12)
+        return 128 + (index - 7) * 32;
+    return 256 + (index - 11) * 64;
+}
+
+// Makes the first `size` bytes of a pooled block addressable and the rest of it not
+static inline void Expose(void* ptr, size_t size, size_t blockSize)
+{
+    POISON(ptr, blockSize);
+    UNPOISON(ptr, size);
+}
+
+void* LuaAllocator::Alloc(void* ud, void* ptr, size_t osize, size_t nsize)
+{
+    LuaAllocator* allocator = static_cast<LuaAllocator*>(ud);
+
+    // Since Lua 5.2 `osize` is the type of the new object when `ptr` is NULL
+    if (!ptr)
+        osize = 0;
+
+    if (!nsize)
+    {
+        if (ptr)
+            allocator->Free(ptr, osize);
+        return NULL;
+    }
+
+    if (!ptr)
+        return allocator->Allocate(nsize);
+
+    return allocator->Reallocate(ptr, osize, nsize);
+}
+
+void* LuaAllocator::Allocate(size_t size)
+{
+    void* ptr = NULL;
+    if (size <= MAX_POOLED_SIZE)
+    {
+        size_t index = GetClassIndex(size);
+        size_t blockSize = GetClassSize(index);
+        SizeClass& sizeClass = classes[index];
+        if (sizeClass.freeList)
+        {
+            ptr = sizeClass.freeList;
+            UNPOISON(ptr, sizeof(FreeBlock));
+            sizeClass.freeList = sizeClass.freeList->next;
+        }
+        else
+        {
+            if (size_t(sizeClass.bumpEnd - sizeClass.bump) < blockSize)
+            {
+                // The rest of the previous slab is too small and left unused
+                char* slab = static_cast<char*>(std::malloc(SLAB_SIZE));
+                if (!slab)
+                    return NULL;
+
+                try
+                {
+                    slabs.push_back(slab);
+                }
+                catch (std::bad_alloc const&)
+                {
+                    std::free(slab);
+                    return NULL;
+                }
+
+                POISON(slab, SLAB_SIZE);
+                sizeClass.bump = slab;
+                sizeClass.bumpEnd = slab + SLAB_SIZE;
+                stats.slabBytes += SLAB_SIZE;
+            }
+
+            ptr = sizeClass.bump;
+            sizeClass.bump += blockSize;
+        }
+        Expose(ptr, size, blockSize);
+        ++stats.pooledAllocations;
+    }
+    else
+    {
+        ptr = std::malloc(size);
+        if (!ptr)
+            return NULL;
+    }
+
+    ++stats.allocations;
+    stats.liveBytes += size;
+    stats.peakBytes = std::max(stats.peakBytes, stats.liveBytes);
+    return ptr;
+}
+
+void LuaAllocator::Free(void* ptr, size_t size)
+{
+    if (size <= MAX_POOLED_SIZE)
+    {
+        size_t index = GetClassIndex(size);
+        SizeClass& sizeClass = classes[index];
+        FreeBlock* block = static_cast<FreeBlock*>(ptr);
+        UNPOISON(block, sizeof(FreeBlock));
+        block->next = sizeClass.freeList;
+        sizeClass.freeList = block;
+        POISON(ptr, GetClassSize(index));
+    }
+    else
+        std::free(ptr);
+
+    ++stats.frees;
+    stats.liveBytes -= size;
+}
+
+void* LuaAllocator::Reallocate(void* ptr, size_t osize, size_t nsize)
+{
+    bool oldPooled = osize <= MAX_POOLED_SIZE;
+    bool newPooled = nsize <= MAX_POOLED_SIZE;
+
+    // The block already has room for the new size
+    if (oldPooled && newPooled && GetClassIndex(osize) == GetClassIndex(nsize))
+    {
+        Expose(ptr, nsize, GetClassSize(GetClassIndex(nsize)));
+        stats.liveBytes = stats.liveBytes - osize + nsize;
+        stats.peakBytes = std::max(stats.peakBytes, stats.liveBytes);
+        return ptr;
+    }
+
+    if (!oldPooled && !newPooled)
+    {
+        void* newPtr = std::realloc(ptr, nsize);
+        if (!newPtr)
+            return nsize <= osize ? KeepShrunk(ptr, osize, nsize) : NULL;
+
+        stats.liveBytes = stats.liveBytes - osize + nsize;
+        stats.peakBytes = std::max(stats.peakBytes, stats.liveBytes);
+        return newPtr;
+    }
+
+    void* newPtr = Allocate(nsize);
+    if (!newPtr)
+    {
+        if (nsize > osize)
+            return NULL;
+
+        // A heap block is freed to the pool from now on, so it must go away with the slabs
+        if (!oldPooled)
+        {
+            try
+            {
+                slabs.push_back(ptr);
+            }
+            catch (std::bad_alloc const&)
+            {
+                // Leaks the block once the state closes, better than failing the shrink
+            }
+        }
+        return KeepShrunk(ptr, osize, nsize);
+    }
+
+    std::memcpy(newPtr, ptr, std::min(osize, nsize));
+    Free(ptr, osize);
+    return newPtr;
+}
+
+/*
+ * Lua requires shrinking a block to never fail, so when the smaller block can't
+ *   be allocated the old one is kept. It is freed as a block of `nsize` later,
+ *   which only wastes the difference.
+ */
+void* LuaAllocator::KeepShrunk(void* ptr, size_t osize, size_t nsize)
+{
+    stats.liveBytes = stats.liveBytes - osize + nsize;
+    return ptr;
+}
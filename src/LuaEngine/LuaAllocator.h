@@ -0,0 +1,86 @@
+/*
+* Copyright (C) 2010 - 2016 Forge Lua Engine <http://emudevs.com/>
+* This program is free software licensed under GPL version 3
+* Please see the included DOCS/LICENSE.md for more information
+*/
+
+#ifndef _LUA_ALLOCATOR_H
+#define _LUA_ALLOCATOR_H
+
+#include <cstddef>
+#include <vector>
+#include "Common.h"
+
+/*
+ * A pooling `lua_Alloc` for one Lua state.
+ *
+ * Blocks up to MAX_POOLED_SIZE bytes are carved from SLAB_SIZE slabs and kept
+ *   in a free list per size class, larger blocks go to malloc. A Lua state is
+ *   only ever used by one thread at a time, so the pool needs no locking.
+ *
+ * Pass `LuaAllocator::Alloc` and the allocator to `lua_newstate`.
+ *   The allocator must outlive the state, and `Release` must only be called
+ *   after `lua_close`.
+ */
+class LuaAllocator
+{
+public:
+    static const size_t SLAB_SIZE = 64 * 1024;
+    static const size_t MAX_POOLED_SIZE = 512;
+
+    struct Stats
+    {
+        // Bytes requested by Lua and not yet freed
+        uint64 liveBytes;
+        uint64 peakBytes;
+        uint64 allocations;
+        uint64 frees;
+        // Allocations served from the slabs, the rest went to malloc
+        uint64 pooledAllocations;
+        // Bytes reserved by the slabs
+        uint64 slabBytes;
+    };
+
+    LuaAllocator();
+    ~LuaAllocator();
+
+    static void* Alloc(void* ud, void* ptr, size_t osize, size_t nsize);
+
+    Stats const& GetStats() const { return stats; }
+
+    // Frees the slabs and resets the stats
+    void Release();
+
+private:
+    LuaAllocator(LuaAllocator const&) = delete;
+    LuaAllocator& operator=(LuaAllocator const&) = delete;
+
+    static const size_t CLASS_COUNT = 16;
+
+    struct FreeBlock
+    {
+        FreeBlock* next;
+    };
+
+    struct SizeClass
+    {
+        FreeBlock* freeList;
+        // Unused tail of the last slab given to this class
+        char* bump;
+        char* bumpEnd;
+    };
+
+    static size_t GetClassIndex(size_t size);
+    static size_t GetClassSize(size_t index);
+
+    void* Allocate(size_t size);
+    void Free(void* ptr, size_t size);
+    void* Reallocate(void* ptr, size_t osize, size_t nsize);
+    void* KeepShrunk(void* ptr, size_t osize, size_t nsize);
+
+    SizeClass classes[CLASS_COUNT];
+    std::vector<void*> slabs;
+    Stats stats;
+};
+
+#endif // _LUA_ALLOCATOR_H
@@ -11,10 +11,14 @@
 #include "ForgeCompat.h"
 #include "ForgeEventMgr.h"
 #include "ForgeIncludes.h"
+#include "ForgeMetrics.h"
 #include "ForgeTemplate.h"
 #include "ForgeUtility.h"
 #include "ForgeCreatureAI.h"
 #include "ForgeInstanceAI.h"
+#include "lmarshal.h"
+#include <iomanip>
+#include <sstream>
 
 #if defined(TRINITY_PLATFORM) && defined(TRINITY_PLATFORM_WINDOWS)
 #if TRINITY_PLATFORM == TRINITY_PLATFORM_WINDOWS
@@ -64,15 +68,37 @@ std::string Forge::m_requirecPath;
 Forge* Forge::GForge = NULL;
 bool Forge::reload = false;
 bool Forge::initialized = false;
-Forge::LockType Forge::lock;
+Forge::LockType Forge::lock("LOCK_FORGE");
+bool Forge::mapStates = false;
+char Forge::stateKey;
+LuaWorkerPool* Forge::workerPool = NULL;
+MapStateRegistry Forge::mapStateRegistry;
+char ForgeObjectCache::key;
+std::atomic<uint32> ForgeObjectCache::destroyEpoch(0);
 
 extern void RegisterFunctions(Forge* E);
 
+// Returns "source:line" of the function at `index`, for diagnostics
+static std::string GetFunctionSource(lua_State* L, int index)
+{
+    lua_Debug ar;
+    lua_pushvalue(L, index);
+    if (!lua_getinfo(L, ">S", &ar))
+        return "?";
+
+    std::ostringstream ss;
+    ss << ar.short_src << ":" << ar.linedefined;
+    return ss.str();
+}
+
 void Forge::Initialize()
 {
     LOCK_FORGE;
     ASSERT(!IsInitialized());
 
+    // Before any state exists, so reporting times never waits for the calibration
+    HookClock::Calibrate();
+
 #if defined TRINITY || AZEROTHCORE
     // For instance data the data column needs to be able to hold more than 255 characters (tinytext)
     // so we change it to TEXT automatically on startup
@@ -81,6 +107,49 @@ void Forge::Initialize()
 
     LoadScriptPaths();
 
+#if defined(AZEROTHCORE)
+    mapStates = eConfigMgr->GetOption<bool>("Forge.MapStates", false);
+#else
+    mapStates = eConfigMgr->GetBoolDefault("Forge.MapStates", false);
+#endif
+
+#if defined(AZEROTHCORE)
+    uint32 asyncWorkers = eConfigMgr->GetOption<uint32>("Forge.AsyncWorkers", 2);
+    uint32 asyncTimeout = eConfigMgr->GetOption<uint32>("Forge.AsyncTimeout", 30000);
+#else
+    uint32 asyncWorkers = eConfigMgr->GetIntDefault("Forge.AsyncWorkers", 2);
+    uint32 asyncTimeout = eConfigMgr->GetIntDefault("Forge.AsyncTimeout", 30000);
+#endif
+    if (asyncWorkers)
+        workerPool = new LuaWorkerPool(asyncWorkers, asyncTimeout);
+
+#if defined(AZEROTHCORE)
+    uint32 httpWorkers = eConfigMgr->GetOption<uint32>("Forge.HttpWorkers", 2);
+    uint32 httpMaxPerHost = eConfigMgr->GetOption<uint32>("Forge.HttpMaxPerHost", 2);
+    uint32 httpQueueLimit = eConfigMgr->GetOption<uint32>("Forge.HttpQueueLimit", 1000);
+    uint32 httpMaxBodySize = eConfigMgr->GetOption<uint32>("Forge.HttpMaxBodySize", 16777216);
+    uint32 httpMaxDownloadSize = eConfigMgr->GetOption<uint32>("Forge.HttpMaxDownloadSize", 1073741824);
+    uint32 httpCacheSize = eConfigMgr->GetOption<uint32>("Forge.HttpCacheSize", 8388608);
+#else
+    uint32 httpWorkers = eConfigMgr->GetIntDefault("Forge.HttpWorkers", 2);
+    uint32 httpMaxPerHost = eConfigMgr->GetIntDefault("Forge.HttpMaxPerHost", 2);
+    uint32 httpQueueLimit = eConfigMgr->GetIntDefault("Forge.HttpQueueLimit", 1000);
+    uint32 httpMaxBodySize = eConfigMgr->GetIntDefault("Forge.HttpMaxBodySize", 16777216);
+    uint32 httpMaxDownloadSize = eConfigMgr->GetIntDefault("Forge.HttpMaxDownloadSize", 1073741824);
+    uint32 httpCacheSize = eConfigMgr->GetIntDefault("Forge.HttpCacheSize", 8388608);
+#endif
+    HttpManager::Initialize(httpWorkers, httpMaxPerHost, httpQueueLimit, httpMaxBodySize, httpMaxDownloadSize, httpCacheSize);
+
+#if defined(AZEROTHCORE)
+    std::string metricsAddress = eConfigMgr->GetOption<std::string>("Forge.MetricsAddress", "127.0.0.1");
+    uint32 metricsPort = eConfigMgr->GetOption<uint32>("Forge.MetricsPort", 0);
+#else
+    std::string metricsAddress = eConfigMgr->GetStringDefault("Forge.MetricsAddress", "127.0.0.1");
+    uint32 metricsPort = eConfigMgr->GetIntDefault("Forge.MetricsPort", 0);
+#endif
+    if (metricsPort)
+        ForgeMetrics::Start(metricsAddress, metricsPort);
+
     // Must be before creating GForge
     // This is checked on Forge creation
     initialized = true;
@@ -94,15 +163,32 @@ void Forge::Uninitialize()
     LOCK_FORGE;
     ASSERT(IsInitialized());
 
+    // Scrapes read the HTTP statistics
+    ForgeMetrics::Stop();
+
     delete GForge;
     GForge = NULL;
 
+    // All maps are unloaded by now, but be safe
+    for (MapStateRegistry::Ref* ref : mapStateRegistry.RemoveAll())
+        RetireMapState(ref);
+
+    delete workerPool;
+    workerPool = NULL;
+
+    HttpManager::Uninitialize();
+
     lua_scripts.clear();
     lua_extensions.clear();
 
     initialized = false;
 }
 
+static bool ScriptPathComparator(const LuaScript& first, const LuaScript& second)
+{
+    return first.filepath < second.filepath;
+}
+
 void Forge::LoadScriptPaths()
 {
     uint32 oldMSTime = ForgeUtil::GetCurrTime();
@@ -141,6 +227,10 @@ void Forge::LoadScriptPaths()
     if (!m_requirecPath.empty())
         m_requirecPath.erase(m_requirecPath.end() - 1);
 
+    // Sorted once here, as map states read the lists from several threads
+    lua_extensions.sort(ScriptPathComparator);
+    lua_scripts.sort(ScriptPathComparator);
+
     FORGE_LOG_DEBUG("[Forge]: Loaded {} scripts in {} ms", lua_scripts.size() + lua_extensions.size(), ForgeUtil::GetTimeDiff(oldMSTime));
 }
 
@@ -154,33 +244,120 @@ void Forge::_ReloadForge()
     else
         ChatHandler(nullptr).SendGMText(SERVER_MSG_STRING, "Reloading Forge...");
 
+    // Reload script paths
+    LoadScriptPaths();
+
+    sForge->ReloadState();
+
+    // Map states are only updated by map threads, which are idle during the world update
+    mapStateRegistry.ForEachState([](Forge* E) { E->ReloadState(); });
+
+    reload = false;
+}
+
+void Forge::ReloadState()
+{
+    LOCK_FORGE_STATE;
+
     // Remove all timed events
-    sForge->eventMgr->SetStates(LUAEVENT_STATE_ERASE);
+    eventMgr->SetStates(LUAEVENT_STATE_ERASE);
 
     // Close lua
-    sForge->CloseLua();
-
-    // Reload script paths
-    LoadScriptPaths();
+    CloseLua();
 
     // Open new lua and libaraies
-    sForge->OpenLua();
+    OpenLua();
 
     // Run scripts from laoded paths
-    sForge->RunScripts();
+    RunScripts();
+}
 
-    reload = false;
+Forge* Forge::GetMapForge(Map const* map)
+{
+    if (!mapStates || !map)
+        return GForge;
+
+    Forge* E = mapStateRegistry.Find(MapStateRegistry::GetKey(map->GetId(), map->GetInstanceId()));
+    return E ? E : GForge;
 }
 
-Forge::Forge() :
+Forge** Forge::GetEventStateRef(WorldObject const* obj, Map const* map)
+{
+    // Players are scripted by the global state
+    if (obj->GetTypeId() == TYPEID_PLAYER)
+        return &GForge;
+    return GetMapForge(map)->GetStateRef();
+}
+
+void Forge::CreateMapState(Map* map)
+{
+    if (!mapStates)
+        return;
+
+    MapStateRegistry::Ref* ref = mapStateRegistry.Add(MapStateRegistry::GetKey(map->GetId(), map->GetInstanceId()));
+
+    // Scripts are run before the state is published, no hooks reach it until then
+    Forge* E = new Forge(map, &ref->state);
+    E->RunScripts();
+
+    mapStateRegistry.Publish(ref, E);
+}
+
+void Forge::DestroyMapState(Map* map)
+{
+    if (!mapStates)
+        return;
+
+    if (MapStateRegistry::Ref* ref = mapStateRegistry.Remove(MapStateRegistry::GetKey(map->GetId(), map->GetInstanceId())))
+        RetireMapState(ref);
+}
+
+/*
+ * Destroys the state of a ref that was taken out of `mapStateRegistry`.
+ *   The ref itself goes away with its last ForgeEventProcessor.
+ */
+void Forge::RetireMapState(MapStateRegistry::Ref* ref)
+{
+    // The state's own processors are released while it's deleted
+    delete mapStateRegistry.Retire(ref);
+    mapStateRegistry.Release(ref);
+}
+
+void Forge::RetainStateRef(Forge** ref)
+{
+    if (ref == &GForge)
+        return;
+
+    mapStateRegistry.Retain(reinterpret_cast<MapStateRegistry::Ref*>(ref));
+}
+
+void Forge::ReleaseStateRef(Forge** ref)
+{
+    if (ref == &GForge)
+        return;
+
+    mapStateRegistry.Release(reinterpret_cast<MapStateRegistry::Ref*>(ref));
+}
+
+Forge::Forge(Map* map, Forge** ref) :
+stateMap(map),
+stateRef(ref),
+stateLock("MapState"),
 event_level(0),
 push_counter(0),
 enabled(false),
+useTraceBack(false),
+usesLuaAllocator(false),
+countHookSet(false),
+asyncStateId(0),
+publishedHeap(0),
+metricsTimer(0),
 
 L(NULL),
 eventMgr(NULL),
-httpManager(),
+httpManager(this),
 queryProcessor(),
+coroutines(this),
 
 ServerEventBindings(NULL),
 PlayerEventBindings(NULL),
@@ -206,11 +383,8 @@ CreatureUniqueBindings(NULL)
 
     OpenLua();
 
-    // Replace this with map insert if making multithread version
-
-    // Set event manager. Must be after setting sForge
-    // on multithread have a map of state pointers and here insert this pointer to the map and then save a pointer of that pointer to the EventMgr
-    eventMgr = new EventMgr(&Forge::GForge);
+    // Timed events find the state through `stateRef`, so that they can tell when it is gone
+    eventMgr = new EventMgr(stateRef);
 }
 
 Forge::~Forge()
@@ -227,19 +401,40 @@ void Forge::CloseLua()
 {
     OnLuaStateClose();
 
+    if (profiler.IsRunning())
+        StopProfile(NULL);
+
     DestroyBindStores();
 
+    // Drops the jobs of this state, their callbacks are about to go away
+    if (workerPool)
+        workerPool->CancelState(asyncStateId);
+
+    // Requests still queued or running would call back into the closed state
+    httpManager.Reset();
+    coroutines.Clear();
+
     // Must close lua state after deleting stores and mgr
     if (L)
         lua_close(L);
     L = NULL;
 
+    ForgeMetrics::AddLuaHeap(-publishedHeap);
+    publishedHeap = 0;
+
+    // Every block was freed by lua_close
+    luaAllocator.Release();
+    usesLuaAllocator = false;
+    countHookSet = false;
+
     instanceDataRefs.clear();
     continentDataRefs.clear();
 }
 
 void Forge::OpenLua()
 {
+    asyncStateId = LuaWorkerPool::NewStateId();
+
 #if defined(AZEROTHCORE)
     enabled = eConfigMgr->GetOption<bool>("Forge.Enabled", true);
 #else
@@ -252,10 +447,34 @@ void Forge::OpenLua()
         return;
     }
 
-    L = luaL_newstate();
+#if defined(AZEROTHCORE)
+    useTraceBack = eConfigMgr->GetOption<bool>("Forge.TraceBack", false);
+    hookStats.SetEnabled(eConfigMgr->GetOption<bool>("Forge.HookStats", false));
+    hookBreaker.Configure(eConfigMgr->GetOption<uint32>("Forge.HandlerErrorLimit", 50), eConfigMgr->GetOption<uint32>("Forge.HandlerErrorWindow", 60) * IN_MILLISECONDS);
+    std::vector<std::string> invalidTimeouts = watchdog.Configure(eConfigMgr->GetOption<uint32>("Forge.WatchdogTimeout", 0), eConfigMgr->GetOption<std::string>("Forge.WatchdogTimeoutOverrides", ""));
+#else
+    useTraceBack = eConfigMgr->GetBoolDefault("Forge.TraceBack", false);
+    hookStats.SetEnabled(eConfigMgr->GetBoolDefault("Forge.HookStats", false));
+    hookBreaker.Configure(eConfigMgr->GetIntDefault("Forge.HandlerErrorLimit", 50), eConfigMgr->GetIntDefault("Forge.HandlerErrorWindow", 60) * IN_MILLISECONDS);
+    std::vector<std::string> invalidTimeouts = watchdog.Configure(eConfigMgr->GetIntDefault("Forge.WatchdogTimeout", 0), eConfigMgr->GetStringDefault("Forge.WatchdogTimeoutOverrides", ""));
+#endif
+    for (std::string const& entry : invalidTimeouts)
+        FORGE_LOG_ERROR("[Forge]: Ignoring invalid Forge.WatchdogTimeoutOverrides entry `{}`, expected Family=ms or Family.event=ms", entry);
 
+    // LuaJIT refuses custom allocators on 64-bit targets unless built with GC64
+    L = lua_newstate(&LuaAllocator::Alloc, &luaAllocator);
+    usesLuaAllocator = L != NULL;
+    if (L)
+        lua_atpanic(L, &AtPanic);
+    else
+        L = luaL_newstate();
+
+    lua_pushlightuserdata(L, &stateKey);
     lua_pushlightuserdata(L, this);
-    lua_setfield(L, LUA_REGISTRYINDEX, FORGE_STATE_PTR);
+    lua_rawset(L, LUA_REGISTRYINDEX);
+
+    ForgeObjectCache::Create(L);
+    ForgeMetrics::WatchGarbageCollector(L);
 
     CreateBindStores();
 
@@ -293,25 +512,25 @@ void Forge::CreateBindStores()
 {
     DestroyBindStores();
 
-    ServerEventBindings      = new BindingMap< EventKey<Hooks::ServerEvents> >(L);
-    PlayerEventBindings      = new BindingMap< EventKey<Hooks::PlayerEvents> >(L);
-    GuildEventBindings       = new BindingMap< EventKey<Hooks::GuildEvents> >(L);
-    GroupEventBindings       = new BindingMap< EventKey<Hooks::GroupEvents> >(L);
-    VehicleEventBindings     = new BindingMap< EventKey<Hooks::VehicleEvents> >(L);
-    BGEventBindings          = new BindingMap< EventKey<Hooks::BGEvents> >(L);
+    ServerEventBindings      = new BindingMap< EventKey<Hooks::ServerEvents> >(L, "ServerEvent");
+    PlayerEventBindings      = new BindingMap< EventKey<Hooks::PlayerEvents> >(L, "PlayerEvent");
+    GuildEventBindings       = new BindingMap< EventKey<Hooks::GuildEvents> >(L, "GuildEvent");
+    GroupEventBindings       = new BindingMap< EventKey<Hooks::GroupEvents> >(L, "GroupEvent");
+    VehicleEventBindings     = new BindingMap< EventKey<Hooks::VehicleEvents> >(L, "VehicleEvent");
+    BGEventBindings          = new BindingMap< EventKey<Hooks::BGEvents> >(L, "BGEvent");
 
-    PacketEventBindings      = new BindingMap< EntryKey<Hooks::PacketEvents> >(L);
-    CreatureEventBindings    = new BindingMap< EntryKey<Hooks::CreatureEvents> >(L);
-    CreatureGossipBindings   = new BindingMap< EntryKey<Hooks::GossipEvents> >(L);
-    GameObjectEventBindings  = new BindingMap< EntryKey<Hooks::GameObjectEvents> >(L);
-    GameObjectGossipBindings = new BindingMap< EntryKey<Hooks::GossipEvents> >(L);
-    ItemEventBindings        = new BindingMap< EntryKey<Hooks::ItemEvents> >(L);
-    ItemGossipBindings       = new BindingMap< EntryKey<Hooks::GossipEvents> >(L);
-    PlayerGossipBindings     = new BindingMap< EntryKey<Hooks::GossipEvents> >(L);
-    MapEventBindings         = new BindingMap< EntryKey<Hooks::InstanceEvents> >(L);
-    InstanceEventBindings    = new BindingMap< EntryKey<Hooks::InstanceEvents> >(L);
+    PacketEventBindings      = new BindingMap< EntryKey<Hooks::PacketEvents> >(L, "PacketEvent");
+    CreatureEventBindings    = new BindingMap< EntryKey<Hooks::CreatureEvents> >(L, "CreatureEvent");
+    CreatureGossipBindings   = new BindingMap< EntryKey<Hooks::GossipEvents> >(L, "CreatureGossip");
+    GameObjectEventBindings  = new BindingMap< EntryKey<Hooks::GameObjectEvents> >(L, "GameObjectEvent");
+    GameObjectGossipBindings = new BindingMap< EntryKey<Hooks::GossipEvents> >(L, "GameObjectGossip");
+    ItemEventBindings        = new BindingMap< EntryKey<Hooks::ItemEvents> >(L, "ItemEvent");
+    ItemGossipBindings       = new BindingMap< EntryKey<Hooks::GossipEvents> >(L, "ItemGossip");
+    PlayerGossipBindings     = new BindingMap< EntryKey<Hooks::GossipEvents> >(L, "PlayerGossip");
+    MapEventBindings         = new BindingMap< EntryKey<Hooks::InstanceEvents> >(L, "MapEvent");
+    InstanceEventBindings    = new BindingMap< EntryKey<Hooks::InstanceEvents> >(L, "InstanceEvent");
 
-    CreatureUniqueBindings   = new BindingMap< UniqueObjectKey<Hooks::CreatureEvents> >(L);
+    CreatureUniqueBindings   = new BindingMap< UniqueObjectKey<Hooks::CreatureEvents> >(L, "UniqueCreatureEvent");
 }
 
 void Forge::DestroyBindStores()
@@ -355,6 +574,12 @@ void Forge::DestroyBindStores()
     InstanceEventBindings = NULL;
 
     CreatureUniqueBindings = NULL;
+
+    // Binding IDs start over with the new stores
+    hookCalls.clear();
+    hookFrames.clear();
+    hookStats.Clear();
+    hookBreaker.Clear();
 }
 
 void Forge::AddScriptPath(std::string filename, const std::string& fullpath)
@@ -487,14 +712,9 @@ void Forge::GetScripts(std::string path)
 #endif
 }
 
-static bool ScriptPathComparator(const LuaScript& first, const LuaScript& second)
-{
-    return first.filepath < second.filepath;
-}
-
 void Forge::RunScripts()
 {
-    LOCK_FORGE;
+    LOCK_FORGE_STATE;
     if (!IsEnabled())
         return;
 
@@ -502,8 +722,6 @@ void Forge::RunScripts()
     uint32 count = 0;
 
     ScriptList scripts;
-    lua_extensions.sort(ScriptPathComparator);
-    lua_scripts.sort(ScriptPathComparator);
     scripts.insert(scripts.end(), lua_extensions.begin(), lua_extensions.end());
     scripts.insert(scripts.end(), lua_scripts.begin(), lua_scripts.end());
 
@@ -595,8 +813,46 @@ void Forge::InvalidateObjects()
 #endif
 }
 
+// Called on errors outside of a protected call, Lua aborts the process after this returns
+int Forge::AtPanic(lua_State* _L)
+{
+    const char* msg = lua_tostring(_L, -1);
+    FORGE_LOG_ERROR("[Forge]: Unprotected error in call to Lua API ({})", msg ? msg : "error object is not a string");
+    return 0;
+}
+
+void Forge::CountHook(lua_State* _L, lua_Debug* /*ar*/)
+{
+    Forge* E = GetForge(_L);
+    E->profiler.OnHook(_L);
+
+    if (E->watchdog.OnHook())
+    {
+        // Also hits the instructions between pcalls, so a loop can't catch it for good
+        if (E->watchdog.IsPastGrace())
+            lua_sethook(_L, &CountHook, LUA_MASKCOUNT, 1);
+        luaL_error(_L, "call exceeded its time limit and was stopped by the watchdog");
+    }
+}
+
+void Forge::UpdateCountHook()
+{
+    bool wanted = profiler.IsRunning() || watchdog.IsArmed();
+    // The watchdog hooks every instruction of a call past its grace, see CountHook
+    if (wanted == countHookSet && (!wanted || lua_gethookcount(L) == COUNT_HOOK_INSTRUCTIONS))
+        return;
+
+    if (wanted)
+        lua_sethook(L, &CountHook, LUA_MASKCOUNT, COUNT_HOOK_INSTRUCTIONS);
+    else
+        lua_sethook(L, NULL, 0, 0);
+    countHookSet = wanted;
+}
+
 void Forge::Report(lua_State* _L)
 {
+    ForgeMetrics::RecordError(NULL);
+
     const char* msg = lua_tostring(_L, -1);
     FORGE_LOG_ERROR("{}", msg);
     lua_pop(_L, 1);
@@ -629,11 +885,38 @@ int Forge::StackTrace(lua_State *_L)
 
     // dirty stack?
     // Stack: errmsg, debug, tracemsg
-    sForge->OnError(std::string(lua_tostring(_L, -1)));
+    GetForge(_L)->OnError(std::string(lua_tostring(_L, -1)));
     return 1;
 }
 
-bool Forge::ExecuteCall(int params, int res)
+/*
+ * Reports the error of an event handler through the circuit breaker,
+ *   which limits how often its errors are logged and disables it if it keeps failing.
+ */
+void Forge::ReportHookError(const HookCall& hook)
+{
+    // Stack: errmsg
+    ForgeMetrics::RecordError(hook.family);
+
+    HookBreaker::ErrorResult result = hookBreaker.OnError(hook);
+    if (result.log)
+    {
+        const char* msg = lua_tostring(L, -1);
+        FORGE_LOG_ERROR("{}", msg ? msg : "(error object is not a string)");
+        if (result.suppressed)
+            FORGE_LOG_ERROR("[Forge]: {} event {} handler #{} raised {} more errors since the last one logged", hook.family, hook.event_id, hook.binding_id, result.suppressed);
+    }
+    lua_pop(L, 1);
+    // Stack: (empty)
+
+    if (result.disable)
+    {
+        FORGE_LOG_ERROR("[Forge]: Disabled {} event {} handler #{} after {} errors within {} seconds", hook.family, hook.event_id, hook.binding_id, result.windowErrors, hookBreaker.GetErrorWindow() / IN_MILLISECONDS);
+        hook.bindings->Remove(hook.binding_id);
+    }
+}
+
+bool Forge::ExecuteCall(int params, int res, const HookCall* hook)
 {
     int top = lua_gettop(L);
     int base = top - params;
@@ -648,12 +931,7 @@ bool Forge::ExecuteCall(int params, int res)
         ASSERT(false); // stack probably corrupt
     }
 
-#if defined(AZEROTHCORE)
-    bool usetrace = eConfigMgr->GetOption<bool>("Forge.TraceBack", false);
-#else
-    bool usetrace = eConfigMgr->GetBoolDefault("Forge.TraceBack", false);
-#endif
-
+    bool usetrace = useTraceBack;
     if (usetrace)
     {
         lua_pushcfunction(L, &StackTrace);
@@ -662,11 +940,26 @@ bool Forge::ExecuteCall(int params, int res)
         // Stack: traceback, function, [parameters]
     }
 
+    // The count hook is only installed while a watched call runs
+    uint32 timeout = watchdog.GetTimeout(hook);
+    HookWatchdog::State previousWatchdog = {};
+    if (timeout)
+    {
+        previousWatchdog = watchdog.Arm(timeout);
+        UpdateCountHook();
+    }
+
     // Objects are invalidated when event_level hits 0
     ++event_level;
     int result = lua_pcall(L, params, res, usetrace ? base : 0);
     --event_level;
 
+    if (timeout)
+    {
+        watchdog.Restore(previousWatchdog);
+        UpdateCountHook();
+    }
+
     if (usetrace)
     {
         // Stack: traceback, [results or errmsg]
@@ -679,10 +972,14 @@ bool Forge::ExecuteCall(int params, int res)
     if (result)
     {
         // Stack: errmsg
-        Report(L);
+        if (hook)
+            ReportHookError(*hook);
+        else
+            Report(L);
 
-        // Force garbage collect
-        lua_gc(L, LUA_GCCOLLECT, 0);
+        // Collect some garbage left behind by the failed call. This is a bounded
+        // incremental step, as a failing handler on a hot hook can error every tick.
+        lua_gc(L, LUA_GCSTEP, 64);
 
         // Push nils for expected amount of results
         for (int i = 0; i < res; ++i)
@@ -691,6 +988,9 @@ bool Forge::ExecuteCall(int params, int res)
         return false;
     }
 
+    if (hook)
+        hookBreaker.OnSuccess(*hook);
+
     // Stack: [results]
     return true;
 }
@@ -699,13 +999,23 @@ void Forge::Push(lua_State* luastate)
 {
     lua_pushnil(luastate);
 }
+// 64-bit values are native integers on Lua 5.3 and newer, unsigned values keep their bit pattern.
+// Older versions use a small userdata holding the value inline, see ForgeTemplate<T>::PushValue.
 void Forge::Push(lua_State* luastate, const long long l)
 {
-    ForgeTemplate<long long>::Push(luastate, new long long(l));
+#if LUA_VERSION_NUM >= 503
+    lua_pushinteger(luastate, static_cast<lua_Integer>(l));
+#else
+    ForgeTemplate<long long>::PushValue(luastate, l);
+#endif
 }
 void Forge::Push(lua_State* luastate, const unsigned long long l)
 {
-    ForgeTemplate<unsigned long long>::Push(luastate, new unsigned long long(l));
+#if LUA_VERSION_NUM >= 503
+    lua_pushinteger(luastate, static_cast<lua_Integer>(l));
+#else
+    ForgeTemplate<unsigned long long>::PushValue(luastate, l);
+#endif
 }
 void Forge::Push(lua_State* luastate, const long l)
 {
@@ -822,7 +1132,7 @@ void Forge::Push(lua_State* luastate, Object const* obj)
 }
 void Forge::Push(lua_State* luastate, ObjectGuid const guid)
 {
-    ForgeTemplate<unsigned long long>::Push(luastate, new unsigned long long(guid.GetRawValue()));
+    Push(luastate, static_cast<unsigned long long>(guid.GetRawValue()));
 }
 
 void Forge::Push(lua_State* luastate, SpellEffectInfo const& spellEffectInfo)
@@ -913,12 +1223,20 @@ template<> std::string Forge::CHECKVAL<std::string>(lua_State* luastate, int nar
 }
 template<> long long Forge::CHECKVAL<long long>(lua_State* luastate, int narg)
 {
+#if LUA_VERSION_NUM >= 503
+    if (lua_isinteger(luastate, narg))
+        return static_cast<long long>(lua_tointeger(luastate, narg));
+#endif
     if (lua_isnumber(luastate, narg))
         return static_cast<long long>(CHECKVAL<double>(luastate, narg));
     return *(Forge::CHECKOBJ<long long>(luastate, narg, true));
 }
 template<> unsigned long long Forge::CHECKVAL<unsigned long long>(lua_State* luastate, int narg)
 {
+#if LUA_VERSION_NUM >= 503
+    if (lua_isinteger(luastate, narg))
+        return static_cast<unsigned long long>(lua_tointeger(luastate, narg));
+#endif
     if (lua_isnumber(luastate, narg))
         return static_cast<unsigned long long>(CHECKVAL<uint32>(luastate, narg));
     return *(Forge::CHECKOBJ<unsigned long long>(luastate, narg, true));
@@ -980,19 +1298,19 @@ ForgeObject* Forge::CHECKTYPE(lua_State* luastate, int narg, const char* tname,
         return NULL;
     }
 
-    ForgeObject** ptrHold = static_cast<ForgeObject**>(lua_touserdata(luastate, narg));
+    ForgeObject* forgeObj = static_cast<ForgeObject*>(lua_touserdata(luastate, narg));
 
-    if (!ptrHold || (tname && (*ptrHold)->GetTypeName() != tname))
+    if (!forgeObj || (tname && forgeObj->GetTypeName() != tname))
     {
         if (error)
         {
             char buff[256];
-            snprintf(buff, 256, "bad argument : %s expected, got %s", tname ? tname : "ForgeObject", ptrHold ? (*ptrHold)->GetTypeName() : luaL_typename(luastate, narg));
+            snprintf(buff, 256, "bad argument : %s expected, got %s", tname ? tname : "ForgeObject", forgeObj ? forgeObj->GetTypeName() : luaL_typename(luastate, narg));
             luaL_argerror(luastate, narg, buff);
         }
         return NULL;
     }
-    return *ptrHold;
+    return forgeObj;
 }
 
 template<typename K>
@@ -1266,6 +1584,17 @@ void Forge::CleanUpStack(int number_of_arguments)
     lua_pop(L, number_of_arguments + 1); // Add 1 because the caller doesn't know about `event_id`.
     // Stack: (empty)
 
+    // Forget the handlers SetupStack pushed for this hook
+    if (!hookFrames.empty())
+    {
+        hookCalls.resize(hookFrames.back());
+        hookFrames.pop_back();
+    }
+
+    // No handler holds an entry once the outermost hook is done
+    if (hookFrames.empty())
+        hookStats.Prune();
+
     if (event_level == 0)
         InvalidateObjects();
 }
@@ -1286,6 +1615,29 @@ int Forge::CallOneFunction(int number_of_functions, int number_of_arguments, int
     int arguments_top        = first_function_index - 1;
     int first_argument_index = arguments_top - number_of_arguments + 1;
 
+    // The function called is the topmost one, which SetupStack pushed last.
+    // Copied, because hooks triggered by the call can grow `hookCalls`.
+    bool hasCall = !hookFrames.empty() && hookFrames.back() + number_of_functions <= hookCalls.size();
+    HookCall call = hasCall ? hookCalls[hookFrames.back() + number_of_functions - 1] : HookCall(NULL, 0, 0);
+
+    // A handler backing off after repeated errors is not called, it returns nothing.
+    if (hasCall && hookBreaker.ShouldSkip(call))
+    {
+        lua_pop(L, 1);
+        for (int i = 0; i < number_of_results; ++i)
+            lua_pushnil(L);
+        // Stack: event_id, [arguments], [functions - 1], [nil results]
+        return functions_top;
+    }
+
+    HookStats::Entry* stats = NULL;
+    if (hasCall && hookStats.IsEnabled())
+    {
+        stats = &hookStats.GetEntry(call);
+        if (stats->source.empty())
+            stats->source = GetFunctionSource(L, functions_top);
+    }
+
     // Copy the arguments from the bottom of the stack to the top.
     for (int argument_index = first_argument_index; argument_index <= arguments_top; ++argument_index)
     {
@@ -1293,7 +1645,17 @@ int Forge::CallOneFunction(int number_of_functions, int number_of_arguments, int
     }
     // Stack: event_id, [arguments], [functions], event_id, [arguments]
 
-    ExecuteCall(number_of_arguments, number_of_results);
+    bool metrics = hasCall && ForgeMetrics::IsEnabled();
+    uint64 start = stats || metrics ? HookClock::Now() : 0;
+    ExecuteCall(number_of_arguments, number_of_results, hasCall ? &call : NULL);
+    if (stats || metrics)
+    {
+        uint64 ticks = HookClock::Now() - start;
+        if (stats)
+            stats->histogram.Record(ticks);
+        if (metrics)
+            ForgeMetrics::RecordHook(call.family, ticks);
+    }
     --functions_top;
     // Stack: event_id, [arguments], [functions - 1], [results]
 
@@ -1314,7 +1676,7 @@ CreatureAI* Forge::GetAI(Creature* creature)
 
         if (CreatureEventBindings->HasBindingsFor(entryKey) ||
             CreatureUniqueBindings->HasBindingsFor(uniqueKey))
-            return new ForgeCreatureAI(creature);
+            return new ForgeCreatureAI(creature, this);
     }
 
     return NULL;
@@ -1333,7 +1695,7 @@ InstanceData* Forge::GetInstanceData(Map* map)
 
         if (MapEventBindings->HasBindingsFor(key) ||
             InstanceEventBindings->HasBindingsFor(key))
-            return new ForgeInstanceAI(map);
+            return new ForgeInstanceAI(map, this);
     }
 
     return NULL;
@@ -1386,7 +1748,7 @@ void Forge::CreateInstanceData(Map const* map)
  */
 void Forge::FreeInstanceId(uint32 instanceId)
 {
-    LOCK_FORGE;
+    LOCK_FORGE_STATE;
 
     if (!IsEnabled())
         return;
@@ -1409,6 +1771,221 @@ void Forge::FreeInstanceId(uint32 instanceId)
     }
 }
 
+void Forge::PushAsyncJob(int funcRef, std::string const& source, std::string const& args, uint32 argCount)
+{
+    ASSERT(workerPool);
+    workerPool->Push(new AsyncJob(asyncStateId, funcRef, source, args, argCount));
+}
+
+void Forge::UpdateMetrics(uint32 diff)
+{
+    if (!ForgeMetrics::IsEnabled())
+        return;
+
+    metricsTimer += diff;
+    if (metricsTimer < METRICS_INTERVAL)
+        return;
+    metricsTimer = 0;
+
+    LOCK_FORGE_STATE;
+    if (!L)
+        return;
+
+    int64 heap = int64(lua_gc(L, LUA_GCCOUNT, 0)) * 1024 + lua_gc(L, LUA_GCCOUNTB, 0);
+    ForgeMetrics::AddLuaHeap(heap - publishedHeap);
+    publishedHeap = heap;
+}
+
+/*
+ * Calls the callbacks of the finished RunAsync jobs of this state,
+ *   with `true` and the results or `false` and the error message.
+ */
+void Forge::HandleAsyncResults()
+{
+    if (!workerPool)
+        return;
+
+    std::vector<AsyncJob*> jobs;
+    workerPool->TakeResults(asyncStateId, jobs);
+    if (jobs.empty())
+        return;
+
+    LOCK_FORGE_STATE;
+
+    for (AsyncJob* job : jobs)
+    {
+        // Get function
+        lua_rawgeti(L, LUA_REGISTRYINDEX, job->funcRef);
+        luaL_unref(L, LUA_REGISTRYINDEX, job->funcRef);
+
+        uint32 params = 2;
+        if (job->success)
+        {
+            // Results are only values a sandbox could make, decoding them only fails on memory errors
+            lua_pushcfunction(L, &mar_decode);
+            lua_pushlstring(L, job->result.data(), job->result.size());
+            if (lua_pcall(L, 1, 1, 0))
+            {
+                Push(L, false);
+                lua_insert(L, -2);
+            }
+            else
+            {
+                int results = lua_gettop(L);
+                Push(L, true);
+                for (uint32 i = 1; i <= job->resultCount; ++i)
+                    lua_rawgeti(L, results, i);
+                lua_remove(L, results);
+                params = 1 + job->resultCount;
+            }
+        }
+        else
+        {
+            Push(L, false);
+            Push(L, job->result);
+        }
+
+        ExecuteCall(params, 0);
+        delete job;
+    }
+}
+
+/*
+ * Sends the `count` event handlers that took the most time, by total time
+ *   spent or by 99th percentile call time, to `handler`.
+ */
+void Forge::SendHookStats(ChatHandler& handler, size_t count, HookStats::SortOrder order)
+{
+    LOCK_FORGE_STATE;
+
+    if (!hookStats.IsEnabled())
+    {
+        handler.SendSysMessage("[Forge]: Hook stats are disabled, see Forge.HookStats in the config");
+        return;
+    }
+
+    std::vector<HookStats::Summary> top = hookStats.GetTop(count, order);
+    if (top.empty())
+    {
+        handler.SendSysMessage("[Forge]: No event handlers have been called yet");
+        return;
+    }
+
+    std::ostringstream ss;
+    ss << "[Forge]: Top " << top.size() << " event handlers by " << (order == HookStats::SORT_BY_P99 ? "p99" : "total") << " time";
+    handler.SendSysMessage(ss.str());
+
+    for (HookStats::Summary const& summary : top)
+    {
+        ss.str("");
+        ss << std::fixed << std::setprecision(1)
+            << summary.family << " " << summary.event_id << " #" << summary.binding_id << " (" << summary.source << ")"
+            << " calls " << summary.calls
+            << " total " << summary.total_us / 1000.0 << "ms"
+            << " avg " << summary.avg_us << "us"
+            << " p50 " << summary.p50_us << "us"
+            << " p99 " << summary.p99_us << "us"
+            << " max " << summary.max_us << "us";
+        handler.SendSysMessage(ss.str());
+    }
+}
+
+/*
+ * Sends the `count` locks and call sites with the most wait time to `handler`.
+ * Takes none of the Forge locks, so it works while a lock is stuck.
+ */
+void Forge::SendLockStats(ChatHandler& handler, size_t count)
+{
+    if (!LockStats::IsEnabled())
+    {
+        handler.SendSysMessage("[Forge]: Lock stats are not compiled in, build with FORGE_LOCK_STATS defined");
+        return;
+    }
+
+    std::vector<LockStats::Summary> top = LockStats::GetTop(count);
+    if (top.empty())
+    {
+        handler.SendSysMessage("[Forge]: No locks have been taken yet");
+        return;
+    }
+
+    std::ostringstream ss;
+    ss << "[Forge]: Top " << top.size() << " lock call sites by wait time";
+    handler.SendSysMessage(ss.str());
+
+    for (LockStats::Summary const& summary : top)
+    {
+        ss.str("");
+        ss << std::fixed << std::setprecision(1)
+            << summary.lock << " " << summary.tag
+            << " acquisitions " << summary.acquisitions
+            << " wait " << summary.wait_us / 1000.0 << "ms"
+            << " max wait " << summary.max_wait_us << "us"
+            << " hold " << summary.hold_us / 1000.0 << "ms"
+            << " max hold " << summary.max_hold_us << "us";
+        handler.SendSysMessage(ss.str());
+    }
+}
+
+void Forge::StartProfile(ChatHandler& handler, uint32 seconds)
+{
+    LOCK_FORGE_STATE;
+
+    if (!IsEnabled())
+    {
+        handler.SendSysMessage("[Forge]: Forge is disabled");
+        return;
+    }
+
+    if (profiler.IsRunning())
+    {
+        handler.SendSysMessage("[Forge]: The profiler is already running, stop it with `.forge profile stop`");
+        return;
+    }
+
+    profiler.Start(seconds);
+    UpdateCountHook();
+
+    std::ostringstream ss;
+    ss << "[Forge]: Profiler started";
+    if (seconds)
+        ss << " for " << seconds << " seconds";
+    else
+        ss << ", stop it with `.forge profile stop`";
+    handler.SendSysMessage(ss.str());
+}
+
+void Forge::StopProfile(ChatHandler* handler)
+{
+    LOCK_FORGE_STATE;
+
+    if (!profiler.IsRunning())
+    {
+        if (handler)
+            handler->SendSysMessage("[Forge]: The profiler is not running");
+        return;
+    }
+
+    profiler.Stop();
+    if (L)
+        UpdateCountHook();
+
+    std::ostringstream ss;
+    std::string path = "forge_profile_" + std::to_string(time(NULL)) + ".folded";
+    if (profiler.WriteFolded(path))
+    {
+        ss << "[Forge]: Profiler wrote " << profiler.GetSampleCount() << " samples to `" << path << "`";
+        if (profiler.GetDroppedCount())
+            ss << ", " << profiler.GetDroppedCount() << " older samples were overwritten";
+    }
+    else
+        ss << "[Forge]: Profiler could not write `" << path << "`";
+
+    FORGE_LOG_INFO("{}", ss.str());
+    if (handler)
+        handler->SendSysMessage(ss.str());
+}
+
 void Forge::PushInstanceData(lua_State* L, ForgeInstanceAI* ai, bool incrementCounter)
 {
     // Check if the instance data is missing (i.e. someone reloaded Forge).
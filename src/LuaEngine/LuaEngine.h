@@ -21,7 +21,14 @@
 #include "LFG.h"
 #include "LootMgr.h"
 #include "ForgeUtility.h"
+#include "CoroutineScheduler.h"
 #include "HttpManager.h"
+#include "HookStats.h"
+#include "LockStats.h"
+#include "LuaAllocator.h"
+#include "LuaProfiler.h"
+#include "LuaWorkerPool.h"
+#include "MapStateRegistry.h"
 #include "EventEmitter.h"
 #include <mutex>
 #include <memory>
@@ -117,8 +124,10 @@ struct LuaScript
     std::string modulepath;
 };
 
-#define FORGE_STATE_PTR "Forge State Ptr"
-#define LOCK_FORGE Forge::Guard __guard(Forge::GetLock())
+// Locks the global Lua state, the function name is the call site for LockStats
+#define LOCK_FORGE Forge::Guard __guard(Forge::GetLock(), __FUNCTION__)
+// Locks the Lua state of `this`, which is the global state unless Forge.MapStates is enabled
+#define LOCK_FORGE_STATE Forge::Guard __guard(GetStateLock(), __FUNCTION__)
 
 #if defined(TRINITY)
 #define FORGE_GAME_API TC_GAME_API
@@ -133,8 +142,8 @@ class FORGE_GAME_API Forge
 public:
     typedef std::list<LuaScript> ScriptList;
 
-    typedef std::recursive_mutex LockType;
-    typedef std::lock_guard<LockType> Guard;
+    typedef InstrumentedLock<std::recursive_mutex> LockType;
+    typedef TaggedGuard<LockType> Guard;
 
     const std::string& GetRequirePath() const { return m_requirePath; }
     const std::string& GetRequireCPath() const { return m_requirecPath; }
@@ -143,6 +152,25 @@ private:
     static bool reload;
     static bool initialized;
     static LockType lock;
+    // Forge.MapStates, read on startup
+    static bool mapStates;
+    // Registry key of the pointer to the Forge that owns a Lua state
+    static char stateKey;
+    // Runs RunAsync jobs for all states, NULL if Forge.AsyncWorkers is 0
+    static LuaWorkerPool* workerPool;
+
+    // The map states by map and instance ID, see GetMapForge.
+    // Entries are erased when their state is destroyed.
+    static MapStateRegistry mapStateRegistry;
+
+    static void RetireMapState(MapStateRegistry::Ref* ref);
+
+    // The map scripted by this state, NULL for the global state
+    Map* const stateMap;
+    // Points to the pointer to this state: &GForge or the `state` of a MapStateRegistry::Ref
+    Forge** const stateRef;
+    // Locks a map state, the global state uses `lock`
+    LockType stateLock;
 
     // Lua script locations
     static ScriptList lua_scripts;
@@ -167,13 +195,31 @@ private:
     //  this is used to keep track of how many arguments were pushed.
     uint8 push_counter;
     bool enabled;
+    // Forge.TraceBack, read when the Lua state is opened
+    bool useTraceBack;
+    // Allocates the memory of `L`, unless the Lua state had to be created with luaL_newstate
+    LuaAllocator luaAllocator;
+    bool usesLuaAllocator;
+    // Whether CountHook is installed on `L`, see UpdateCountHook
+    bool countHookSet;
+    // Identifies the current Lua state to `workerPool`, changes on reload
+    uint64 asyncStateId;
+    // The heap size of `L` last added to ForgeMetrics, see UpdateMetrics
+    int64 publishedHeap;
+    uint32 metricsTimer;
+
+    // The event handlers pushed by SetupStack, in push order, for every hook
+    //  that is currently running. `hookFrames` holds where each hook's handlers start.
+    std::vector<HookCall> hookCalls;
+    std::vector<size_t> hookFrames;
+    std::vector<uint64> hookBindingIds;
 
     // Map from instance ID -> Lua table ref
     std::unordered_map<uint32, int> instanceDataRefs;
     // Map from map ID -> Lua table ref
     std::unordered_map<uint32, int> continentDataRefs;
 
-    Forge();
+    Forge(Map* map = NULL, Forge** ref = &GForge);
     ~Forge();
 
     // Prevent copy
@@ -189,15 +235,22 @@ private:
     // Use ReloadForge() to make forge reload
     // This is called on world update to reload forge
     static void _ReloadForge();
+    void ReloadState();
     static void LoadScriptPaths();
     static void GetScripts(std::string path);
     static void AddScriptPath(std::string filename, const std::string& fullpath);
 
+    static int AtPanic(lua_State* _L);
+    static void CountHook(lua_State* _L, lua_Debug* ar);
+    // Installs CountHook while the profiler or the watchdog needs it, and removes it otherwise
+    void UpdateCountHook();
     static int StackTrace(lua_State *_L);
     static void Report(lua_State* _L);
+    void ReportHookError(const HookCall& hook);
 
     // Some helpers for hooks to call event handlers.
     // The bodies of the templates are in HookHelpers.h, so if you want to use them you need to #include "HookHelpers.h".
+    template<typename K>               void PushHookRefs(BindingMap<K>* bindings, const K& key);
     template<typename K1, typename K2> int SetupStack(BindingMap<K1>* bindings1, BindingMap<K2>* bindings2, const K1& key1, const K2& key2, int number_of_arguments);
                                        int CallOneFunction(int number_of_functions, int number_of_arguments, int number_of_results);
                                        void CleanUpStack(int number_of_arguments);
@@ -241,11 +294,21 @@ private:
 public:
     static Forge* GForge;
 
+    // How often CountHook runs, in Lua instructions
+    static const int COUNT_HOOK_INSTRUCTIONS = 1000;
+    // How often the states publish their heap size to ForgeMetrics, in milliseconds of updates
+    static const uint32 METRICS_INTERVAL = 1000;
+
     lua_State* L;
     EventMgr* eventMgr;
     HttpManager httpManager;
     QueryCallbackProcessor queryProcessor;
+    CoroutineScheduler coroutines;
     EventEmitter<void(std::string)> OnError;
+    HookStats hookStats;
+    HookBreaker hookBreaker;
+    LuaProfiler profiler;
+    HookWatchdog watchdog;
 
     BindingMap< EventKey<Hooks::ServerEvents> >*     ServerEventBindings;
     BindingMap< EventKey<Hooks::PlayerEvents> >*     PlayerEventBindings;
@@ -272,11 +335,33 @@ public:
     // This function is used to make forge reload
     static void ReloadForge() { LOCK_FORGE; reload = true; }
     static LockType& GetLock() { return lock; };
+    LockType& GetStateLock() { return stateMap ? stateLock : lock; }
     static bool IsInitialized() { return initialized; }
+    static bool UsesMapStates() { return mapStates; }
+
+    /*
+     * Returns the state that scripts `map`: the map's own state when Forge.MapStates
+     *   is enabled, and the global state otherwise or if `map` is NULL.
+     *   Never returns nullptr while Forge is initialized.
+     */
+    static Forge* GetMapForge(Map const* map);
+    // The state that runs the timed events of `obj` on `map`: the global state for players,
+    //  the state of the map otherwise
+    static Forge** GetEventStateRef(WorldObject const* obj, Map const* map);
+    // Create and destroy the state of `map`, only do something when Forge.MapStates is enabled
+    static void CreateMapState(Map* map);
+    static void DestroyMapState(Map* map);
+    // Keep the state pointer of a ForgeEventProcessor valid until it's released, nothing to do for &GForge
+    static void RetainStateRef(Forge** ref);
+    static void ReleaseStateRef(Forge** ref);
+    // The map scripted by this state, NULL for the global state
+    Map* GetStateMap() const { return stateMap; }
+    Forge** GetStateRef() const { return stateRef; }
+
     // Never returns nullptr
     static Forge* GetForge(lua_State* L)
     {
-        lua_pushstring(L, FORGE_STATE_PTR);
+        lua_pushlightuserdata(L, &stateKey);
         lua_rawget(L, LUA_REGISTRYINDEX);
         ASSERT(lua_islightuserdata(L, -1));
         Forge* E = static_cast<Forge*>(lua_touserdata(L, -1));
@@ -311,7 +396,7 @@ public:
         ForgeTemplate<T>::Push(luastate, ptr);
     }
 
-    bool ExecuteCall(int params, int res);
+    bool ExecuteCall(int params, int res, const HookCall* hook = NULL);
 
     /*
      * Returns `true` if Forge has instance data for `map`.
@@ -359,6 +444,20 @@ public:
     CreatureAI* GetAI(Creature* creature);
     InstanceData* GetInstanceData(Map* map);
     void FreeInstanceId(uint32 instanceId);
+    void SendHookStats(ChatHandler& handler, size_t count, HookStats::SortOrder order);
+    static void SendLockStats(ChatHandler& handler, size_t count);
+    void StartProfile(ChatHandler& handler, uint32 seconds);
+    // Writes the profile to a file, `handler` is NULL when the profile ran out of time
+    void StopProfile(ChatHandler* handler);
+    // Returns NULL if the Lua state does not use Forge's allocator
+    const LuaAllocator::Stats* GetLuaMemoryStats() const { return usesLuaAllocator ? &luaAllocator.GetStats() : NULL; }
+
+    static bool IsAsyncEnabled() { return workerPool != NULL; }
+    // Queues a RunAsync job, the results are passed to `funcRef` by HandleAsyncResults
+    void PushAsyncJob(int funcRef, std::string const& source, std::string const& args, uint32 argCount);
+    void HandleAsyncResults();
+    // Publishes the heap size of the state every METRICS_INTERVAL while metrics are served
+    void UpdateMetrics(uint32 diff);
 
     /* Custom */
     void OnTimedEvent(int funcRef, uint32 delay, uint32 calls, WorldObject* obj);
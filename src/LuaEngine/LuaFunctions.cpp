@@ -583,7 +583,8 @@ template<> int ForgeTemplate<Vehicle>::CollectGarbage(lua_State* L)
 
     // Get object pointer (and check type, no error)
     ForgeObject* obj = Forge::CHECKOBJ<ForgeObject>(L, 1, false);
-    delete obj;
+    if (obj)
+        obj->~ForgeObject();
     return 0;
 }
 #endif
@@ -735,7 +736,8 @@ void RegisterFunctions(Forge* E)
     ForgeTemplate<Loot>::Register(E, "Loot");
     ForgeTemplate<Loot>::SetMethods(E, LuaLoot::LootMethods);
 
-    ForgeTemplate<long long>::Register(E, "long long", true);
+    // values are stored inline in the userdata by PushValue, so lua has no C++ memory to manage for them
+    ForgeTemplate<long long>::Register(E, "long long");
 
-    ForgeTemplate<unsigned long long>::Register(E, "unsigned long long", true);
+    ForgeTemplate<unsigned long long>::Register(E, "unsigned long long");
 }
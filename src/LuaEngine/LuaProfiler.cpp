@@ -0,0 +1,148 @@
+/*
+* Copyright (C) 2010 - 2016 Forge Lua Engine <http://emudevs.com/>
+* This program is free software licensed under GPL version 3
+* Please see the included DOCS/LICENSE.md for more information
+*/
+
+#include "LuaProfiler.h"
+#include <chrono>
+#include <cstring>
+#include <fstream>
+#include <map>
+
+namespace
+{
+    uint64 SteadyMicroseconds()
+    {
+        return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+    }
+}
+
+LuaProfiler::LuaProfiler() :
+running(false),
+nextSampleTime(0),
+stopTime(0),
+nextSample(0),
+sampleCount(0),
+dropped(0)
+{
+}
+
+bool LuaProfiler::IsExpired() const
+{
+    return running && stopTime && SteadyMicroseconds() >= stopTime;
+}
+
+void LuaProfiler::Start(uint32 durationSeconds)
+{
+    samples.resize(SAMPLE_CAPACITY);
+    nextSample = 0;
+    sampleCount = 0;
+    dropped = 0;
+    frameNames.clear();
+    frameIds.clear();
+
+    uint64 now = SteadyMicroseconds();
+    nextSampleTime = now;
+    stopTime = durationSeconds ? now + uint64(durationSeconds) * 1000000 : 0;
+    running = true;
+}
+
+void LuaProfiler::Stop()
+{
+    running = false;
+}
+
+void LuaProfiler::OnHook(lua_State* L)
+{
+    if (!running)
+        return;
+
+    uint64 now = SteadyMicroseconds();
+    if (now < nextSampleTime)
+        return;
+    nextSampleTime = now + SAMPLE_INTERVAL_US;
+
+    Sample& sample = samples[nextSample];
+    sample.depth = 0;
+
+    lua_Debug ar;
+    for (int level = 0; sample.depth < MAX_DEPTH && lua_getstack(L, level, &ar); ++level)
+    {
+        if (!lua_getinfo(L, "Sn", &ar))
+            break;
+        sample.frames[sample.depth++] = GetFrameId(ar);
+    }
+
+    if (!sample.depth)
+        return;
+
+    nextSample = (nextSample + 1) % SAMPLE_CAPACITY;
+    if (sampleCount < SAMPLE_CAPACITY)
+        ++sampleCount;
+    else
+        ++dropped;
+}
+
+uint32 LuaProfiler::GetFrameId(lua_Debug& ar)
+{
+    std::string name;
+    if (std::strcmp(ar.what, "main") == 0)
+        name = "main chunk";
+    else
+        name = ar.name ? ar.name : "?";
+
+    if (std::strcmp(ar.what, "C") == 0)
+        name += " [C]";
+    else
+    {
+        name += " (";
+        name += ar.short_src;
+        name += ":";
+        name += std::to_string(ar.linedefined);
+        name += ")";
+    }
+
+    // `;` separates the frames of a folded stack
+    for (char& c : name)
+        if (c == ';')
+            c = ':';
+
+    auto itr = frameIds.find(name);
+    if (itr != frameIds.end())
+        return itr->second;
+
+    uint32 id = frameNames.size();
+    frameNames.push_back(name);
+    frameIds.emplace(name, id);
+    return id;
+}
+
+bool LuaProfiler::WriteFolded(std::string const& path) const
+{
+    std::ofstream file(path.c_str(), std::ios::out | std::ios::trunc);
+    if (!file)
+        return false;
+
+    // Count identical stacks, sorted so that the output is stable
+    std::map<std::string, uint32> stacks;
+    uint32 first = (nextSample + SAMPLE_CAPACITY - sampleCount) % SAMPLE_CAPACITY;
+    for (uint32 i = 0; i < sampleCount; ++i)
+    {
+        Sample const& sample = samples[(first + i) % SAMPLE_CAPACITY];
+
+        std::string stack;
+        for (uint32 depth = sample.depth; depth > 0; --depth)
+        {
+            if (depth != sample.depth)
+                stack += ';';
+            stack += frameNames[sample.frames[depth - 1]];
+        }
+        ++stacks[stack];
+    }
+
+    for (auto const& stack : stacks)
+        file << stack.first << ' ' << stack.second << '\n';
+
+    return bool(file);
+}
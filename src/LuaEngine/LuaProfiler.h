@@ -0,0 +1,95 @@
+/*
+* Copyright (C) 2010 - 2016 Forge Lua Engine <http://emudevs.com/>
+* This program is free software licensed under GPL version 3
+* Please see the included DOCS/LICENSE.md for more information
+*/
+
+#ifndef _LUA_PROFILER_H
+#define _LUA_PROFILER_H
+
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include "Common.h"
+
+extern "C"
+{
+#include "lua.h"
+};
+
+/*
+ * A sampling profiler for Lua code.
+ *
+ * While running, Forge installs a count hook that calls `OnHook` every
+ *   Forge::COUNT_HOOK_INSTRUCTIONS instructions. At most once per SAMPLE_INTERVAL_US
+ *   the hook records the Lua call stack into a fixed ring buffer; when the
+ *   buffer is full the oldest samples are overwritten.
+ *
+ * The samples are written as folded stacks ("root;caller;leaf count" lines),
+ *   which flamegraph.pl and speedscope read directly. Lua has no name for
+ *   functions called from C, such as event handlers, so they are written as
+ *   "? (source:line)".
+ *
+ * Count hooks only fire while Lua code runs, so time spent inside C functions
+ *   is attributed to the Lua function that called them, or not sampled at all
+ *   if no Lua instructions follow. On LuaJIT count hooks are not called from
+ *   JIT compiled code, so samples are only taken in the interpreter and hot
+ *   compiled loops are under-represented; call `jit.off()` for a fair profile.
+ *
+ * Only accessed while holding the lock of the owning state, see Forge::GetStateLock.
+ */
+class LuaProfiler
+{
+public:
+    static const uint32 SAMPLE_CAPACITY = 16384;
+    // Deeper stacks keep their innermost frames
+    static const uint32 MAX_DEPTH = 32;
+    static const uint32 SAMPLE_INTERVAL_US = 1000;
+
+    LuaProfiler();
+
+    bool IsRunning() const { return running; }
+
+    // Returns true if the profiler was started with a duration that has passed
+    bool IsExpired() const;
+
+    // Clears the previous samples, a `durationSeconds` of 0 runs until stopped
+    void Start(uint32 durationSeconds);
+    void Stop();
+
+    // Records the call stack of `L` if a sample is due, called from the count hook
+    void OnHook(lua_State* L);
+
+    // Samples currently held, and samples overwritten because the buffer was full
+    uint32 GetSampleCount() const { return sampleCount; }
+    uint64 GetDroppedCount() const { return dropped; }
+
+    // Writes the held samples to `path` as folded stacks, returns false if the file can't be written
+    bool WriteFolded(std::string const& path) const;
+
+private:
+    struct Sample
+    {
+        uint32 depth;
+        // Innermost frame first
+        uint32 frames[MAX_DEPTH];
+    };
+
+    uint32 GetFrameId(lua_Debug& ar);
+
+    bool running;
+    uint64 nextSampleTime;
+    // 0 if running until stopped
+    uint64 stopTime;
+
+    std::vector<Sample> samples;
+    uint32 nextSample;
+    uint32 sampleCount;
+    uint64 dropped;
+
+    // "function (source:line)" of every frame seen, indexed by frame ID
+    std::vector<std::string> frameNames;
+    std::unordered_map<std::string, uint32> frameIds;
+};
+
+#endif // _LUA_PROFILER_H
@@ -0,0 +1,310 @@
+/*
+* Copyright (C) 2010 - 2016 Forge Lua Engine <http://emudevs.com/>
+* This program is free software licensed under GPL version 3
+* Please see the included DOCS/LICENSE.md for more information
+*/
+
+#include "LuaWorkerPool.h"
+#include "lmarshal.h"
+#include <algorithm>
+#include <chrono>
+
+extern "C"
+{
+#include "lualib.h"
+#include "lauxlib.h"
+};
+
+#include "ForgeCompat.h"
+
+namespace
+{
+    // Compiled chunks by source, kept in the registry of each worker state
+    const char* CHUNK_CACHE = "Forge RunAsync chunks";
+    // The cache is dropped when it grows past this, scripts normally use a handful of sources
+    const uint32 MAX_CACHED_CHUNKS = 64;
+    const int TIMEOUT_HOOK_INSTRUCTIONS = 1000;
+
+    std::atomic<uint64> nextStateId(1);
+
+    // The deadline of the job running on this worker thread, 0 if none
+    thread_local uint64 jobDeadline = 0;
+
+    uint64 SteadyMilliseconds()
+    {
+        return std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+    }
+
+    std::string PopError(lua_State* L)
+    {
+        const char* msg = lua_tostring(L, -1);
+        std::string error = msg ? msg : "unknown error";
+        lua_pop(L, 1);
+        return error;
+    }
+}
+
+AsyncJob::AsyncJob(uint64 stateId, int funcRef, std::string const& source, std::string const& args, uint32 argCount) :
+    stateId(stateId),
+    funcRef(funcRef),
+    source(source),
+    args(args),
+    argCount(argCount),
+    success(false),
+    resultCount(0)
+{ }
+
+LuaWorkerPool::LuaWorkerPool(uint32 workerCount, uint32 timeoutMs) :
+    timeoutMs(timeoutMs),
+    finishedCount(0),
+    stopping(false)
+{
+    for (uint32 i = 0; i < workerCount; ++i)
+        workers.push_back(std::thread(&LuaWorkerPool::WorkerThread, this));
+}
+
+LuaWorkerPool::~LuaWorkerPool()
+{
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        stopping = true;
+    }
+    jobQueued.notify_all();
+
+    for (std::thread& worker : workers)
+        worker.join();
+
+    for (AsyncJob* job : queue)
+        delete job;
+    for (AsyncJob* job : finished)
+        delete job;
+}
+
+uint64 LuaWorkerPool::NewStateId()
+{
+    return nextStateId++;
+}
+
+void LuaWorkerPool::Push(AsyncJob* job)
+{
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        queue.push_back(job);
+    }
+    jobQueued.notify_one();
+}
+
+void LuaWorkerPool::TakeResults(uint64 stateId, std::vector<AsyncJob*>& jobs)
+{
+    // Called every update by every state, most of the time there is nothing to take
+    if (!finishedCount.load(std::memory_order_acquire))
+        return;
+
+    std::lock_guard<std::mutex> guard(lock);
+    auto itr = std::stable_partition(finished.begin(), finished.end(), [stateId](AsyncJob* job) { return job->stateId != stateId; });
+    jobs.insert(jobs.end(), itr, finished.end());
+    finished.erase(itr, finished.end());
+    finishedCount.store(finished.size(), std::memory_order_release);
+}
+
+void LuaWorkerPool::CancelState(uint64 stateId)
+{
+    std::lock_guard<std::mutex> guard(lock);
+
+    for (auto itr = queue.begin(); itr != queue.end();)
+    {
+        if ((*itr)->stateId == stateId)
+        {
+            delete *itr;
+            itr = queue.erase(itr);
+        }
+        else
+            ++itr;
+    }
+
+    // A reload must not wait for a job that may run until its timeout, or forever on LuaJIT.
+    // The state's Lua references go away with it, so the results are just dropped.
+    if (running.find(stateId) != running.end())
+        cancelled.insert(stateId);
+
+    auto itr = std::stable_partition(finished.begin(), finished.end(), [stateId](AsyncJob* job) { return job->stateId != stateId; });
+    for (auto it = itr; it != finished.end(); ++it)
+        delete *it;
+    finished.erase(itr, finished.end());
+    finishedCount.store(finished.size(), std::memory_order_release);
+}
+
+void LuaWorkerPool::WorkerThread()
+{
+    lua_State* L = CreateSandbox();
+    uint32 cachedChunks = 0;
+
+    while (true)
+    {
+        AsyncJob* job;
+        {
+            std::unique_lock<std::mutex> guard(lock);
+            jobQueued.wait(guard, [this] { return stopping || !queue.empty(); });
+            if (stopping)
+                break;
+
+            job = queue.front();
+            queue.pop_front();
+            ++running[job->stateId];
+        }
+
+        Run(L, job, cachedChunks);
+
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            auto itr = running.find(job->stateId);
+            bool last = !--itr->second;
+            if (last)
+                running.erase(itr);
+
+            auto cancel = cancelled.find(job->stateId);
+            if (cancel != cancelled.end())
+            {
+                if (last)
+                    cancelled.erase(cancel);
+                delete job;
+                continue;
+            }
+
+            finished.push_back(job);
+            finishedCount.store(finished.size(), std::memory_order_release);
+        }
+    }
+
+    lua_close(L);
+}
+
+lua_State* LuaWorkerPool::CreateSandbox()
+{
+    lua_State* L = luaL_newstate();
+    luaL_openlibs(L);
+
+    // No files, modules, output or introspection
+    static const char* const removed[] = { "io", "debug", "package", "require", "module", "dofile", "loadfile", "print" };
+    for (const char* name : removed)
+    {
+        lua_pushnil(L);
+        lua_setglobal(L, name);
+    }
+
+    // Only the time functions of `os`
+    static const char* const osKept[] = { "clock", "date", "difftime", "time" };
+    lua_getglobal(L, "os");
+    lua_newtable(L);
+    for (const char* name : osKept)
+    {
+        lua_getfield(L, -2, name);
+        lua_setfield(L, -2, name);
+    }
+    lua_setglobal(L, "os");
+    lua_pop(L, 1);
+
+    lua_newtable(L);
+    lua_setfield(L, LUA_REGISTRYINDEX, CHUNK_CACHE);
+
+    if (timeoutMs)
+        lua_sethook(L, &LuaWorkerPool::TimeoutHook, LUA_MASKCOUNT, TIMEOUT_HOOK_INSTRUCTIONS);
+
+    return L;
+}
+
+void LuaWorkerPool::TimeoutHook(lua_State* L, lua_Debug* /*ar*/)
+{
+    if (!jobDeadline || SteadyMilliseconds() < jobDeadline)
+        return;
+
+    // Raised again on every instruction after the deadline, so a job that catches it with pcall
+    // in a loop fails on the first instruction outside the pcall. Run sets the hook back.
+    lua_sethook(L, &LuaWorkerPool::TimeoutHook, LUA_MASKCOUNT, 1);
+    luaL_error(L, "RunAsync job timed out");
+}
+
+void LuaWorkerPool::Run(lua_State* L, AsyncJob* job, uint32& cachedChunks)
+{
+    lua_settop(L, 0);
+
+    // Get the compiled chunk, compile and cache it on first use
+    lua_getfield(L, LUA_REGISTRYINDEX, CHUNK_CACHE);
+    lua_pushlstring(L, job->source.data(), job->source.size());
+    lua_rawget(L, -2);
+    if (lua_isnil(L, -1))
+    {
+        lua_pop(L, 1);
+        if (luaL_loadbuffer(L, job->source.data(), job->source.size(), "=RunAsync"))
+        {
+            job->result = PopError(L);
+            return;
+        }
+
+        if (cachedChunks >= MAX_CACHED_CHUNKS)
+        {
+            lua_newtable(L);
+            lua_replace(L, 1);
+            lua_pushvalue(L, 1);
+            lua_setfield(L, LUA_REGISTRYINDEX, CHUNK_CACHE);
+            cachedChunks = 0;
+        }
+
+        lua_pushlstring(L, job->source.data(), job->source.size());
+        lua_pushvalue(L, -2);
+        lua_rawset(L, 1);
+        ++cachedChunks;
+    }
+    // Stack: cache, chunk
+
+    lua_pushcfunction(L, &mar_decode);
+    lua_pushlstring(L, job->args.data(), job->args.size());
+    if (lua_pcall(L, 1, 1, 0))
+    {
+        job->result = PopError(L);
+        return;
+    }
+    const int args = lua_gettop(L);
+    // Stack: cache, chunk, args
+
+    lua_pushvalue(L, 2);
+    for (uint32 i = 1; i <= job->argCount; ++i)
+        lua_rawgeti(L, args, i);
+
+    if (timeoutMs)
+    {
+        lua_sethook(L, &LuaWorkerPool::TimeoutHook, LUA_MASKCOUNT, TIMEOUT_HOOK_INSTRUCTIONS);
+        jobDeadline = SteadyMilliseconds() + timeoutMs;
+    }
+    int status = lua_pcall(L, job->argCount, LUA_MULTRET, 0);
+    jobDeadline = 0;
+
+    if (status)
+    {
+        job->result = PopError(L);
+        return;
+    }
+    // Stack: cache, chunk, args, results...
+
+    job->resultCount = lua_gettop(L) - args;
+    lua_createtable(L, job->resultCount, 0);
+    for (uint32 i = 1; i <= job->resultCount; ++i)
+    {
+        lua_pushvalue(L, args + i);
+        lua_rawseti(L, -2, i);
+    }
+
+    lua_pushcfunction(L, &mar_encode);
+    lua_insert(L, -2);
+    if (lua_pcall(L, 1, 1, 0))
+    {
+        job->result = PopError(L);
+        return;
+    }
+
+    size_t length;
+    const char* encoded = lua_tolstring(L, -1, &length);
+    job->result.assign(encoded, length);
+    job->success = true;
+    lua_settop(L, 0);
+}
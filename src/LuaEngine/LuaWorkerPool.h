@@ -0,0 +1,105 @@
+/*
+* Copyright (C) 2010 - 2016 Forge Lua Engine <http://emudevs.com/>
+* This program is free software licensed under GPL version 3
+* Please see the included DOCS/LICENSE.md for more information
+*/
+
+#ifndef _LUA_WORKER_POOL_H
+#define _LUA_WORKER_POOL_H
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+#include "Common.h"
+
+extern "C"
+{
+#include "lua.h"
+};
+
+/*
+ * A job of `RunAsync`: Lua source to run on a worker and the marshalled
+ *   arguments, and once done the marshalled results or the error message.
+ */
+struct AsyncJob
+{
+    AsyncJob(uint64 stateId, int funcRef, std::string const& source, std::string const& args, uint32 argCount);
+
+    // The Lua state that started the job and gets the results, see LuaWorkerPool::NewStateId
+    uint64 stateId;
+    // The callback in the starting state
+    int funcRef;
+    std::string source;
+    std::string args;
+    uint32 argCount;
+
+    bool success;
+    // The encoded results if `success`, the error message otherwise
+    std::string result;
+    uint32 resultCount;
+};
+
+/*
+ * A fixed pool of threads that run pure Lua code for `RunAsync`.
+ *
+ * Every worker owns a sandboxed Lua state with the standard libraries minus
+ *   files, modules and output, and no game API. Values cross between states marshalled with
+ *   `mar_encode` and `mar_decode`, so only plain data can be passed.
+ *
+ * Finished jobs wait in the pool until the starting state collects them
+ *   with `TakeResults` from its update.
+ */
+class LuaWorkerPool
+{
+public:
+    // `timeoutMs` stops a job running longer with an error, 0 lets jobs run forever
+    LuaWorkerPool(uint32 workerCount, uint32 timeoutMs);
+    // Waits for the running jobs and drops the rest
+    ~LuaWorkerPool();
+
+    // Returns a new ID for a Lua state, IDs are never reused
+    static uint64 NewStateId();
+
+    void Push(AsyncJob* job);
+
+    // Moves the finished jobs of `stateId` to `jobs`, the caller deletes them
+    void TakeResults(uint64 stateId, std::vector<AsyncJob*>& jobs);
+
+    // Drops the queued and finished jobs of `stateId`, the jobs still running are dropped once they finish.
+    // Called before the state closes, so that no results outlive it. Doesn't wait for the running jobs.
+    void CancelState(uint64 stateId);
+
+private:
+    LuaWorkerPool(LuaWorkerPool const&) = delete;
+    LuaWorkerPool& operator=(LuaWorkerPool const&) = delete;
+
+    void WorkerThread();
+    lua_State* CreateSandbox();
+    void Run(lua_State* L, AsyncJob* job, uint32& cachedChunks);
+
+    static void TimeoutHook(lua_State* L, lua_Debug* ar);
+
+    const uint32 timeoutMs;
+
+    std::mutex lock;
+    std::condition_variable jobQueued;
+    std::deque<AsyncJob*> queue;
+    std::vector<AsyncJob*> finished;
+    // Jobs being run by state ID
+    std::unordered_map<uint64, uint32> running;
+    // States cancelled while some of their jobs were running, forgotten when the last one finishes
+    std::unordered_set<uint64> cancelled;
+    // Size of `finished`, checked without locking by TakeResults
+    std::atomic<uint32> finishedCount;
+    bool stopping;
+
+    std::vector<std::thread> workers;
+};
+
+#endif // _LUA_WORKER_POOL_H
@@ -0,0 +1,90 @@
+/*
+* Copyright (C) 2010 - 2016 Forge Lua Engine <http://emudevs.com/>
+* This program is free software licensed under GPL version 3
+* Please see the included DOCS/LICENSE.md for more information
+*/
+
+#include "MapStateRegistry.h"
+#include "LuaEngine.h"
+#include <mutex>
+
+Forge* MapStateRegistry::Find(uint64 key)
+{
+    std::shared_lock<std::shared_mutex> guard(lock);
+    auto itr = refs.find(key);
+    if (itr == refs.end())
+        return NULL;
+    return itr->second->state;
+}
+
+MapStateRegistry::Ref* MapStateRegistry::Add(uint64 key)
+{
+    Ref* ref = new Ref();
+
+    std::unique_lock<std::shared_mutex> guard(lock);
+    ASSERT(refs.find(key) == refs.end());
+    refs[key] = ref;
+    return ref;
+}
+
+void MapStateRegistry::Publish(Ref* ref, Forge* E)
+{
+    std::unique_lock<std::shared_mutex> guard(lock);
+    ref->state = E;
+}
+
+MapStateRegistry::Ref* MapStateRegistry::Remove(uint64 key)
+{
+    std::unique_lock<std::shared_mutex> guard(lock);
+    auto itr = refs.find(key);
+    if (itr == refs.end())
+        return NULL;
+    Ref* ref = itr->second;
+    refs.erase(itr);
+    return ref;
+}
+
+std::vector<MapStateRegistry::Ref*> MapStateRegistry::RemoveAll()
+{
+    std::vector<Ref*> removed;
+    std::unique_lock<std::shared_mutex> guard(lock);
+    removed.reserve(refs.size());
+    for (auto const& ref : refs)
+        removed.push_back(ref.second);
+    refs.clear();
+    return removed;
+}
+
+void MapStateRegistry::ForEachState(std::function<void(Forge*)> const& fn)
+{
+    std::shared_lock<std::shared_mutex> guard(lock);
+    for (auto const& ref : refs)
+        if (ref.second->state)
+            fn(ref.second->state);
+}
+
+Forge* MapStateRegistry::Retire(Ref* ref)
+{
+    std::unique_lock<std::shared_mutex> guard(lock);
+    Forge* E = ref->state;
+    ref->state = NULL;
+    ++ref->users;
+    return E;
+}
+
+void MapStateRegistry::Retain(Ref* ref)
+{
+    std::unique_lock<std::shared_mutex> guard(lock);
+    ++ref->users;
+}
+
+void MapStateRegistry::Release(Ref* ref)
+{
+    {
+        std::unique_lock<std::shared_mutex> guard(lock);
+        if (--ref->users || ref->state)
+            return;
+    }
+
+    delete ref;
+}
@@ -0,0 +1,63 @@
+/*
+* Copyright (C) 2010 - 2016 Forge Lua Engine <http://emudevs.com/>
+* This program is free software licensed under GPL version 3
+* Please see the included DOCS/LICENSE.md for more information
+*/
+
+#ifndef _MAP_STATE_REGISTRY_H
+#define _MAP_STATE_REGISTRY_H
+
+#include <functional>
+#include <shared_mutex>
+#include <unordered_map>
+#include <vector>
+#include "Common.h"
+
+class Forge;
+
+/*
+ * The map states by map and instance ID, see Forge::GetMapForge.
+ *
+ * Lookups only take a shared lock, so map threads find their states in parallel.
+ *   Each entry is a Ref, that the ForgeEventProcessors of the state point to as
+ *   a Forge**. Refs are counted by their processors, so they stay valid for
+ *   processors that outlive their state. Their state is NULL once destroyed.
+ */
+class MapStateRegistry
+{
+public:
+    // `state` must stay first, refs are used as Forge**
+    struct Ref
+    {
+        Forge* state;
+        uint32 users;
+    };
+
+    static uint64 GetKey(uint32 mapId, uint32 instanceId) { return (uint64(mapId) << 32) | instanceId; }
+
+    // Returns the state of `key`, NULL if there is none or its scripts are still loading
+    Forge* Find(uint64 key);
+
+    // Adds the entry of `key` without a state, Publish sets it once its scripts are loaded
+    Ref* Add(uint64 key);
+    void Publish(Ref* ref, Forge* E);
+    // Takes the entry of `key` out, NULL if there is none
+    Ref* Remove(uint64 key);
+    // Takes all entries out
+    std::vector<Ref*> RemoveAll();
+    // Calls `fn` for every published state, entries can't be added or removed meanwhile
+    void ForEachState(std::function<void(Forge*)> const& fn);
+
+    // Clears the state of a removed entry and returns it, for the caller to delete.
+    // Counts the caller as a user of the ref, so it has to Release it after the delete.
+    Forge* Retire(Ref* ref);
+    void Retain(Ref* ref);
+    // Deletes the ref once it has no users and no state
+    void Release(Ref* ref);
+
+private:
+    std::unordered_map<uint64, Ref*> refs;
+    std::shared_mutex lock;
+};
+
+#endif
@@ -20,7 +20,7 @@ using namespace Hooks;
     auto key = EntryKey<GameObjectEvents>(EVENT, ENTRY);\
     if (!GameObjectEventBindings->HasBindingsFor(key))\
         return;\
-    LOCK_FORGE
+    LOCK_FORGE_STATE
 
 #define START_HOOK_WITH_RETVAL(EVENT, ENTRY, RETVAL) \
     if (!IsEnabled())\
@@ -28,7 +28,7 @@ using namespace Hooks;
     auto key = EntryKey<GameObjectEvents>(EVENT, ENTRY);\
     if (!GameObjectEventBindings->HasBindingsFor(key))\
         return RETVAL;\
-    LOCK_FORGE
+    LOCK_FORGE_STATE
 
 void Forge::OnDummyEffect(WorldObject* pCaster, uint32 spellId, SpellEffIndex effIndex, GameObject* pTarget)
 {
@@ -42,7 +42,8 @@ void Forge::OnDummyEffect(WorldObject* pCaster, uint32 spellId, SpellEffIndex ef
 
 void Forge::UpdateAI(GameObject* pGameObject, uint32 diff)
 {
-    pGameObject->forgeEvents->Update(diff);
+    if (pGameObject->forgeEvents)
+        pGameObject->forgeEvents->Update(diff);
     START_HOOK(GAMEOBJECT_EVENT_ON_AIUPDATE, pGameObject->GetEntry());
     Push(pGameObject);
     Push(diff);
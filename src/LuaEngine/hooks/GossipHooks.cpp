@@ -19,7 +19,7 @@ using namespace Hooks;
     auto key = EntryKey<GossipEvents>(EVENT, ENTRY);\
     if (!BINDINGS->HasBindingsFor(key))\
         return;\
-    LOCK_FORGE
+    LOCK_FORGE_STATE
 
 #define START_HOOK_WITH_RETVAL(BINDINGS, EVENT, ENTRY, RETVAL) \
     if (!IsEnabled())\
@@ -27,7 +27,7 @@ using namespace Hooks;
     auto key = EntryKey<GossipEvents>(EVENT, ENTRY);\
     if (!BINDINGS->HasBindingsFor(key))\
         return RETVAL;\
-    LOCK_FORGE
+    LOCK_FORGE_STATE
 
 bool Forge::OnGossipHello(Player* pPlayer, GameObject* pGameObject)
 {
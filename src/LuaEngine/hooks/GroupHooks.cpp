@@ -18,7 +18,7 @@ using namespace Hooks;
     auto key = EventKey<GroupEvents>(EVENT);\
     if (!GroupEventBindings->HasBindingsFor(key))\
         return;\
-    LOCK_FORGE
+    LOCK_FORGE_STATE
 
 void Forge::OnAddMember(Group* group, ObjectGuid guid)
 {
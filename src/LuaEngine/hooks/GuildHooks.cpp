@@ -18,7 +18,7 @@ using namespace Hooks;
     auto key = EventKey<GuildEvents>(EVENT);\
     if (!GuildEventBindings->HasBindingsFor(key))\
         return;\
-    LOCK_FORGE
+    LOCK_FORGE_STATE
 
 void Forge::OnAddMember(Guild* guild, Player* player, uint32 plRank)
 {
@@ -21,7 +21,7 @@ using namespace Hooks;
     auto instanceKey = EntryKey<InstanceEvents>(EVENT, AI->instance->GetInstanceId());\
     if (!MapEventBindings->HasBindingsFor(mapKey) && !InstanceEventBindings->HasBindingsFor(instanceKey))\
         return;\
-    LOCK_FORGE;\
+    LOCK_FORGE_STATE;\
     PushInstanceData(L, AI);\
     Push(AI->instance)
 
@@ -32,7 +32,7 @@ using namespace Hooks;
     auto instanceKey = EntryKey<InstanceEvents>(EVENT, AI->instance->GetInstanceId());\
     if (!MapEventBindings->HasBindingsFor(mapKey) && !InstanceEventBindings->HasBindingsFor(instanceKey))\
         return RETVAL;\
-    LOCK_FORGE;\
+    LOCK_FORGE_STATE;\
     PushInstanceData(L, AI);\
     Push(AI->instance)
 
@@ -19,7 +19,7 @@ using namespace Hooks;
     auto key = EventKey<ServerEvents>(EVENT);\
     if (!ServerEventBindings->HasBindingsFor(key))\
         return;\
-    LOCK_FORGE
+    LOCK_FORGE_STATE
 
 #define START_HOOK_PACKET(EVENT, OPCODE) \
     if (!IsEnabled())\
@@ -27,7 +27,7 @@ using namespace Hooks;
     auto key = EntryKey<PacketEvents>(EVENT, OPCODE);\
     if (!PacketEventBindings->HasBindingsFor(key))\
         return;\
-    LOCK_FORGE
+    LOCK_FORGE_STATE
 
 bool Forge::OnPacketSend(WorldSession* session, const WorldPacket& packet)
 {
@@ -10,6 +10,7 @@
 #include "BindingMap.h"
 #include "ForgeIncludes.h"
 #include "ForgeTemplate.h"
+#include <sstream>
 
 using namespace Hooks;
 
@@ -19,7 +20,7 @@ using namespace Hooks;
     auto key = EventKey<PlayerEvents>(EVENT);\
     if (!PlayerEventBindings->HasBindingsFor(key))\
         return;\
-    LOCK_FORGE
+    LOCK_FORGE_STATE
 
 #define START_HOOK_WITH_RETVAL(EVENT, RETVAL) \
     if (!IsEnabled())\
@@ -27,7 +28,7 @@ using namespace Hooks;
     auto key = EventKey<PlayerEvents>(EVENT);\
     if (!PlayerEventBindings->HasBindingsFor(key))\
         return RETVAL;\
-    LOCK_FORGE
+    LOCK_FORGE_STATE
 
 void Forge::OnLearnTalents(Player* pPlayer, uint32 talentId, uint32 talentRank, uint32 spellid)
 {
@@ -52,6 +53,56 @@ bool Forge::OnCommand(ChatHandler& handler, const char* text)
             ReloadForge();
             return false;
         }
+
+        // .forge stats [count] [total|p99]
+        if (reload.find("forge stats") == 0)
+        {
+            size_t count = 10;
+            HookStats::SortOrder order = HookStats::SORT_BY_TOTAL;
+
+            std::istringstream args(reload.substr(11));
+            std::string arg;
+            while (args >> arg)
+            {
+                if (arg == "p99")
+                    order = HookStats::SORT_BY_P99;
+                else if (arg == "total")
+                    order = HookStats::SORT_BY_TOTAL;
+                else if (uint32 n = atoi(arg.c_str()))
+                    count = n;
+            }
+
+            SendHookStats(handler, count, order);
+            return false;
+        }
+
+        // .forge locks [count]
+        if (reload.find("forge locks") == 0)
+        {
+            size_t count = 10;
+            if (uint32 n = atoi(reload.substr(11).c_str()))
+                count = n;
+
+            SendLockStats(handler, count);
+            return false;
+        }
+
+        // .forge profile start [seconds] | .forge profile stop
+        if (reload.find("forge profile") == 0)
+        {
+            std::istringstream args(reload.substr(13));
+            std::string action;
+            uint32 seconds = 0;
+            args >> action >> seconds;
+
+            if (action == "start")
+                StartProfile(handler, seconds);
+            else if (action == "stop")
+                StopProfile(&handler);
+            else
+                handler.SendSysMessage("[Forge]: Usage: .forge profile start [seconds] | .forge profile stop");
+            return false;
+        }
     }
 
     START_HOOK_WITH_RETVAL(PLAYER_EVENT_ON_COMMAND, true);
@@ -10,6 +10,7 @@
 #include "BindingMap.h"
 #include "ForgeEventMgr.h"
 #include "ForgeIncludes.h"
+#include "ForgeMetrics.h"
 #include "ForgeTemplate.h"
 
 using namespace Hooks;
@@ -20,7 +21,7 @@ using namespace Hooks;
     auto key = EventKey<ServerEvents>(EVENT);\
     if (!ServerEventBindings->HasBindingsFor(key))\
         return;\
-    LOCK_FORGE
+    LOCK_FORGE_STATE
 
 #define START_HOOK_WITH_RETVAL(EVENT, RETVAL) \
     if (!IsEnabled())\
@@ -28,7 +29,7 @@ using namespace Hooks;
     auto key = EventKey<ServerEvents>(EVENT);\
     if (!ServerEventBindings->HasBindingsFor(key))\
         return RETVAL;\
-    LOCK_FORGE
+    LOCK_FORGE_STATE
 
 bool Forge::OnAddonMessage(Player* sender, uint32 type, std::string& msg, Player* receiver, Guild* guild, Group* group, Channel* channel)
 {
@@ -66,8 +67,10 @@ bool Forge::OnAddonMessage(Player* sender, uint32 type, std::string& msg, Player
 
 void Forge::OnTimedEvent(int funcRef, uint32 delay, uint32 calls, WorldObject* obj)
 {
-    LOCK_FORGE;
+    LOCK_FORGE_STATE;
     ASSERT(!event_level);
+    if (ForgeMetrics::IsEnabled())
+        ForgeMetrics::RecordTimerCall();
 
     // Get function
     lua_rawgeti(L, LUA_REGISTRYINDEX, funcRef);
@@ -314,14 +317,23 @@ void Forge::OnShutdownCancel()
 
 void Forge::OnWorldUpdate(uint32 diff)
 {
+    ForgeEventProcessor::NextTick();
+
     {
         LOCK_FORGE;
         if (ShouldReload())
             _ReloadForge();
+
+        if (profiler.IsExpired())
+            StopProfile(NULL);
     }
 
+    eventMgr->globalProcessor->Update(diff);
     httpManager.HandleHttpResponses();
+    HandleAsyncResults();
     queryProcessor.ProcessReadyCallbacks();
+    coroutines.Update(diff);
+    UpdateMetrics(diff);
 
     START_HOOK(WORLD_EVENT_ON_UPDATE);
     Push(diff);
@@ -373,9 +385,19 @@ void Forge::OnPlayerLeave(Map* map, Player* player)
 
 void Forge::OnUpdate(Map* map, uint32 diff)
 {
+    // A map state runs its timed events and callbacks in the map's update,
+    //  the global state does so in OnWorldUpdate
+    if (stateMap)
+    {
+        eventMgr->globalProcessor->Update(diff);
+        httpManager.HandleHttpResponses();
+        HandleAsyncResults();
+        queryProcessor.ProcessReadyCallbacks();
+        coroutines.Update(diff);
+        UpdateMetrics(diff);
+    }
+
     START_HOOK(MAP_EVENT_ON_UPDATE);
-    // enable this for multithread
-    // eventMgr->globalProcessor->Update(diff);
     Push(map);
     Push(diff);
     CallAllFunctions(ServerEventBindings, key);
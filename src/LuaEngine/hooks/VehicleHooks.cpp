@@ -21,7 +21,7 @@ using namespace Hooks;
     auto key = EventKey<VehicleEvents>(EVENT);\
     if (!VehicleEventBindings->HasBindingsFor(key))\
         return;\
-    LOCK_FORGE
+    LOCK_FORGE_STATE
 
 void Forge::OnInstall(Vehicle* vehicle)
 {
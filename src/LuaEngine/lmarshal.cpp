@@ -32,6 +32,8 @@
 #include <stdlib.h>
 #include <string.h>
 #include <cstdint>
+#include <new>
+#include <vector>
 
 extern "C" {
 #include "lua.h"
@@ -45,6 +47,9 @@ extern "C" {
 #define MAR_TVAL 2
 #define MAR_TUSR 3
 
+/* Type byte of integers, Lua 5.3 and later. Numbers written before are still read as LUA_TNUMBER */
+#define MAR_TINT 0x40
+
 #define MAR_CHR 1
 #define MAR_I32 4
 #define MAR_I64 8
@@ -60,8 +65,13 @@ typedef struct mar_Buffer {
     size_t seek;
     size_t head;
     char*  data;
+    size_t slot;
 } mar_Buffer;
 
+/* Data of the buffers in use on this thread, by nesting depth. An error unwinds past
+   their buf_done, so mar_encode frees the ones left over. */
+static thread_local std::vector<char*> live_buffers;
+
 static int mar_encode_table(lua_State *L, mar_Buffer *buf, size_t *idx);
 static int mar_decode_table(lua_State *L, const char* buf, size_t len, size_t *idx);
 
@@ -71,11 +81,20 @@ static void buf_init(lua_State *L, mar_Buffer *buf)
     buf->seek = 0;
     buf->head = 0;
     if (!(buf->data = (char*)malloc(buf->size))) luaL_error(L, "Out of memory!");
+    try {
+        live_buffers.push_back(buf->data);
+    }
+    catch (std::bad_alloc const&) {
+        free(buf->data);
+        luaL_error(L, "Out of memory!");
+    }
+    buf->slot = live_buffers.size() - 1;
 }
 
 static void buf_done(lua_State* /*L*/, mar_Buffer *buf)
 {
     free(buf->data);
+    live_buffers.resize(buf->slot);
 }
 
 static int buf_write(lua_State* L, const char* str, size_t len, mar_Buffer *buf)
@@ -93,6 +112,7 @@ static int buf_write(lua_State* L, const char* str, size_t len, mar_Buffer *buf)
         }
         buf->data = data;
         buf->size = new_size;
+        live_buffers[buf->slot] = data;
     }
     memcpy(&buf->data[buf->head], str, len);
     buf->head += len;
@@ -114,6 +134,10 @@ static void mar_encode_value(lua_State *L, mar_Buffer *buf, int val, size_t *idx
 {
     size_t l;
     int val_type = lua_type(L, val);
+#if LUA_VERSION_NUM >= 503
+    if (val_type == LUA_TNUMBER && lua_isinteger(L, val))
+        val_type = MAR_TINT;
+#endif
     lua_pushvalue(L, val);
 
     buf_write(L, (const char*)&val_type, MAR_CHR, buf);
@@ -134,6 +158,11 @@ static void mar_encode_value(lua_State *L, mar_Buffer *buf, int val, size_t *idx
         buf_write(L, (const char*)&num_val, MAR_I64, buf);
         break;
     }
+    case MAR_TINT: {
+        int64_t int_val = lua_tointeger(L, -1);
+        buf_write(L, (const char*)&int_val, MAR_I64, buf);
+        break;
+    }
     case LUA_TTABLE: {
         int tag, ref;
         lua_pushvalue(L, -1);
@@ -344,6 +373,10 @@ static void mar_decode_value
         lua_pushnumber(L, *(lua_Number*)*p);
         mar_incr_ptr(MAR_I64);
         break;
+    case MAR_TINT:
+        lua_pushinteger(L, (lua_Integer)*(int64_t*)*p);
+        mar_incr_ptr(MAR_I64);
+        break;
     case LUA_TSTRING:
         mar_next_len(l, uint32_t);
         lua_pushlstring(L, *p, l);
@@ -478,7 +511,7 @@ static int mar_decode_table(lua_State *L, const char* buf, size_t len, size_t *i
     return 1;
 }
 
-int mar_encode(lua_State* L)
+static int mar_encode_protected(lua_State* L)
 {
     const unsigned char m = MAR_MAGIC;
     size_t idx, len;
@@ -524,6 +557,22 @@ int mar_encode(lua_State* L)
     return 1;
 }
 
+/* Encodes under a pcall, so the buffers of a failed encode are freed before the error goes on */
+int mar_encode(lua_State* L)
+{
+    size_t outer = live_buffers.size();
+    lua_pushcfunction(L, &mar_encode_protected);
+    lua_insert(L, 1);
+    if (lua_pcall(L, lua_gettop(L) - 1, 1, 0)) {
+        for (size_t i = outer; i < live_buffers.size(); ++i) {
+            free(live_buffers[i]);
+        }
+        live_buffers.resize(outer);
+        return lua_error(L);
+    }
+    return 1;
+}
+
 int mar_decode(lua_State* L)
 {
     size_t l, idx, len;
@@ -577,7 +626,12 @@ static const luaL_Reg R[] =
 int luaopen_marshal(lua_State *L)
 {
     lua_newtable(L);
-    luaL_setfuncs(L, R, 0);
+    // luaL_setfuncs is missing from Lua 5.1
+    for (const luaL_Reg* reg = R; reg->name; ++reg)
+    {
+        lua_pushcfunction(L, reg->func);
+        lua_setfield(L, -2, reg->name);
+    }
     return 1;
 }
 
@@ -8,6 +8,8 @@
 #define GLOBALMETHODS_H
 
 #include "BindingMap.h"
+#include "ForgeMetrics.h"
+#include "lmarshal.h"
 
 #ifdef AZEROTHCORE
 
@@ -114,38 +116,40 @@ namespace LuaGlobalFunctions
     }
     
     /**
-     * Returns the [Map] pointer of the Lua state. Returns null for the "World" state. 
+     * Returns the [Map] the current Lua state belongs to, or nil for the global state.
+     *
+     * Each map gets its own Lua state when `Forge.MapStates` is enabled in the config.
      *
      * @return [Map] map
      */
     int GetStateMap(lua_State* L)
     {
-        // Until AC supports multistate, this will always return nil
-        Forge::Push(L);
+        Forge::Push(L, Forge::GetForge(L)->GetStateMap());
         return 1;
     }
 
     /**
-     * Returns the map ID of the Lua state. Returns -1 for the "World" state.
+     * Returns the ID of the [Map] the current Lua state belongs to, or -1 for the global state.
      *
      * @return int32 mapId
      */
     int GetStateMapId(lua_State* L)
     {
-        // Until AC supports multistate, this will always return -1
-        Forge::Push(L, -1);
+        Map* map = Forge::GetForge(L)->GetStateMap();
+        Forge::Push(L, map ? int32(map->GetId()) : -1);
         return 1;
     }
 
     /**
-     * Returns the instance ID of the Lua state. Returns 0 for continent maps and the world state.
+     * Returns the instance ID of the [Map] the current Lua state belongs to, or -1 for the global state.
+     * Continent maps have the instance ID 0.
      *
-     * @return uint32 instanceId
+     * @return int32 instanceId
      */
     int GetStateInstanceId(lua_State* L)
     {
-        // Until AC supports multistate, this will always return 0
-        Forge::Push(L, 0);
+        Map* map = Forge::GetForge(L)->GetStateMap();
+        Forge::Push(L, map ? int32(map->GetInstanceId()) : -1);
         return 1;
     }
 
@@ -1322,22 +1326,25 @@ namespace LuaGlobalFunctions
             return 0;
         }
 
-        Forge::GForge->queryProcessor.AddCallback(db.AsyncQuery(query).WithCallback([L, funcRef](QueryResult result)
+        Forge* E = Forge::GetForge(L);
+        // The callback runs on the main thread of the state, `L` may be a coroutine that is gone by then.
+        // The query is counted as pending until the callback ran or was dropped.
+        E->queryProcessor.AddCallback(db.AsyncQuery(query).WithCallback([E, funcRef, pending = ForgeMetrics::TrackQuery()](QueryResult result)
             {
                 ForgeQuery* eq = result ? new ForgeQuery(result) : nullptr;
 
-                LOCK_FORGE;
+                Forge::Guard guard(E->GetStateLock(), "DBQueryAsync");
 
                 // Get function
-                lua_rawgeti(L, LUA_REGISTRYINDEX, funcRef);
+                lua_rawgeti(E->L, LUA_REGISTRYINDEX, funcRef);
 
                 // Push parameters
-                Forge::Push(L, eq);
+                Forge::Push(E->L, eq);
 
                 // Call function
-                Forge::GForge->ExecuteCall(1, 0);
+                E->ExecuteCall(1, 0);
 
-                luaL_unref(L, LUA_REGISTRYINDEX, funcRef);
+                luaL_unref(E->L, LUA_REGISTRYINDEX, funcRef);
             }));
 
         return 0;
@@ -1574,11 +1581,14 @@ namespace LuaGlobalFunctions
      * @proto eventId = (function, delaytable)
      * @proto eventId = (function, delay, repeats)
      * @proto eventId = (function, delaytable, repeats)
+     * @proto eventId = (function, delay, repeats, spread)
+     * @proto eventId = (function, delaytable, repeats, spread)
      *
      * @param function function : function to trigger when the time has passed
      * @param uint32 delay : set time in milliseconds for the event to trigger
      * @param table delaytable : a table `{min, max}` containing the minimum and maximum delay time
      * @param uint32 repeats = 1 : how many times for the event to repeat, 0 is infinite
+     * @param bool spread = false : if true the first call happens sooner, after a part of the delay picked from the event ID, so that events created together run in different ticks
      * @return int eventId : unique ID for the timed event used to cancel it or nil
      */
     int CreateLuaEvent(lua_State* L)
@@ -1598,6 +1608,7 @@ namespace LuaGlobalFunctions
         else
             min = max = Forge::CHECKVAL<uint32>(L, 2);
         uint32 repeats = Forge::CHECKVAL<uint32>(L, 3, 1);
+        bool spread = Forge::CHECKVAL<bool>(L, 4, false);
 
         if (min > max)
             return luaL_argerror(L, 2, "min is bigger than max delay");
@@ -1606,7 +1617,7 @@ namespace LuaGlobalFunctions
         int functionRef = luaL_ref(L, LUA_REGISTRYINDEX);
         if (functionRef != LUA_REFNIL && functionRef != LUA_NOREF)
         {
-            Forge::GetForge(L)->eventMgr->globalProcessor->AddEvent(functionRef, min, max, repeats);
+            Forge::GetForge(L)->eventMgr->globalProcessor->AddEvent(functionRef, min, max, repeats, spread);
             Forge::Push(L, functionRef);
         }
         return 1;
@@ -1621,7 +1632,7 @@ namespace LuaGlobalFunctions
     int RemoveEventById(lua_State* L)
     {
         int eventId = Forge::CHECKVAL<int>(L, 1);
-        bool all_Events = Forge::CHECKVAL<bool>(L, 1, false);
+        bool all_Events = Forge::CHECKVAL<bool>(L, 2, false);
 
         // not thread safe
         if (all_Events)
@@ -2807,6 +2818,58 @@ namespace LuaGlobalFunctions
         return 0;
     }
 
+    // Reads the optional body, content type, headers and options of HttpRequest, AwaitHttp and
+    //  HttpDownload that follow the first two arguments into `request`, returns the index after them
+    static int CheckHttpArgs(lua_State* L, HttpWorkItem& request, bool allowBody = true)
+    {
+        int headersIdx = 3;
+        int nextIdx = 3;
+
+        if (allowBody && !lua_istable(L, headersIdx) && lua_isstring(L, headersIdx) && lua_isstring(L, headersIdx + 1))
+        {
+            request.body = Forge::CHECKVAL<std::string>(L, 3);
+            request.contentType = Forge::CHECKVAL<std::string>(L, 4);
+            headersIdx = 5;
+            nextIdx = 5;
+        }
+
+        if (lua_istable(L, headersIdx))
+        {
+            ++nextIdx;
+
+            lua_pushnil(L); // First key
+            while (lua_next(L, headersIdx) != 0)
+            {
+                // Uses 'key' (at index -2) and 'value' (at index -1)
+                if (lua_isstring(L, -2))
+                {
+                    std::string key(lua_tostring(L, -2));
+                    std::string value(lua_tostring(L, -1));
+                    request.headers.insert(std::pair<std::string, std::string>(key, value));
+                }
+                // Removes 'value'; keeps 'key' for next iteration
+                lua_pop(L, 1);
+            }
+
+            // Options can only follow headers, a single table is always the headers
+            if (lua_istable(L, nextIdx))
+            {
+                lua_getfield(L, nextIdx, "connectTimeout");
+                request.connectTimeout = Forge::CHECKVAL<uint32>(L, -1, request.connectTimeout);
+                lua_getfield(L, nextIdx, "timeout");
+                request.timeout = Forge::CHECKVAL<uint32>(L, -1, request.timeout);
+                lua_getfield(L, nextIdx, "chunkSize");
+                request.chunkSize = Forge::CHECKVAL<uint32>(L, -1, request.chunkSize);
+                lua_getfield(L, nextIdx, "maxBodySize");
+                request.maxBodySize = Forge::CHECKVAL<uint64>(L, -1, request.maxBodySize);
+                lua_pop(L, 4);
+                ++nextIdx;
+            }
+        }
+
+        return nextIdx;
+    }
+
     /**
      * Performs a non-blocking HTTP request.
      *
@@ -2827,70 +2890,340 @@ namespace LuaGlobalFunctions
      *         print(body)
      *     end)
      *
+     *     -- Example with a longer timeout, options always follow the headers
+     *     HttpRequest("GET", "https://postman-echo.com/delay/8", {}, { timeout = 10000 }, function(status, body, headers)
+     *         print(status)
+     *     end)
+     *
+     *     -- Example of a big body passed in chunks of 64 KiB as it arrives
+     *     local parts = {}
+     *     HttpRequest("GET", "https://example.com/export.csv", {}, { chunkSize = 65536, maxBodySize = 0 }, function(status, chunk, headers, last)
+     *         if not status then
+     *             print("Request failed: " .. chunk)
+     *             return
+     *         end
+     *         table.insert(parts, chunk)
+     *         if last then
+     *             print(#table.concat(parts))
+     *         end
+     *     end)
+     *
+     * With the `chunkSize` option the callback is called for every chunk with a fourth value that
+     * is `true` for the last one, and with `nil` and the error message if the request fails.
+     * Bodies longer than `Forge.HttpMaxBodySize` make the request fail unless the `maxBodySize` option is given.
+     *
+     * Connections are kept open and reused by later requests to the same server.
+     * GET responses that allow it are cached and answered without sending the request again while
+     * they are fresh, see `Forge.HttpCacheSize`.
+     *
+     * When `Forge.HttpQueueLimit` requests are already waiting for their response the request is
+     * rejected: `false` is returned and the callback is never called. See [Global:GetHttpStats].
+     *
      * @proto (httpMethod, url, function)
      * @proto (httpMethod, url, headers, function)
+     * @proto (httpMethod, url, headers, options, function)
      * @proto (httpMethod, url, body, contentType, function)
      * @proto (httpMethod, url, body, contentType, headers, function)
+     * @proto (httpMethod, url, body, contentType, headers, options, function)
      *
      * @param string httpMethod : the HTTP method to use (possible values are: `"GET"`, `"HEAD"`, `"POST"`, `"PUT"`, `"PATCH"`, `"DELETE"`, `"OPTIONS"`)
      * @param string url : the URL to query
      * @param table headers : a table with string key-value pairs containing the request headers
+     * @param table options : a table with the timeouts in milliseconds, `connectTimeout` (3000 by default) and `timeout` for every read and write (5000 by default), and `chunkSize` and `maxBodySize` (0 for no limit) in bytes
      * @param string body : the request's body (only used for POST, PUT and PATCH requests)
      * @param string contentType : the body's content-type
      * @param function function : function that will be called when the request is executed
+     * @return bool queued : `false` if the request was rejected because too many requests are pending
      */
     int HttpRequest(lua_State* L)
     {
         std::string httpVerb = Forge::CHECKVAL<std::string>(L, 1);
         std::string url = Forge::CHECKVAL<std::string>(L, 2);
-        std::string body;
-        std::string bodyContentType;
-        httplib::Headers headers;
+        HttpWorkItem request(LUA_NOREF, httpVerb, url, "", "", httplib::Headers());
 
-        int headersIdx = 3;
-        int callbackIdx = 3;
+        int callbackIdx = CheckHttpArgs(L, request);
 
-        if (!lua_istable(L, headersIdx) && lua_isstring(L, headersIdx) && lua_isstring(L, headersIdx + 1))
-        {
-            body = Forge::CHECKVAL<std::string>(L, 3);
-            bodyContentType = Forge::CHECKVAL<std::string>(L, 4);
-            headersIdx = 5;
-            callbackIdx = 5;
-        }
+        lua_pushvalue(L, callbackIdx);
+        int funcRef = luaL_ref(L, LUA_REGISTRYINDEX);
+        if (funcRef < 0)
+            return luaL_argerror(L, callbackIdx, "unable to make a ref to function");
 
-        if (lua_istable(L, headersIdx))
-        {
-            ++callbackIdx;
+        request.funcRef = funcRef;
+        bool queued = Forge::GetForge(L)->httpManager.PushRequest(new HttpWorkItem(request));
+        if (!queued)
+            luaL_unref(L, LUA_REGISTRYINDEX, funcRef);
 
-            lua_pushnil(L); // First key
-            while (lua_next(L, headersIdx) != 0)
-            {
-                // Uses 'key' (at index -2) and 'value' (at index -1)
-                if (lua_isstring(L, -2))
-                {
-                    std::string key(lua_tostring(L, -2));
-                    std::string value(lua_tostring(L, -1));
-                    headers.insert(std::pair<std::string, std::string>(key, value));
-                }
-                // Removes 'value'; keeps 'key' for next iteration
-                lua_pop(L, 1);
-            }
-        }
+        Forge::Push(L, queued);
+        return 1;
+    }
+
+    /**
+     * Downloads a file with a non-blocking HTTP GET request.
+     *
+     * The body is written to the file as it arrives instead of being kept in memory. It is written to
+     * `path` with `.part` appended first and replaces the file at `path` once complete, so the file is
+     * never left half written. Responses with a status other than 2xx don't change the file.
+     * Reloading the scripts stops a running download and leaves the file as it was.
+     *
+     * The callback is called with `(status, size, headers)` once the download is done,
+     * or with `nil` and the error message if it failed.
+     *
+     *     HttpDownload("https://example.com/data.json", "lua_scripts/data/data.json", function(status, size, headers)
+     *         if status == 200 then
+     *             print("Downloaded " .. size .. " bytes")
+     *         end
+     *     end)
+     *
+     * @proto (url, path, function)
+     * @proto (url, path, headers, function)
+     * @proto (url, path, headers, options, function)
+     *
+     * @param string url : the URL to download
+     * @param string path : the file to write, relative to the working directory of the server
+     * @param table headers : a table with string key-value pairs containing the request headers
+     * @param table options : a table with the timeouts in milliseconds, `connectTimeout` and `timeout`, and `maxBodySize` in bytes (`Forge.HttpMaxDownloadSize` by default, 0 for no limit)
+     * @param function function : function that will be called when the download is done
+     * @return bool queued : `false` if the request was rejected because too many requests are pending
+     */
+    int HttpDownload(lua_State* L)
+    {
+        std::string url = Forge::CHECKVAL<std::string>(L, 1);
+        std::string path = Forge::CHECKVAL<std::string>(L, 2);
+        HttpWorkItem request(LUA_NOREF, "GET", url, "", "", httplib::Headers());
+
+        int callbackIdx = CheckHttpArgs(L, request, false);
+        request.chunkSize = 0;
+        request.downloadPath = path;
 
         lua_pushvalue(L, callbackIdx);
         int funcRef = luaL_ref(L, LUA_REGISTRYINDEX);
-        if (funcRef >= 0)
+        if (funcRef < 0)
+            return luaL_argerror(L, callbackIdx, "unable to make a ref to function");
+
+        request.funcRef = funcRef;
+        bool queued = Forge::GetForge(L)->httpManager.PushRequest(new HttpWorkItem(request));
+        if (!queued)
+            luaL_unref(L, LUA_REGISTRYINDEX, funcRef);
+
+        Forge::Push(L, queued);
+        return 1;
+    }
+
+    /**
+     * Runs Lua code on a worker thread, so that heavy computations don't hold up the server.
+     *
+     * The code runs in a separate Lua state without access to the game, other scripts or globals,
+     * and gets a copy of `args` as its `...`. Tables, strings, numbers and booleans can be passed
+     * in and returned, game objects can't. When the code is done, the callback is called during
+     * the next update with `true` and the values returned by the code, or with `false` and the
+     * error message.
+     *
+     *     RunAsync("local t = ... table.sort(t) return t", { scores }, function(ok, sorted)
+     *         if ok then
+     *             print(sorted[1])
+     *         end
+     *     end)
+     *
+     * When Forge is reloaded, queued jobs are dropped and running jobs are not waited for: they keep
+     * their worker thread until they end or hit the time limit, and their callbacks are not called.
+     * Set the number of worker threads and the time limit of a job with `Forge.AsyncWorkers`
+     * and `Forge.AsyncTimeout` in the config.
+     *
+     * @param string source : the Lua code to run, it is compiled once and reused
+     * @param table args : an array of the arguments to pass to the code, can be nil
+     * @param function callback : function called with the results
+     */
+    int RunAsync(lua_State* L)
+    {
+        size_t sourceLength;
+        const char* source = luaL_checklstring(L, 1, &sourceLength);
+        if (!lua_isnoneornil(L, 2))
+            luaL_checktype(L, 2, LUA_TTABLE);
+        luaL_checktype(L, 3, LUA_TFUNCTION);
+
+        if (!Forge::IsAsyncEnabled())
+            return luaL_error(L, "RunAsync is disabled, see Forge.AsyncWorkers in the config");
+
+        uint32 argCount = 0;
+        lua_pushcfunction(L, &mar_encode);
+        if (lua_istable(L, 2))
         {
-            Forge::GForge->httpManager.PushRequest(new HttpWorkItem(funcRef, httpVerb, url, body, bodyContentType, headers));
+            argCount = lua_rawlen(L, 2);
+            lua_pushvalue(L, 2);
         }
         else
-        {
-            luaL_argerror(L, callbackIdx, "unable to make a ref to function");
-        }
+            lua_newtable(L);
+        lua_call(L, 1, 1);
+
+        size_t argsLength;
+        const char* args = lua_tolstring(L, -1, &argsLength);
+        std::string encodedArgs(args, argsLength);
+        lua_pop(L, 1);
 
+        lua_pushvalue(L, 3);
+        int funcRef = luaL_ref(L, LUA_REGISTRYINDEX);
+        if (funcRef == LUA_REFNIL || funcRef == LUA_NOREF)
+            return luaL_argerror(L, 3, "unable to make a ref to function");
+
+        Forge::GetForge(L)->PushAsyncJob(funcRef, std::string(source, sourceLength), encodedArgs, argCount);
         return 0;
     }
 
+    // Raises an error unless L is a coroutine started with StartCoroutine, which the await functions can yield
+    static Forge* CheckCoroutine(lua_State* L, const char* function)
+    {
+        Forge* E = Forge::GetForge(L);
+        if (!E->coroutines.IsCoroutine(L))
+            luaL_error(L, "%s can only be called from a coroutine started with StartCoroutine", function);
+        return E;
+    }
+
+    /**
+     * Runs a function as a coroutine that can wait with [Global:Sleep], [Global:AwaitQuery] and [Global:AwaitHttp]
+     * without holding up the server.
+     *
+     * The function runs right away until it waits for the first time, and continues during a later update once
+     * what it waits for is done. Errors are logged like the errors of event handlers. Calling `coroutine.yield`
+     * in the coroutine waits for the next update.
+     *
+     *     StartCoroutine(function(playerGuid)
+     *         local Q = AwaitQuery("SELECT name FROM creature_template WHERE entry = 1")
+     *         Sleep(2000)
+     *         local status, body = AwaitHttp("GET", "https://example.com/")
+     *         print(Q and Q:GetString(0), status)
+     *     end, player:GetGUID())
+     *
+     * With Lua 5.1 and LuaJIT a coroutine can't wait inside `pcall`, the wait raises an error instead.
+     * Coroutines that are waiting when Forge is reloaded are dropped.
+     *
+     * @param function func : the function to run
+     * @param ... : arguments passed to the function
+     */
+    int StartCoroutine(lua_State* L)
+    {
+        luaL_checktype(L, 1, LUA_TFUNCTION);
+
+        Forge::GetForge(L)->coroutines.Start(L, lua_gettop(L) - 1);
+        return 0;
+    }
+
+    /**
+     * Pauses the current coroutine for the given time. Can only be called from a coroutine started with [Global:StartCoroutine].
+     *
+     * The time is counted in server updates, the coroutine continues in the first update after it is over.
+     *
+     * @param uint32 ms : time to wait in milliseconds, 0 waits for the next update
+     */
+    int Sleep(lua_State* L)
+    {
+        uint32 ms = Forge::CHECKVAL<uint32>(L, 1);
+
+        CheckCoroutine(L, "Sleep")->coroutines.Sleep(L, ms);
+        return lua_yield(L, 0);
+    }
+
+    template <typename T>
+    static int AwaitDBQuery(lua_State* L, DatabaseWorkerPool<T>& db, const char* query)
+    {
+        Forge* E = CheckCoroutine(L, "AwaitQuery");
+        uint64 waitId = E->coroutines.Park(L);
+
+        E->queryProcessor.AddCallback(db.AsyncQuery(query).WithCallback([E, waitId, pending = ForgeMetrics::TrackQuery()](QueryResult result)
+            {
+                ForgeQuery* eq = result ? new ForgeQuery(result) : nullptr;
+
+                Forge::Guard guard(E->GetStateLock(), "AwaitQuery");
+
+                // The coroutine is gone if the state was reloaded meanwhile
+                if (!E->coroutines.Wake(waitId, [eq](lua_State* L) { Forge::Push(L, eq); return 1; }))
+                    delete eq;
+            }));
+
+        return lua_yield(L, 0);
+    }
+
+    /**
+     * Executes an SQL query asynchronously and pauses the current coroutine until the results are available.
+     * Can only be called from a coroutine started with [Global:StartCoroutine].
+     *
+     *     local Q = AwaitQuery("SELECT guid FROM characters WHERE online = 1", "char")
+     *
+     * @param string sql : query to execute
+     * @param string database = "world" : the database to query, `"world"`, `"char"` or `"auth"`
+     * @return [ForgeQuery] results : the results or `nil` if no rows were found
+     */
+    int AwaitQuery(lua_State* L)
+    {
+        // Only PODs may be alive when AwaitDBQuery yields, with Lua 5.2+ built as C
+        // the yield unwinds this frame without running destructors
+        const char* query = Forge::CHECKVAL<const char*>(L, 1);
+        const char* database = Forge::CHECKVAL<const char*>(L, 2, "world");
+
+        if (!strcmp(database, "world"))
+            return AwaitDBQuery(L, WorldDatabase, query);
+        if (!strcmp(database, "char"))
+            return AwaitDBQuery(L, CharacterDatabase, query);
+        if (!strcmp(database, "auth"))
+            return AwaitDBQuery(L, LoginDatabase, query);
+        return luaL_argerror(L, 2, "expected \"world\", \"char\" or \"auth\"");
+    }
+
+    /**
+     * Performs an HTTP request and pauses the current coroutine until it is done.
+     * Can only be called from a coroutine started with [Global:StartCoroutine].
+     *
+     * Takes the same arguments as [Global:HttpRequest] without the callback.
+     *
+     *     local status, body, headers = AwaitHttp("GET", "https://example.com/")
+     *     if not status then
+     *         print("Request failed: " .. body)
+     *     end
+     *
+     * A request rejected because too many requests are pending fails right away without pausing.
+     *
+     * @proto (httpMethod, url)
+     * @proto (httpMethod, url, headers)
+     * @proto (httpMethod, url, headers, options)
+     * @proto (httpMethod, url, body, contentType)
+     * @proto (httpMethod, url, body, contentType, headers)
+     * @proto (httpMethod, url, body, contentType, headers, options)
+     *
+     * @param string httpMethod : the HTTP method to use (possible values are: `"GET"`, `"HEAD"`, `"POST"`, `"PUT"`, `"PATCH"`, `"DELETE"`, `"OPTIONS"`)
+     * @param string url : the URL to query
+     * @param table headers : a table with string key-value pairs containing the request headers
+     * @param table options : a table with the timeouts in milliseconds, `connectTimeout` and `timeout`, and `maxBodySize` in bytes
+     * @param string body : the request's body (only used for POST, PUT and PATCH requests)
+     * @param string contentType : the body's content-type
+     * @return number status : the response status, or `nil` if the request failed
+     * @return string body : the response body, or the error message if the request failed
+     * @return table headers : the response headers
+     */
+    int AwaitHttp(lua_State* L)
+    {
+        // Only PODs may be alive at the yield, with Lua 5.2+ built as C
+        // it unwinds this frame without running destructors
+        {
+            std::string httpVerb = Forge::CHECKVAL<std::string>(L, 1);
+            std::string url = Forge::CHECKVAL<std::string>(L, 2);
+            HttpWorkItem request(LUA_NOREF, httpVerb, url, "", "", httplib::Headers());
+
+            CheckHttpArgs(L, request);
+            // The coroutine is resumed once, with the whole body
+            request.chunkSize = 0;
+
+            Forge* E = CheckCoroutine(L, "AwaitHttp");
+            request.waitId = E->coroutines.Park(L);
+            if (!E->httpManager.PushRequest(new HttpWorkItem(request)))
+            {
+                E->coroutines.Unpark(L);
+                lua_pushnil(L);
+                Forge::Push(L, "too many pending HTTP requests");
+                return 2;
+            }
+        }
+        return lua_yield(L, 0);
+    }
+
     /**
      * Returns an object representing a `long long` (64-bit) value.
      *
@@ -3706,6 +4039,243 @@ namespace LuaGlobalFunctions
         return 1;
     }
 
+    /**
+     * Returns the event handlers that have taken the most time, as a table of tables.
+     *
+     * Every handler table has the fields `family` (for example "PlayerEvent"),
+     * `event`, `binding`, `source` ("file:line" of the handler function), `calls`,
+     * and the times `total`, `avg`, `p50`, `p99` and `max` in microseconds.
+     *
+     * Times are only recorded when `Forge.HookStats` is enabled in the config,
+     * otherwise the table is empty.
+     *
+     * @param uint32 count = 10 : the amount of handlers to return
+     * @param string sortBy = "total" : "total" to sort by total time, or "p99" to sort by 99th percentile call time
+     * @return table hookStats
+     */
+    int GetHookStats(lua_State* L)
+    {
+        uint32 count = Forge::CHECKVAL<uint32>(L, 1, 10);
+        std::string sortBy = Forge::CHECKVAL<std::string>(L, 2, "total");
+
+        HookStats::SortOrder order = HookStats::SORT_BY_TOTAL;
+        if (sortBy == "p99")
+            order = HookStats::SORT_BY_P99;
+        else if (sortBy != "total")
+            return luaL_argerror(L, 2, "expected \"total\" or \"p99\"");
+
+        std::vector<HookStats::Summary> top = Forge::GetForge(L)->hookStats.GetTop(count, order);
+
+        lua_createtable(L, top.size(), 0);
+        int tbl = lua_gettop(L);
+
+        uint32 i = 0;
+        for (HookStats::Summary const& summary : top)
+        {
+            lua_newtable(L);
+
+            Forge::Push(L, summary.family);
+            lua_setfield(L, -2, "family");
+
+            Forge::Push(L, summary.event_id);
+            lua_setfield(L, -2, "event");
+
+            Forge::Push(L, summary.binding_id);
+            lua_setfield(L, -2, "binding");
+
+            Forge::Push(L, summary.source);
+            lua_setfield(L, -2, "source");
+
+            Forge::Push(L, summary.calls);
+            lua_setfield(L, -2, "calls");
+
+            Forge::Push(L, summary.total_us);
+            lua_setfield(L, -2, "total");
+
+            Forge::Push(L, summary.avg_us);
+            lua_setfield(L, -2, "avg");
+
+            Forge::Push(L, summary.p50_us);
+            lua_setfield(L, -2, "p50");
+
+            Forge::Push(L, summary.p99_us);
+            lua_setfield(L, -2, "p99");
+
+            Forge::Push(L, summary.max_us);
+            lua_setfield(L, -2, "max");
+
+            lua_rawseti(L, tbl, ++i);
+        }
+
+        return 1;
+    }
+
+    /**
+     * Returns the memory usage of the Lua state as a table, or nil if the Lua state
+     * does not use Forge's allocator (LuaJIT on 64-bit targets without GC64).
+     *
+     * The table has the fields `live` and `peak` in bytes, the counts `allocations`
+     * and `frees`, `pooled` (the allocations served from Forge's pool rather than
+     * malloc) and `slabs` (the bytes reserved by the pool).
+     *
+     * @return table memoryStats
+     */
+    int GetLuaMemoryStats(lua_State* L)
+    {
+        const LuaAllocator::Stats* stats = Forge::GetForge(L)->GetLuaMemoryStats();
+        if (!stats)
+            return 0;
+
+        lua_createtable(L, 0, 6);
+
+        Forge::Push(L, stats->liveBytes);
+        lua_setfield(L, -2, "live");
+
+        Forge::Push(L, stats->peakBytes);
+        lua_setfield(L, -2, "peak");
+
+        Forge::Push(L, stats->allocations);
+        lua_setfield(L, -2, "allocations");
+
+        Forge::Push(L, stats->frees);
+        lua_setfield(L, -2, "frees");
+
+        Forge::Push(L, stats->pooledAllocations);
+        lua_setfield(L, -2, "pooled");
+
+        Forge::Push(L, stats->slabBytes);
+        lua_setfield(L, -2, "slabs");
+
+        return 1;
+    }
+
+    /**
+     * Returns the contention of the locks used by Forge as an array of tables, sorted by wait time,
+     * or nil if Forge was built without FORGE_LOCK_STATS defined.
+     *
+     * Every table is one lock and call site and has the fields `lock`, `site` and `acquisitions`,
+     * and the times `wait`, `maxWait`, `hold` and `maxHold` in microseconds.
+     *
+     * @param uint32 count = 10 : the amount of entries to return
+     * @return table lockStats
+     */
+    int GetLockStats(lua_State* L)
+    {
+        uint32 count = Forge::CHECKVAL<uint32>(L, 1, 10);
+
+        if (!LockStats::IsEnabled())
+            return 0;
+
+        std::vector<LockStats::Summary> top = LockStats::GetTop(count);
+
+        lua_createtable(L, top.size(), 0);
+        int tbl = lua_gettop(L);
+        uint32 i = 0;
+
+        for (LockStats::Summary const& summary : top)
+        {
+            lua_createtable(L, 0, 7);
+
+            Forge::Push(L, summary.lock);
+            lua_setfield(L, -2, "lock");
+
+            Forge::Push(L, summary.tag);
+            lua_setfield(L, -2, "site");
+
+            Forge::Push(L, summary.acquisitions);
+            lua_setfield(L, -2, "acquisitions");
+
+            Forge::Push(L, summary.wait_us);
+            lua_setfield(L, -2, "wait");
+
+            Forge::Push(L, summary.max_wait_us);
+            lua_setfield(L, -2, "maxWait");
+
+            Forge::Push(L, summary.hold_us);
+            lua_setfield(L, -2, "hold");
+
+            Forge::Push(L, summary.max_hold_us);
+            lua_setfield(L, -2, "maxHold");
+
+            lua_rawseti(L, tbl, ++i);
+        }
+
+        return 1;
+    }
+
+    /**
+     * Returns the state of the HTTP requests of all Lua states as a table.
+     *
+     * The fields are `pending`, the requests that have not been passed to Lua yet, and out of these
+     * `queued`, the requests waiting for a worker, and `running`. `limit` is `Forge.HttpQueueLimit`.
+     * The counters `started`, `completed` and `rejected` count the requests taken by a worker,
+     * the responses handled and the requests rejected because the limit was reached.
+     * `wait` and `maxWait` are the average and longest time until a worker took a request,
+     * `latency` and `maxLatency` the average and longest time until the response was handled,
+     * all in microseconds.
+     * The GET response cache counts `cacheHits`, the requests answered without sending them,
+     * `cacheRevalidated`, the ones answered by a 304, and `cacheMisses`, the ones sent without a usable
+     * entry. `cacheEntries` and `cacheSize` are the responses it holds and their size in bytes.
+     *
+     * @return table httpStats
+     */
+    int GetHttpStats(lua_State* L)
+    {
+        HttpStats stats = HttpManager::GetStats();
+
+        lua_createtable(L, 0, 16);
+
+        Forge::Push(L, stats.pending);
+        lua_setfield(L, -2, "pending");
+
+        Forge::Push(L, stats.queued);
+        lua_setfield(L, -2, "queued");
+
+        Forge::Push(L, stats.running);
+        lua_setfield(L, -2, "running");
+
+        Forge::Push(L, stats.limit);
+        lua_setfield(L, -2, "limit");
+
+        Forge::Push(L, stats.started);
+        lua_setfield(L, -2, "started");
+
+        Forge::Push(L, stats.completed);
+        lua_setfield(L, -2, "completed");
+
+        Forge::Push(L, stats.rejected);
+        lua_setfield(L, -2, "rejected");
+
+        Forge::Push(L, stats.started ? stats.total_wait_us / stats.started : 0);
+        lua_setfield(L, -2, "wait");
+
+        Forge::Push(L, stats.max_wait_us);
+        lua_setfield(L, -2, "maxWait");
+
+        Forge::Push(L, stats.completed ? stats.total_latency_us / stats.completed : 0);
+        lua_setfield(L, -2, "latency");
+
+        Forge::Push(L, stats.max_latency_us);
+        lua_setfield(L, -2, "maxLatency");
+
+        Forge::Push(L, stats.cache_hits);
+        lua_setfield(L, -2, "cacheHits");
+
+        Forge::Push(L, stats.cache_revalidated);
+        lua_setfield(L, -2, "cacheRevalidated");
+
+        Forge::Push(L, stats.cache_misses);
+        lua_setfield(L, -2, "cacheMisses");
+
+        Forge::Push(L, stats.cache_entries);
+        lua_setfield(L, -2, "cacheEntries");
+
+        Forge::Push(L, stats.cache_size);
+        lua_setfield(L, -2, "cacheSize");
+
+        return 1;
+    }
+
     luaL_Reg GlobalMethods[] =
     {
         // Hooks
@@ -3752,6 +4322,8 @@ namespace LuaGlobalFunctions
         { "GetStateMap", &LuaGlobalFunctions::GetStateMap },
         { "GetStateMapId", &LuaGlobalFunctions::GetStateMapId },
         { "GetStateInstanceId", &LuaGlobalFunctions::GetStateInstanceId },
+        { "GetLockStats", &LuaGlobalFunctions::GetLockStats },
+        { "GetHttpStats", &LuaGlobalFunctions::GetHttpStats },
         { "GetQuest", &LuaGlobalFunctions::GetQuest },
         { "GetPlayerByGUID", &LuaGlobalFunctions::GetPlayerByGUID },
         { "GetPlayerByName", &LuaGlobalFunctions::GetPlayerByName },
@@ -3790,6 +4362,8 @@ namespace LuaGlobalFunctions
         { "GetDungeonEntrancePosition", &LuaGlobalFunctions::GetDungeonEntrancePosition },
         { "GetTrainerSpells", &LuaGlobalFunctions::GetTrainerSpells },
         { "GetItemTemplateByEntry", &LuaGlobalFunctions::GetItemTemplateByEntry },
+        { "GetHookStats", &LuaGlobalFunctions::GetHookStats },
+        { "GetLuaMemoryStats", &LuaGlobalFunctions::GetLuaMemoryStats },
         
         // Boolean
         { "IsCompatibilityMode", &LuaGlobalFunctions::IsCompatibilityMode },
@@ -3830,6 +4404,12 @@ namespace LuaGlobalFunctions
         { "StartGameEvent", &LuaGlobalFunctions::StartGameEvent },
         { "StopGameEvent", &LuaGlobalFunctions::StopGameEvent },
         { "HttpRequest", &LuaGlobalFunctions::HttpRequest },
+        { "HttpDownload", &LuaGlobalFunctions::HttpDownload },
+        { "RunAsync", &LuaGlobalFunctions::RunAsync },
+        { "StartCoroutine", &LuaGlobalFunctions::StartCoroutine },
+        { "Sleep", &LuaGlobalFunctions::Sleep },
+        { "AwaitQuery", &LuaGlobalFunctions::AwaitQuery },
+        { "AwaitHttp", &LuaGlobalFunctions::AwaitHttp },
         { "SetOwnerHalaa", &LuaGlobalFunctions::SetOwnerHalaa },
 
         { NULL, NULL }
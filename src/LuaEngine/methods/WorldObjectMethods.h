@@ -852,16 +852,23 @@ namespace LuaWorldObject
      *     end
      *     worldobject:RegisterEvent(Timed, 1000, 5) -- do it after 1 second 5 times
      *     worldobject:RegisterEvent(Timed, {1000, 10000}, 0) -- do it after 1 to 10 seconds forever
+     *     worldobject:RegisterEvent(Timed, 5000, 0, true) -- every 5 seconds, the first time within 5 seconds
+     *
+     * Registering the same periodic event on many objects at once, for example on spawn, makes them all
+     * run in the same tick. Pass `spread` to start each object's event at a different point of the delay.
      *
      * @proto eventId = (function, delay)
      * @proto eventId = (function, delaytable)
      * @proto eventId = (function, delay, repeats)
      * @proto eventId = (function, delaytable, repeats)
+     * @proto eventId = (function, delay, repeats, spread)
+     * @proto eventId = (function, delaytable, repeats, spread)
      *
      * @param function function : function to trigger when the time has passed
      * @param uint32 delay : set time in milliseconds for the event to trigger
      * @param table delaytable : a table `{min, max}` containing the minimum and maximum delay time
      * @param uint32 repeats = 1 : how many times for the event to repeat, 0 is infinite
+     * @param bool spread = false : if true the first call happens sooner, after a part of the delay picked from the object's GUID and the event ID
      * @return int eventId : unique ID for the timed event used to cancel it or nil
      */
     int RegisterEvent(lua_State* L, WorldObject* obj)
@@ -881,15 +888,23 @@ namespace LuaWorldObject
         else
             min = max = Forge::CHECKVAL<uint32>(L, 3);
         uint32 repeats = Forge::CHECKVAL<uint32>(L, 4, 1);
+        bool spread = Forge::CHECKVAL<bool>(L, 5, false);
 
         if (min > max)
             return luaL_argerror(L, 3, "min is bigger than max delay");
 
+        // Most objects never get a timed event, so the processor is made on first use
+        Forge** E = obj->forgeEvents ? obj->forgeEvents->GetStateRef() : Forge::GetEventStateRef(obj, obj->FindMap());
+        if (*E != Forge::GetForge(L))
+            return luaL_error(L, "the timed events of this object belong to another Lua state");
+        if (!obj->forgeEvents)
+            obj->forgeEvents = new ForgeEventProcessor(E, obj);
+
         lua_pushvalue(L, 2);
         int functionRef = luaL_ref(L, LUA_REGISTRYINDEX);
         if (functionRef != LUA_REFNIL && functionRef != LUA_NOREF)
         {
-            obj->forgeEvents->AddEvent(functionRef, min, max, repeats);
+            obj->forgeEvents->AddEvent(functionRef, min, max, repeats, spread);
             Forge::Push(L, functionRef);
         }
         return 1;
@@ -903,6 +918,10 @@ namespace LuaWorldObject
     int RemoveEventById(lua_State* L, WorldObject* obj)
     {
         int eventId = Forge::CHECKVAL<int>(L, 2);
+        if (!obj->forgeEvents)
+            return 0;
+        if (*obj->forgeEvents->GetStateRef() != Forge::GetForge(L))
+            return luaL_error(L, "the timed events of this object belong to another Lua state");
         obj->forgeEvents->SetState(eventId, LUAEVENT_STATE_ABORT);
         return 0;
     }
@@ -911,8 +930,12 @@ namespace LuaWorldObject
      * Removes all timed events from a [WorldObject]
      *
      */
-    int RemoveEvents(lua_State* /*L*/, WorldObject* obj)
+    int RemoveEvents(lua_State* L, WorldObject* obj)
     {
+        if (!obj->forgeEvents)
+            return 0;
+        if (*obj->forgeEvents->GetStateRef() != Forge::GetForge(L))
+            return luaL_error(L, "the timed events of this object belong to another Lua state");
         obj->forgeEvents->SetStates(LUAEVENT_STATE_ABORT);
         return 0;
     }
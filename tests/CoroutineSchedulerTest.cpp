@@ -0,0 +1,228 @@
+/*
+* Copyright (C) 2010 - 2016 Forge Lua Engine <http://emudevs.com/>
+* This program is free software licensed under GPL version 3
+* Please see the included DOCS/LICENSE.md for more information
+*/
+
+#include "ForgeTest.h"
+#include "LuaEngine.h"
+#include "ForgeTemplate.h"
+
+extern "C"
+{
+#include "lua.h"
+#include "lauxlib.h"
+};
+
+namespace
+{
+    // The wait ID of the last coroutine that called Wait
+    uint64 lastWaitId = 0;
+
+    // Like the global functions in GlobalMethods.h, and registered the same way through ForgeGlobal::thunk
+    int StartCoroutine(lua_State* L)
+    {
+        luaL_checktype(L, 1, LUA_TFUNCTION);
+        Forge::GetForge(L)->coroutines.Start(L, lua_gettop(L) - 1);
+        return 0;
+    }
+
+    int Sleep(lua_State* L)
+    {
+        uint32 ms = Forge::CHECKVAL<uint32>(L, 1);
+        Forge::GetForge(L)->coroutines.Sleep(L, ms);
+        return lua_yield(L, 0);
+    }
+
+    // Waits like AwaitQuery, until the test calls Wake with `lastWaitId`
+    int Wait(lua_State* L)
+    {
+        lastWaitId = Forge::GetForge(L)->coroutines.Park(L);
+        return lua_yield(L, 0);
+    }
+
+    // Parks and gives up right away, like AwaitHttp when too many requests are pending
+    int Reject(lua_State* L)
+    {
+        Forge* E = Forge::GetForge(L);
+        lastWaitId = E->coroutines.Park(L);
+        E->coroutines.Unpark(L);
+        Forge::Push(L, "rejected");
+        return 1;
+    }
+
+    luaL_Reg globals[] =
+    {
+        { "StartCoroutine", &StartCoroutine },
+        { "Sleep", &Sleep },
+        { "Wait", &Wait },
+        { "Reject", &Reject },
+        { NULL, NULL }
+    };
+
+    std::string GetOrder(Forge& E)
+    {
+        lua_getglobal(E.L, "order");
+        std::string order = lua_isstring(E.L, -1) ? lua_tostring(E.L, -1) : "";
+        lua_pop(E.L, 1);
+        return order;
+    }
+
+    void Setup(Forge& E)
+    {
+        ForgeGlobal::SetMethods(&E, globals);
+        REQUIRE(E.Run("order = ''"));
+    }
+}
+
+FORGE_TEST(SleepWakesInWakeTimeOrder)
+{
+    Forge E;
+    Setup(E);
+
+    // Coroutines with the same wake time wake in the order they went to sleep
+    REQUIRE(E.Run(
+        "local function Sleeper(name, ms)"
+        "    StartCoroutine(function() Sleep(ms) order = order .. name end)"
+        "end "
+        "Sleeper('a', 30) Sleeper('b', 10) Sleeper('c', 20) Sleeper('d', 10)"));
+    CHECK_EQUAL(GetOrder(E), "");
+
+    E.coroutines.Update(5);
+    CHECK_EQUAL(GetOrder(E), "");
+    E.coroutines.Update(5);
+    CHECK_EQUAL(GetOrder(E), "bd");
+    E.coroutines.Update(9);
+    CHECK_EQUAL(GetOrder(E), "bd");
+    E.coroutines.Update(1);
+    CHECK_EQUAL(GetOrder(E), "bdc");
+    E.coroutines.Update(100);
+    CHECK_EQUAL(GetOrder(E), "bdca");
+    CHECK(TestLog::TakeErrors().empty());
+}
+
+FORGE_TEST(SleepWakesOncePerUpdate)
+{
+    Forge E;
+    Setup(E);
+
+    // A coroutine woken by an update is only woken again by a later one,
+    // even if the diff covers several of its sleeps
+    REQUIRE(E.Run(
+        "StartCoroutine(function()"
+        "    for i = 1, 3 do Sleep(10) order = order .. i end "
+        "end)"));
+
+    E.coroutines.Update(100);
+    CHECK_EQUAL(GetOrder(E), "1");
+    E.coroutines.Update(100);
+    CHECK_EQUAL(GetOrder(E), "12");
+    E.coroutines.Update(100);
+    CHECK_EQUAL(GetOrder(E), "123");
+    E.coroutines.Update(100);
+    CHECK_EQUAL(GetOrder(E), "123");
+}
+
+FORGE_TEST(ZeroSleepAndYieldWaitForNextUpdate)
+{
+    Forge E;
+    Setup(E);
+
+    REQUIRE(E.Run(
+        "StartCoroutine(function() Sleep(0) order = order .. 's' end) "
+        "StartCoroutine(function() coroutine.yield() order = order .. 'y' end)"));
+    CHECK_EQUAL(GetOrder(E), "");
+
+    E.coroutines.Update(0);
+    CHECK_EQUAL(GetOrder(E), "sy");
+}
+
+FORGE_TEST(WakeResumesWithValues)
+{
+    Forge E;
+    Setup(E);
+
+    REQUIRE(E.Run(
+        "StartCoroutine(function()"
+        "    local a, b = Wait() order = order .. a .. b "
+        "end)"));
+    uint64 waitId = lastWaitId;
+    REQUIRE(waitId);
+
+    bool woken = E.coroutines.Wake(waitId, [](lua_State* L) { Forge::Push(L, "x"); Forge::Push(L, "y"); return 2; });
+    CHECK(woken);
+    CHECK_EQUAL(GetOrder(E), "xy");
+}
+
+FORGE_TEST(StaleWaitIdIsDropped)
+{
+    Forge E;
+    Setup(E);
+
+    REQUIRE(E.Run("StartCoroutine(function() Wait() order = order .. '1' Wait() order = order .. '2' end)"));
+    uint64 firstWait = lastWaitId;
+    CHECK(E.coroutines.Wake(firstWait, CoroutineScheduler::ResumeArgs()));
+    CHECK_EQUAL(GetOrder(E), "1");
+    uint64 secondWait = lastWaitId;
+    CHECK(secondWait != firstWait);
+
+    // The first wait is over, a second result for it must not resume the coroutine
+    bool called = false;
+    CHECK(!E.coroutines.Wake(firstWait, [&called](lua_State*) { called = true; return 0; }));
+    CHECK(!called);
+    CHECK_EQUAL(GetOrder(E), "1");
+
+    CHECK(E.coroutines.Wake(secondWait, CoroutineScheduler::ResumeArgs()));
+    CHECK_EQUAL(GetOrder(E), "12");
+
+    // The coroutine ended, its wait IDs are gone for good
+    CHECK(!E.coroutines.Wake(secondWait, CoroutineScheduler::ResumeArgs()));
+}
+
+FORGE_TEST(ClearDropsWaitsOfReloadedState)
+{
+    Forge E;
+    Setup(E);
+
+    REQUIRE(E.Run("StartCoroutine(function() Wait() order = order .. 'w' end) StartCoroutine(function() Sleep(10) order = order .. 's' end)"));
+    uint64 waitId = lastWaitId;
+
+    // Like a reload, results still on their way find nothing to wake
+    E.coroutines.Clear();
+    bool called = false;
+    CHECK(!E.coroutines.Wake(waitId, [&called](lua_State*) { called = true; return 0; }));
+    CHECK(!called);
+    E.coroutines.Update(100);
+    CHECK_EQUAL(GetOrder(E), "");
+}
+
+FORGE_TEST(ErrorsAreReportedAndEndTheCoroutine)
+{
+    Forge E;
+    Setup(E);
+
+    REQUIRE(E.Run("StartCoroutine(function() Sleep(10) error('failed after sleeping') end)"));
+    E.coroutines.Update(10);
+
+    std::vector<std::string> errors = TestLog::TakeErrors();
+    REQUIRE(errors.size() == 1);
+    CHECK(errors[0].find("failed after sleeping") != std::string::npos);
+
+    // Nothing is left to wake
+    E.coroutines.Update(100);
+    CHECK(TestLog::TakeErrors().empty());
+}
+
+FORGE_TEST(UnparkedCoroutineCarriesOn)
+{
+    Forge E;
+    Setup(E);
+
+    // Like AwaitHttp when the request is rejected, the coroutine goes on without yielding
+    REQUIRE(E.Run("StartCoroutine(function() local result = Reject() order = order .. result Sleep(10) order = order .. 's' end)"));
+    CHECK_EQUAL(GetOrder(E), "rejected");
+    CHECK(!E.coroutines.Wake(lastWaitId, CoroutineScheduler::ResumeArgs()));
+
+    E.coroutines.Update(10);
+    CHECK_EQUAL(GetOrder(E), "rejecteds");
+}
@@ -0,0 +1,402 @@
+/*
+* Copyright (C) 2010 - 2016 Forge Lua Engine <http://emudevs.com/>
+* This program is free software licensed under GPL version 3
+* Please see the included DOCS/LICENSE.md for more information
+*/
+
+#include "ForgeTest.h"
+#include "ForgeMetrics.h"
+#include "HookStats.h"
+#include "HttpManager.h"
+#include "Log.h"
+#include <atomic>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <map>
+#include <memory>
+#include <sstream>
+#include <thread>
+#include <vector>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+extern "C"
+{
+#include "lua.h"
+#include "lauxlib.h"
+};
+
+/*
+ * Serves the metrics on loopback and scrapes them like Prometheus does,
+ *   checking the text format and the values recorded before the scrape.
+ *
+ * The counters are process wide and never reset, so tests compare scrapes
+ *   taken before and after recording.
+ */
+
+namespace
+{
+    // A port of 127.0.0.1 that nothing listens on right now
+    uint16 GetFreePort()
+    {
+        int fd = socket(AF_INET, SOCK_STREAM, 0);
+        ASSERT(fd >= 0);
+        sockaddr_in addr = {};
+        addr.sin_family = AF_INET;
+        addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        socklen_t length = sizeof(addr);
+        ASSERT(!bind(fd, (sockaddr*)&addr, sizeof(addr)));
+        ASSERT(!getsockname(fd, (sockaddr*)&addr, &length));
+        close(fd);
+        return ntohs(addr.sin_port);
+    }
+
+    // ForgeMetrics::Start on a free port, stopped when it goes out of scope
+    class MetricsServer
+    {
+    public:
+        MetricsServer() : port(GetFreePort()), started(ForgeMetrics::Start("127.0.0.1", port)) { }
+        ~MetricsServer() { ForgeMetrics::Stop(); }
+
+        uint16 port;
+        bool started;
+    };
+
+    // One scrape, samples are keyed by their name and label set as written,
+    //  e.g. forge_hook_errors_total{family="PlayerEvent"}
+    struct Scrape
+    {
+        int status = 0;
+        std::string contentType;
+        std::map<std::string, double> samples;
+        std::map<std::string, std::string> types;
+        std::vector<std::string> errors;
+
+        double Get(std::string const& key) const
+        {
+            auto itr = samples.find(key);
+            return itr == samples.end() ? NAN : itr->second;
+        }
+    };
+
+    // The metric a sample belongs to, histogram samples carry a suffix
+    std::string GetMetricName(std::string const& sample, std::map<std::string, std::string> const& types)
+    {
+        for (const char* suffix : { "_bucket", "_sum", "_count" })
+        {
+            size_t length = strlen(suffix);
+            if (sample.size() > length && !sample.compare(sample.size() - length, length, suffix))
+            {
+                std::string base = sample.substr(0, sample.size() - length);
+                auto itr = types.find(base);
+                if (itr != types.end() && itr->second == "histogram")
+                    return base;
+            }
+        }
+        return sample;
+    }
+
+    // Parses the text exposition format, anything off is added to `errors`
+    void Parse(std::string const& body, Scrape& scrape)
+    {
+        std::string help;
+        std::istringstream lines(body);
+        std::string line;
+        while (std::getline(lines, line))
+        {
+            if (!line.compare(0, 7, "# HELP "))
+            {
+                help = line.substr(7, line.find(' ', 7) - 7);
+                continue;
+            }
+            if (!line.compare(0, 7, "# TYPE "))
+            {
+                std::istringstream fields(line.substr(7));
+                std::string name, type;
+                fields >> name >> type;
+                if (name != help)
+                    scrape.errors.push_back("TYPE without HELP: " + line);
+                if (type != "counter" && type != "gauge" && type != "histogram")
+                    scrape.errors.push_back("unknown type: " + line);
+                if (!scrape.types.emplace(name, type).second)
+                    scrape.errors.push_back("declared twice: " + line);
+                continue;
+            }
+
+            size_t space = line.rfind(' ');
+            if (line.empty() || line[0] == '#' || space == std::string::npos)
+            {
+                scrape.errors.push_back("not a sample: " + line);
+                continue;
+            }
+
+            std::string key = line.substr(0, space);
+            std::string value = line.substr(space + 1);
+            char* end;
+            double number = strtod(value.c_str(), &end);
+            if (value.empty() || *end)
+                scrape.errors.push_back("bad value: " + line);
+
+            size_t brace = key.find('{');
+            if (brace != std::string::npos && key.back() != '}')
+                scrape.errors.push_back("bad labels: " + line);
+            if (!scrape.types.count(GetMetricName(key.substr(0, brace), scrape.types)))
+                scrape.errors.push_back("sample without TYPE: " + line);
+            if (!scrape.samples.emplace(key, number).second)
+                scrape.errors.push_back("sample twice: " + line);
+        }
+    }
+
+    Scrape Get(uint16 port)
+    {
+        Scrape scrape;
+        httplib::Client client("127.0.0.1", port);
+        client.set_connection_timeout(2);
+        client.set_read_timeout(5);
+        if (httplib::Result result = client.Get("/metrics"))
+        {
+            scrape.status = result->status;
+            scrape.contentType = result->get_header_value("Content-Type");
+            Parse(result->body, scrape);
+        }
+        return scrape;
+    }
+
+    // The buckets of `family` in the order they were written, ending with +Inf
+    std::vector<double> GetBuckets(Scrape const& scrape, const char* family)
+    {
+        static const char* const bounds[] =
+        {
+            "1e-05", "5e-05", "0.0001", "0.0005", "0.001", "0.005", "0.01", "0.05", "0.1", "1", "+Inf"
+        };
+
+        std::vector<double> buckets;
+        for (const char* bound : bounds)
+            buckets.push_back(scrape.Get(std::string("forge_hook_duration_seconds_bucket{family=\"") + family + "\",le=\"" + bound + "\"}"));
+        return buckets;
+    }
+
+    std::string Labels(const char* family)
+    {
+        return std::string("{family=\"") + family + "\"}";
+    }
+
+    uint64 Microseconds(double us)
+    {
+        return uint64(us * 1000000.0 / HookClock::TicksToMicroseconds(1000000));
+    }
+}
+
+FORGE_TEST(ScrapeIsValidTextFormat)
+{
+    HookClock::Calibrate();
+    MetricsServer metrics;
+    REQUIRE(metrics.started);
+    CHECK(ForgeMetrics::IsEnabled());
+
+    ForgeMetrics::RecordHook("FormatEvent", Microseconds(20));
+    ForgeMetrics::RecordError("FormatEvent");
+
+    Scrape scrape = Get(metrics.port);
+    CHECK_EQUAL(scrape.status, 200);
+    CHECK_EQUAL(scrape.contentType, "text/plain; version=0.0.4; charset=utf-8");
+    for (std::string const& error : scrape.errors)
+        fprintf(stderr, "%s\n", error.c_str());
+    CHECK(scrape.errors.empty());
+
+    CHECK_EQUAL(scrape.types["forge_hook_duration_seconds"], "histogram");
+    CHECK_EQUAL(scrape.types["forge_hook_errors_total"], "counter");
+    CHECK_EQUAL(scrape.types["forge_lua_heap_bytes"], "gauge");
+    CHECK_EQUAL(scrape.types["forge_http_requests_pending"], "gauge");
+    CHECK_EQUAL(scrape.types["forge_http_cache_hits_total"], "counter");
+
+    // Nothing else is served
+    httplib::Client client("127.0.0.1", metrics.port);
+    httplib::Result other = client.Get("/");
+    REQUIRE(other);
+    CHECK_EQUAL(other->status, 404);
+}
+
+FORGE_TEST(RecordedValuesAreScraped)
+{
+    HookClock::Calibrate();
+    MetricsServer metrics;
+    REQUIRE(metrics.started);
+    Scrape before = Get(metrics.port);
+
+    ForgeMetrics::RecordError(NULL);
+    ForgeMetrics::RecordError("ScrapedEvent");
+    ForgeMetrics::RecordError("ScrapedEvent");
+    ForgeMetrics::AddTimers(5);
+    ForgeMetrics::AddTimers(-2);
+    for (uint32 i = 0; i < 4; ++i)
+        ForgeMetrics::RecordTimerCall();
+    ForgeMetrics::AddLuaHeap(4096);
+    ForgeMetrics::AddLuaHeap(-1024);
+
+    std::shared_ptr<void> pending = ForgeMetrics::TrackQuery();
+    {
+        // Copies like the ones callbacks keep don't count twice
+        std::shared_ptr<void> copy = pending;
+        ForgeMetrics::TrackQuery();
+    }
+
+    Scrape after = Get(metrics.port);
+    REQUIRE(after.errors.empty());
+    auto Delta = [&](const char* key) { return after.Get(key) - (before.samples.count(key) ? before.Get(key) : 0.0); };
+
+    CHECK_EQUAL(Delta("forge_lua_errors_total"), 3.0);
+    CHECK_EQUAL(after.Get("forge_hook_errors_total" + Labels("ScrapedEvent")), 2.0);
+    CHECK_EQUAL(Delta("forge_timed_events"), 3.0);
+    CHECK_EQUAL(Delta("forge_timed_event_calls_total"), 4.0);
+    CHECK_EQUAL(Delta("forge_lua_heap_bytes"), 3072.0);
+    CHECK_EQUAL(Delta("forge_db_queries_total"), 2.0);
+    CHECK_EQUAL(Delta("forge_db_queries_pending"), 1.0);
+
+    pending.reset();
+    CHECK_EQUAL(Get(metrics.port).Get("forge_db_queries_pending"), before.Get("forge_db_queries_pending"));
+}
+
+FORGE_TEST(HistogramBucketsAreCumulative)
+{
+    HookClock::Calibrate();
+    MetricsServer metrics;
+    REQUIRE(metrics.started);
+
+    // Three calls of 20 us, two of 300 us, one of 2 ms and one of 3 s
+    const double durations[] = { 20, 20, 20, 300, 300, 2000, 3000000 };
+    double totalUs = 0.0;
+    for (double us : durations)
+    {
+        ForgeMetrics::RecordHook("HistogramEvent", Microseconds(us));
+        totalUs += us;
+    }
+    // Another family doesn't mix in
+    ForgeMetrics::RecordHook("OtherEvent", Microseconds(5));
+
+    Scrape scrape = Get(metrics.port);
+    REQUIRE(scrape.errors.empty());
+
+    std::vector<double> buckets = GetBuckets(scrape, "HistogramEvent");
+    const double expected[] = { 0, 3, 3, 5, 5, 6, 6, 6, 6, 6, 7 };
+    for (size_t i = 0; i < buckets.size(); ++i)
+        CHECK_EQUAL(buckets[i], expected[i]);
+    for (size_t i = 1; i < buckets.size(); ++i)
+        CHECK(buckets[i] >= buckets[i - 1]);
+
+    CHECK_EQUAL(scrape.Get("forge_hook_duration_seconds_count" + Labels("HistogramEvent")), buckets.back());
+    double sum = scrape.Get("forge_hook_duration_seconds_sum" + Labels("HistogramEvent"));
+    CHECK(std::fabs(sum - totalUs / 1000000.0) < 0.001);
+
+    std::vector<double> other = GetBuckets(scrape, "OtherEvent");
+    CHECK_EQUAL(other.front(), 1.0);
+    CHECK_EQUAL(other.back(), 1.0);
+    CHECK_EQUAL(scrape.Get("forge_hook_errors_total" + Labels("OtherEvent")), 0.0);
+}
+
+FORGE_TEST(GarbageCollectionsAreCounted)
+{
+    HookClock::Calibrate();
+    MetricsServer metrics;
+    REQUIRE(metrics.started);
+    double before = Get(metrics.port).Get("forge_lua_gc_cycles_total");
+
+    lua_State* L = luaL_newstate();
+    ForgeMetrics::WatchGarbageCollector(L);
+    // The first sentinel is finalized by the first cycle, the one it makes by the second
+    lua_gc(L, LUA_GCCOLLECT, 0);
+    lua_gc(L, LUA_GCCOLLECT, 0);
+    lua_gc(L, LUA_GCCOLLECT, 0);
+
+    double after = Get(metrics.port).Get("forge_lua_gc_cycles_total");
+    CHECK(after - before >= 2.0);
+    lua_close(L);
+}
+
+FORGE_TEST(ScrapesDontWaitForRecording)
+{
+    HookClock::Calibrate();
+    MetricsServer metrics;
+    REQUIRE(metrics.started);
+
+    // Map threads record while scrapes come in
+    const uint32 threadCount = 4;
+    const uint32 calls = uint32(ForgeTest::Scale(100000));
+    std::atomic<bool> done(false);
+    std::vector<std::thread> threads;
+    for (uint32 i = 0; i < threadCount; ++i)
+    {
+        threads.emplace_back([&]
+        {
+            for (uint32 call = 0; call < calls; ++call)
+                ForgeMetrics::RecordHook("ConcurrentEvent", Microseconds(call % 200));
+        });
+    }
+
+    uint32 scrapes = 0;
+    double last = 0.0;
+    auto start = std::chrono::steady_clock::now();
+    for (uint32 i = 0; i < 20; ++i)
+    {
+        Scrape scrape = Get(metrics.port);
+        CHECK(scrape.errors.empty());
+        if (scrape.status != 200)
+            continue;
+        ++scrapes;
+
+        // Counts only grow, and every scrape is consistent with itself
+        std::vector<double> buckets = GetBuckets(scrape, "ConcurrentEvent");
+        if (std::isnan(buckets.back()))
+            continue;
+        CHECK(buckets.back() >= last);
+        last = buckets.back();
+        for (size_t bucket = 1; bucket < buckets.size(); ++bucket)
+            CHECK(buckets[bucket] >= buckets[bucket - 1]);
+    }
+    double seconds = ForgeTest::Seconds(start);
+    for (std::thread& thread : threads)
+        thread.join();
+
+    ForgeTest::Report("scrape", seconds * 1000.0 / 20, "ms");
+    CHECK_EQUAL(scrapes, 20u);
+
+    Scrape final = Get(metrics.port);
+    CHECK_EQUAL(final.Get("forge_hook_duration_seconds_count" + Labels("ConcurrentEvent")), double(threadCount) * calls);
+}
+
+FORGE_TEST(StartFailsOnABusyPort)
+{
+    // Another server already listens on the configured port, with httplib's default
+    //  socket options like another worldserver's metrics
+    httplib::Server other;
+    int port = other.bind_to_any_port("127.0.0.1");
+    REQUIRE(port > 0);
+    std::thread thread([&] { other.listen_after_bind(); });
+    other.wait_until_ready();
+
+    bool started = ForgeMetrics::Start("127.0.0.1", uint16(port));
+    bool enabled = ForgeMetrics::IsEnabled();
+    // Stop after a failed start does nothing
+    ForgeMetrics::Stop();
+    other.stop();
+    thread.join();
+
+    CHECK(!started);
+    CHECK(!enabled);
+    std::vector<std::string> errors = TestLog::TakeErrors();
+    REQUIRE(errors.size() == 1);
+    CHECK(errors[0].find("Could not serve metrics") != std::string::npos);
+
+    // Stopping frees the port for the next start, as on a reload of the configuration
+    MetricsServer metrics;
+    REQUIRE(metrics.started);
+    ForgeMetrics::Stop();
+    CHECK(!ForgeMetrics::IsEnabled());
+    CHECK_EQUAL(Get(metrics.port).status, 0);
+    CHECK(ForgeMetrics::Start("127.0.0.1", metrics.port));
+    CHECK_EQUAL(Get(metrics.port).status, 200);
+}
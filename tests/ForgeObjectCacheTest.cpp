@@ -0,0 +1,213 @@
+/*
+* Copyright (C) 2010 - 2016 Forge Lua Engine <http://emudevs.com/>
+* This program is free software licensed under GPL version 3
+* Please see the included DOCS/LICENSE.md for more information
+*/
+
+#include "ForgeTest.h"
+#include "LuaEngine.h"
+#include "ForgeTemplate.h"
+#include <new>
+
+extern "C"
+{
+#include "lua.h"
+#include "lauxlib.h"
+};
+
+namespace
+{
+    // Stands in for a core object like Item, owned by C++ and only pointed to by Lua
+    struct CacheObject
+    {
+        uint32 id;
+    };
+
+    // Makes every push in Self act as if an object was destroyed just before,
+    // which is what pushing cost before the cache was added
+    bool destroyBeforePush = false;
+
+    int Self(lua_State* L, CacheObject* obj)
+    {
+        if (destroyBeforePush)
+            ForgeObjectCache::OnObjectDestroyed();
+        Forge::Push(L, obj);
+        return 1;
+    }
+
+    int GetId(lua_State* L, CacheObject* obj)
+    {
+        Forge::Push(L, obj->id);
+        return 1;
+    }
+
+    ForgeRegister<CacheObject> methods[] =
+    {
+        { "Self", &Self },
+        { "GetId", &GetId },
+        { NULL, NULL }
+    };
+
+    void Setup(Forge& E)
+    {
+        ForgeTemplate<CacheObject>::Register(&E, "CacheObject");
+        ForgeTemplate<CacheObject>::SetMethods(&E, methods);
+    }
+
+    // Counts the blocks the Lua state allocates, on top of its own allocator
+    struct AllocCounter
+    {
+        lua_Alloc alloc;
+        void* ud;
+        uint64 allocations;
+
+        static void* Alloc(void* ud, void* ptr, size_t osize, size_t nsize)
+        {
+            AllocCounter* counter = static_cast<AllocCounter*>(ud);
+            if (!ptr && nsize)
+                ++counter->allocations;
+            return counter->alloc(counter->ud, ptr, osize, nsize);
+        }
+
+        explicit AllocCounter(lua_State* L) : allocations(0)
+        {
+            alloc = lua_getallocf(L, &ud);
+            lua_setallocf(L, &Alloc, this);
+        }
+    };
+
+    // Pushes `obj` to the function in global `name` and calls it like a hook does
+    void Dispatch(Forge& E, const char* name, CacheObject* obj)
+    {
+        lua_getglobal(E.L, name);
+        if (destroyBeforePush)
+            ForgeObjectCache::OnObjectDestroyed();
+        Forge::Push(E.L, obj);
+        E.ExecuteCall(1, 0);
+    }
+}
+
+FORGE_TEST(SameObjectGetsSameUserdataWithinCallStack)
+{
+    Forge E;
+    Setup(E);
+
+    CacheObject a = { 1 };
+    CacheObject b = { 2 };
+    Forge::Push(E.L, &a);
+    Forge::Push(E.L, &a);
+    Forge::Push(E.L, &b);
+    CHECK(lua_rawequal(E.L, -3, -2));
+    CHECK(!lua_rawequal(E.L, -3, -1));
+    lua_pop(E.L, 3);
+}
+
+FORGE_TEST(NewCallStackGetsNewUserdata)
+{
+    Forge E;
+    Setup(E);
+
+    CacheObject obj = { 1 };
+    Forge::Push(E.L, &obj);
+    E.InvalidateObjects();
+    Forge::Push(E.L, &obj);
+    CHECK(!lua_rawequal(E.L, -2, -1));
+
+    // The old userdata is invalid, the new one is not
+    CHECK(!ForgeTemplate<CacheObject>::Check(E.L, -2, false));
+    CHECK(TestLog::TakeErrors().size() == 1);
+    CHECK(ForgeTemplate<CacheObject>::Check(E.L, -1, false) == &obj);
+    lua_pop(E.L, 2);
+}
+
+FORGE_TEST(ObjectCreatedAtDestroyedAddressGetsNewUserdata)
+{
+    Forge E;
+    Setup(E);
+
+    // Like RemoveItem and AddItem in the same call, the new item reuses the memory of the old one
+    alignas(CacheObject) unsigned char storage[sizeof(CacheObject)];
+    CacheObject* removed = new (storage) CacheObject{ 1 };
+    Forge::Push(E.L, removed);
+    ForgeObjectCache::OnObjectDestroyed();
+
+    CacheObject* added = new (storage) CacheObject{ 2 };
+    CHECK(static_cast<void*>(added) == static_cast<void*>(removed));
+    Forge::Push(E.L, added);
+    CHECK(!lua_rawequal(E.L, -2, -1));
+
+    // The userdata pushed for the new object is cached again until the next destruction
+    Forge::Push(E.L, added);
+    CHECK(lua_rawequal(E.L, -2, -1));
+    lua_pop(E.L, 3);
+}
+
+FORGE_TEST(CachedUserdataCanBeCollected)
+{
+    Forge E;
+    Setup(E);
+
+    // The cache holds its values weakly, so unreferenced userdata doesn't pile up
+    CacheObject obj = { 1 };
+    Forge::Push(E.L, &obj);
+    lua_pop(E.L, 1);
+    lua_gc(E.L, LUA_GCCOLLECT, 0);
+
+    ForgeObjectCache::Push(E.L);
+    lua_pushlightuserdata(E.L, &obj);
+    lua_rawget(E.L, -2);
+    CHECK(lua_isnil(E.L, -1));
+    lua_pop(E.L, 2);
+}
+
+FORGE_TEST(AllocationsPerDispatch)
+{
+    Forge E;
+    Setup(E);
+
+    // A handler that gets the object like hooks do and pushes it again through its methods
+    REQUIRE(E.Run(
+        "function OnEvent(obj)"
+        "    local sum = 0 "
+        "    for i = 1, 4 do sum = sum + obj:Self():GetId() end "
+        "    return sum "
+        "end"));
+
+    CacheObject obj = { 7 };
+    const uint64 dispatches = ForgeTest::Scale(10000);
+    double perDispatch[2];
+    for (int uncached = 0; uncached < 2; ++uncached)
+    {
+        destroyBeforePush = uncached != 0;
+
+        // Warm up first, so the state has grown its stack and interned its strings
+        for (int i = 0; i < 100; ++i)
+            Dispatch(E, "OnEvent", &obj);
+        lua_gc(E.L, LUA_GCSTOP, 0);
+
+        AllocCounter counter(E.L);
+        for (uint64 i = 0; i < dispatches; ++i)
+        {
+            Dispatch(E, "OnEvent", &obj);
+            if (i % 256 == 255)
+            {
+                lua_gc(E.L, LUA_GCRESTART, 0);
+                lua_gc(E.L, LUA_GCCOLLECT, 0);
+                lua_gc(E.L, LUA_GCSTOP, 0);
+            }
+        }
+        lua_setallocf(E.L, counter.alloc, counter.ud);
+        lua_gc(E.L, LUA_GCRESTART, 0);
+
+        perDispatch[uncached] = double(counter.allocations) / double(dispatches);
+    }
+    destroyBeforePush = false;
+    CHECK(TestLog::TakeErrors().empty());
+
+    ForgeTest::Report("allocations per dispatch, cached", perDispatch[0], "allocations");
+    ForgeTest::Report("allocations per dispatch, uncached", perDispatch[1], "allocations");
+
+    // One userdata per call stack instead of one per push
+    CHECK(perDispatch[0] <= 1.5);
+    CHECK(perDispatch[1] > perDispatch[0] + 3.5);
+}
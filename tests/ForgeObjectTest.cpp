@@ -0,0 +1,322 @@
+/*
+* Copyright (C) 2010 - 2016 Forge Lua Engine <http://emudevs.com/>
+* This program is free software licensed under GPL version 3
+* Please see the included DOCS/LICENSE.md for more information
+*/
+
+#include "ForgeTest.h"
+#include "LuaEngine.h"
+#include "ForgeTemplate.h"
+#include <string>
+#include <vector>
+
+extern "C"
+{
+#include "lua.h"
+#include "lauxlib.h"
+};
+
+/*
+ * Checks the ForgeObject stored inline in the userdata of every pushed object:
+ *   what owns the wrapped object, when the userdata stops being valid and
+ *   what __gc does with it.
+ */
+
+namespace
+{
+    // Stands in for a core object like Creature, owned by C++ and only pointed to by Lua
+    struct CoreObject
+    {
+        static uint32 destroyed;
+
+        uint32 id;
+
+        ~CoreObject() { ++destroyed; }
+    };
+    uint32 CoreObject::destroyed = 0;
+
+    // Stands in for an object owned by Lua like WorldPacket, deleted by __gc
+    struct OwnedObject
+    {
+        static int32 live;
+
+        uint32 id;
+
+        explicit OwnedObject(uint32 id) : id(id) { ++live; }
+        ~OwnedObject() { --live; }
+    };
+    int32 OwnedObject::live = 0;
+
+    int GetId(lua_State* L, CoreObject* obj)
+    {
+        Forge::Push(L, obj->id);
+        return 1;
+    }
+
+    int Self(lua_State* L, CoreObject* obj)
+    {
+        Forge::Push(L, obj);
+        return 1;
+    }
+
+    // Like Aura:Remove, the object is gone but its userdata may still be referenced
+    int Remove(lua_State* L, CoreObject* /*obj*/)
+    {
+        Forge::CHECKOBJ<ForgeObject>(L, 1)->Invalidate();
+        return 0;
+    }
+
+    // Calls the global OnNested with the object, like a hook triggered from a method
+    int Nested(lua_State* L, CoreObject* obj)
+    {
+        Forge* E = Forge::GetForge(L);
+        lua_getglobal(L, "OnNested");
+        Forge::Push(L, obj);
+        E->ExecuteCall(1, 0);
+        return 0;
+    }
+
+    ForgeRegister<CoreObject> coreMethods[] =
+    {
+        { "GetId", &GetId },
+        { "Self", &Self },
+        { "Remove", &Remove },
+        { "Nested", &Nested },
+        { NULL, NULL }
+    };
+
+    int GetOwnedId(lua_State* L, OwnedObject* obj)
+    {
+        Forge::Push(L, obj->id);
+        return 1;
+    }
+
+    ForgeRegister<OwnedObject> ownedMethods[] =
+    {
+        { "GetId", &GetOwnedId },
+        { NULL, NULL }
+    };
+
+    // Creates a new OwnedObject each call, like CreatePacket
+    int CreateOwned(lua_State* L)
+    {
+        Forge::Push(L, new OwnedObject(Forge::CHECKVAL<uint32>(L, 1)));
+        return 1;
+    }
+
+    luaL_Reg globals[] =
+    {
+        { "CreateOwned", &CreateOwned },
+        { NULL, NULL }
+    };
+
+    void Setup(Forge& E)
+    {
+        ForgeTemplate<CoreObject>::Register(&E, "CoreObject");
+        ForgeTemplate<CoreObject>::SetMethods(&E, coreMethods);
+        ForgeTemplate<OwnedObject>::Register(&E, "OwnedObject", true);
+        ForgeTemplate<OwnedObject>::SetMethods(&E, ownedMethods);
+        ForgeTemplate<long long>::Register(&E, "long long");
+        ForgeGlobal::SetMethods(&E, globals);
+    }
+
+    // Pushes `obj` to the function in global `name` and calls it like a hook does
+    bool Dispatch(Forge& E, const char* name, CoreObject* obj)
+    {
+        lua_getglobal(E.L, name);
+        Forge::Push(E.L, obj);
+        return E.ExecuteCall(1, 0);
+    }
+
+    bool IsInvalidatedError(std::string const& error)
+    {
+        return error.find("nonexisting (invalidated) object") != std::string::npos;
+    }
+}
+
+FORGE_TEST(ObjectIsStoredInTheUserdata)
+{
+    Forge E;
+    Setup(E);
+
+    CoreObject obj = { 1 };
+    Forge::Push(E.L, &obj);
+
+    // One block holding the ForgeObject, with no pointer to a separate allocation
+    REQUIRE(lua_type(E.L, -1) == LUA_TUSERDATA);
+    CHECK_EQUAL(lua_rawlen(E.L, -1), sizeof(ForgeObject));
+    ForgeObject* forgeObj = static_cast<ForgeObject*>(lua_touserdata(E.L, -1));
+    CHECK(forgeObj->GetObj() == &obj);
+    CHECK(forgeObj->GetTypeName() == ForgeTemplate<CoreObject>::tname);
+    CHECK(forgeObj->CanInvalidate());
+    CHECK(forgeObj->IsValid());
+    CHECK(Forge::CHECKOBJ<CoreObject>(E.L, -1) == &obj);
+
+    // The type is checked against the name in the block
+    CHECK(!Forge::CHECKOBJ<OwnedObject>(E.L, -1, false));
+    lua_pop(E.L, 1);
+}
+
+FORGE_TEST(ValuesAreStoredAfterTheObject)
+{
+    Forge E;
+    Setup(E);
+
+    ForgeTemplate<long long>::PushValue(E.L, -1234567890123LL);
+    CHECK_EQUAL(lua_rawlen(E.L, -1), sizeof(ForgeObject) + sizeof(long long));
+    ForgeObject* forgeObj = static_cast<ForgeObject*>(lua_touserdata(E.L, -1));
+    CHECK(forgeObj->GetObj() == forgeObj + 1);
+    CHECK_EQUAL(*Forge::CHECKOBJ<long long>(E.L, -1), -1234567890123LL);
+
+    // Owned by Lua, so never invalidated, and there's nothing for __gc to free
+    CHECK(!forgeObj->CanInvalidate());
+    E.InvalidateObjects();
+    CHECK(Forge::CHECKOBJ<long long>(E.L, -1, false));
+    REQUIRE(lua_getmetatable(E.L, -1));
+    lua_getfield(E.L, -1, "__gc");
+    CHECK(lua_isnil(E.L, -1));
+    lua_pop(E.L, 3);
+}
+
+FORGE_TEST(ObjectsAreInvalidatedWhenTheCallStackEnds)
+{
+    Forge E;
+    Setup(E);
+
+    REQUIRE(E.Run(
+        "function OnEvent(obj) kept = obj; id = obj:GetId() end "
+        "function OnLater() return kept:GetId() end"));
+
+    CoreObject obj = { 7 };
+    CHECK(Dispatch(E, "OnEvent", &obj));
+
+    // The handler saw the object, a later call only has the stale userdata
+    lua_getglobal(E.L, "id");
+    CHECK_EQUAL(lua_tonumber(E.L, -1), 7.0);
+    lua_pop(E.L, 1);
+    CHECK(!E.Run("OnLater()"));
+    std::vector<std::string> errors = TestLog::TakeErrors();
+    REQUIRE(errors.size() == 1);
+    CHECK(IsInvalidatedError(errors[0]));
+
+    // Pushing the object again makes new userdata, the stale one stays invalid
+    CHECK(Dispatch(E, "OnEvent", &obj));
+    CHECK(TestLog::TakeErrors().empty());
+    CHECK(!E.Run("OnLater()"));
+    CHECK_EQUAL(TestLog::TakeErrors().size(), size_t(1));
+}
+
+FORGE_TEST(NestedCallsDontInvalidateTheOuterCall)
+{
+    Forge E;
+    Setup(E);
+
+    // A hook called while another one runs, the outer one keeps using its object after
+    REQUIRE(E.Run(
+        "function OnNested(obj) inner = obj:GetId() end "
+        "function OnEvent(obj) obj:Nested() outer = obj:GetId() end"));
+
+    CoreObject obj = { 3 };
+    CHECK(Dispatch(E, "OnEvent", &obj));
+    CHECK(TestLog::TakeErrors().empty());
+    CHECK(E.Run("assert(inner == 3 and outer == 3)"));
+}
+
+FORGE_TEST(SetInvalidationKeepsTheObjectAcrossCalls)
+{
+    Forge E;
+    Setup(E);
+
+    REQUIRE(E.Run(
+        "function OnEvent(obj) obj:SetInvalidation(false) kept = obj end "
+        "function OnLater() return kept:GetId() end "
+        "function OnAgain(obj) again = obj end"));
+
+    CoreObject obj = { 9 };
+    CHECK(Dispatch(E, "OnEvent", &obj));
+    E.InvalidateObjects();
+    CHECK(E.Run("assert(OnLater() == 9)"));
+    CHECK(TestLog::TakeErrors().empty());
+
+    // Kept userdata isn't shared with later pushes, those are invalidated as usual
+    CHECK(Dispatch(E, "OnAgain", &obj));
+    CHECK(E.Run("assert(not rawequal(kept, again))"));
+    CHECK(!E.Run("return again:GetId()"));
+    CHECK_EQUAL(TestLog::TakeErrors().size(), size_t(1));
+
+    // Turned back on, it's invalidated with the call stack that did it
+    CHECK(E.Run("kept:SetInvalidation(true) assert(kept:GetId() == 9)"));
+    CHECK(!E.Run("return OnLater()"));
+    CHECK_EQUAL(TestLog::TakeErrors().size(), size_t(1));
+}
+
+FORGE_TEST(InvalidateOnlyAffectsThatUserdata)
+{
+    Forge E;
+    Setup(E);
+
+    // Like an aura removed by a handler, later calls can't use it anymore
+    REQUIRE(E.Run("function OnEvent(obj) obj:Remove() removed = not pcall(obj.GetId, obj) end"));
+    CoreObject obj = { 5 };
+    CHECK(Dispatch(E, "OnEvent", &obj));
+    CHECK(TestLog::TakeErrors().empty());
+    CHECK(E.Run("assert(removed)"));
+
+    // An object at the same address pushed during the same call gets new userdata
+    Forge::Push(E.L, &obj);
+    Forge::CHECKOBJ<ForgeObject>(E.L, -1)->Invalidate();
+    Forge::Push(E.L, &obj);
+    CHECK(!lua_rawequal(E.L, -2, -1));
+    CHECK(!Forge::CHECKOBJ<CoreObject>(E.L, -2, false));
+    CHECK_EQUAL(TestLog::TakeErrors().size(), size_t(1));
+    CHECK(Forge::CHECKOBJ<CoreObject>(E.L, -1, false) == &obj);
+    lua_pop(E.L, 2);
+}
+
+FORGE_TEST(LuaOwnedObjectsAreDeletedOnce)
+{
+    OwnedObject::live = 0;
+    {
+        Forge E;
+        Setup(E);
+
+        // Created and dropped in a loop, only the last one is kept
+        const uint32 count = uint32(ForgeTest::Scale(20000));
+        std::string code = "local sum = 0 for i = 1, " + std::to_string(count) +
+            " do local o = CreateOwned(i) sum = sum + o:GetId() kept = o end "
+            "collectgarbage() collectgarbage() "
+            "total = sum";
+        REQUIRE(E.Run(code.c_str()));
+        CHECK_EQUAL(OwnedObject::live, 1);
+
+        // Never invalidated, it's valid as long as Lua holds it
+        E.InvalidateObjects();
+        std::string check = "assert(kept:GetId() == " + std::to_string(count) + ")";
+        CHECK(E.Run(check.c_str()));
+        CHECK(TestLog::TakeErrors().empty());
+    }
+    // Closing the state deletes what was still referenced
+    CHECK_EQUAL(OwnedObject::live, 0);
+}
+
+FORGE_TEST(CoreObjectsAreNeverDeletedByLua)
+{
+    CoreObject::destroyed = 0;
+    CoreObject* obj = new CoreObject{ 11 };
+    {
+        Forge E;
+        Setup(E);
+        for (uint32 i = 0; i < 1000; ++i)
+        {
+            Forge::Push(E.L, obj);
+            lua_pop(E.L, 1);
+            E.InvalidateObjects();
+        }
+        lua_gc(E.L, LUA_GCCOLLECT, 0);
+        Forge::Push(E.L, obj);
+        lua_setglobal(E.L, "kept");
+    }
+    CHECK_EQUAL(CoreObject::destroyed, 0u);
+    CHECK_EQUAL(obj->id, 11u);
+    delete obj;
+}
@@ -0,0 +1,104 @@
+/*
+* Copyright (C) 2010 - 2016 Forge Lua Engine <http://emudevs.com/>
+* This program is free software licensed under GPL version 3
+* Please see the included DOCS/LICENSE.md for more information
+*/
+
+#include "ForgeTest.h"
+#include "HookStats.h"
+#include <chrono>
+#include <cmath>
+#include <thread>
+#include <vector>
+
+namespace
+{
+    // Times `work` with HookClock and steady_clock, returns {HookClock, steady_clock} microseconds
+    template<typename Work>
+    std::pair<double, double> Measure(Work work)
+    {
+        auto start = std::chrono::steady_clock::now();
+        uint64 startTicks = HookClock::Now();
+        work();
+        uint64 ticks = HookClock::Now() - startTicks;
+        double steady = std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - start).count();
+        return { HookClock::TicksToMicroseconds(ticks), steady };
+    }
+}
+
+// Runs first, while the clock is not calibrated yet: the threads race to
+// calibrate it and must all get the same rate
+FORGE_TEST(ConcurrentFirstUseCalibratesOnce)
+{
+    const uint32 threadCount = 8;
+    std::vector<double> rates(threadCount);
+    std::vector<std::thread> threads;
+    for (uint32 i = 0; i < threadCount; ++i)
+        threads.emplace_back([&rates, i] { rates[i] = HookClock::TicksToMicroseconds(1000000); });
+    for (std::thread& thread : threads)
+        thread.join();
+
+    CHECK(rates[0] > 0.0);
+    for (double rate : rates)
+        CHECK_EQUAL(rate, rates[0]);
+}
+
+FORGE_TEST(ConversionIsLinear)
+{
+    HookClock::Calibrate();
+    CHECK_EQUAL(HookClock::TicksToMicroseconds(0), 0.0);
+    double one = HookClock::TicksToMicroseconds(1000);
+    CHECK(std::fabs(HookClock::TicksToMicroseconds(1000000) - one * 1000) < one * 1e-6);
+}
+
+FORGE_TEST(ConversionNeverWaits)
+{
+    HookClock::Calibrate();
+
+    // The old calibration busy waited 10 ms on first use, under the state lock
+    const uint64 conversions = ForgeTest::Scale(100000);
+    auto start = std::chrono::steady_clock::now();
+    double sum = 0.0;
+    for (uint64 i = 0; i < conversions; ++i)
+        sum += HookClock::TicksToMicroseconds(i);
+    double seconds = ForgeTest::Seconds(start);
+    CHECK(sum > 0.0);
+
+    ForgeTest::Report("conversion", seconds * 1e9 / double(conversions), "ns");
+    CHECK(seconds < 0.5);
+}
+
+FORGE_TEST(SleepsAreMeasuredAccurately)
+{
+    HookClock::Calibrate();
+
+    // Synthetic intervals from 1 ms to 100 ms, timed with both clocks
+    const uint32 intervals[] = { 1, 5, 20, 100 };
+    for (uint32 ms : intervals)
+    {
+        std::pair<double, double> us = Measure([ms] { std::this_thread::sleep_for(std::chrono::milliseconds(ms)); });
+        double error = std::fabs(us.first - us.second) / us.second;
+
+        std::string name = "error over " + std::to_string(ms) + " ms";
+        ForgeTest::Report(name.c_str(), error * 100.0, "%");
+        CHECK(us.second >= ms * 1000.0);
+        CHECK(error < 0.05);
+    }
+}
+
+FORGE_TEST(BusyIntervalsAreMeasuredAccurately)
+{
+    HookClock::Calibrate();
+
+    // Spins instead of sleeping, like a handler that does work
+    std::pair<double, double> us = Measure([]
+    {
+        auto end = std::chrono::steady_clock::now() + std::chrono::milliseconds(50);
+        while (std::chrono::steady_clock::now() < end)
+        {
+        }
+    });
+    double error = std::fabs(us.first - us.second) / us.second;
+    ForgeTest::Report("error over 50 ms busy", error * 100.0, "%");
+    CHECK(error < 0.05);
+}
@@ -0,0 +1,156 @@
+/*
+* Copyright (C) 2010 - 2016 Forge Lua Engine <http://emudevs.com/>
+* This program is free software licensed under GPL version 3
+* Please see the included DOCS/LICENSE.md for more information
+*/
+
+#include "ForgeTest.h"
+#include "LuaEngine.h"
+
+extern "C"
+{
+#include "lua.h"
+};
+
+namespace
+{
+    // LuaJIT doesn't call hooks from compiled loops, the runaway scripts are interpreted there
+    std::string Interpreted(const char* code)
+    {
+        return std::string("if jit then jit.off() end ") + code;
+    }
+
+    std::string GetString(Forge& E, const char* name)
+    {
+        lua_getglobal(E.L, name);
+        std::string value = lua_isstring(E.L, -1) ? lua_tostring(E.L, -1) : "";
+        lua_pop(E.L, 1);
+        return value;
+    }
+
+    bool IsWatchdogError(std::string const& error)
+    {
+        return error.find("stopped by the watchdog") != std::string::npos;
+    }
+}
+
+FORGE_TEST(RunawayLoopIsStopped)
+{
+    Forge E;
+    E.watchdog.Configure(50, "");
+
+    auto start = std::chrono::steady_clock::now();
+    CHECK(!E.Run(Interpreted("while true do end").c_str()));
+    double seconds = ForgeTest::Seconds(start);
+
+    std::vector<std::string> errors = TestLog::TakeErrors();
+    REQUIRE(errors.size() == 1);
+    CHECK(IsWatchdogError(errors[0]));
+    CHECK(seconds >= 0.04);
+    CHECK(seconds < 1.0);
+
+    // Disarmed again once the call returned
+    CHECK(!E.watchdog.IsArmed());
+    CHECK(!lua_gethook(E.L));
+}
+
+FORGE_TEST(PcallCanRecoverFromTheFirstError)
+{
+    Forge E;
+    E.watchdog.Configure(50, "");
+
+    // Like a handler that guards an expensive search and falls back to a default
+    CHECK(E.Run(Interpreted(
+        "local ok, err = pcall(function() while true do end end) "
+        "caught = err "
+        "local n = 0 for i = 1, 1000 do n = n + i end "
+        "result = 'fallback ' .. n").c_str()));
+    CHECK(IsWatchdogError(GetString(E, "caught")));
+    CHECK_EQUAL(GetString(E, "result"), "fallback 500500");
+    CHECK(TestLog::TakeErrors().empty());
+}
+
+FORGE_TEST(CatchingInALoopIsStoppedAfterTheGrace)
+{
+    Forge E;
+    E.watchdog.Configure(50, "");
+
+    auto start = std::chrono::steady_clock::now();
+    CHECK(!E.Run(Interpreted(
+        "caught = 0 "
+        "while true do "
+        "    if not pcall(function() while true do end end) then caught = caught + 1 end "
+        "end").c_str()));
+    double seconds = ForgeTest::Seconds(start);
+
+    std::vector<std::string> errors = TestLog::TakeErrors();
+    REQUIRE(errors.size() == 1);
+    CHECK(IsWatchdogError(errors[0]));
+
+    // The timeout, then the same again as grace
+    CHECK(seconds >= 0.09);
+    CHECK(seconds < 2.0);
+    // Only the first error was caught, the second one reached the loop around the pcall
+    lua_getglobal(E.L, "caught");
+    CHECK_EQUAL(lua_tonumber(E.L, -1), 1.0);
+    lua_pop(E.L, 1);
+}
+
+FORGE_TEST(EachCallGetsItsOwnTimeout)
+{
+    Forge E;
+    E.watchdog.Configure(50, "");
+
+    // The error of one call doesn't carry over to the next
+    CHECK(!E.Run(Interpreted("while true do end").c_str()));
+    TestLog::TakeErrors();
+    CHECK(E.Run(Interpreted("local ok = pcall(function() while true do end end) second = ok").c_str()));
+    lua_getglobal(E.L, "second");
+    CHECK(lua_isboolean(E.L, -1) && !lua_toboolean(E.L, -1));
+    lua_pop(E.L, 1);
+    CHECK(TestLog::TakeErrors().empty());
+}
+
+FORGE_TEST(DisabledWatchdogInstallsNoHook)
+{
+    Forge E;
+    E.watchdog.Configure(0, "");
+
+    CHECK(E.Run("local n = 0 for i = 1, 100000 do n = n + i end hooked = debug.gethook() ~= nil"));
+    lua_getglobal(E.L, "hooked");
+    CHECK(!lua_toboolean(E.L, -1));
+    lua_pop(E.L, 1);
+    CHECK(!E.watchdog.IsArmed());
+}
+
+FORGE_TEST(ArmedOverhead)
+{
+    // A handler that does a bounded amount of work, timed with the watchdog disarmed and armed
+    const uint64 iterations = ForgeTest::Scale(2000000);
+    std::string code = "local n = 0 for i = 1, " + std::to_string(iterations) + " do n = n + i % 7 end";
+
+    double seconds[2];
+    for (int armed = 0; armed < 2; ++armed)
+    {
+        Forge E;
+        E.watchdog.Configure(armed ? 60000 : 0, "");
+        // Best of three, against noise from the rest of the machine
+        seconds[armed] = 0.0;
+        for (int run = 0; run < 3; ++run)
+        {
+            auto start = std::chrono::steady_clock::now();
+            CHECK(E.Run(code.c_str()));
+            double elapsed = ForgeTest::Seconds(start);
+            if (!run || elapsed < seconds[armed])
+                seconds[armed] = elapsed;
+        }
+    }
+
+    ForgeTest::Report("disarmed", seconds[0] * 1e9 / double(iterations), "ns per iteration");
+    ForgeTest::Report("armed", seconds[1] * 1e9 / double(iterations), "ns per iteration");
+    ForgeTest::Report("armed overhead", (seconds[1] / seconds[0] - 1.0) * 100.0, "%");
+
+    // One clock read per COUNT_HOOK_INSTRUCTIONS instructions. Lua 5.4 also leaves its
+    // fast instruction dispatch while any hook is set, which roughly doubles this loop there.
+    CHECK(seconds[1] < seconds[0] * 3.0);
+}
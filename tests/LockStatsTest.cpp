@@ -0,0 +1,153 @@
+/*
+* Copyright (C) 2010 - 2016 Forge Lua Engine <http://emudevs.com/>
+* This program is free software licensed under GPL version 3
+* Please see the included DOCS/LICENSE.md for more information
+*/
+
+#include "ForgeTest.h"
+#include "LockStats.h"
+#include <functional>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+/*
+ * Checks the accounting of LockStats with threads taking a recursive lock the
+ *   way hooks take LOCK_FORGE. Needs FORGE_LOCK_STATS, without it only checks
+ *   that nothing is recorded.
+ */
+
+namespace
+{
+    typedef InstrumentedLock<std::recursive_mutex> RecursiveLock;
+    typedef TaggedGuard<RecursiveLock> Guard;
+
+    const uint32 THREAD_COUNT = 8;
+
+    // The summary of `lock` and `tag`, zeroed if nothing was recorded for them
+    LockStats::Summary Find(const char* lock, const char* tag)
+    {
+        for (LockStats::Summary const& summary : LockStats::GetTop(1000))
+            if (std::string(summary.lock) == lock && std::string(summary.tag) == tag)
+                return summary;
+
+        LockStats::Summary none = { lock, tag, 0, 0.0, 0.0, 0.0, 0.0 };
+        return none;
+    }
+
+    void RunThreads(std::function<void()> const& fn)
+    {
+        std::vector<std::thread> threads;
+        for (uint32 i = 0; i < THREAD_COUNT; ++i)
+            threads.emplace_back(fn);
+        for (std::thread& thread : threads)
+            thread.join();
+    }
+}
+
+FORGE_TEST(CountsEveryAcquisition)
+{
+    RecursiveLock lock("CountLock");
+    const uint32 iterations = uint32(ForgeTest::Scale(20000));
+    uint64 total = 0;
+
+    // A hook that calls into another hook while holding the lock
+    RunThreads([&]
+    {
+        for (uint32 i = 0; i < iterations; ++i)
+        {
+            Guard outer(lock, "OnOuter");
+            Guard inner(lock, "OnInner");
+            ++total;
+        }
+    });
+    CHECK_EQUAL(total, uint64(THREAD_COUNT) * iterations);
+
+    LockStats::Summary outer = Find("CountLock", "OnOuter");
+    LockStats::Summary inner = Find("CountLock", "OnInner");
+    if (!LockStats::IsEnabled())
+    {
+        CHECK(LockStats::GetTop(1000).empty());
+        return;
+    }
+
+    CHECK_EQUAL(outer.acquisitions, uint64(THREAD_COUNT) * iterations);
+    CHECK_EQUAL(inner.acquisitions, uint64(THREAD_COUNT) * iterations);
+
+    // The lock is held by the outermost acquisition, nested ones never wait for it
+    CHECK(outer.hold_us > 0.0);
+    CHECK_EQUAL(inner.hold_us, 0.0);
+}
+
+FORGE_TEST(MeasuresWaitAndHoldTime)
+{
+    if (!LockStats::IsEnabled())
+        return;
+
+    RecursiveLock lock("SleepLock");
+    const uint32 iterations = 10;
+    const uint32 holdMs = 2;
+
+    RunThreads([&]
+    {
+        for (uint32 i = 0; i < iterations; ++i)
+        {
+            Guard guard(lock, "OnSleep");
+            {
+                Guard nested(lock, "OnSleep");
+                std::this_thread::sleep_for(std::chrono::milliseconds(holdMs));
+            }
+        }
+    });
+
+    LockStats::Summary summary = Find("SleepLock", "OnSleep");
+    ForgeTest::Report("hold", summary.hold_us / 1000.0, "ms");
+    ForgeTest::Report("wait", summary.wait_us / 1000.0, "ms");
+    ForgeTest::Report("max wait", summary.max_wait_us / 1000.0, "ms");
+
+    // Nested acquisitions count, but the hold time is only recorded once per outermost one
+    CHECK_EQUAL(summary.acquisitions, uint64(THREAD_COUNT) * iterations * 2);
+    double minHoldUs = double(THREAD_COUNT) * iterations * holdMs * 1000.0;
+    CHECK(summary.hold_us >= minHoldUs * 0.95);
+    CHECK(summary.max_hold_us >= holdMs * 1000.0 * 0.95);
+    CHECK(summary.max_hold_us <= summary.hold_us);
+
+    // Eight threads take turns, every thread but the first waits for at least one hold
+    CHECK(summary.wait_us >= holdMs * 1000.0 * (THREAD_COUNT - 1) * 0.95);
+    CHECK(summary.max_wait_us >= holdMs * 1000.0 * 0.95);
+    CHECK(summary.max_wait_us <= summary.wait_us);
+
+    // Sorted by total wait time and cut to the count asked for
+    std::vector<LockStats::Summary> top = LockStats::GetTop(1000);
+    REQUIRE(top.size() >= 2);
+    for (size_t i = 1; i < top.size(); ++i)
+        CHECK(top[i - 1].wait_us >= top[i].wait_us);
+    CHECK_EQUAL(LockStats::GetTop(1).size(), size_t(1));
+}
+
+FORGE_TEST(TotalsOutliveTheirThreads)
+{
+    if (!LockStats::IsEnabled())
+        return;
+
+    // Each round of threads takes over the counter blocks of the last one
+    RecursiveLock lock("RoundLock");
+    for (uint32 round = 1; round <= 3; ++round)
+    {
+        RunThreads([&]
+        {
+            for (uint32 i = 0; i < 100; ++i)
+                Guard guard(lock, "OnRound");
+        });
+        CHECK_EQUAL(Find("RoundLock", "OnRound").acquisitions, uint64(round) * THREAD_COUNT * 100);
+    }
+
+    // Untagged acquisitions are reported under "?"
+    RunThreads([&]
+    {
+        lock.lock();
+        lock.unlock();
+    });
+    CHECK_EQUAL(Find("RoundLock", "?").acquisitions, uint64(THREAD_COUNT));
+}
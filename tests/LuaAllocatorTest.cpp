@@ -0,0 +1,331 @@
+/*
+* Copyright (C) 2010 - 2016 Forge Lua Engine <http://emudevs.com/>
+* This program is free software licensed under GPL version 3
+* Please see the included DOCS/LICENSE.md for more information
+*/
+
+#include "ForgeTest.h"
+#include "LuaAllocator.h"
+#include <algorithm>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <random>
+#include <string>
+#include <utility>
+#include <vector>
+
+extern "C"
+{
+#include "lua.h"
+#include "lualib.h"
+#include "lauxlib.h"
+};
+
+#if defined(__SANITIZE_ADDRESS__)
+#define FORGE_TEST_ASAN
+#elif defined(__has_feature)
+#if __has_feature(address_sanitizer)
+#define FORGE_TEST_ASAN
+#endif
+#endif
+
+#ifdef FORGE_TEST_ASAN
+#include <sanitizer/asan_interface.h>
+#endif
+
+#if defined(__SANITIZE_THREAD__)
+#define FORGE_TEST_TSAN
+#elif defined(__has_feature)
+#if __has_feature(thread_sanitizer)
+#define FORGE_TEST_TSAN
+#endif
+#endif
+
+/*
+ * Checks LuaAllocator against a random trace of allocations and against Lua
+ *   itself, and times it against the default allocator of luaL_newstate.
+ *
+ * Built with FORGE_TESTS_SANITIZER=address the pool poisons its free blocks,
+ *   so the stress test also checks that AddressSanitizer would catch accesses
+ *   to them.
+ */
+
+namespace
+{
+    // The allocator of luaL_newstate
+    void* DefaultAlloc(void* /*ud*/, void* ptr, size_t /*osize*/, size_t nsize)
+    {
+        if (!nsize)
+        {
+            free(ptr);
+            return NULL;
+        }
+        return realloc(ptr, nsize);
+    }
+
+    // Churns through short lived tables and strings, like handlers building
+    //  their arguments and messages, while keeping a working set alive
+    const char* WORKLOAD =
+        "if jit then jit.off() end "
+        "local kept = {} "
+        "for i = 1, ... do "
+        "    local row = { id = i, name = 'npc' .. i, pos = { i, i * 2, i * 3 } } "
+        "    kept[i % 2000 + 1] = row "
+        "    local parts = {} "
+        "    for j = 1, 4 do parts[j] = row.name .. ':' .. j end "
+        "    kept[(i * 7) % 2000 + 1] = table.concat(parts, ',') "
+        "end";
+
+    // Runs the workload on a new state, returns the seconds it took or a negative value if it failed
+    double RunWorkload(lua_Alloc alloc, void* ud, uint64 iterations)
+    {
+        lua_State* L = lua_newstate(alloc, ud);
+        if (!L)
+            return -1.0;
+        luaL_openlibs(L);
+
+        auto start = std::chrono::steady_clock::now();
+        bool ok = !luaL_loadstring(L, WORKLOAD);
+        if (ok)
+        {
+            lua_pushnumber(L, lua_Number(iterations));
+            ok = !lua_pcall(L, 1, 0, 0);
+        }
+        lua_gc(L, LUA_GCCOLLECT, 0);
+        double seconds = ForgeTest::Seconds(start);
+
+        lua_close(L);
+        return ok ? seconds : -1.0;
+    }
+
+    struct Block
+    {
+        char* ptr;
+        size_t size;
+        char fill;
+    };
+
+    // Sizes like Lua's: mostly small objects, some strings and arrays past
+    //  MAX_POOLED_SIZE and the occasional large table part
+    size_t RandomSize(std::mt19937& rng)
+    {
+        uint32 kind = rng() % 100;
+        if (kind < 80)
+            return 1 + rng() % LuaAllocator::MAX_POOLED_SIZE;
+        if (kind < 97)
+            return LuaAllocator::MAX_POOLED_SIZE + 1 + rng() % 4096;
+        return 1 + rng() % (256 * 1024);
+    }
+
+    bool HasFill(Block const& block, size_t size)
+    {
+        for (size_t i = 0; i < size; ++i)
+            if (block.ptr[i] != block.fill)
+                return false;
+        return true;
+    }
+
+#ifdef FORGE_TEST_ASAN
+    const bool POISONING = true;
+#else
+    const bool POISONING = false;
+#endif
+
+    // Whether AddressSanitizer would report an access to `ptr`, always false without it
+    bool IsPoisoned(const void* ptr)
+    {
+#ifdef FORGE_TEST_ASAN
+        return __asan_address_is_poisoned(ptr);
+#else
+        (void)ptr;
+        return false;
+#endif
+    }
+
+    // The byte after a block is off limits, unless it's the first byte of the next pooled block
+    void CheckEnd(Block const& block)
+    {
+        if (block.size > LuaAllocator::MAX_POOLED_SIZE || block.size % 16)
+            CHECK_EQUAL(IsPoisoned(block.ptr + block.size), POISONING);
+    }
+}
+
+FORGE_TEST(RandomTraceKeepsContents)
+{
+    LuaAllocator allocator;
+    std::mt19937 rng(20160514);
+    std::vector<Block> live;
+    uint64 liveBytes = 0;
+    const uint64 operations = ForgeTest::Scale(200000);
+
+    for (uint64 op = 0; op < operations; ++op)
+    {
+        uint32 kind = rng() % 4;
+        if (live.empty() || (kind < 2 && live.size() < 4096))
+        {
+            // Lua 5.2 and later pass the type of the new object as the old size
+            Block block = { NULL, RandomSize(rng), char(rng()) };
+            block.ptr = static_cast<char*>(LuaAllocator::Alloc(&allocator, NULL, rng() % 9, block.size));
+            REQUIRE(block.ptr);
+            CHECK_EQUAL(uintptr_t(block.ptr) % 16, uintptr_t(0));
+            memset(block.ptr, block.fill, block.size);
+            CheckEnd(block);
+            liveBytes += block.size;
+            live.push_back(block);
+            continue;
+        }
+
+        size_t index = rng() % live.size();
+        Block& block = live[index];
+        REQUIRE(HasFill(block, block.size));
+
+        if (kind == 2)
+        {
+            // Growing and shrinking, within and across size classes
+            size_t size = rng() % 2 ? RandomSize(rng) : size_t(std::max<int64>(1, int64(block.size) + rng() % 33 - 16));
+            char* ptr = static_cast<char*>(LuaAllocator::Alloc(&allocator, block.ptr, block.size, size));
+            REQUIRE(ptr);
+            block.ptr = ptr;
+            CHECK(HasFill(block, std::min(block.size, size)));
+            liveBytes = liveBytes - block.size + size;
+            block.size = size;
+            block.fill = char(rng());
+            memset(block.ptr, block.fill, block.size);
+            CheckEnd(block);
+        }
+        else
+        {
+            char* ptr = block.ptr;
+            CHECK(!LuaAllocator::Alloc(&allocator, block.ptr, block.size, 0));
+            liveBytes -= block.size;
+            block = live.back();
+            live.pop_back();
+            // Freed blocks stay in the pool, but reading them would be reported
+            CHECK_EQUAL(IsPoisoned(ptr), POISONING);
+        }
+
+        CHECK_EQUAL(allocator.GetStats().liveBytes, liveBytes);
+    }
+
+    LuaAllocator::Stats const& stats = allocator.GetStats();
+    CHECK(stats.peakBytes >= liveBytes);
+    CHECK(stats.pooledAllocations > 0);
+    CHECK(stats.pooledAllocations < stats.allocations);
+
+    for (Block const& block : live)
+    {
+        CHECK(HasFill(block, block.size));
+        LuaAllocator::Alloc(&allocator, block.ptr, block.size, 0);
+    }
+    CHECK_EQUAL(stats.liveBytes, uint64(0));
+    CHECK_EQUAL(stats.allocations, stats.frees);
+}
+
+FORGE_TEST(LuaRunsOnThePool)
+{
+    LuaAllocator allocator;
+    double seconds = RunWorkload(&LuaAllocator::Alloc, &allocator, ForgeTest::Scale(20000));
+    // LuaJIT without GC64 only accepts its own allocator on 64-bit, Forge falls back to it
+    if (seconds < 0.0 && !allocator.GetStats().allocations)
+        return;
+    CHECK(seconds >= 0.0);
+
+    // Everything was freed by lua_close, the slabs stay until Release
+    LuaAllocator::Stats stats = allocator.GetStats();
+    CHECK_EQUAL(stats.liveBytes, uint64(0));
+    CHECK_EQUAL(stats.allocations, stats.frees);
+    CHECK(stats.pooledAllocations * 2 > stats.allocations);
+    CHECK(stats.slabBytes > 0);
+    ForgeTest::Report("peak", double(stats.peakBytes) / 1024.0, "KiB");
+    ForgeTest::Report("slabs", double(stats.slabBytes) / 1024.0, "KiB");
+
+    allocator.Release();
+    CHECK_EQUAL(allocator.GetStats().slabBytes, uint64(0));
+
+    // The allocator can serve another state after a Release, as on a reload
+    CHECK(RunWorkload(&LuaAllocator::Alloc, &allocator, 1000) >= 0.0);
+}
+
+FORGE_TEST(AgainstTheDefaultAllocator)
+{
+    const uint64 iterations = ForgeTest::Scale(200000);
+
+    // Best of three for each, alternating so both see the same machine
+    double pooled = 0.0;
+    double standard = 0.0;
+    for (int run = 0; run < 3; ++run)
+    {
+        LuaAllocator allocator;
+        double seconds = RunWorkload(&LuaAllocator::Alloc, &allocator, iterations);
+        if (seconds < 0.0)
+            return;
+        pooled = run ? std::min(pooled, seconds) : seconds;
+
+        seconds = RunWorkload(&DefaultAlloc, NULL, iterations);
+        REQUIRE(seconds >= 0.0);
+        standard = run ? std::min(standard, seconds) : seconds;
+    }
+
+    ForgeTest::Report("default allocator", standard * 1e9 / double(iterations), "ns per iteration");
+    ForgeTest::Report("LuaAllocator", pooled * 1e9 / double(iterations), "ns per iteration");
+    ForgeTest::Report("speedup", standard / pooled, "x");
+
+    // Sanitizers replace malloc and slow down everything else, the times say nothing there
+#if !defined(FORGE_TEST_ASAN) && !defined(FORGE_TEST_TSAN)
+    CHECK(pooled < standard * 1.1);
+#endif
+}
+
+FORGE_TEST(SmallBlocksAgainstMalloc)
+{
+    // The allocator calls alone: a working set of small objects where each new one
+    //  replaces an old one, as the collector frees what handlers made before
+    const uint64 iterations = ForgeTest::Scale(5000000);
+    const size_t slotCount = 10000;
+    std::mt19937 rng(5);
+    std::vector<uint16> sizes(4096);
+    for (uint16& size : sizes)
+        size = uint16(16 + rng() % 113);
+
+    auto Time = [&](lua_Alloc alloc, void* ud)
+    {
+        std::vector<std::pair<void*, size_t>> slots(slotCount, std::make_pair((void*)NULL, size_t(0)));
+        auto start = std::chrono::steady_clock::now();
+        for (uint64 i = 0; i < iterations; ++i)
+        {
+            std::pair<void*, size_t>& slot = slots[i % slotCount];
+            if (slot.first)
+                alloc(ud, slot.first, slot.second, 0);
+            slot.second = sizes[i % sizes.size()];
+            slot.first = alloc(ud, NULL, 0, slot.second);
+            // Touched like a new object would be
+            *static_cast<char*>(slot.first) = 1;
+        }
+        double seconds = ForgeTest::Seconds(start);
+        for (std::pair<void*, size_t>& slot : slots)
+            alloc(ud, slot.first, slot.second, 0);
+        return seconds;
+    };
+
+    double pooled = 0.0;
+    double standard = 0.0;
+    for (int run = 0; run < 3; ++run)
+    {
+        LuaAllocator allocator;
+        double seconds = Time(&LuaAllocator::Alloc, &allocator);
+        pooled = run ? std::min(pooled, seconds) : seconds;
+        CHECK_EQUAL(allocator.GetStats().liveBytes, uint64(0));
+
+        seconds = Time(&DefaultAlloc, NULL);
+        standard = run ? std::min(standard, seconds) : seconds;
+    }
+
+    ForgeTest::Report("malloc", standard * 1e9 / double(iterations), "ns per allocation");
+    ForgeTest::Report("LuaAllocator", pooled * 1e9 / double(iterations), "ns per allocation");
+    ForgeTest::Report("speedup", standard / pooled, "x");
+
+#if !defined(FORGE_TEST_ASAN) && !defined(FORGE_TEST_TSAN)
+    CHECK(pooled < standard);
+#endif
+}
@@ -0,0 +1,229 @@
+/*
+* Copyright (C) 2010 - 2016 Forge Lua Engine <http://emudevs.com/>
+* This program is free software licensed under GPL version 3
+* Please see the included DOCS/LICENSE.md for more information
+*/
+
+#include "ForgeTest.h"
+#include "LuaEngine.h"
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <map>
+#include <string>
+#include <utility>
+#include <vector>
+
+extern "C"
+{
+#include "lua.h"
+#include "lauxlib.h"
+};
+
+/*
+ * Profiles scripted workloads with a known shape and checks that the folded
+ *   stacks attribute the samples to the right functions and callers.
+ */
+
+namespace
+{
+    // Loaded as "workload", so frames read "name (workload:line)". The leaves spin
+    //  for fixed amounts of work, heavy three times as long as light and direct.
+    const char* WORKLOAD =
+        "if jit then jit.off() end\n"                                       // 1
+        "local function spin(n)\n"                                          // 2
+        "    local x = 0 for i = 1, n do x = x + i % 7 end return x\n"      // 3
+        "end\n"                                                             // 4
+        "local function heavy()\n"                                          // 5
+        "    local x = spin(3000) return x\n"                               // 6
+        "end\n"                                                             // 7
+        "local function light()\n"                                          // 8
+        "    local x = spin(1000) return x\n"                               // 9
+        "end\n"                                                             // 10
+        "local function middle()\n"                                         // 11
+        "    local x = heavy() + light() return x\n"                        // 12
+        "end\n"                                                             // 13
+        "local function direct()\n"                                         // 14
+        "    local x = spin(1000) return x\n"                               // 15
+        "end\n"                                                             // 16
+        "function Work(seconds)\n"                                          // 17
+        "    local stop = os.clock() + seconds\n"                           // 18
+        "    while os.clock() < stop do\n"                                  // 19
+        "        pcall(middle)\n"                                           // 20
+        "        direct()\n"                                                // 21
+        "    end\n"                                                         // 22
+        "end\n"                                                             // 23
+        "local function recurse(depth, seconds)\n"                          // 24
+        "    if depth > 0 then local x = recurse(depth - 1, seconds) return x end\n" // 25
+        "    local x = Work(seconds) return x\n"                            // 26
+        "end\n"                                                             // 27
+        "function Deep(depth, seconds)\n"                                   // 28
+        "    local x = recurse(depth, seconds) return x\n"                  // 29
+        "end\n";                                                            // 30
+
+    void LoadWorkload(Forge& E)
+    {
+        ASSERT(!luaL_loadbuffer(E.L, WORKLOAD, strlen(WORKLOAD), "=workload"));
+        ASSERT(E.ExecuteCall(0, 0));
+    }
+
+    // Folded stacks split into their frames, root first, with their sample counts
+    struct Profile
+    {
+        std::vector<std::pair<std::vector<std::string>, uint32>> stacks;
+        uint32 total = 0;
+
+        // Samples whose innermost frames are `frames`, innermost last
+        uint32 Count(std::vector<std::string> const& frames) const
+        {
+            uint32 count = 0;
+            for (auto const& stack : stacks)
+                if (stack.first.size() >= frames.size() && std::equal(frames.begin(), frames.end(), stack.first.end() - frames.size()))
+                    count += stack.second;
+            return count;
+        }
+    };
+
+    Profile Write(Forge& E)
+    {
+        std::string path = (std::filesystem::temp_directory_path() / "forge_profile_test.folded").string();
+        ASSERT(E.profiler.WriteFolded(path));
+
+        Profile profile;
+        std::ifstream file(path);
+        std::string line;
+        while (std::getline(file, line))
+        {
+            size_t space = line.rfind(' ');
+            ASSERT(space != std::string::npos);
+            uint32 count = uint32(std::stoul(line.substr(space + 1)));
+
+            std::vector<std::string> frames;
+            size_t start = 0;
+            for (size_t end; (end = line.find(';', start)) < space; start = end + 1)
+                frames.push_back(line.substr(start, end - start));
+            frames.push_back(line.substr(start, space - start));
+
+            profile.stacks.emplace_back(frames, count);
+            profile.total += count;
+        }
+        std::remove(path.c_str());
+        return profile;
+    }
+
+    std::string Frame(const char* name, int line)
+    {
+        return std::string(name) + " (workload:" + std::to_string(line) + ")";
+    }
+}
+
+FORGE_TEST(SamplesAreAttributedToTheirCallers)
+{
+    Forge E;
+    LoadWorkload(E);
+
+    E.StartProfile(0);
+    auto start = std::chrono::steady_clock::now();
+    CHECK(E.Run("Work(0.5)"));
+    double seconds = ForgeTest::Seconds(start);
+    E.StopProfile();
+
+    Profile profile = Write(E);
+    ForgeTest::Report("samples", profile.total, "");
+    CHECK_EQUAL(profile.total, E.profiler.GetSampleCount());
+    CHECK_EQUAL(E.profiler.GetDroppedCount(), uint64(0));
+    // One sample per millisecond at most
+    REQUIRE(profile.total >= 100);
+    CHECK(profile.total <= seconds * 1000.0 / LuaProfiler::SAMPLE_INTERVAL_US * 1000.0 + 1.0);
+
+    // Every stack starts at the chunk run by the test and goes through Work
+    for (auto const& stack : profile.stacks)
+    {
+        REQUIRE(stack.first.size() >= 2);
+        CHECK_EQUAL(stack.first[0].compare(0, 10, "main chunk"), 0);
+        CHECK_EQUAL(stack.first[1], Frame("Work", 17));
+    }
+
+    // Each leaf under the caller that called it, with C functions in between. Lua has no
+    //  name for functions called from C, like middle here and every event handler.
+    std::string pcall = "pcall [C]";
+    std::string middle = Frame("?", 11);
+    uint32 heavy = profile.Count({ Frame("Work", 17), pcall, middle, Frame("heavy", 5), Frame("spin", 2) });
+    uint32 light = profile.Count({ Frame("Work", 17), pcall, middle, Frame("light", 8), Frame("spin", 2) });
+    uint32 direct = profile.Count({ Frame("Work", 17), Frame("direct", 14), Frame("spin", 2) });
+    ForgeTest::Report("heavy", heavy, "samples");
+    ForgeTest::Report("light", light, "samples");
+    ForgeTest::Report("direct", direct, "samples");
+
+    // Nearly all the time is spent in spin, and no other path leads there
+    CHECK(heavy + light + direct >= profile.total * 0.9);
+    CHECK_EQUAL(heavy + light + direct, profile.Count({ Frame("spin", 2) }));
+    CHECK_EQUAL(profile.Count({ Frame("direct", 14), Frame("heavy", 5) }), 0u);
+
+    // The samples split like the work does, 3:1:1
+    REQUIRE(light > 0 && direct > 0);
+    CHECK(heavy > light * 2 && heavy < light * 4.5);
+    CHECK(direct > light * 0.6 && direct < light * 1.6);
+}
+
+FORGE_TEST(DeepStacksKeepTheirInnermostFrames)
+{
+    Forge E;
+    LoadWorkload(E);
+
+    // Work is called 50 calls deep, past MAX_DEPTH
+    E.StartProfile(0);
+    CHECK(E.Run("Deep(50, 0.1)"));
+    E.StopProfile();
+
+    Profile profile = Write(E);
+    REQUIRE(profile.total > 0);
+    for (auto const& stack : profile.stacks)
+    {
+        CHECK_EQUAL(stack.first.size(), size_t(LuaProfiler::MAX_DEPTH));
+        // The root is cut off, what is left are the recursion and what it called
+        CHECK(stack.first[0] == Frame("recurse", 24));
+    }
+    CHECK(profile.Count({ Frame("recurse", 24), Frame("Work", 17), Frame("direct", 14), Frame("spin", 2) }) > 0);
+}
+
+FORGE_TEST(NothingIsSampledWhenStopped)
+{
+    Forge E;
+    LoadWorkload(E);
+
+    E.StartProfile(0);
+    CHECK(E.Run("Work(0.05)"));
+    E.StopProfile();
+    uint32 count = E.profiler.GetSampleCount();
+    CHECK(count > 0);
+
+    // The hook is gone and the samples stay as they were
+    CHECK(!lua_gethook(E.L));
+    CHECK(E.Run("Work(0.05)"));
+    CHECK_EQUAL(E.profiler.GetSampleCount(), count);
+
+    // Starting again begins a new profile
+    E.StartProfile(0);
+    CHECK_EQUAL(E.profiler.GetSampleCount(), 0u);
+    CHECK(E.Run("Work(0.05)"));
+    E.StopProfile();
+    CHECK(E.profiler.GetSampleCount() > 0);
+    CHECK(Write(E).total == E.profiler.GetSampleCount());
+}
+
+FORGE_TEST(TimedProfilesExpire)
+{
+    Forge E;
+    LoadWorkload(E);
+
+    // The world update stops expired profiles, see Forge::OnWorldUpdate
+    E.StartProfile(1);
+    CHECK(!E.profiler.IsExpired());
+    CHECK(E.Run("Work(1.1)"));
+    CHECK(E.profiler.IsExpired());
+    E.StopProfile();
+    CHECK(!E.profiler.IsExpired());
+}
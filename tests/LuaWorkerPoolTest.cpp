@@ -0,0 +1,303 @@
+/*
+* Copyright (C) 2010 - 2016 Forge Lua Engine <http://emudevs.com/>
+* This program is free software licensed under GPL version 3
+* Please see the included DOCS/LICENSE.md for more information
+*/
+
+#include "ForgeTest.h"
+#include "LuaWorkerPool.h"
+#include "lmarshal.h"
+#include <algorithm>
+#include <map>
+#include <memory>
+#include <thread>
+
+extern "C"
+{
+#include "lua.h"
+#include "lualib.h"
+#include "lauxlib.h"
+};
+
+namespace
+{
+    // Encodes arguments and decodes results like RunAsync and its callbacks do
+    class Marshal
+    {
+    public:
+        Marshal() : L(luaL_newstate())
+        {
+            luaL_openlibs(L);
+            lua_pushcfunction(L, &mar_encode);
+            lua_setglobal(L, "encode");
+        }
+
+        ~Marshal() { lua_close(L); }
+
+        // Encodes the table that `expression` evaluates to
+        std::string Encode(const char* expression)
+        {
+            std::string code = std::string("return encode(") + expression + ")";
+            ASSERT(!luaL_dostring(L, code.c_str()));
+            size_t length;
+            const char* encoded = lua_tolstring(L, -1, &length);
+            std::string result(encoded, length);
+            lua_pop(L, 1);
+            return result;
+        }
+
+        // Decodes the results of `job` and returns them joined by commas
+        std::string Decode(AsyncJob const* job)
+        {
+            lua_pushcfunction(L, &mar_decode);
+            lua_pushlstring(L, job->result.data(), job->result.size());
+            ASSERT(!lua_pcall(L, 1, 1, 0));
+
+            std::string joined;
+            for (uint32 i = 1; i <= job->resultCount; ++i)
+            {
+                lua_rawgeti(L, -1, i);
+                lua_getglobal(L, "tostring");
+                lua_insert(L, -2);
+                lua_call(L, 1, 1);
+                joined += (i > 1 ? "," : "") + std::string(lua_tostring(L, -1));
+                lua_pop(L, 1);
+            }
+            lua_pop(L, 1);
+            return joined;
+        }
+
+    private:
+        lua_State* L;
+    };
+
+    // Spins for a fixed amount of work, the same on every thread
+    const char* BUSY_JOB = "local n = 0 for i = 1, ... do n = n + i % 7 end return n";
+
+    // Takes the results of `stateId` until `count` jobs are back
+    std::vector<std::unique_ptr<AsyncJob>> Collect(LuaWorkerPool& pool, uint64 stateId, size_t count, uint32 timeoutMs = 10000)
+    {
+        std::vector<std::unique_ptr<AsyncJob>> results;
+        ForgeTest::WaitFor([&]
+        {
+            std::vector<AsyncJob*> jobs;
+            pool.TakeResults(stateId, jobs);
+            for (AsyncJob* job : jobs)
+                results.emplace_back(job);
+            return results.size() >= count;
+        }, timeoutMs);
+        return results;
+    }
+
+    std::unique_ptr<AsyncJob> RunOne(LuaWorkerPool& pool, const char* source, std::string const& args, uint32 argCount)
+    {
+        uint64 stateId = LuaWorkerPool::NewStateId();
+        pool.Push(new AsyncJob(stateId, 0, source, args, argCount));
+        std::vector<std::unique_ptr<AsyncJob>> results = Collect(pool, stateId, 1);
+        if (results.empty())
+            return nullptr;
+        return std::move(results[0]);
+    }
+}
+
+FORGE_TEST(ResultsComeBackMarshalled)
+{
+    LuaWorkerPool pool(2, 0);
+    Marshal marshal;
+
+    std::unique_ptr<AsyncJob> job = RunOne(pool, "local t, s = ... table.sort(t) return t[1], t[3], s:upper(), true",
+        marshal.Encode("{ { 3, 1, 2 }, 'abc' }"), 2);
+    REQUIRE(job);
+    CHECK(job->success);
+    CHECK_EQUAL(job->resultCount, 4u);
+    CHECK_EQUAL(marshal.Decode(job.get()), "1,3,ABC,true");
+
+    // Integers stay integers both ways on Lua 5.3 and later
+    std::unique_ptr<AsyncJob> numbers = RunOne(pool, "local i, f = ... return tostring(i) .. ' ' .. tostring(f), i + 1",
+        marshal.Encode("{ 7, 0.5 }"), 2);
+    REQUIRE(numbers);
+    CHECK(numbers->success);
+    CHECK_EQUAL(marshal.Decode(numbers.get()), "7 0.5,8");
+}
+
+FORGE_TEST(SandboxHasNoFilesOrOutput)
+{
+    LuaWorkerPool pool(1, 0);
+    Marshal marshal;
+
+    std::unique_ptr<AsyncJob> job = RunOne(pool,
+        "return io == nil, require == nil, print == nil, os.execute == nil, os.time ~= nil",
+        marshal.Encode("{}"), 0);
+    REQUIRE(job);
+    CHECK(job->success);
+    CHECK_EQUAL(marshal.Decode(job.get()), "true,true,true,true,true");
+}
+
+FORGE_TEST(ErrorsArePropagated)
+{
+    LuaWorkerPool pool(2, 0);
+    Marshal marshal;
+    std::string noArgs = marshal.Encode("{}");
+
+    std::unique_ptr<AsyncJob> syntax = RunOne(pool, "return +", noArgs, 0);
+    REQUIRE(syntax);
+    CHECK(!syntax->success);
+    CHECK(syntax->result.find("RunAsync") != std::string::npos);
+
+    std::unique_ptr<AsyncJob> runtime = RunOne(pool, "error('job failed')", noArgs, 0);
+    REQUIRE(runtime);
+    CHECK(!runtime->success);
+    CHECK(runtime->result.find("job failed") != std::string::npos);
+
+    // Functions can't leave the worker state
+    std::unique_ptr<AsyncJob> unmarshallable = RunOne(pool, "return string.rep", noArgs, 0);
+    REQUIRE(unmarshallable);
+    CHECK(!unmarshallable->success);
+
+    // The worker carries on with the next job
+    std::unique_ptr<AsyncJob> next = RunOne(pool, "return 1 + 1", noArgs, 0);
+    REQUIRE(next);
+    CHECK(next->success);
+    CHECK_EQUAL(marshal.Decode(next.get()), "2");
+}
+
+FORGE_TEST(TimeoutStopsRunawayJobs)
+{
+    LuaWorkerPool pool(1, 50);
+    Marshal marshal;
+    std::string noArgs = marshal.Encode("{}");
+
+    // LuaJIT doesn't call hooks from compiled loops, see Forge.AsyncTimeout
+    std::unique_ptr<AsyncJob> loop = RunOne(pool, "if jit then jit.off() end while true do end", noArgs, 0);
+    REQUIRE(loop);
+    CHECK(!loop->success);
+    CHECK(loop->result.find("timed out") != std::string::npos);
+
+    // pcall can't catch the timeout for good, it's raised again outside of it
+    std::unique_ptr<AsyncJob> caught = RunOne(pool, "if jit then jit.off() end while true do pcall(function() while true do end end) end", noArgs, 0);
+    REQUIRE(caught);
+    CHECK(!caught->success);
+    CHECK(caught->result.find("timed out") != std::string::npos);
+
+    // The next job gets its own deadline
+    std::unique_ptr<AsyncJob> quick = RunOne(pool, "return 'done'", noArgs, 0);
+    REQUIRE(quick);
+    CHECK(quick->success);
+}
+
+FORGE_TEST(ConcurrentStatesGetTheirOwnResults)
+{
+    const uint32 stateCount = 4;
+    const uint32 jobsPerState = uint32(ForgeTest::Scale(200));
+    LuaWorkerPool pool(4, 0);
+
+    std::vector<uint64> stateIds;
+    for (uint32 i = 0; i < stateCount; ++i)
+        stateIds.push_back(LuaWorkerPool::NewStateId());
+
+    // Each state pushes and collects its jobs on its own thread, like map states do
+    std::vector<std::map<uint32, std::string>> results(stateCount);
+    std::vector<std::thread> threads;
+    for (uint32 state = 0; state < stateCount; ++state)
+    {
+        threads.emplace_back([&, state]
+        {
+            Marshal marshal;
+            for (uint32 i = 0; i < jobsPerState; ++i)
+            {
+                std::string args = marshal.Encode(("{ " + std::to_string(state) + ", " + std::to_string(i) + " }").c_str());
+                pool.Push(new AsyncJob(stateIds[state], int(i), "local s, i = ... return s .. ':' .. i", args, 2));
+            }
+
+            for (std::unique_ptr<AsyncJob>& job : Collect(pool, stateIds[state], jobsPerState))
+            {
+                CHECK(job->stateId == stateIds[state]);
+                CHECK(job->success);
+                results[state][uint32(job->funcRef)] = marshal.Decode(job.get());
+            }
+        });
+    }
+    for (std::thread& thread : threads)
+        thread.join();
+
+    for (uint32 state = 0; state < stateCount; ++state)
+    {
+        CHECK_EQUAL(results[state].size(), size_t(jobsPerState));
+        for (auto const& result : results[state])
+            CHECK_EQUAL(result.second, std::to_string(state) + ":" + std::to_string(result.first));
+    }
+}
+
+FORGE_TEST(WorkersRunJobsInParallel)
+{
+    if (std::thread::hardware_concurrency() < 2)
+        return;
+
+    LuaWorkerPool pool(2, 0);
+    Marshal marshal;
+    std::string args = marshal.Encode(("{ " + std::to_string(ForgeTest::Scale(20000000)) + " }").c_str());
+
+    auto Time = [&](uint32 jobs)
+    {
+        uint64 stateId = LuaWorkerPool::NewStateId();
+        auto start = std::chrono::steady_clock::now();
+        for (uint32 i = 0; i < jobs; ++i)
+            pool.Push(new AsyncJob(stateId, 0, BUSY_JOB, args, 1));
+        CHECK_EQUAL(Collect(pool, stateId, jobs, 60000).size(), size_t(jobs));
+        return ForgeTest::Seconds(start);
+    };
+
+    double one = Time(1);
+    double two = Time(2);
+    ForgeTest::Report("one job", one * 1000.0, "ms");
+    ForgeTest::Report("two jobs on two workers", two * 1000.0, "ms");
+    CHECK(two < one * 1.8);
+}
+
+FORGE_TEST(CancelDoesNotWaitForRunningJobs)
+{
+    LuaWorkerPool pool(1, 0);
+    Marshal marshal;
+    std::string noArgs = marshal.Encode("{}");
+    std::string busyArgs = marshal.Encode(("{ " + std::to_string(ForgeTest::Scale(30000000)) + " }").c_str());
+
+    // Like a reload: one job of the state is running, one is queued behind it and one is done
+    uint64 reloaded = LuaWorkerPool::NewStateId();
+    pool.Push(new AsyncJob(reloaded, 1, "return 'finished'", noArgs, 0));
+    std::this_thread::sleep_for(std::chrono::milliseconds(50));
+    pool.Push(new AsyncJob(reloaded, 2, BUSY_JOB, busyArgs, 1));
+    std::this_thread::sleep_for(std::chrono::milliseconds(20));
+    pool.Push(new AsyncJob(reloaded, 3, "return 'queued'", noArgs, 0));
+
+    auto start = std::chrono::steady_clock::now();
+    pool.CancelState(reloaded);
+    double cancelSeconds = ForgeTest::Seconds(start);
+    ForgeTest::Report("cancel", cancelSeconds * 1000.0, "ms");
+    CHECK(cancelSeconds < 0.05);
+
+    // Jobs of other states still run, after the running job is done with the worker
+    std::unique_ptr<AsyncJob> other = RunOne(pool, "return 'other'", noArgs, 0);
+    REQUIRE(other);
+    CHECK(other->success);
+
+    // Nothing of the cancelled state ever comes back
+    std::vector<AsyncJob*> jobs;
+    pool.TakeResults(reloaded, jobs);
+    CHECK(jobs.empty());
+}
+
+FORGE_TEST(DestructorDropsQueuedJobs)
+{
+    Marshal marshal;
+    std::string busyArgs = marshal.Encode(("{ " + std::to_string(ForgeTest::Scale(5000000)) + " }").c_str());
+
+    // Waits for the running job, the queued ones are deleted without running
+    std::unique_ptr<LuaWorkerPool> pool(new LuaWorkerPool(1, 0));
+    uint64 stateId = LuaWorkerPool::NewStateId();
+    for (uint32 i = 0; i < 20; ++i)
+        pool->Push(new AsyncJob(stateId, 0, BUSY_JOB, busyArgs, 1));
+
+    auto start = std::chrono::steady_clock::now();
+    pool.reset();
+    ForgeTest::Report("destroy with 20 queued jobs", ForgeTest::Seconds(start) * 1000.0, "ms");
+}
@@ -0,0 +1,248 @@
+/*
+* Copyright (C) 2010 - 2016 Forge Lua Engine <http://emudevs.com/>
+* This program is free software licensed under GPL version 3
+* Please see the included DOCS/LICENSE.md for more information
+*/
+
+#include "ForgeTest.h"
+#include "LuaEngine.h"
+#include "ForgeTemplate.h"
+#include "MapStateRegistry.h"
+#include <atomic>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+extern "C"
+{
+#include "lua.h"
+#include "lauxlib.h"
+};
+
+/*
+ * Updates map states on several threads at once, the way map threads do with
+ *   Forge.MapStates enabled. Meant to run under ThreadSanitizer, see
+ *   FORGE_TESTS_SANITIZER, but also checks that every update reached its state.
+ */
+
+namespace
+{
+    const uint32 MAP_COUNT = 8;
+
+    // Stands in for a creature of a map, pushed to its state's handlers
+    struct StressObject
+    {
+        uint32 id;
+    };
+
+    int GetId(lua_State* L, StressObject* obj)
+    {
+        Forge::Push(L, obj->id);
+        return 1;
+    }
+
+    ForgeRegister<StressObject> methods[] =
+    {
+        { "GetId", &GetId },
+        { NULL, NULL }
+    };
+
+    int StartCoroutine(lua_State* L)
+    {
+        luaL_checktype(L, 1, LUA_TFUNCTION);
+        Forge::GetForge(L)->coroutines.Start(L, lua_gettop(L) - 1);
+        return 0;
+    }
+
+    int Sleep(lua_State* L)
+    {
+        uint32 ms = Forge::CHECKVAL<uint32>(L, 1);
+        Forge::GetForge(L)->coroutines.Sleep(L, ms);
+        return lua_yield(L, 0);
+    }
+
+    luaL_Reg globals[] =
+    {
+        { "StartCoroutine", &StartCoroutine },
+        { "Sleep", &Sleep },
+        { NULL, NULL }
+    };
+
+    // Counts its updates and keeps a few coroutines sleeping, like map scripts with timers
+    const char* MAP_SCRIPT =
+        "updates = 0 "
+        "woken = 0 "
+        "function OnUpdate(obj)"
+        "    updates = updates + 1 "
+        "    local t = {} "
+        "    for i = 1, 20 do t[i] = obj:GetId() + i end "
+        "    if updates % 8 == 0 then "
+        "        StartCoroutine(function() Sleep(3) woken = woken + 1 end) "
+        "    end "
+        "end";
+
+    Forge* CreateState()
+    {
+        Forge* E = new Forge();
+        ForgeTemplate<StressObject>::Register(E, "StressObject");
+        ForgeTemplate<StressObject>::SetMethods(E, methods);
+        ForgeGlobal::SetMethods(E, globals);
+        ASSERT(E->Run(MAP_SCRIPT));
+        return E;
+    }
+
+    // Calls OnUpdate with the state's lock held, like a map thread dispatching a hook
+    void Dispatch(Forge* E, StressObject* obj, uint32 diff)
+    {
+        Forge::Guard guard(E->GetStateLock(), "MapUpdate");
+        lua_getglobal(E->L, "OnUpdate");
+        Forge::Push(E->L, obj);
+        E->ExecuteCall(1, 0);
+        E->coroutines.Update(diff);
+    }
+
+    uint32 GetCount(Forge* E, const char* name)
+    {
+        Forge::Guard guard(E->GetStateLock(), "Check");
+        lua_getglobal(E->L, name);
+        uint32 count = uint32(lua_tonumber(E->L, -1));
+        lua_pop(E->L, 1);
+        return count;
+    }
+}
+
+FORGE_TEST(MapsUpdateInParallel)
+{
+    MapStateRegistry registry;
+
+    // The world state is shared by every map thread, like player hooks reaching sForge
+    Forge* world = CreateState();
+
+    // Map states are created one by one before the maps update, as on startup
+    for (uint32 map = 0; map < MAP_COUNT; ++map)
+    {
+        MapStateRegistry::Ref* ref = registry.Add(MapStateRegistry::GetKey(map, 0));
+        registry.Publish(ref, CreateState());
+    }
+
+    const uint32 updates = uint32(ForgeTest::Scale(2000));
+    std::atomic<bool> mapsDone(false);
+
+    // Refs of destroyed instances still held by a processor, released by the map threads
+    std::mutex retiredLock;
+    std::vector<MapStateRegistry::Ref*> retired;
+
+    std::vector<std::thread> threads;
+    for (uint32 map = 0; map < MAP_COUNT; ++map)
+    {
+        threads.emplace_back([&, map]
+        {
+            StressObject creature = { map };
+            for (uint32 i = 0; i < updates; ++i)
+            {
+                Forge* E = registry.Find(MapStateRegistry::GetKey(map, 0));
+                ASSERT(E);
+                Dispatch(E, &creature, 1);
+
+                // Lookups of other maps and of instances coming and going
+                registry.Find(MapStateRegistry::GetKey((map + i) % MAP_COUNT, 0));
+                registry.Find(MapStateRegistry::GetKey(MAP_COUNT, i % 4));
+
+                if (i % 16 == 0)
+                    Dispatch(world, &creature, 0);
+
+                // Objects are destroyed on every map thread
+                if (i % 4 == 0)
+                    ForgeObjectCache::OnObjectDestroyed();
+
+                if (i % 32 == 0)
+                {
+                    std::lock_guard<std::mutex> guard(retiredLock);
+                    for (MapStateRegistry::Ref* ref : retired)
+                        registry.Release(ref);
+                    retired.clear();
+                }
+            }
+        });
+    }
+
+    // Instances are created and destroyed while the maps update
+    threads.emplace_back([&]
+    {
+        StressObject boss = { 1000 };
+        uint32 instance = 0;
+        while (!mapsDone)
+        {
+            MapStateRegistry::Ref* ref = registry.Add(MapStateRegistry::GetKey(MAP_COUNT, instance % 4));
+            Forge* E = CreateState();
+            registry.Publish(ref, E);
+            // A processor of one of the instance's objects
+            registry.Retain(ref);
+
+            for (uint32 i = 0; i < 10; ++i)
+                Dispatch(E, &boss, 1);
+
+            ref = registry.Remove(MapStateRegistry::GetKey(MAP_COUNT, instance % 4));
+            delete registry.Retire(ref);
+            registry.Release(ref);
+            {
+                std::lock_guard<std::mutex> guard(retiredLock);
+                retired.push_back(ref);
+            }
+            ++instance;
+        }
+    });
+
+    for (uint32 map = 0; map < MAP_COUNT; ++map)
+        threads[map].join();
+    mapsDone = true;
+    threads.back().join();
+
+    for (MapStateRegistry::Ref* ref : retired)
+        registry.Release(ref);
+
+    CHECK(TestLog::TakeErrors().empty());
+    for (uint32 map = 0; map < MAP_COUNT; ++map)
+    {
+        Forge* E = registry.Find(MapStateRegistry::GetKey(map, 0));
+        CHECK_EQUAL(GetCount(E, "updates"), updates);
+        CHECK(GetCount(E, "woken") > 0);
+    }
+    CHECK_EQUAL(GetCount(world, "updates"), MAP_COUNT * ((updates + 15) / 16));
+
+    for (MapStateRegistry::Ref* ref : registry.RemoveAll())
+    {
+        delete registry.Retire(ref);
+        registry.Release(ref);
+    }
+    delete world;
+}
+
+FORGE_TEST(RefsOutliveTheirState)
+{
+    MapStateRegistry registry;
+    uint64 key = MapStateRegistry::GetKey(1, 2);
+
+    MapStateRegistry::Ref* ref = registry.Add(key);
+    CHECK(!registry.Find(key));
+    Forge* E = CreateState();
+    registry.Publish(ref, E);
+    CHECK(registry.Find(key) == E);
+
+    // A processor still points to the ref after the state is gone
+    registry.Retain(ref);
+    CHECK(registry.Remove(key) == ref);
+    CHECK(!registry.Find(key));
+    delete registry.Retire(ref);
+    registry.Release(ref);
+    CHECK(ref->state == NULL);
+
+    // Readding the key while the old ref lives on gets a new one
+    MapStateRegistry::Ref* newRef = registry.Add(key);
+    CHECK(newRef != ref);
+    registry.Release(ref);
+
+    registry.Remove(key);
+    registry.Retire(newRef);
+    registry.Release(newRef);
+}
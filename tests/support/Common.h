@@ -0,0 +1,42 @@
+/*
+* Copyright (C) 2010 - 2016 Forge Lua Engine <http://emudevs.com/>
+* This program is free software licensed under GPL version 3
+* Please see the included DOCS/LICENSE.md for more information
+*/
+
+#ifndef _FORGE_TEST_COMMON_H
+#define _FORGE_TEST_COMMON_H
+
+// Stands in for the core's Common.h, with the types and macros the engine sources under test use
+
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <string>
+#include <vector>
+
+typedef int64_t int64;
+typedef int32_t int32;
+typedef int16_t int16;
+typedef int8_t int8;
+typedef uint64_t uint64;
+typedef uint32_t uint32;
+typedef uint16_t uint16;
+typedef uint8_t uint8;
+
+#define IN_MILLISECONDS 1000
+
+// Like the core's ASSERT, also checked in release builds
+#define ASSERT(cond) \
+    do \
+    { \
+        if (!(cond)) \
+        { \
+            std::fprintf(stderr, "%s:%d: ASSERT(%s) failed\n", __FILE__, __LINE__, #cond); \
+            std::abort(); \
+        } \
+    } while (0)
+
+#endif
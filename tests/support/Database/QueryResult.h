@@ -0,0 +1,17 @@
+/*
+* Copyright (C) 2010 - 2016 Forge Lua Engine <http://emudevs.com/>
+* This program is free software licensed under GPL version 3
+* Please see the included DOCS/LICENSE.md for more information
+*/
+
+#ifndef _FORGE_TEST_QUERY_RESULT_H
+#define _FORGE_TEST_QUERY_RESULT_H
+
+// Stands in for the core's QueryResult.h
+
+#include <memory>
+
+class ResultSet;
+typedef std::shared_ptr<ResultSet> QueryResult;
+
+#endif
@@ -0,0 +1,248 @@
+/*
+* Copyright (C) 2010 - 2016 Forge Lua Engine <http://emudevs.com/>
+* This program is free software licensed under GPL version 3
+* Please see the included DOCS/LICENSE.md for more information
+*/
+
+#include "LuaEngine.h"
+#include "ForgeTemplate.h"
+
+extern "C"
+{
+#include "lua.h"
+#include "lualib.h"
+#include "lauxlib.h"
+};
+
+char Forge::stateKey;
+char ForgeObjectCache::key;
+std::atomic<uint32> ForgeObjectCache::destroyEpoch(0);
+
+Forge::Forge() :
+    L(NULL),
+    coroutines(this),
+    stateLock("TestState"),
+    callstackid(2),
+    event_level(0),
+    countHookSet(false)
+{
+    L = luaL_newstate();
+
+    lua_pushlightuserdata(L, &stateKey);
+    lua_pushlightuserdata(L, this);
+    lua_rawset(L, LUA_REGISTRYINDEX);
+
+    ForgeObjectCache::Create(L);
+    luaL_openlibs(L);
+}
+
+Forge::~Forge()
+{
+    coroutines.Clear();
+    lua_close(L);
+}
+
+Forge* Forge::GetForge(lua_State* L)
+{
+    lua_pushlightuserdata(L, &stateKey);
+    lua_rawget(L, LUA_REGISTRYINDEX);
+    ASSERT(lua_islightuserdata(L, -1));
+    Forge* E = static_cast<Forge*>(lua_touserdata(L, -1));
+    lua_pop(L, 1);
+    ASSERT(E);
+    return E;
+}
+
+void Forge::CountHook(lua_State* L, lua_Debug* /*ar*/)
+{
+    Forge* E = GetForge(L);
+    E->profiler.OnHook(L);
+
+    if (E->watchdog.OnHook())
+    {
+        // Also hits the instructions between pcalls, so a loop can't catch it for good
+        if (E->watchdog.IsPastGrace())
+            lua_sethook(L, &CountHook, LUA_MASKCOUNT, 1);
+        luaL_error(L, "call exceeded its time limit and was stopped by the watchdog");
+    }
+}
+
+void Forge::UpdateCountHook()
+{
+    bool wanted = profiler.IsRunning() || watchdog.IsArmed();
+    // The watchdog hooks every instruction of a call past its grace, see CountHook
+    if (wanted == countHookSet && (!wanted || lua_gethookcount(L) == COUNT_HOOK_INSTRUCTIONS))
+        return;
+
+    if (wanted)
+        lua_sethook(L, &CountHook, LUA_MASKCOUNT, COUNT_HOOK_INSTRUCTIONS);
+    else
+        lua_sethook(L, NULL, 0, 0);
+    countHookSet = wanted;
+}
+
+bool Forge::ExecuteCall(int params, int res, const HookCall* hook)
+{
+    int base = lua_gettop(L) - params;
+    ASSERT(base > 0 && lua_isfunction(L, base));
+
+    uint32 timeout = watchdog.GetTimeout(hook);
+    HookWatchdog::State previousWatchdog = {};
+    if (timeout)
+    {
+        previousWatchdog = watchdog.Arm(timeout);
+        UpdateCountHook();
+    }
+
+    ++event_level;
+    int result = lua_pcall(L, params, res, 0);
+    if (!--event_level)
+        InvalidateObjects();
+
+    if (timeout)
+    {
+        watchdog.Restore(previousWatchdog);
+        UpdateCountHook();
+    }
+
+    if (result)
+    {
+        const char* msg = lua_tostring(L, -1);
+        FORGE_LOG_ERROR("{}", msg ? msg : "(error object is not a string)");
+        lua_pop(L, 1);
+
+        for (int i = 0; i < res; ++i)
+            lua_pushnil(L);
+        return false;
+    }
+    return true;
+}
+
+bool Forge::Run(const char* code, const HookCall* hook)
+{
+    if (luaL_loadstring(L, code))
+    {
+        FORGE_LOG_ERROR("{}", lua_tostring(L, -1));
+        lua_pop(L, 1);
+        return false;
+    }
+    return ExecuteCall(0, 0, hook);
+}
+
+void Forge::StartProfile(uint32 seconds)
+{
+    profiler.Start(seconds);
+    UpdateCountHook();
+}
+
+void Forge::StopProfile()
+{
+    profiler.Stop();
+    UpdateCountHook();
+}
+
+void Forge::Push(lua_State* luastate)
+{
+    lua_pushnil(luastate);
+}
+// Integers on Lua 5.3 and later like the engine, numbers instead of its 64 bit userdata before
+void Forge::Push(lua_State* luastate, const long long l)
+{
+#if LUA_VERSION_NUM >= 503
+    lua_pushinteger(luastate, static_cast<lua_Integer>(l));
+#else
+    lua_pushnumber(luastate, static_cast<lua_Number>(l));
+#endif
+}
+void Forge::Push(lua_State* luastate, const unsigned long long l)
+{
+#if LUA_VERSION_NUM >= 503
+    lua_pushinteger(luastate, static_cast<lua_Integer>(l));
+#else
+    lua_pushnumber(luastate, static_cast<lua_Number>(l));
+#endif
+}
+void Forge::Push(lua_State* luastate, const long l)
+{
+    Push(luastate, static_cast<long long>(l));
+}
+void Forge::Push(lua_State* luastate, const unsigned long l)
+{
+    Push(luastate, static_cast<unsigned long long>(l));
+}
+void Forge::Push(lua_State* luastate, const int i)
+{
+    lua_pushinteger(luastate, i);
+}
+void Forge::Push(lua_State* luastate, const unsigned int u)
+{
+    lua_pushnumber(luastate, u);
+}
+void Forge::Push(lua_State* luastate, const bool b)
+{
+    lua_pushboolean(luastate, b);
+}
+void Forge::Push(lua_State* luastate, const float f)
+{
+    lua_pushnumber(luastate, f);
+}
+void Forge::Push(lua_State* luastate, const double d)
+{
+    lua_pushnumber(luastate, d);
+}
+void Forge::Push(lua_State* luastate, const std::string& str)
+{
+    lua_pushlstring(luastate, str.data(), str.size());
+}
+void Forge::Push(lua_State* luastate, const char* str)
+{
+    lua_pushstring(luastate, str);
+}
+
+template<> bool Forge::CHECKVAL<bool>(lua_State* luastate, int narg)
+{
+    return lua_toboolean(luastate, narg) != 0;
+}
+template<> uint32 Forge::CHECKVAL<uint32>(lua_State* luastate, int narg)
+{
+    lua_Number value = luaL_checknumber(luastate, narg);
+    luaL_argcheck(luastate, value >= 0 && value <= 4294967295.0, narg, "value out of range");
+    return static_cast<uint32>(value);
+}
+template<> const char* Forge::CHECKVAL<const char*>(lua_State* luastate, int narg)
+{
+    return luaL_checkstring(luastate, narg);
+}
+template<> std::string Forge::CHECKVAL<std::string>(lua_State* luastate, int narg)
+{
+    return luaL_checkstring(luastate, narg);
+}
+
+template<> ForgeObject* Forge::CHECKOBJ<ForgeObject>(lua_State* luastate, int narg, bool error)
+{
+    return CHECKTYPE(luastate, narg, NULL, error);
+}
+
+ForgeObject* Forge::CHECKTYPE(lua_State* luastate, int narg, const char* tname, bool error)
+{
+    if (lua_islightuserdata(luastate, narg))
+    {
+        if (error)
+            luaL_argerror(luastate, narg, "bad argument : userdata expected, got lightuserdata");
+        return NULL;
+    }
+
+    ForgeObject* forgeObj = static_cast<ForgeObject*>(lua_touserdata(luastate, narg));
+
+    if (!forgeObj || (tname && forgeObj->GetTypeName() != tname))
+    {
+        if (error)
+        {
+            char buff[256];
+            snprintf(buff, 256, "bad argument : %s expected, got %s", tname ? tname : "ForgeObject", forgeObj ? forgeObj->GetTypeName() : luaL_typename(luastate, narg));
+            luaL_argerror(luastate, narg, buff);
+        }
+        return NULL;
+    }
+    return forgeObj;
+}
@@ -0,0 +1,122 @@
+/*
+* Copyright (C) 2010 - 2016 Forge Lua Engine <http://emudevs.com/>
+* This program is free software licensed under GPL version 3
+* Please see the included DOCS/LICENSE.md for more information
+*/
+
+#include "ForgeTest.h"
+#include "Log.h"
+#include <atomic>
+#include <cstdio>
+#include <cstdlib>
+#include <exception>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace
+{
+    struct Test
+    {
+        const char* name;
+        ForgeTest::TestFunction function;
+    };
+
+    std::vector<Test>& GetTests()
+    {
+        static std::vector<Test> tests;
+        return tests;
+    }
+
+    std::atomic<uint32_t> failures(0);
+
+    std::mutex logLock;
+    std::vector<std::string> loggedErrors;
+}
+
+ForgeTest::Registrar::Registrar(const char* name, TestFunction function)
+{
+    GetTests().push_back({ name, function });
+}
+
+void ForgeTest::Fail(const char* file, int line, std::string const& message)
+{
+    ++failures;
+    std::fprintf(stderr, "%s:%d: %s\n", file, line, message.c_str());
+}
+
+uint64_t ForgeTest::Scale(uint64_t iterations)
+{
+    const char* scale = std::getenv("FORGE_BENCH_SCALE");
+    double factor = scale ? std::atof(scale) : 1.0;
+    uint64_t scaled = uint64_t(double(iterations) * factor);
+    return scaled ? scaled : 1;
+}
+
+void ForgeTest::Report(const char* name, double value, const char* unit)
+{
+    std::printf("  %s: %.3f %s\n", name, value, unit);
+}
+
+bool ForgeTest::WaitFor(std::function<bool()> const& done, uint32_t timeoutMs)
+{
+    auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(timeoutMs);
+    while (!done())
+    {
+        if (std::chrono::steady_clock::now() >= deadline)
+            return done();
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    return true;
+}
+
+void TestLog::Write(const char* level, std::string const& message)
+{
+    std::lock_guard<std::mutex> guard(logLock);
+    std::fprintf(stderr, "  [%s] %s\n", level, message.c_str());
+    if (!std::strcmp(level, "ERROR"))
+        loggedErrors.push_back(message);
+}
+
+std::vector<std::string> TestLog::TakeErrors()
+{
+    std::lock_guard<std::mutex> guard(logLock);
+    std::vector<std::string> errors;
+    errors.swap(loggedErrors);
+    return errors;
+}
+
+int main(int argc, char** argv)
+{
+    const char* filter = argc > 1 ? argv[1] : NULL;
+
+    uint32_t run = 0;
+    for (Test const& test : GetTests())
+    {
+        if (filter && !std::strstr(test.name, filter))
+            continue;
+
+        std::printf("%s\n", test.name);
+        std::fflush(stdout);
+        uint32_t failuresBefore = failures;
+        TestLog::TakeErrors();
+        try
+        {
+            test.function();
+        }
+        catch (ForgeTest::Abort const&)
+        {
+        }
+        catch (std::exception const& ex)
+        {
+            ForgeTest::Fail(__FILE__, __LINE__, std::string(test.name) + " threw " + ex.what());
+        }
+        if (failures != failuresBefore)
+            std::printf("%s FAILED\n", test.name);
+        std::fflush(stdout);
+        ++run;
+    }
+
+    std::printf("%u tests, %u failed checks\n", run, failures.load());
+    return failures || !run ? 1 : 0;
+}
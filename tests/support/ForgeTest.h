@@ -0,0 +1,93 @@
+/*
+* Copyright (C) 2010 - 2016 Forge Lua Engine <http://emudevs.com/>
+* This program is free software licensed under GPL version 3
+* Please see the included DOCS/LICENSE.md for more information
+*/
+
+#ifndef _FORGE_TEST_H
+#define _FORGE_TEST_H
+
+#include <chrono>
+#include <functional>
+#include <sstream>
+#include <string>
+
+/*
+ * A minimal test runner, every test executable links ForgeTest.cpp for its main.
+ *
+ *     FORGE_TEST(SleepWakesInOrder)
+ *     {
+ *         CHECK(order == "abc");
+ *         CHECK_EQUAL(count, 3);
+ *     }
+ *
+ * A failed CHECK reports and carries on, a failed REQUIRE ends the test.
+ *   Passing a test name on the command line runs only the tests containing it.
+ *   The environment variable FORGE_BENCH_SCALE multiplies the iterations of
+ *   benchmarks, see ForgeTest::Scale.
+ */
+namespace ForgeTest
+{
+    typedef void (*TestFunction)();
+
+    struct Registrar
+    {
+        Registrar(const char* name, TestFunction function);
+    };
+
+    // Thrown by a failed REQUIRE
+    struct Abort { };
+
+    void Fail(const char* file, int line, std::string const& message);
+
+    // `iterations` scaled by FORGE_BENCH_SCALE, at least 1
+    uint64_t Scale(uint64_t iterations);
+
+    // Prints one line of benchmark results, "name: value unit"
+    void Report(const char* name, double value, const char* unit);
+
+    // Polls `done` until it returns true or `timeoutMs` passed, returns its last result
+    bool WaitFor(std::function<bool()> const& done, uint32_t timeoutMs = 5000);
+
+    inline double Seconds(std::chrono::steady_clock::time_point start)
+    {
+        return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    }
+}
+
+#define FORGE_TEST(name) \
+    static void name(); \
+    static ForgeTest::Registrar name##Registrar(#name, &name); \
+    static void name()
+
+#define CHECK(cond) \
+    do \
+    { \
+        if (!(cond)) \
+            ForgeTest::Fail(__FILE__, __LINE__, "CHECK(" #cond ")"); \
+    } while (0)
+
+#define CHECK_EQUAL(actual, expected) \
+    do \
+    { \
+        auto const& actualValue = (actual); \
+        auto const& expectedValue = (expected); \
+        if (!(actualValue == expectedValue)) \
+        { \
+            std::ostringstream message; \
+            message << "CHECK_EQUAL(" #actual ", " #expected "): " << actualValue << " != " << expectedValue; \
+            ForgeTest::Fail(__FILE__, __LINE__, message.str()); \
+        } \
+    } while (0)
+
+#define REQUIRE(cond) \
+    do \
+    { \
+        if (!(cond)) \
+        { \
+            ForgeTest::Fail(__FILE__, __LINE__, "REQUIRE(" #cond ")"); \
+            throw ForgeTest::Abort(); \
+        } \
+    } while (0)
+
+#endif
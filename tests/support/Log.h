@@ -0,0 +1,57 @@
+/*
+* Copyright (C) 2010 - 2016 Forge Lua Engine <http://emudevs.com/>
+* This program is free software licensed under GPL version 3
+* Please see the included DOCS/LICENSE.md for more information
+*/
+
+#ifndef _FORGE_TEST_LOG_H
+#define _FORGE_TEST_LOG_H
+
+// Stands in for the core's Log.h. Messages are formatted like the core does,
+//  each "{}" takes the next argument, and kept for the tests to check.
+
+#include <cstring>
+#include <sstream>
+#include <string>
+#include <vector>
+
+namespace TestLog
+{
+    inline void Format(std::ostringstream& out, const char* format)
+    {
+        out << format;
+    }
+
+    template<typename T, typename... Args>
+    void Format(std::ostringstream& out, const char* format, T const& value, Args const&... args)
+    {
+        const char* field = std::strstr(format, "{}");
+        if (!field)
+        {
+            out << format;
+            return;
+        }
+        out.write(format, field - format);
+        out << value;
+        Format(out, field + 2, args...);
+    }
+
+    void Write(const char* level, std::string const& message);
+
+    // The error messages logged since the last call, may be called from any thread
+    std::vector<std::string> TakeErrors();
+}
+
+#define FORGE_TEST_LOG(level, format, ...) \
+    do \
+    { \
+        std::ostringstream message; \
+        TestLog::Format(message, format, ##__VA_ARGS__); \
+        TestLog::Write(level, message.str()); \
+    } while (0)
+
+#define LOG_INFO(filter, ...) FORGE_TEST_LOG("INFO", __VA_ARGS__)
+#define LOG_ERROR(filter, ...) FORGE_TEST_LOG("ERROR", __VA_ARGS__)
+#define LOG_DEBUG(filter, ...) FORGE_TEST_LOG("DEBUG", __VA_ARGS__)
+
+#endif
@@ -0,0 +1,120 @@
+/*
+* Copyright (C) 2010 - 2016 Forge Lua Engine <http://emudevs.com/>
+* This program is free software licensed under GPL version 3
+* Please see the included DOCS/LICENSE.md for more information
+*/
+
+#ifndef _FORGE_TEST_LUA_ENGINE_H
+#define _FORGE_TEST_LUA_ENGINE_H
+
+/*
+ * Stands in for the engine's LuaEngine.h in the tests.
+ *
+ * `Forge` here is one Lua state with the members the engine sources under
+ *   test use, without the core. Its ExecuteCall, CountHook, CHECKTYPE and
+ *   Push follow the engine's, so the sources under test see the same state
+ *   they do in the server.
+ */
+
+#include <mutex>
+#include <string>
+#include "Common.h"
+#include "ForgeUtility.h"
+#include "CoroutineScheduler.h"
+#include "HookStats.h"
+#include "LockStats.h"
+#include "LuaProfiler.h"
+
+extern "C"
+{
+#include "lua.h"
+};
+
+class ForgeObject;
+template<typename T> class ForgeTemplate;
+
+class Forge
+{
+public:
+    typedef InstrumentedLock<std::recursive_mutex> LockType;
+    typedef TaggedGuard<LockType> Guard;
+
+    static const int COUNT_HOOK_INSTRUCTIONS = 1000;
+
+    Forge();
+    ~Forge();
+
+    lua_State* L;
+    CoroutineScheduler coroutines;
+    HookWatchdog watchdog;
+    LuaProfiler profiler;
+
+    LockType& GetStateLock() { return stateLock; }
+    uint64 GetCallstackId() const { return callstackid; }
+    // Ends the current call stack, like the engine does when the outermost event returns
+    void InvalidateObjects() { ++callstackid; }
+
+    // Calls the function below the `params` arguments on top of the stack, with the watchdog
+    //  armed if it has a timeout for `hook`. Errors are logged and replaced by `res` nils.
+    bool ExecuteCall(int params, int res, const HookCall* hook = NULL);
+    // Loads and runs `code` with ExecuteCall, returns false on errors
+    bool Run(const char* code, const HookCall* hook = NULL);
+
+    // Like `.forge profile start` and `.forge profile stop`, without writing the samples
+    void StartProfile(uint32 seconds);
+    void StopProfile();
+
+    static Forge* GetForge(lua_State* L);
+
+    static void Push(lua_State* luastate); // nil
+    static void Push(lua_State* luastate, const long long);
+    static void Push(lua_State* luastate, const unsigned long long);
+    static void Push(lua_State* luastate, const long);
+    static void Push(lua_State* luastate, const unsigned long);
+    static void Push(lua_State* luastate, const int);
+    static void Push(lua_State* luastate, const unsigned int);
+    static void Push(lua_State* luastate, const bool);
+    static void Push(lua_State* luastate, const float);
+    static void Push(lua_State* luastate, const double);
+    static void Push(lua_State* luastate, const std::string&);
+    static void Push(lua_State* luastate, const char*);
+    template<typename T>
+    static void Push(lua_State* luastate, T const* ptr)
+    {
+        ForgeTemplate<T>::Push(luastate, ptr);
+    }
+
+    template<typename T> static T CHECKVAL(lua_State* luastate, int narg);
+    template<typename T> static T CHECKVAL(lua_State* luastate, int narg, T def)
+    {
+        return lua_isnoneornil(luastate, narg) ? def : CHECKVAL<T>(luastate, narg);
+    }
+    template<typename T> static T* CHECKOBJ(lua_State* luastate, int narg, bool error = true)
+    {
+        return ForgeTemplate<T>::Check(luastate, narg, error);
+    }
+    static ForgeObject* CHECKTYPE(lua_State* luastate, int narg, const char *tname, bool error = true);
+
+private:
+    Forge(Forge const&) = delete;
+    Forge& operator=(Forge const&) = delete;
+
+    static void CountHook(lua_State* L, lua_Debug* ar);
+    void UpdateCountHook();
+
+    // Registry key of the pointer to the Forge that owns a Lua state
+    static char stateKey;
+
+    LockType stateLock;
+    uint64 callstackid;
+    uint32 event_level;
+    bool countHookSet;
+};
+
+template<> bool Forge::CHECKVAL<bool>(lua_State* luastate, int narg);
+template<> uint32 Forge::CHECKVAL<uint32>(lua_State* luastate, int narg);
+template<> const char* Forge::CHECKVAL<const char*>(lua_State* luastate, int narg);
+template<> std::string Forge::CHECKVAL<std::string>(lua_State* luastate, int narg);
+template<> ForgeObject* Forge::CHECKOBJ<ForgeObject>(lua_State* luastate, int narg, bool error);
+
+#endif
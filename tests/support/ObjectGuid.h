@@ -0,0 +1,29 @@
+/*
+* Copyright (C) 2010 - 2016 Forge Lua Engine <http://emudevs.com/>
+* This program is free software licensed under GPL version 3
+* Please see the included DOCS/LICENSE.md for more information
+*/
+
+#ifndef _FORGE_TEST_OBJECT_GUID_H
+#define _FORGE_TEST_OBJECT_GUID_H
+
+// Stands in for the core's ObjectGuid.h
+
+#include "Common.h"
+
+class ObjectGuid
+{
+public:
+    ObjectGuid() : guid(0) { }
+    explicit ObjectGuid(uint64 guid) : guid(guid) { }
+
+    uint64 GetRawValue() const { return guid; }
+
+    bool operator==(ObjectGuid const& other) const { return guid == other.guid; }
+    bool operator<(ObjectGuid const& other) const { return guid < other.guid; }
+
+private:
+    uint64 guid;
+};
+
+#endif
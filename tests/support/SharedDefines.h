@@ -0,0 +1,14 @@
+/*
+* Copyright (C) 2010 - 2016 Forge Lua Engine <http://emudevs.com/>
+* This program is free software licensed under GPL version 3
+* Please see the included DOCS/LICENSE.md for more information
+*/
+
+#ifndef _FORGE_TEST_SHARED_DEFINES_H
+#define _FORGE_TEST_SHARED_DEFINES_H
+
+// Stands in for the core's SharedDefines.h, the engine sources under test use none of it
+
+#include "Common.h"
+
+#endif